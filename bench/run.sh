@@ -0,0 +1,42 @@
+#!/bin/sh
+# times every benchmark with a leafc binary; when a second binary is given
+# its output is checked against the first, which serves as the oracle
+#
+#   bench/run.sh build/leafc
+#   bench/run.sh build/leafc path/to/other/leafc
+#   bench/run.sh "build/leafc --no-jit" build/leafc
+#
+# a command may carry options, so the two are split on spaces. only the
+# files directly in bench/ run; its directories hold what those include,
+# and benchmarks an oracle cannot run, like tailcall/deep.lf
+
+if [ $# -lt 1 ]; then
+    echo "syntax: $0 <leafc> [leafc to check against it]" >&2
+    exit 1
+fi
+
+oracle=$1
+candidate=$2
+dir=$(dirname "$0")
+status=0
+
+for bench in "$dir"/*.lf; do
+    name=$(basename "$bench" .lf)
+    start=$(date +%s.%N)
+    expected=$($oracle "$bench")
+    end=$(date +%s.%N)
+    line=$(printf '%-12s %8.3fs' "$name" "$(awk "BEGIN { print $end - $start }")")
+    if [ -n "$candidate" ]; then
+        start=$(date +%s.%N)
+        actual=$($candidate "$bench")
+        end=$(date +%s.%N)
+        line=$(printf '%s %8.3fs' "$line" "$(awk "BEGIN { print $end - $start }")")
+        if [ "$actual" != "$expected" ]; then
+            line="$line  MISMATCH"
+            status=1
+        fi
+    fi
+    echo "$line"
+done
+
+exit $status
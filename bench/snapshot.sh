@@ -0,0 +1,48 @@
+#!/bin/sh
+# times starting a script whose include does heavy initialization, first
+# cold and then from a snapshot of that initialization, checking both
+# print the same
+#
+#   bench/snapshot.sh build/leafc
+#   bench/snapshot.sh build/leafc 50
+#
+# snapshot/main.lf includes snapshot/app.lf under the same path the
+# snapshot was written from, so the snapshot's copy is used as is
+
+if [ $# -lt 1 ]; then
+    echo "syntax: $0 <leafc> [runs]" >&2
+    exit 1
+fi
+
+leafc=$1
+runs=${2:-20}
+dir=$(dirname "$0")/snapshot
+snapshot=${TMPDIR:-/tmp}/leaf-bench-$$.snap
+trap 'rm -f "$snapshot"' EXIT
+
+start=$(date +%s.%N)
+$leafc --write-snapshot "$snapshot" "$dir/app.lf" || exit 1
+end=$(date +%s.%N)
+printf '%-12s %8.3fs  %s bytes, %s KB on disk\n' "write" "$(awk "BEGIN { print $end - $start }")" "$(wc -c < "$snapshot")" "$(du -k "$snapshot" | cut -f1)"
+
+# the average of runs starts
+time_runs() {
+    start=$(date +%s.%N)
+    i=0
+    while [ $i -lt "$runs" ]; do
+        $leafc "$@" "$dir/main.lf" >/dev/null
+        i=$((i + 1))
+    done
+    end=$(date +%s.%N)
+    awk "BEGIN { print ($end - $start) / $runs }"
+}
+
+cold=$(time_runs)
+warm=$(time_runs --snapshot "$snapshot")
+printf '%-12s %8.4fs\n' "cold" "$cold"
+printf '%-12s %8.4fs  %.1fx\n' "snapshot" "$warm" "$(awk "BEGIN { print $cold / $warm }")"
+
+if [ "$($leafc "$dir/main.lf")" != "$($leafc --snapshot "$snapshot" "$dir/main.lf")" ]; then
+    echo "MISMATCH"
+    exit 1
+fi
@@ -0,0 +1,13 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_BUILTINS_H
+#define LEAF_BUILTINS_H
+
+#include "interp/state.h"
+
+/* defines print, len, push, ... and the null, true and false constants */
+void lf_open_builtins(lfState *L);
+
+#endif /* LEAF_BUILTINS_H */
@@ -0,0 +1,155 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_CORO_H
+#define LEAF_CORO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <setjmp.h>
+
+#include "interp/state.h"
+#include "interp/value.h"
+
+/*
+ * coroutines are stackful: each runs the ordinary recursive evaluator on
+ * a C stack of its own, so compiled code and natives can suspend too.
+ * x86-64 switches with a few instructions, other unix systems through
+ * ucontext
+ */
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define LF_CORO_SUPPORTED 1
+#define LF_CORO_UCONTEXT 0
+#elif defined(__unix__) || defined(__APPLE__)
+#define LF_CORO_SUPPORTED 1
+#define LF_CORO_UCONTEXT 1
+#else
+#define LF_CORO_SUPPORTED 0
+#define LF_CORO_UCONTEXT 0
+#endif
+
+#if LF_CORO_UCONTEXT
+#include <ucontext.h>
+#endif
+
+/*
+ * per coroutine, in one mapping whose pages are only backed once touched.
+ * the C stack holds LF_CORO_FRAMES at the bytes per frame of the main
+ * thread's 8MB over LF_MAX_FRAMES, and above them the margin calls keep
+ * free, which the evaluator checks on every call. the guard below it
+ * faults on anything that still runs off the end, and is wider than any
+ * one frame so none can step over it
+ */
+#define LF_CORO_FRAMES 256
+#define LF_CORO_CSTACK (LF_CORO_FRAMES * ((8 << 20) / LF_MAX_FRAMES) + LF_STACK_MARGIN) /* bytes */
+#define LF_CORO_GUARD (1 << 16) /* bytes */
+#define LF_CORO_VALUES (1 << 14)
+#define LF_CORO_POOL 256 /* mappings of finished coroutines kept for reuse */
+#define LF_CORO_BATCH 64 /* resumes between checks for I/O while others are runnable */
+
+/* the interpreter registers of one thread of leaf code, swapped in and out of lfState */
+typedef struct lfRegisters {
+    lfValue *stack;
+    lfValue *stack_end;
+    lfValue *top;
+    lfValue *base;
+    lfFunction *closure;
+    lfFrame *frames;
+    int nframes;
+    int max_frames;
+    lfFrame *frame;
+    char *stack_limit;
+    bool returning;
+    lfValue retval;
+    jmp_buf *error_jmp;
+} lfRegisters;
+
+typedef enum lfCoroutineState {
+    CO_READY, /* queued to run */
+    CO_RUNNING,
+    CO_WAITING, /* on a task, a timer or a file descriptor */
+    CO_DONE
+} lfCoroutineState;
+
+typedef struct lfCoroutine {
+    lfState *L;
+    lfTask *task; /* completed with the entry function's result */
+    lfCoroutineState state;
+    bool failed; /* ended by a runtime error, already reported */
+    lfRegisters regs; /* while it is not running */
+#if LF_CORO_UCONTEXT
+    ucontext_t context;
+#else
+    void *sp; /* saved stack pointer while it is not running */
+#endif
+    char *memory; /* guard page, C stack, value stack, frames */
+    struct lfCoroutine *next; /* in the run queue or a task's waiters */
+    struct lfCoroutine *waiters; /* coroutines awaiting this one's task */
+    uint64_t wake; /* deadline in nanoseconds while sleeping */
+    int fd; /* while waiting on a file descriptor */
+    int index; /* in the scheduler's list of live coroutines */
+    void *fake_stack; /* AddressSanitizer's, across switches */
+    jmp_buf handler;
+} lfCoroutine;
+
+/*
+ * a single threaded event loop. the main thread of leaf code is not a
+ * coroutine: it runs the loop itself whenever it awaits, yields or sleeps,
+ * and once more after the top level chunk ends. coroutines only ever
+ * switch to and from the loop
+ */
+typedef struct lfScheduler {
+    lfArray(lfCoroutine *) live; /* every coroutine that has not finished, for the collector */
+    lfArray(lfCoroutine *) timers; /* binary heap on wake */
+    lfArray(char *) pool; /* mappings of finished coroutines */
+    lfCoroutine *head; /* run queue */
+    lfCoroutine *tail;
+    int nready;
+    uint64_t resumes;
+    lfCoroutine *current; /* NULL while the main thread runs */
+    lfRegisters main; /* the main thread's registers while a coroutine runs */
+#if LF_CORO_UCONTEXT
+    ucontext_t context;
+#else
+    void *sp;
+#endif
+    int epoll; /* -1 until something waits on a file descriptor */
+    int nfds; /* file descriptors being waited on */
+    int main_fd; /* the one the main thread waits on */
+    bool main_woken; /* and it is ready */
+    void *fake_stack; /* AddressSanitizer's view of the main thread's stack */
+    const void *main_stack;
+    size_t main_stack_size;
+} lfScheduler;
+
+/*
+ * starts fn(args...) as a coroutine, which first runs the next time the
+ * current thread of leaf code suspends. the task completes with fn's
+ * return value
+ */
+lfTask *lf_coro_spawn(lfState *L, lfValue fn, const lfValue *args, int argc);
+
+/* lets every other runnable coroutine run once before carrying on */
+void lf_coro_yield(lfState *L);
+
+/* suspends until task completes and returns its result */
+lfValue lf_coro_await(lfState *L, lfTask *task);
+
+/* suspends for at least the given time */
+void lf_coro_sleep(lfState *L, double seconds);
+
+/*
+ * suspends until fd is readable, or writable, for natives doing I/O.
+ * descriptors epoll cannot watch, like regular files, count as ready
+ * at once, as do all descriptors where there is no epoll
+ */
+void lf_coro_wait_fd(lfState *L, int fd, bool write);
+
+/* runs the loop until no coroutine is runnable or waiting on a timer or descriptor */
+void lf_coro_run(lfState *L);
+
+/* unmaps every coroutine, finished or not */
+void lf_coro_free(lfState *L);
+
+#endif /* LEAF_CORO_H */
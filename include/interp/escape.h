@@ -0,0 +1,25 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_ESCAPE_H
+#define LEAF_ESCAPE_H
+
+#include "interp/state.h"
+#include "parser/node.h"
+
+/*
+ * scalar replacement of the map and array literals in a body that never
+ * escape it. a local qualifies when its one declaration initializes it to
+ * an array, or to a map whose keys are distinct string or int literals,
+ * and everything else only reads or writes it at a constant key: v.x,
+ * v["x"], v[0], v.x = ... and not as a method call. it is then never
+ * allocated: each element, and each key only written, gets a local of its
+ * own, declared where the literal was, null if the literal lacks it, and
+ * the reads and writes go to those. array indices must be in range, as
+ * out of range ones raise. body is rewritten in place and nslots grown by
+ * the locals added; the count of literals replaced is returned
+ */
+int lf_scalar_replace(lfState *L, lfArray(lfNode *) *body, int *nslots);
+
+#endif /* LEAF_ESCAPE_H */
@@ -0,0 +1,49 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_EVAL_H
+#define LEAF_EVAL_H
+
+#include "interp/state.h"
+#include "interp/value.h"
+#include "parser/node.h"
+
+typedef lfValue (*lfEvaluator)(lfState *L, lfNode *node);
+
+/* one evaluator per node type, picked with a single indexed load */
+extern const lfEvaluator lf_evaluators[];
+
+#ifdef LF_DISPATCH_STATS
+/* counting builds route every dispatch through here, see lf_dispatch_report */
+lfValue lf_eval_counted(lfState *L, lfNode *node);
+#define lf_eval(L, N) lf_eval_counted((L), (N))
+
+/* writes the dispatch counts and the most frequent pairs and triples of node types */
+void lf_dispatch_report(lfState *L, FILE *out);
+#else
+#define lf_eval(L, N) lf_evaluators[(N)->type]((L), (N))
+#endif
+
+#define lf_push(L, V) {                                 \
+    if ((L)->top >= (L)->stack_end) {                   \
+        lf_runtime_error((L), "stack overflow");        \
+    }                                                   \
+    *(L)->top++ = (V);                                  \
+}
+
+/*
+ * calls callee with the argc values following it on the stack. a function
+ * whose body ends in return g(...), where nothing is left to check of the
+ * result, hands its frame over to g instead of calling it: g's arguments
+ * move down to the frame's base and g runs in it, so recursion through
+ * such calls, direct or mutual, runs in constant stack
+ */
+lfValue lf_call(lfState *L, lfValue *callee, int argc);
+void lf_exec_chunk(lfState *L, lfChunk *chunk);
+
+lfValue lf_arith(lfState *L, lfTokenType op, lfValue a, lfValue b);
+lfValue lf_index(lfState *L, lfValue object, lfValue index);
+void lf_set_index(lfState *L, lfValue object, lfValue index, lfValue value);
+
+#endif /* LEAF_EVAL_H */
@@ -0,0 +1,31 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_GC_H
+#define LEAF_GC_H
+
+#include <stddef.h>
+
+#include "interp/state.h"
+#include "interp/value.h"
+
+#define LF_GC_INITIAL (1 << 20) /* bytes allocated before the first collection */
+
+/*
+ * collections only ever run at safepoints (function entry and loop back
+ * edges), so a value is live as long as it is reachable from the stack,
+ * the globals or the constants; evaluators push any temporary they hold
+ * on to while evaluating something else
+ */
+#define lf_gc_check(L) {                  \
+    if ((L)->allocated > (L)->next_gc) { \
+        lf_gc_collect(L);                \
+    }                                    \
+}
+
+void *lf_gc_alloc(lfState *L, lfValueType type, size_t size);
+void lf_gc_collect(lfState *L);
+void lf_gc_free_all(lfState *L);
+
+#endif /* LEAF_GC_H */
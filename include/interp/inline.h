@@ -0,0 +1,39 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_INLINE_H
+#define LEAF_INLINE_H
+
+#include <stdbool.h>
+
+#include "interp/state.h"
+#include "parser/node.h"
+
+#define LF_INLINE_NODES 32 /* largest body copied into a call site */
+#define LF_INLINE_DEPTH 3 /* copies nested in copies, at most */
+#define LF_INLINE_BUDGET 65536 /* nodes, over all copies */
+
+/*
+ * whether calls to f can run a copy of its body in their place: its body
+ * is a single return or expression statement of at most LF_INLINE_NODES
+ * nodes that declares nothing, captures nothing, does not suspend and does
+ * not call f by its own name. the answer is kept in f, unless its body is
+ * not parsed yet
+ */
+bool lf_inlinable(lfFunctionNode *f);
+
+/*
+ * gives call a copy of target, or of body, a specialized copy of it, if
+ * that is inlinable and the call passes every parameter (argc counts the
+ * receiver of a method). for as long as the call's callee stays target,
+ * the evaluator runs the copy's body instead of calling it: the arguments
+ * become its slots, and it gets a frame above the caller's only so errors
+ * and profiler samples name it. the copy is compiled once it is
+ * hot, like any function. calls inside it are inlined in turn up to
+ * LF_INLINE_DEPTH copies deep, so recursion still goes through frames.
+ * false if the call was left alone
+ */
+bool lf_inline(lfState *L, lfCallNode *call, lfFunctionNode *target, lfFunctionNode *body, int argc);
+
+#endif /* LEAF_INLINE_H */
@@ -0,0 +1,112 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_ISOLATE_H
+#define LEAF_ISOLATE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "interp/state.h"
+#include "interp/value.h"
+#include "lib/alloc.h"
+#include "lib/error.h"
+
+/*
+ * isolates run leaf code in parallel, each on an OS thread of its own with
+ * its own state: heap, globals, compiled code and coroutines. nothing leaf
+ * can see is shared between them; they only ever talk by sending messages,
+ * which are copied
+ */
+#if defined(__unix__) || defined(__APPLE__)
+#define LF_ISOLATE_SUPPORTED 1
+#else
+#define LF_ISOLATE_SUPPORTED 0
+#endif
+
+#if LF_ISOLATE_SUPPORTED
+#include <pthread.h>
+#endif
+
+#define LF_MAX_ISOLATES 256 /* per group, over its whole life */
+#define LF_ISOLATE_CSTACK (8 << 20) /* bytes, what LF_MAX_FRAMES was sized for */
+#define LF_MESSAGE_DEPTH 64 /* arrays and maps nested in a message, which also stops cycles */
+
+/* one copied value, its encoding following the header */
+typedef struct lfMessage {
+    struct lfMessage *next;
+    size_t size;
+} lfMessage;
+
+/*
+ * intrusive multiple producer, single consumer queue. senders only swap
+ * the head and link the node they pushed, so they never wait on each
+ * other or on the receiver
+ */
+typedef struct lfMailbox {
+    lfMessage *head; /* the last message pushed */
+    lfMessage *tail; /* the next to pop, owned by the receiver */
+    lfMessage stub; /* keeps the queue from ever being empty */
+} lfMailbox;
+
+typedef struct lfIsolateGroup lfIsolateGroup;
+
+typedef struct lfIsolate {
+    lfIsolateGroup *group;
+    int id;
+    lfState *L; /* while its script runs */
+    char *path; /* NULL for a state that was attached rather than started */
+    lfMailbox inbox;
+    int wake[2]; /* read and write ends, the same eventfd where there is one */
+    bool parked; /* the receiver is about to wait on wake, so senders must write to it */
+    bool receiving; /* a coroutine of its own is waiting on wake */
+    bool ok; /* the script ran without errors */
+#if LF_ISOLATE_SUPPORTED
+    pthread_t thread;
+#endif
+} lfIsolate;
+
+struct lfIsolateGroup {
+    lfAllocator allocator; /* shared by every isolate, so it must be thread safe */
+    lfDiagnosticSink diagnostics;
+    FILE *out; /* where print writes */
+    bool jit;
+    bool inline_calls;
+    bool tail_calls;
+    bool optimize;
+    bool lazy; /* parse function bodies on first call, see lfParser */
+    FILE *shake; /* where each isolate reports tree shaking its script, NULL for none */
+    lfIsolate *isolates[LF_MAX_ISOLATES]; /* by id */
+    int count;
+};
+
+/*
+ * a group of isolates that can message each other, sharing an allocator
+ * (lf_default_allocator is thread safe) and a diagnostic sink, which
+ * must be too
+ */
+lfIsolateGroup *lf_isolate_group_new(const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, FILE *out);
+
+/*
+ * makes a state created by the caller an isolate of the group, running on
+ * the caller's thread; its id. the group must be deleted before the state
+ */
+int lf_isolate_attach(lfIsolateGroup *G, lfState *L);
+
+/* runs the script at path in a new isolate on a new thread; its id, or -1 */
+int lf_isolate_start(lfIsolateGroup *G, const char *path);
+
+/* waits for every started isolate, including ones started meanwhile; false if any script failed */
+bool lf_isolate_group_wait(lfIsolateGroup *G);
+
+/* frees the group once it has been waited for, with any messages never received */
+void lf_isolate_group_delete(lfIsolateGroup *G);
+
+/* copies a null, number or string, or an array or map of them, to isolate id */
+void lf_isolate_send(lfState *L, int id, lfValue value);
+
+/* the oldest message sent to L's isolate, suspending the calling coroutine until there is one */
+lfValue lf_isolate_receive(lfState *L);
+
+#endif /* LEAF_ISOLATE_H */
@@ -0,0 +1,62 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_JIT_H
+#define LEAF_JIT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "interp/state.h"
+#include "parser/node.h"
+
+/* the generated code follows the System V calling convention */
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define LF_JIT_SUPPORTED 1
+#else
+#define LF_JIT_SUPPORTED 0
+#endif
+
+#define LF_JIT_CALLS 64 /* calls before a function body is compiled */
+#define LF_JIT_ENTRIES 8 /* entries before a loop is compiled on its own */
+#define LF_JIT_BACKEDGES 512 /* iterations of an interpreted loop before it is replaced while running */
+#define LF_JIT_REGION (64 * 1024) /* bytes of pages mapped at a time for code, a multiple of the page size */
+#define LF_JIT_PROTECT_TRIES 8 /* failed mprotect calls before giving up on making code executable again */
+
+/*
+ * compiled code runs in the frame the interpreter set up for it, with
+ * L->base, L->frame and L->closure as they would be for the tree it came
+ * from, and leaves L->returning and L->retval the way the evaluators would
+ */
+typedef void (*lfNativeCode)(lfState *L);
+
+/*
+ * baseline compiler from trees to x86-64. locals, proven int and float
+ * arithmetic, comparisons and control flow become machine code; anything
+ * else calls back into the evaluator for that node. both return false,
+ * and mark the node so it is not tried again, if the code cannot be made
+ */
+bool lf_jit_function(lfState *L, lfFunctionNode *f);
+
+/*
+ * a compiled loop starts at its condition and keeps every variable in its
+ * frame slot, so the interpreter can also switch to it between two
+ * iterations of a loop that is already running (on-stack replacement)
+ */
+bool lf_jit_loop(lfState *L, lfWhileNode *loop);
+
+/*
+ * the line frame is on. while compiled code runs in it, that comes from
+ * the code's position table, at pc if that is inside the code (as when a
+ * profiler sample interrupts it) and otherwise at the call it made last
+ */
+int lf_jit_line(const lfFrame *frame, const void *pc);
+
+/* how much code the state compiled, and what its position tables cost */
+void lf_jit_report(lfState *L, FILE *out);
+
+/* unmaps every page of code the state compiled */
+void lf_jit_free(lfState *L);
+
+#endif /* LEAF_JIT_H */
@@ -0,0 +1,48 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_PROFILE_H
+#define LEAF_PROFILE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "interp/state.h"
+
+/* the sampler runs off SIGPROF and a CPU time interval timer */
+#if defined(__unix__) || defined(__APPLE__)
+#define LF_PROFILE_SUPPORTED 1
+#else
+#define LF_PROFILE_SUPPORTED 0
+#endif
+
+#define LF_PROFILE_HZ 997 /* samples per second of CPU time, off any round timer period */
+#define LF_PROFILE_DEPTH 64 /* innermost frames kept per sample */
+#define LF_PROFILE_STACKS 4096 /* distinct stacks, a power of two */
+#define LF_PROFILE_FRAMES 65536 /* frames over all distinct stacks */
+
+/*
+ * starts sampling the leaf call stack of L, hz times a second of CPU time.
+ * the signal handler only counts into tables allocated here, so samples
+ * of a stack seen before cost a hash and a compare. SIGPROF belongs to
+ * the process, so only one state can be profiled at a time, and samples
+ * taken on other threads are only counted; false if another state is
+ * being profiled, or sampling is not supported here
+ */
+bool lf_profile_start(lfState *L, int hz);
+
+/* stops sampling, keeping what was counted */
+void lf_profile_stop(lfState *L);
+
+/*
+ * writes the samples as collapsed stacks, one "outer;...;inner count" line
+ * per distinct stack, for flamegraph.pl and similar tools. frames read
+ * "name (file:line)", at the line the frame was running
+ */
+void lf_profile_write(lfState *L, FILE *out);
+
+/* stops sampling if needed and frees the tables */
+void lf_profile_free(lfState *L);
+
+#endif /* LEAF_PROFILE_H */
@@ -0,0 +1,25 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_RESOLVE_H
+#define LEAF_RESOLVE_H
+
+#include "interp/state.h"
+
+/*
+ * maps every variable in a chunk to a frame slot, a closure capture or a
+ * global slot, once, so that evaluation never looks names up by string.
+ * also decodes literals into the nodes' constants and loads the chunks it
+ * includes. every name that resolves to a global nothing declares is
+ * reported before returning false
+ */
+bool lf_resolve_chunk(lfState *L, lfChunk *chunk);
+
+/*
+ * resolves a lazy function of chunk once its body is parsed. the chunk
+ * only gave it its global slot, as nothing it can see is local
+ */
+bool lf_resolve_function(lfState *L, lfChunk *chunk, lfFunctionNode *f);
+
+#endif /* LEAF_RESOLVE_H */
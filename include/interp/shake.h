@@ -0,0 +1,27 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_SHAKE_H
+#define LEAF_SHAKE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "interp/state.h"
+
+/*
+ * whole program tree shaking, between parsing and resolving. starting from
+ * the top level statements of chunk, it follows includes and every name
+ * reachable code uses, loading the chunks it reaches, and drops the top
+ * level functions and classes of all of them that nothing reachable names,
+ * so they are never resolved, checked or compiled, and whatever only they
+ * include is never loaded. names are matched by string whatever scope they
+ * are used in, which can only keep too much. lazy bodies are scanned for
+ * names rather than parsed. each removal and a summary are written to
+ * report, unless it is NULL; false if an include could not be loaded,
+ * which has been reported
+ */
+bool lf_shake(lfState *L, lfChunk *chunk, FILE *report);
+
+#endif /* LEAF_SHAKE_H */
@@ -0,0 +1,63 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_SNAPSHOT_H
+#define LEAF_SNAPSHOT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "interp/state.h"
+#include "lib/alloc.h"
+#include "lib/error.h"
+
+/* snapshots are mapped back at a fixed address, and relocated against the loaded image */
+#if defined(__linux__) || defined(__FreeBSD__)
+#define LF_SNAPSHOT_SUPPORTED 1
+#else
+#define LF_SNAPSHOT_SUPPORTED 0
+#endif
+
+#define LF_SNAPSHOT_BASE ((uintptr_t)0x3f0000000000) /* clear of where PIE images, the heap and mmap usually land */
+#define LF_SNAPSHOT_RESERVE ((size_t)1 << 34) /* bytes of address space a state being snapshotted may fill */
+#define LF_SNAPSHOT_VERSION 2
+
+/*
+ * a state that allocates everything, itself included, from a region at
+ * LF_SNAPSHOT_BASE, so that once it has run its initialization the region
+ * can be written out as is. the region only ever grows, and is not thread
+ * safe, so the state's parser must tokenize on one thread. the JIT is off,
+ * since machine code would be left out of the snapshot anyway
+ */
+lfState *lf_snapshot_state_new(const lfDiagnosticSink *diagnostics);
+
+/*
+ * writes the region of a state made by lf_snapshot_state_new to path,
+ * replacing it atomically, so processes that have the old one mapped keep
+ * it. nothing may be running: no frames, no isolate group, no profiler,
+ * and no coroutine left unfinished. the trees, globals and heap are kept,
+ * along with where the few words pointing into leaf's own code are, the
+ * state's and its parser's allocators and diagnostic sinks, to be
+ * relocated if that lands elsewhere next time. pages of zeros are left as
+ * holes. false, reported, if the state cannot be written
+ */
+bool lf_snapshot_write(lfState *L, const char *path);
+
+/*
+ * maps the snapshot at path privately, at the address it was written
+ * from, and returns its state, with diagnostics, out (for print) and the
+ * JIT as a new state would have them. pages are only read in as they are
+ * touched, though relocating touches those holding pointers to code when
+ * the image has moved. includes of files the snapshot already loaded,
+ * by the same path, are neither read nor run again. the snapshot must
+ * have been written by this very build of leaf. memory the state
+ * allocates from then on comes from allocator, and what it frees of the
+ * snapshot is simply left in place. NULL, reported, on failure
+ */
+lfState *lf_snapshot_load(const char *path, const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, FILE *out);
+
+/* deletes a state made by either of the above, and unmaps its region */
+void lf_snapshot_state_delete(lfState *L);
+
+#endif /* LEAF_SNAPSHOT_H */
@@ -0,0 +1,41 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_SSA_H
+#define LEAF_SSA_H
+
+#include <stdio.h>
+
+#include "interp/state.h"
+#include "parser/node.h"
+
+/*
+ * optimizes every body of the chunks checked since the last call: the top
+ * level, functions, methods and specialized copies. each body is put in SSA
+ * form, with a block per arm of an if and per loop header, body and exit,
+ * and phis where they meet. the variables are the locals no closure
+ * captures; globals, fields and boxes are memory and opaque to it. before
+ * that, the literals the body never lets out are taken apart into locals,
+ * see lf_scalar_replace. then, in order:
+ *  - copy propagation: a read of x after x = y reads y instead, where y
+ *    still holds the same value
+ *  - licm: proven int or float arithmetic that cannot fail and whose
+ *    operands do not change in a loop is computed once, before it
+ *  - cse: arithmetic equal to an earlier one it is dominated by reuses
+ *    that one's value, kept in a new slot
+ *  - dce: statements after a return, and pure stores and expression
+ *    statements nothing observes, are removed
+ * leaf runs trees, so that is what the IR lowers back to: each pass
+ * rewrites the body it was built from. with L->ir_dump set, each body's IR
+ * is written there after the passes
+ */
+void lf_optimize(lfState *L);
+
+/* optimizes a lazy function of chunk once its body is parsed and checked */
+void lf_optimize_function(lfState *L, lfChunk *chunk, lfFunctionNode *f);
+
+/* writes what the passes did so far, one line per pass */
+void lf_optimize_report(lfState *L, FILE *out);
+
+#endif /* LEAF_SSA_H */
@@ -0,0 +1,220 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_STATE_H
+#define LEAF_STATE_H
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <stdbool.h>
+
+#include "interp/value.h"
+#include "parser/parse.h"
+#include "lib/alloc.h"
+#include "lib/array.h"
+#include "lib/error.h"
+
+#define LF_STACK_SIZE (1 << 18) /* values */
+#define LF_MAX_FRAMES 2048
+
+/*
+ * C stack a call must leave free, enough to compile and evaluate the
+ * deepest tree a parse accepts. unoptimized and sanitized builds take a
+ * few times more per level of nesting
+ */
+#if defined(__SANITIZE_ADDRESS__)
+#define LF_STACK_MARGIN (LF_MAX_NESTING << 12)
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define LF_STACK_MARGIN (LF_MAX_NESTING << 12)
+#endif
+#endif
+#ifndef LF_STACK_MARGIN
+#ifdef __OPTIMIZE__
+#define LF_STACK_MARGIN (LF_MAX_NESTING << 10)
+#else
+#define LF_STACK_MARGIN (LF_MAX_NESTING << 12)
+#endif
+#endif
+
+/* generic functions get copies per type instantiation, within these limits */
+#define LF_SPECIALIZE_BUDGET 16384 /* nodes, over all copies */
+#define LF_MAX_SPECIALIZATIONS 8 /* per function */
+
+/* a parsed source file; its tree lives in the state's parser arena */
+struct lfChunk {
+    char *file;
+    char *source;
+    lfNode *ast;
+    int nslots; /* locals of the top level (globals live in the global table) */
+    bool resolved;
+    bool checked;
+    bool optimized;
+    bool executed; /* includes only run the first time they are reached */
+};
+
+/* what the type checker knows about a global */
+typedef struct lfGlobalType {
+    lfTypeSet type; /* everything it may hold, TS_ANY unless it is annotated */
+    lfTypeSet declared; /* its annotation, 0 for none */
+    lfFunctionNode *function; /* the function declared under its name, if any */
+} lfGlobalType;
+
+/* what the optimizer did, over every body it ran on; see interp/ssa.h */
+typedef struct lfOptStats {
+    int scalars; /* literals replaced by locals */
+    int scalar_locals; /* the locals they became */
+    int bodies;
+    int blocks;
+    int instructions;
+    int phis; /* left once trivial ones are folded */
+    int copies; /* reads of a copy turned into reads of its source */
+    int hoisted; /* expressions computed before their loop */
+    int loops; /* loops anything was hoisted out of */
+    int common; /* expressions replaced by an earlier equal one */
+    int dead; /* statements removed */
+} lfOptStats;
+
+/* sampling profiler tables, defined in profile.c */
+typedef struct lfProfile lfProfile;
+
+/* coroutines and their event loop, see interp/coro.h */
+typedef struct lfScheduler lfScheduler;
+
+/* a state running in parallel with others, see interp/isolate.h */
+typedef struct lfIsolate lfIsolate;
+
+/* executable pages compiled functions and loops are packed into */
+typedef struct lfCodeRegion {
+    void *start;
+    size_t size;
+    size_t used;
+} lfCodeRegion;
+
+/*
+ * a compiled function or loop. in place of storing the line of every
+ * statement into the frame as it runs, the code carries a table with an
+ * entry per statement: how far its code starts past the previous one's,
+ * then its line less the previous one's, zigzagged, both as varints.
+ * nodes only know their line, so that is all the entries hold
+ */
+typedef struct lfCodeInfo {
+    const uint8_t *start;
+    size_t size;
+    int statements; /* entries in positions */
+    int frame_code; /* bytes of the code setting and clearing lfFrame.native */
+    size_t npositions; /* bytes */
+    uint8_t positions[];
+} lfCodeInfo;
+
+typedef struct lfFrame {
+    lfFunction *function; /* NULL while running a chunk's top level */
+    lfChunk *chunk;
+    lfValue *base;
+    int line; /* see lf_jit_line while native is set */
+    const lfCodeInfo *native; /* compiled code running in this frame, which runs no statements through the evaluators */
+    void **native_sp; /* its stack pointer, just below the return address of its latest call */
+} lfFrame;
+
+/* the callee and arguments of a call in tail position, left on the stack above the frame */
+typedef struct lfTailCall {
+    lfFunction *function; /* NULL when none is pending */
+    lfFunctionNode *node; /* function's tree, or a specialized copy of it */
+    lfValue *args;
+    int argc;
+} lfTailCall;
+
+struct lfState {
+    lfAllocator allocator;
+    lfDiagnosticSink diagnostics;
+    lfParser *parser;
+    lfArray(lfChunk *) chunks;
+    FILE *out;
+
+    /* preallocated value stack holding every frame's slots and temporaries */
+    lfValue *stack;
+    lfValue *stack_end;
+    lfValue *top;
+    lfValue *base; /* slots of the running frame */
+    lfFunction *closure; /* running closure, for captured variables */
+    lfFrame *frames;
+    int nframes;
+    int max_frames; /* LF_MAX_FRAMES, or fewer in a coroutine */
+    lfFrame *frame; /* innermost frame, NULL when nothing is running */
+    char *stack_limit; /* calls overflow once the C stack reaches below this */
+
+    /* set by return statements while unwinding to the enclosing call */
+    bool returning;
+    lfValue retval;
+    lfTailCall tail; /* a return f(...) waiting for its caller's frame, see lf_call */
+
+    lfArray(lfValue) globals;
+    lfArray(const char *) global_names;
+    lfArray(bool) global_declared; /* by a builtin or a top level declaration */
+    lfArray(lfGlobalType) global_types;
+    lfArray(const char *) class_names; /* every class declared so far, usable as a type */
+    int specialized_nodes; /* spent of LF_SPECIALIZE_BUDGET */
+    int inlined_nodes; /* spent of LF_INLINE_BUDGET */
+
+    /* heap */
+    lfObject *objects;
+    size_t allocated;
+    size_t next_gc;
+    lfArray(lfObject *) gray;
+    lfMap *strings; /* string literals referenced from the tree, interned */
+
+    bool jit; /* compile hot functions and loops to machine code */
+    bool inline_calls; /* run copies of small callees in place of calling them, see interp/inline.h */
+    bool tail_calls; /* let the checker mark calls in tail position to run in their caller's frame, see lf_call */
+    bool optimize; /* run the SSA passes over bodies once they are checked, see interp/ssa.h */
+    FILE *ir_dump; /* when set, the optimizer writes every body's IR here */
+    lfOptStats opt_stats;
+    FILE *shake; /* when set, runs drop what nothing reachable names, reporting it here; see lf_shake */
+    lfArray(lfCodeRegion) code;
+    lfArray(lfCodeInfo *) compiled;
+
+    lfProfile *profile; /* samples of the call stack, see lf_profile_start */
+    lfScheduler *scheduler; /* NULL until the first coroutine is spawned */
+    lfIsolate *isolate; /* NULL unless it belongs to an isolate group */
+
+#ifdef LF_DISPATCH_STATS
+    /* evaluator dispatches by node type, and by the types of the one and two evaluators they came from */
+    uint64_t dispatches[LF_NODE_TYPES];
+    uint64_t dispatch_pairs[LF_NODE_TYPES][LF_NODE_TYPES];
+    uint64_t dispatch_triples[LF_NODE_TYPES][LF_NODE_TYPES][LF_NODE_TYPES];
+    int dispatch_path[2]; /* the running evaluator's type and its caller's, -1 for none */
+#endif
+
+    jmp_buf *error_jmp;
+};
+
+lfState *lf_state_new(const lfAllocator *allocator, const lfDiagnosticSink *diagnostics);
+void lf_state_delete(lfState *L);
+
+/* parse, resolve and run; errors go to the state's diagnostic sink */
+bool lf_run_string(lfState *L, const char *source, const char *file);
+bool lf_run_file(lfState *L, const char *path);
+
+/*
+ * the file an include in from names, include a.b.c being a/b/c.lf relative
+ * to from's directory. path is the include's names, with or without the
+ * dots between them. freed with array_delete
+ */
+lfArray(char) lf_include_path(const lfAllocator *allocator, const char *from, const lfToken *path, int ntokens);
+
+/* finds or parses (without resolving) the chunk an include names */
+lfChunk *lf_load_include(lfState *L, lfChunk *from, lfImportNode *import);
+
+/* parses, resolves and checks the body of a lazy function of chunk, reporting errors as the chunk would */
+bool lf_load_body(lfState *L, lfChunk *chunk, lfFunctionNode *f);
+
+int lf_global_slot(lfState *L, const char *name);
+void lf_global_set(lfState *L, const char *name, lfValue value);
+
+#if defined(__GNUC__)
+__attribute__((noreturn, format(printf, 2, 3)))
+#endif
+void lf_runtime_error(lfState *L, const char *fmt, ...);
+
+#endif /* LEAF_STATE_H */
@@ -0,0 +1,27 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_TYPECHECK_H
+#define LEAF_TYPECHECK_H
+
+#include <stddef.h>
+
+#include "interp/state.h"
+
+/*
+ * checks the type annotations of every chunk resolved since the last call
+ * and infers the types of local variables. annotated variables, parameters
+ * and return values get guards where a value may not fit, so that inside a
+ * function the declared types hold, and arithmetic whose operands are
+ * proven ints or floats is marked on its node
+ */
+bool lf_typecheck(lfState *L);
+
+/* checks a lazy function of chunk once its body is parsed and resolved */
+bool lf_typecheck_function(lfState *L, lfChunk *chunk, lfFunctionNode *f);
+
+/* writes "int", "int|float", ... */
+void lf_typeset_format(lfTypeSet set, char *buffer, size_t size);
+
+#endif /* LEAF_TYPECHECK_H */
@@ -0,0 +1,231 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_VALUE_H
+#define LEAF_VALUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "parser/node.h"
+#include "lib/array.h"
+
+typedef struct lfState lfState;
+typedef struct lfChunk lfChunk;
+
+typedef enum lfValueType {
+    LF_UNDEFINED, /* unassigned global, never visible to leaf code */
+    LF_NULL,
+    LF_INT,
+    LF_FLOAT,
+    LF_NATIVE,
+
+    /* heap objects */
+    LF_STRING,
+    LF_ARRAY,
+    LF_MAP,
+    LF_FUNCTION,
+    LF_METHOD,
+    LF_CLASS,
+    LF_INSTANCE,
+    LF_TASK,
+    LF_BOX /* captured local, only ever found in frame slots and captures */
+} lfValueType;
+
+typedef struct lfObject {
+    struct lfObject *next;
+    lfValueType type;
+    bool marked;
+} lfObject;
+
+typedef struct lfValue lfValue;
+
+typedef lfValue (*lfNativeFn)(lfState *L, lfValue *args, int argc);
+
+typedef struct lfNative {
+    const char *name;
+    lfNativeFn fn;
+} lfNative;
+
+/* every native, ending in a NULL name, defined with the builtins */
+extern const lfNative lf_natives[];
+
+struct lfValue {
+    lfValueType type;
+    union {
+        int64_t i;
+        double f;
+        lfObject *o;
+        int64_t native; /* index into lf_natives */
+    } as;
+};
+
+#define is_object(V) ((V).type >= LF_STRING)
+
+#define lf_null()     ((lfValue) { .type = LF_NULL, .as.i = 0 })
+#define lf_int(I)     ((lfValue) { .type = LF_INT, .as.i = (I) })
+#define lf_float(F)   ((lfValue) { .type = LF_FLOAT, .as.f = (F) })
+#define lf_obj(T, O)  ((lfValue) { .type = (T), .as.o = (lfObject *)(O) })
+
+#define as_string(V)   ((lfString *)(V).as.o)
+#define as_array(V)    ((lfArrayObject *)(V).as.o)
+#define as_map(V)      ((lfMap *)(V).as.o)
+#define as_function(V) ((lfFunction *)(V).as.o)
+#define as_method(V)   ((lfBoundMethod *)(V).as.o)
+#define as_class(V)    ((lfClass *)(V).as.o)
+#define as_instance(V) ((lfInstance *)(V).as.o)
+#define as_box(V)      ((lfBox *)(V).as.o)
+#define as_task(V)     ((lfTask *)(V).as.o)
+#define as_native(V)   (&lf_natives[(V).as.native])
+
+/*
+ * a string is flat, with its characters inline, or a rope joining two
+ * others, whose characters are copied out the first time anything reads
+ * them. the hash is computed on first use too, so strings that are only
+ * built and printed never pay for it
+ */
+typedef struct lfString {
+    lfObject obj;
+    int length;
+    uint32_t hash; /* 0 until computed */
+    const char *chars; /* nul terminated, NULL while a rope */
+    struct lfString *left; /* a rope's halves, NULL once flat */
+    struct lfString *right;
+    char data[]; /* a flat string's characters */
+} lfString;
+
+/*
+ * arrays of only ints or only floats keep bare payloads, packed; the first
+ * element of another type moves the array to tagged values for good
+ */
+typedef enum lfArrayKind {
+    AK_INT, /* also what an empty array starts as */
+    AK_FLOAT,
+    AK_VALUE
+} lfArrayKind;
+
+typedef struct lfArrayObject {
+    lfObject obj;
+    lfArrayKind kind;
+    int length;
+    int capacity;
+    union {
+        int64_t *ints;
+        double *floats;
+        lfValue *values;
+    } as;
+} lfArrayObject;
+
+typedef struct lfMapEntry {
+    lfValue key;
+    lfValue value;
+    uint32_t hash;
+} lfMapEntry;
+
+#define LF_MAP_LINEAR 8 /* maps up to this many entries are searched linearly */
+#define LF_MAP_GROUP 16 /* control bytes probed at once */
+
+/*
+ * entries are kept in insertion order. a map that outgrows LF_MAP_LINEAR
+ * gets a swiss table: one control byte per slot, holding the low 7 bits of
+ * the key's hash or 0x80 when empty, next to the index of the slot's entry.
+ * slots are probed a group of control bytes at a time, and only the
+ * entries whose control byte matches are compared
+ */
+typedef struct lfMap {
+    lfObject obj;
+    int count;
+    int capacity; /* entries */
+    lfMapEntry *entries;
+    int nslots; /* power of two and a multiple of LF_MAP_GROUP, 0 while linear */
+    uint8_t *ctrl; /* nslots control bytes, followed by the slots */
+    int32_t *slots;
+} lfMap;
+
+typedef struct lfBox {
+    lfObject obj;
+    lfValue value;
+} lfBox;
+
+typedef struct lfFunction {
+    lfObject obj;
+    lfFunctionNode *node;
+    lfChunk *chunk;
+    int ncaptures;
+    lfBox *captures[];
+} lfFunction;
+
+typedef struct lfBoundMethod {
+    lfObject obj;
+    lfValue receiver;
+    lfFunction *method;
+} lfBoundMethod;
+
+typedef struct lfClass {
+    lfObject obj;
+    lfClassNode *node;
+    lfString *name;
+    lfArray(const char *) field_names;
+    lfArray(lfValue) field_defaults; /* evaluated once, when the class is declared */
+    lfArray(lfTypeSet) field_types; /* declared types, 0 where a field has none */
+    lfArray(lfFunction *) methods;
+    lfFunction *init;
+} lfClass;
+
+typedef struct lfInstance {
+    lfObject obj;
+    lfClass *cls;
+    int nfields;
+    lfValue fields[];
+} lfInstance;
+
+/* the handle of a coroutine, see interp/coro.h */
+typedef struct lfTask {
+    lfObject obj;
+    struct lfCoroutine *coro; /* NULL once it has finished */
+    lfValue result;
+} lfTask;
+
+lfString *lf_string_new(lfState *L, const char *data, int length);
+lfString *lf_string_concat(lfState *L, lfString *a, lfString *b);
+lfString *lf_string_intern(lfState *L, const char *data, int length);
+const char *lf_string_chars(lfState *L, lfString *str);
+lfString *lf_value_tostring(lfState *L, lfValue v);
+
+lfArrayObject *lf_array_new(lfState *L, int reserve);
+void lf_array_push(lfState *L, lfArrayObject *array, lfValue v);
+void lf_array_set(lfState *L, lfArrayObject *array, int index, lfValue v);
+lfValue lf_array_pop(lfArrayObject *array);
+
+static inline lfValue lf_array_get(const lfArrayObject *array, int index) {
+    switch (array->kind) {
+        case AK_INT:
+            return lf_int(array->as.ints[index]);
+        case AK_FLOAT:
+            return lf_float(array->as.floats[index]);
+        default:
+            return array->as.values[index];
+    }
+}
+
+lfMap *lf_map_new(lfState *L);
+bool lf_map_get(lfState *L, lfMap *map, lfValue key, lfValue *out);
+void lf_map_set(lfState *L, lfMap *map, lfValue key, lfValue value);
+size_t lf_map_storage(const lfMap *map);
+
+lfBox *lf_box_new(lfState *L, lfValue value);
+lfFunction *lf_function_new(lfState *L, lfFunctionNode *node, lfChunk *chunk);
+lfBoundMethod *lf_bound_method_new(lfState *L, lfValue receiver, lfFunction *method);
+lfClass *lf_class_new(lfState *L, lfClassNode *node);
+lfInstance *lf_instance_new(lfState *L, lfClass *cls);
+lfTask *lf_task_new(lfState *L);
+
+int lf_class_field(lfClass *cls, const char *name);
+lfFunction *lf_class_method(lfClass *cls, const char *name);
+
+bool lf_values_equal(lfState *L, lfValue a, lfValue b);
+bool lf_value_truthy(lfValue v);
+const char *lf_type_name(lfValue v);
+
+#endif /* LEAF_VALUE_H */
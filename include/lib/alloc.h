@@ -0,0 +1,35 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_ALLOC_H
+#define LEAF_ALLOC_H
+
+#include <stddef.h>
+
+/*
+ * caller-supplied allocation hooks
+ * a NULL ptr allocates, a new_size of 0 frees; old_size is always the size the
+ * block was allocated with, so arena-style allocators need no bookkeeping
+ */
+typedef struct lfAllocator {
+    void *(*realloc)(void *userdata, void *ptr, size_t old_size, size_t new_size);
+    void *userdata;
+} lfAllocator;
+
+/* backed by the C library's realloc and free */
+extern const lfAllocator lf_default_allocator;
+
+static inline void *lf_malloc(const lfAllocator *allocator, size_t size) {
+    return allocator->realloc(allocator->userdata, NULL, 0, size);
+}
+
+static inline void *lf_realloc(const lfAllocator *allocator, void *ptr, size_t old_size, size_t new_size) {
+    return allocator->realloc(allocator->userdata, ptr, old_size, new_size);
+}
+
+static inline void lf_free(const lfAllocator *allocator, void *ptr, size_t size) {
+    allocator->realloc(allocator->userdata, ptr, size, 0);
+}
+
+#endif /* LEAF_ALLOC_H */
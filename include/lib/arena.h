@@ -0,0 +1,40 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_ARENA_H
+#define LEAF_ARENA_H
+
+#include <stddef.h>
+
+#include "lib/alloc.h"
+
+typedef struct lfArenaChunk {
+    struct lfArenaChunk *next;
+    size_t size;
+    size_t used;
+} lfArenaChunk;
+
+/*
+ * bump allocator over a list of chunks taken from a parent allocator
+ * frees are no-ops and only the most recent allocation can grow in place;
+ * everything is released at once by lf_arena_reset, which keeps the chunks
+ */
+typedef struct lfArena {
+    lfAllocator parent;
+    lfArenaChunk *chunks;
+    lfArenaChunk *current;
+    void *last; /* most recent allocation */
+    size_t chunk_size;
+} lfArena;
+
+void lf_arena_init(lfArena *arena, const lfAllocator *parent, size_t chunk_size);
+void lf_arena_reset(lfArena *arena);
+void lf_arena_free(lfArena *arena);
+
+void *lf_arena_alloc(lfArena *arena, size_t size);
+
+/* an allocator that serves from the arena, for use with arrays and nodes */
+lfAllocator lf_arena_allocator(lfArena *arena);
+
+#endif /* LEAF_ARENA_H */
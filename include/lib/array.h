@@ -8,9 +8,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-#define array_new_for(T) _array_new(sizeof(T))
-#define array_new_deleter(T, D) _array_new_deleter(array_new_for(T), (void (*)(void *))D)
-#define array_get_ctor(_1, _2, f, ...) f
+#include "lib/alloc.h"
+
+#define array_new_for(A, T) _array_new(A, sizeof(T))
+#define array_new_deleter(A, T, D) _array_new_deleter(array_new_for(A, T), (lfArrayDeleter)D)
+#define array_get_ctor(_1, _2, _3, f, ...) f
 #define array_ctor_for(...) array_get_ctor(__VA_ARGS__, array_new_deleter, array_new_for)
 #define array_new(...) array_ctor_for(__VA_ARGS__)(__VA_ARGS__)
 
@@ -19,38 +21,58 @@
 #define length(ARR) header(ARR).length
 #define size(ARR) header(ARR).size
 #define typesize(ARR) header(ARR).typesize
-#define deleter(ARR) header(ARR).deleter
+#define deleter(ARR) array_deleter_at(header(ARR).deleter)
+#define allocator(ARR) header(ARR).allocator
+
+/* element deleters get the allocator of the array they live in */
+typedef void (*lfArrayDeleter)(const lfAllocator *allocator, void *element);
 
 typedef struct lfArrayHeader {
     int size;
     int length;
     size_t typesize;
-    void (*deleter)(void *element);
-    size_t pad;
+    intptr_t deleter; /* see array_deleter_offset */
+    const lfAllocator *allocator;
 } lfArrayHeader;
 
-static inline void *_array_new(size_t typesize) {
-    void *arr = malloc(sizeof(lfArrayHeader));
+/*
+ * headers keep their deleter as an offset from lf_default_allocator, 0 for
+ * none, rather than its address, so that arrays mapped back in by a
+ * process whose code landed elsewhere still find it
+ */
+static inline intptr_t array_deleter_offset(lfArrayDeleter deleter) {
+    return deleter ? (intptr_t)(void *)deleter - (intptr_t)(const void *)&lf_default_allocator : 0;
+}
+
+static inline lfArrayDeleter array_deleter_at(intptr_t offset) {
+    return offset ? (lfArrayDeleter)(void *)((intptr_t)(const void *)&lf_default_allocator + offset) : NULL;
+}
+
+static inline void *_array_new(const lfAllocator *allocator, size_t typesize) {
+    void *arr = lf_malloc(allocator, sizeof(lfArrayHeader));
     *(lfArrayHeader *)arr = (lfArrayHeader) {
         .size = 0,
         .length = 0,
         .typesize = typesize,
-        .deleter = NULL
+        .deleter = 0,
+        .allocator = allocator
     };
     return (uint8_t *)arr + sizeof(lfArrayHeader);
 }
 
-static inline void *_array_new_deleter(void *array, void (*new_deleter)(void *element)) {
-    deleter(&array) = new_deleter;
+static inline void *_array_new_deleter(void *array, lfArrayDeleter new_deleter) {
+    header(&array).deleter = array_deleter_offset(new_deleter);
     return array;
 }
 
-#define array_reserve(ARR, S) {                                                                                                   \
-    int s = (S);                                                                                                                  \
-    if (size(ARR) < s) {                                                                                                          \
-        *(ARR) = (void *)((uint8_t *)realloc(&header(ARR), sizeof(lfArrayHeader) + (s * typesize(ARR))) + sizeof(lfArrayHeader)); \
-        size(ARR) = s;                                                                                                            \
-    }                                                                                                                             \
+#define array_reserve(ARR, S) {                                                                                             \
+    int s = (S);                                                                                                            \
+    if (size(ARR) < s) {                                                                                                    \
+        size_t old_size = sizeof(lfArrayHeader) + (size(ARR) * typesize(ARR));                                              \
+        size_t new_size = sizeof(lfArrayHeader) + (s * typesize(ARR));                                                      \
+        *(ARR) = (void *)((uint8_t *)lf_realloc(allocator(ARR), &header(ARR), old_size, new_size) + sizeof(lfArrayHeader)); \
+        size(ARR) = s;                                                                                                      \
+    }                                                                                                                       \
 }
 
 #define array_push(ARR, ELEMENT) {                             \
@@ -60,13 +82,13 @@ static inline void *_array_new_deleter(void *array, void (*new_deleter)(void *el
     (*(ARR))[length(ARR)++] = ELEMENT;                         \
 }
 
-#define array_delete(ARR) {                     \
-    if (deleter(ARR)) {                         \
-        for (int i = 0; i < length(ARR); i++) { \
-            deleter(ARR)((*ARR) + i);           \
-        }                                       \
-    }                                           \
-    free(&header(ARR));                         \
+#define array_delete(ARR) {                                                                     \
+    if (deleter(ARR)) {                                                                         \
+        for (int i = 0; i < length(ARR); i++) {                                                 \
+            deleter(ARR)(allocator(ARR), (*ARR) + i);                                           \
+        }                                                                                       \
+    }                                                                                           \
+    lf_free(allocator(ARR), &header(ARR), sizeof(lfArrayHeader) + (size(ARR) * typesize(ARR))); \
 }
 
 #endif /* LEAF_ARRAY_H */
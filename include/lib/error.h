@@ -5,7 +5,30 @@
 #ifndef LEAF_ERROR_H
 #define LEAF_ERROR_H
 
-void lf_error_underline_code(const char *source, int idx_start, int idx_end);
-void lf_error_print(const char *file, const char *source, int idx_start, int idx_end, const char *message);
+#include <stdio.h>
+
+typedef struct lfDiagnostic {
+    const char *file;
+    const char *source;
+    int idx_start;
+    int idx_end;
+    int line;
+    int column;
+    const char *message;
+} lfDiagnostic;
+
+/* receives every error the front end runs into, in place of printing it */
+typedef struct lfDiagnosticSink {
+    void (*report)(void *userdata, const lfDiagnostic *diagnostic);
+    void *userdata;
+} lfDiagnosticSink;
+
+void lf_error_report(const lfDiagnosticSink *sink, const char *file, const char *source, int idx_start, int idx_end, const char *message);
+/* underlines the whole line, for errors without a token to point at */
+void lf_error_report_line(const lfDiagnosticSink *sink, const char *file, const char *source, int line, const char *message);
+
+/* sink that pretty prints to the FILE * in userdata (stdout if NULL) */
+void lf_error_print_diagnostic(void *userdata, const lfDiagnostic *diagnostic);
+void lf_error_underline_code(FILE *out, const char *source, int idx_start, int idx_end);
 
 #endif /* LEAF_ERROR_H */
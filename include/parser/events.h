@@ -0,0 +1,57 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifndef LEAF_EVENTS_H
+#define LEAF_EVENTS_H
+
+#include <stdbool.h>
+
+#include "parser/node.h"
+#include "parser/parse.h"
+#include "parser/token.h"
+
+/*
+ * one side of a node lf_parse would have built. idx_end is only known on
+ * exit, and is idx_start on enter. tokens point into the parser's token
+ * buffer and stay valid until the parser is reset
+ */
+typedef struct lfParseEvent {
+    lfNodeType type;
+    int idx_start;
+    int idx_end;
+    int lineno;
+    const lfToken *tokens; /* the node's own: a name, an operator or a literal, or an include's path dots and all */
+    int ntokens;
+} lfParseEvent;
+
+/*
+ * either callback may be NULL. enter returning false skips everything
+ * inside the node, though not its exit, and function, class and block
+ * bodies inside a skipped node are only checked for balanced brackets
+ */
+typedef struct lfParseHandler {
+    bool (*enter)(void *userdata, const lfParseEvent *event);
+    void (*exit)(void *userdata, const lfParseEvent *event);
+    void *userdata;
+} lfParseHandler;
+
+/*
+ * parses source like lf_parse, with the same syntax errors, but builds no
+ * tree: it calls handler on entering and leaving every node in source
+ * order, starting with the chunk's compound. type annotations have no
+ * nodes and so no events. parsing stops at the first syntax error, which
+ * returns false with the nodes around it never exited
+ */
+bool lf_parse_events(lfParser *parser, const char *source, const char *file, const lfParseHandler *handler);
+
+/*
+ * checks the function body in the parser's tokens from *token, its '{',
+ * to the matching '}' for the syntax errors lf_parse would report there,
+ * calling nothing. depth is the blocks around the function and lineno the
+ * line of the '{'. *token is left past the '}'; this is a lazy parse's
+ * preparse of a body
+ */
+bool lf_parse_events_body(lfParser *parser, int *token, int depth, int lineno, const char *source, const char *file);
+
+#endif /* LEAF_EVENTS_H */
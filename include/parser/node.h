@@ -6,9 +6,11 @@
 #define LEAF_NODE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "parser/token.h"
 #include "lib/array.h"
+#include "lib/alloc.h"
 
 typedef enum lfNodeType {
     /* literals */
@@ -38,6 +40,10 @@ typedef enum lfNodeType {
     NT_WHILE,
     NT_RETURN,
 
+    /* coroutines */
+    NT_YIELD,
+    NT_AWAIT,
+
     /* types */
     NT_CLASS,
 
@@ -46,6 +52,8 @@ typedef enum lfNodeType {
     NT_IMPORT
 } lfNodeType;
 
+#define LF_NODE_TYPES (NT_IMPORT + 1)
+
 /* typing */
 
 typedef enum lfTypeType {
@@ -98,17 +106,61 @@ typedef struct lfFuncType {
     lfType *ret;
 } lfFuncType;
 
+/* name resolution, filled in after parsing */
+
+typedef enum lfVarKind {
+    VK_UNRESOLVED,
+    VK_LOCAL,   /* slot in the current frame */
+    VK_UPVALUE, /* index into the running closure's captures */
+    VK_GLOBAL,  /* slot in the global table */
+    VK_FIELD    /* class fields only: index into the instance's fields */
+} lfVarKind;
+
+typedef struct lfVarRef {
+    lfVarKind kind;
+    int depth; /* functions between the use and the declaration, 0 for locals */
+    int slot;
+    bool captured; /* declarations only: an inner function captures it, so it lives in a box */
+} lfVarRef;
+
+/* static typing, filled in after parsing */
+
+typedef unsigned lfTypeSet; /* the runtime types a value may have */
+
+#define TS_NULL     (1u << 0)
+#define TS_INT      (1u << 1)
+#define TS_FLOAT    (1u << 2)
+#define TS_STRING   (1u << 3)
+#define TS_ARRAY    (1u << 4)
+#define TS_MAP      (1u << 5)
+#define TS_FUNCTION (1u << 6) /* functions, bound methods and natives */
+#define TS_CLASS    (1u << 7)
+#define TS_INSTANCE (1u << 8)
+#define TS_TASK     (1u << 9)
+#define TS_ANY      ((1u << 10) - 1)
+
+typedef struct lfCapture {
+    bool local; /* taken from the enclosing frame, otherwise from the enclosing closure's captures */
+    int slot;
+} lfCapture;
+
 /* nodes */
 
 typedef struct lfLiteralNode {
     LF_NODE_HEADER;
     lfToken value;
+    union {
+        int64_t i;
+        double f;
+        void *object;
+    } constant; /* decoded value, filled in after parsing */
 } lfLiteralNode;
 
 typedef struct lfUnaryOpNode {
     LF_NODE_HEADER;
     lfToken op;
     lfNode *value;
+    lfTypeSet operand; /* TS_INT or TS_FLOAT when proven, 0 otherwise */
 } lfUnaryOpNode;
 
 typedef struct lfBinaryOpNode {
@@ -116,23 +168,43 @@ typedef struct lfBinaryOpNode {
     lfToken op;
     lfNode *lhs;
     lfNode *rhs;
+    lfTypeSet operands; /* TS_INT or TS_FLOAT when both are proven to be, 0 otherwise */
 } lfBinaryOpNode;
 
 typedef struct lfVarAccessNode {
     LF_NODE_HEADER;
     lfToken var;
+    lfVarRef ref;
 } lfVarAccessNode;
 
+/*
+ * obj.name on an instance remembers where name was found, for the class
+ * it saw last. classes made from the same declaration share a layout, so
+ * the declaration is what the slot is keyed on
+ */
+typedef struct lfMemberCache {
+    const void *cls; /* an lfClassNode, NULL until the first lookup */
+    int slot; /* a field index, or -1 - a method index */
+} lfMemberCache;
+
 typedef struct lfSubscriptionNode {
     LF_NODE_HEADER;
     lfNode *object;
     lfNode *index;
+    lfMemberCache cache;
 } lfSubscriptionNode;
 
 typedef struct lfCallNode {
     LF_NODE_HEADER;
     lfNode *func;
     lfArray(lfNode *) args;
+    /* set when the callee is expected to be a function declared at the top level */
+    struct lfFunctionNode *target;
+    struct lfFunctionNode *specialized; /* target's copy for these arguments */
+    /* a copy of the first callee's body run in its place, see interp/inline.h */
+    struct lfFunctionNode *inline_target; /* the callee it was copied from */
+    struct lfFunctionNode *inlined; /* the copy, which runs on the caller's stack */
+    int inline_depth; /* copies this call is nested in */
 } lfCallNode;
 
 typedef struct lfArrayNode {
@@ -150,6 +222,8 @@ typedef struct lfAssignNode {
     LF_NODE_HEADER;
     lfToken var;
     lfNode *value;
+    lfVarRef ref;
+    lfTypeSet guard; /* declared type the value is checked against, 0 for none */
 } lfAssignNode;
 
 typedef struct lfObjectAssignNode {
@@ -157,6 +231,7 @@ typedef struct lfObjectAssignNode {
     lfNode *object;
     lfNode *key;
     lfNode *value;
+    lfMemberCache cache;
 } lfObjectAssignNode;
 
 /* statements */
@@ -168,6 +243,9 @@ typedef struct lfVarDeclNode {
     bool is_const;
     bool is_ref; /* for functions */
     lfType *vartype;
+    lfVarRef ref;
+    lfTypeSet guard; /* vartype, when the initializer or argument needs checking */
+    lfTypeSet declared; /* a field's vartype, which every write to the field is checked against */
 } lfVarDeclNode;
 
 typedef struct lfIfNode {
@@ -181,24 +259,58 @@ typedef struct lfWhileNode {
     LF_NODE_HEADER;
     lfNode *condition;
     lfNode *body;
+    int hotness; /* entries so far, -1 once compiling failed */
+    int backedges; /* iterations run by the interpreter */
+    void *native; /* machine code for the whole loop, see interp/jit.h */
 } lfWhileNode;
 
 typedef struct lfFunctionNode {
     LF_NODE_HEADER;
     lfToken name;
     lfArray(lfVarDeclNode *) params;
-    lfArray(lfNode *) body;
+    lfArray(lfNode *) body; /* empty while lazy */
     lfType *return_type;
+    /* preparsed: only the signature is parsed until the body is first needed, see lf_parse_body */
+    bool lazy;
+    int body_start; /* source indices of the body's braces, the closing one included */
+    int body_end;
     /* for generic typing */
     lfArray(lfToken) type_names;
     lfArray(lfType *) types;
+    /* resolution */
+    lfVarRef ref;
+    int nslots; /* parameters and locals, plus the receiver for methods */
+    bool is_method;
+    lfVarRef self; /* methods only: the receiver, in slot 0 */
+    lfArray(lfCapture) captures;
+    /* copies of a generic function for concrete type arguments */
+    lfArray(struct lfSpecialization) specializations;
+    int hotness; /* calls so far, -1 once compiling failed */
+    void *native; /* machine code for the body, see interp/jit.h */
+    int inlinable; /* 0 until known, then 1 if calls may run a copy of the body in their place, -1 if not */
 } lfFunctionNode;
 
+typedef struct lfSpecialization {
+    lfArray(lfTypeSet) bindings; /* one per type name */
+    lfFunctionNode *node; /* NULL if the copy did not type check */
+} lfSpecialization;
+
 typedef struct lfReturnNode {
     LF_NODE_HEADER;
     lfNode *value;
+    lfTypeSet guard; /* the function's return type, 0 for none */
+    bool tail; /* value is a call the function's frame may be handed to, see lf_call */
 } lfReturnNode;
 
+typedef struct lfYieldNode {
+    LF_NODE_HEADER;
+} lfYieldNode;
+
+typedef struct lfAwaitNode {
+    LF_NODE_HEADER;
+    lfNode *value; /* the task */
+} lfAwaitNode;
+
 typedef struct lfCompoundNode {
     LF_NODE_HEADER;
     lfArray(lfNode *) statements;
@@ -208,14 +320,21 @@ typedef struct lfClassNode {
     LF_NODE_HEADER;
     lfToken name;
     lfArray(lfNode *) body;
+    lfVarRef ref;
 } lfClassNode;
 
 typedef struct lfImportNode {
     LF_NODE_HEADER;
     lfArray(lfToken) path;
+    void *module; /* the included chunk, filled in after parsing */
 } lfImportNode;
 
-void lf_node_deleter(lfNode **node);
-void lf_type_deleter(lfType **t);
+void lf_node_deleter(const lfAllocator *allocator, lfNode **node);
+void lf_type_deleter(const lfAllocator *allocator, lfType **t);
+
+/* deep copies, annotations included; specializations, inlined calls and machine code are not copied */
+lfNode *lf_node_clone(const lfAllocator *allocator, const lfNode *node);
+lfType *lf_type_clone(const lfAllocator *allocator, const lfType *t);
+int lf_node_count(const lfNode *node);
 
 #endif /* LEAF_NODE_H */
@@ -6,7 +6,58 @@
 #define LEAF_PARSE_H
 
 #include "parser/node.h"
+#include "parser/token.h"
+#include "parser/tokenize.h"
+#include "lib/alloc.h"
+#include "lib/arena.h"
+#include "lib/array.h"
+#include "lib/error.h"
 
-lfNode *lf_parse(const char *source, const char *file) ;
+/*
+ * how deep expressions, types and blocks may nest before a parse fails
+ * with a syntax error. it bounds the depth of every tree, and with it the
+ * C stack of every pass that walks one
+ */
+#define LF_MAX_NESTING 512
+
+/*
+ * a parser can be reused for any number of parses, and every error goes to
+ * its diagnostic sink. trees (and the token values they point into) are
+ * allocated from the parser's arena and stay valid until lf_parser_reset or
+ * lf_parser_delete; resetting keeps the arena chunks and the token buffer,
+ * so a parser that is reset between small inputs stops allocating.
+ *
+ * a lazy parser only preparses the bodies of functions declared outside of
+ * any block or other function: it checks their syntax without building
+ * anything, keeping the signature and the body's position, and reports
+ * the same syntax errors as building them would. lf_parse_body builds
+ * such a body once something needs it.
+ *
+ * with more than one thread, large sources are tokenized in parallel,
+ * which needs the parser's allocator to be thread safe
+ */
+typedef struct lfParser {
+    lfAllocator allocator;
+    lfDiagnosticSink diagnostics;
+    lfArena arena;
+    lfAllocator arena_allocator;
+    lfArray(lfToken) tokens;
+    lfArray(lfToken) brackets; /* open while lf_parse_events skips a body */
+    bool lazy; /* false unless set */
+    int threads; /* to tokenize sources of LF_TOKENIZE_PARALLEL_MIN bytes or more with, 1 unless set */
+    lfArena lexer_arenas[LF_TOKENIZE_MAX_THREADS - 1]; /* token values from every thread but the parser's */
+    lfAllocator lexer_allocators[LF_TOKENIZE_MAX_THREADS];
+} lfParser;
+
+lfParser *lf_parser_new(const lfAllocator *allocator, const lfDiagnosticSink *diagnostics);
+void lf_parser_reset(lfParser *parser);
+void lf_parser_delete(lfParser *parser);
+
+/* fills the parser's token buffer from source, for lf_parse and lf_parse_events */
+bool lf_parser_tokenize(lfParser *parser, const char *source, const char *file);
+lfNode *lf_parse(lfParser *parser, const char *source, const char *file);
+
+/* parses a lazy function's body out of the source it was preparsed from, false on a syntax error */
+bool lf_parse_body(lfParser *parser, lfFunctionNode *f, const char *source, const char *file);
 
 #endif /* LEAF_PARSE_H */
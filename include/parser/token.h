@@ -7,6 +7,8 @@
 
 #include <stdint.h>
 
+#include "lib/alloc.h"
+
 typedef enum lfTokenType {
     TT_EOF,
 
@@ -73,6 +75,6 @@ typedef struct lfToken {
     int idx_end;
 } lfToken;
 
-void lf_token_deleter(lfToken *tok);
+void lf_token_deleter(const lfAllocator *allocator, lfToken *tok);
 
 #endif /* LEAF_TOKEN_H */
@@ -5,9 +5,43 @@
 #ifndef LEAF_TOKENIZE_H
 #define LEAF_TOKENIZE_H
 
+#include <stdbool.h>
+
 #include "parser/token.h"
 #include "lib/array.h"
+#include "lib/alloc.h"
+#include "lib/error.h"
+
+/*
+ * appends to an existing token array; on error the tokens pushed so far are
+ * left in it for the caller to dispose of. values are allocated with allocator
+ */
+bool lf_tokenize_into(lfArray(lfToken) *tokens, const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, const char *source, const char *file);
+/*
+ * the same for source[start..end), which has to start and end on token
+ * boundaries; positions stay relative to source
+ */
+bool lf_tokenize_range(lfArray(lfToken) *tokens, const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, const char *source, int start, int end, const char *file);
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LF_TOKENIZE_SUPPORTED 1 /* in parallel */
+#else
+#define LF_TOKENIZE_SUPPORTED 0
+#endif
+
+#define LF_TOKENIZE_MAX_THREADS 16
+#define LF_TOKENIZE_PARALLEL_MIN (1 << 20) /* bytes of source below which one thread lexes faster */
+
+/* the cores online, up to LF_TOKENIZE_MAX_THREADS */
+int lf_tokenize_threads(void);
+/*
+ * lf_tokenize_into split over up to threads threads, giving the same
+ * tokens and reporting the same error. thread i allocates token values
+ * with allocators[i] alone, and the allocator of tokens, which all of them
+ * use for scratch, has to be thread safe
+ */
+bool lf_tokenize_parallel(lfArray(lfToken) *tokens, const lfAllocator *allocators, int threads, const lfDiagnosticSink *diagnostics, const char *source, const char *file);
 
-lfArray(lfToken) lf_tokenize(const char *source, const char *file);
+lfArray(lfToken) lf_tokenize(const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, const char *source, const char *file);
 
 #endif /* LEAF_TOKENIZE_H */
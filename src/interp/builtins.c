@@ -0,0 +1,251 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "interp/builtins.h"
+#include "interp/coro.h"
+#include "interp/isolate.h"
+#include "interp/state.h"
+#include "interp/value.h"
+#include "lib/array.h"
+
+#ifdef _WIN32
+#define flockfile _lock_file
+#define funlockfile _unlock_file
+#endif
+
+static void check_argc(lfState *L, const char *name, int argc, int expected) {
+    if (argc != expected) {
+        lf_runtime_error(L, "%s() takes %d arguments, got %d", name, expected, argc);
+    }
+}
+
+/*
+ * the line goes out under the stream's lock, so isolates printing to the
+ * same stream never interleave within a line. everything that may fail
+ * is done before taking it
+ */
+static lfValue builtin_print(lfState *L, lfValue *args, int argc) {
+    for (int i = 0; i < argc; i++) {
+        lfString *str = lf_value_tostring(L, args[i]);
+        lf_string_chars(L, str); /* flattens ropes */
+        args[i] = lf_obj(LF_STRING, str);
+    }
+    flockfile(L->out);
+    for (int i = 0; i < argc; i++) {
+        lfString *str = as_string(args[i]);
+        if (i > 0) {
+            fputc(' ', L->out);
+        }
+        fwrite(lf_string_chars(L, str), 1, str->length, L->out);
+    }
+    fputc('\n', L->out);
+    funlockfile(L->out);
+    return lf_null();
+}
+
+static lfValue builtin_len(lfState *L, lfValue *args, int argc) {
+    check_argc(L, "len", argc, 1);
+    switch (args[0].type) {
+        case LF_STRING:
+            return lf_int(as_string(args[0])->length);
+        case LF_ARRAY:
+            return lf_int(as_array(args[0])->length);
+        case LF_MAP:
+            return lf_int(as_map(args[0])->count);
+        default:
+            lf_runtime_error(L, "len() of %s", lf_type_name(args[0]));
+    }
+}
+
+static lfValue builtin_push(lfState *L, lfValue *args, int argc) {
+    check_argc(L, "push", argc, 2);
+    if (args[0].type != LF_ARRAY) {
+        lf_runtime_error(L, "push() to %s", lf_type_name(args[0]));
+    }
+    lf_array_push(L, as_array(args[0]), args[1]);
+    return args[0];
+}
+
+static lfValue builtin_pop(lfState *L, lfValue *args, int argc) {
+    check_argc(L, "pop", argc, 1);
+    if (args[0].type != LF_ARRAY) {
+        lf_runtime_error(L, "pop() from %s", lf_type_name(args[0]));
+    }
+    lfArrayObject *array = as_array(args[0]);
+    if (array->length == 0) {
+        lf_runtime_error(L, "pop() from an empty array");
+    }
+    return lf_array_pop(array);
+}
+
+static lfValue builtin_keys(lfState *L, lfValue *args, int argc) {
+    check_argc(L, "keys", argc, 1);
+    if (args[0].type != LF_MAP) {
+        lf_runtime_error(L, "keys() of %s", lf_type_name(args[0]));
+    }
+    lfMap *map = as_map(args[0]);
+    lfArrayObject *keys = lf_array_new(L, map->count);
+    for (int i = 0; i < map->count; i++) {
+        lf_array_push(L, keys, map->entries[i].key);
+    }
+    return lf_obj(LF_ARRAY, keys);
+}
+
+static lfValue builtin_str(lfState *L, lfValue *args, int argc) {
+    check_argc(L, "str", argc, 1);
+    return lf_obj(LF_STRING, lf_value_tostring(L, args[0]));
+}
+
+static lfValue builtin_int(lfState *L, lfValue *args, int argc) {
+    check_argc(L, "int", argc, 1);
+    switch (args[0].type) {
+        case LF_INT:
+            return args[0];
+        case LF_FLOAT:
+            if (!(args[0].as.f > -9.2e18 && args[0].as.f < 9.2e18)) {
+                lf_runtime_error(L, "int() of out of range float");
+            }
+            return lf_int((int64_t)args[0].as.f);
+        case LF_STRING:
+            return lf_int(strtoll(lf_string_chars(L, as_string(args[0])), NULL, 10));
+        default:
+            lf_runtime_error(L, "int() of %s", lf_type_name(args[0]));
+    }
+}
+
+static lfValue builtin_float(lfState *L, lfValue *args, int argc) {
+    check_argc(L, "float", argc, 1);
+    switch (args[0].type) {
+        case LF_INT:
+            return lf_float((double)args[0].as.i);
+        case LF_FLOAT:
+            return args[0];
+        case LF_STRING:
+            return lf_float(strtod(lf_string_chars(L, as_string(args[0])), NULL));
+        default:
+            lf_runtime_error(L, "float() of %s", lf_type_name(args[0]));
+    }
+}
+
+static lfValue builtin_type(lfState *L, lfValue *args, int argc) {
+    check_argc(L, "type", argc, 1);
+    const char *name = lf_type_name(args[0]);
+    return lf_obj(LF_STRING, lf_string_new(L, name, strlen(name)));
+}
+
+static lfValue builtin_clock(lfState *L, lfValue *args, int argc) {
+    (void)args;
+    check_argc(L, "clock", argc, 0);
+    return lf_float((double)clock() / CLOCKS_PER_SEC);
+}
+
+/* spawn(fn, args...) runs fn(args...) as a coroutine, returning its task */
+static lfValue builtin_spawn(lfState *L, lfValue *args, int argc) {
+    if (argc < 1) {
+        lf_runtime_error(L, "spawn() takes a function");
+    }
+    if (args[0].type != LF_FUNCTION && args[0].type != LF_METHOD && args[0].type != LF_NATIVE && args[0].type != LF_CLASS) {
+        lf_runtime_error(L, "cannot spawn %s", lf_type_name(args[0]));
+    }
+    return lf_obj(LF_TASK, lf_coro_spawn(L, args[0], args + 1, argc - 1));
+}
+
+static lfValue builtin_sleep(lfState *L, lfValue *args, int argc) {
+    check_argc(L, "sleep", argc, 1);
+    if (args[0].type != LF_INT && args[0].type != LF_FLOAT) {
+        lf_runtime_error(L, "sleep() for %s", lf_type_name(args[0]));
+    }
+    lf_coro_sleep(L, args[0].type == LF_INT ? (double)args[0].as.i : args[0].as.f);
+    return lf_null();
+}
+
+/* isolate(path) runs the script at path, relative to the calling file, in parallel; its id */
+static lfValue builtin_isolate(lfState *L, lfValue *args, int argc) {
+    check_argc(L, "isolate", argc, 1);
+    if (args[0].type != LF_STRING) {
+        lf_runtime_error(L, "isolate() of %s", lf_type_name(args[0]));
+    }
+    if (L->isolate == NULL) {
+        lf_runtime_error(L, "isolate() outside of an isolate group");
+    }
+    lfString *name = as_string(args[0]);
+    const char *from = L->frame ? L->frame->chunk->file : "";
+    const char *slash = strrchr(from, '/');
+    int dir_length = slash && lf_string_chars(L, name)[0] != '/' ? (int)(slash - from) + 1 : 0;
+
+    lfArray(char) path = array_new(&L->allocator, char);
+    array_reserve(&path, dir_length + name->length + 1);
+    memcpy(path, from, dir_length);
+    memcpy(path + dir_length, lf_string_chars(L, name), name->length);
+    path[dir_length + name->length] = 0;
+    int id = lf_isolate_start(L->isolate->group, path);
+    array_delete(&path);
+    if (id < 0) {
+        lf_runtime_error(L, "cannot start an isolate for '%s'", lf_string_chars(L, name));
+    }
+    return lf_int(id);
+}
+
+/* send(id, value) copies value to isolate id */
+static lfValue builtin_send(lfState *L, lfValue *args, int argc) {
+    check_argc(L, "send", argc, 2);
+    if (args[0].type != LF_INT) {
+        lf_runtime_error(L, "send() to %s", lf_type_name(args[0]));
+    }
+    if (args[0].as.i < 0 || args[0].as.i >= LF_MAX_ISOLATES) {
+        lf_runtime_error(L, "no isolate %" PRId64, args[0].as.i);
+    }
+    lf_isolate_send(L, (int)args[0].as.i, args[1]);
+    return lf_null();
+}
+
+static lfValue builtin_receive(lfState *L, lfValue *args, int argc) {
+    (void)args;
+    check_argc(L, "receive", argc, 0);
+    return lf_isolate_receive(L);
+}
+
+static lfValue builtin_isolate_id(lfState *L, lfValue *args, int argc) {
+    (void)args;
+    check_argc(L, "isolate_id", argc, 0);
+    if (L->isolate == NULL) {
+        lf_runtime_error(L, "isolate_id() outside of an isolate group");
+    }
+    return lf_int(L->isolate->id);
+}
+
+const lfNative lf_natives[] = {
+    { "print", builtin_print },
+    { "len", builtin_len },
+    { "push", builtin_push },
+    { "pop", builtin_pop },
+    { "keys", builtin_keys },
+    { "str", builtin_str },
+    { "int", builtin_int },
+    { "float", builtin_float },
+    { "type", builtin_type },
+    { "clock", builtin_clock },
+    { "spawn", builtin_spawn },
+    { "sleep", builtin_sleep },
+    { "isolate", builtin_isolate },
+    { "send", builtin_send },
+    { "receive", builtin_receive },
+    { "isolate_id", builtin_isolate_id },
+    { NULL, NULL }
+};
+
+void lf_open_builtins(lfState *L) {
+    for (int i = 0; lf_natives[i].name != NULL; i++) {
+        lf_global_set(L, lf_natives[i].name, (lfValue) { .type = LF_NATIVE, .as.native = i });
+    }
+    lf_global_set(L, "null", lf_null());
+    lf_global_set(L, "true", lf_int(1));
+    lf_global_set(L, "false", lf_int(0));
+}
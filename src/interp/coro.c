@@ -0,0 +1,671 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "interp/coro.h"
+#include "interp/state.h"
+#include "interp/eval.h"
+#include "interp/value.h"
+#include "lib/alloc.h"
+#include "lib/array.h"
+
+#if LF_CORO_SUPPORTED
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+/* AddressSanitizer has to be told whenever the stack changes under it */
+#if defined(__SANITIZE_ADDRESS__)
+#define CORO_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CORO_ASAN 1
+#endif
+#endif
+
+#ifdef CORO_ASAN
+#include <sanitizer/common_interface_defs.h>
+#define start_switch(SAVE, BOTTOM, SIZE) __sanitizer_start_switch_fiber((SAVE), (BOTTOM), (SIZE))
+#define finish_switch(SAVE, BOTTOM, SIZE) __sanitizer_finish_switch_fiber((SAVE), (BOTTOM), (SIZE))
+#else
+#define start_switch(SAVE, BOTTOM, SIZE) ((void)(SAVE), (void)(BOTTOM), (void)(SIZE))
+#define finish_switch(SAVE, BOTTOM, SIZE) ((void)(SAVE), (void)(BOTTOM), (void)(SIZE))
+#endif
+
+#define NEVER UINT64_MAX
+
+#if !LF_CORO_UCONTEXT
+
+#ifdef __APPLE__
+#define ASM_NAME(N) "_" #N
+#define ASM_HIDDEN(N) ".private_extern " ASM_NAME(N) "\n"
+#else
+#define ASM_NAME(N) #N
+#define ASM_HIDDEN(N) ".hidden " ASM_NAME(N) "\n"
+#endif
+
+/*
+ * lf_coro_switch pushes the callee saved registers and the sse and x87
+ * control words, leaves the stack pointer in *from and pops the same off
+ * to. a new coroutine's stack is laid out to pop into lf_coro_boot, which
+ * calls r13 with r12
+ */
+void lf_coro_switch(void **from, void *to);
+void lf_coro_boot(void);
+
+__asm__(
+    ".text\n"
+    ".globl " ASM_NAME(lf_coro_switch) "\n"
+    ASM_HIDDEN(lf_coro_switch)
+    ASM_NAME(lf_coro_switch) ":\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".globl " ASM_NAME(lf_coro_boot) "\n"
+    ASM_HIDDEN(lf_coro_boot)
+    ASM_NAME(lf_coro_boot) ":\n"
+    "    movq %r12, %rdi\n"
+    "    call *%r13\n"
+    "    ud2\n"
+);
+
+#define MXCSR_DEFAULT 0x1f80
+#define FPUCW_DEFAULT 0x037f
+
+#endif /* !LF_CORO_UCONTEXT */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* mappings */
+
+/* isolates map stacks from several threads, which all store the same size */
+static size_t page_size(void) {
+    static size_t size = 0;
+    size_t cached = __atomic_load_n(&size, __ATOMIC_RELAXED);
+    if (cached == 0) {
+        cached = (size_t)sysconf(_SC_PAGESIZE);
+        __atomic_store_n(&size, cached, __ATOMIC_RELAXED);
+    }
+    return cached;
+}
+
+/* whole pages, at least one */
+static size_t guard_size(void) {
+    return (LF_CORO_GUARD + page_size() - 1) & ~(page_size() - 1);
+}
+
+static size_t mapping_size(void) {
+    size_t size = guard_size() + LF_CORO_CSTACK + LF_CORO_VALUES * sizeof(lfValue) + LF_CORO_FRAMES * sizeof(lfFrame);
+    return (size + page_size() - 1) & ~(page_size() - 1);
+}
+
+static char *c_stack(lfCoroutine *co) {
+    return co->memory + guard_size();
+}
+
+static char *take_mapping(lfScheduler *S) {
+    if (length(&S->pool) > 0) {
+        return S->pool[--length(&S->pool)];
+    }
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    char *memory = mmap(NULL, mapping_size(), PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    /* running off the end of the C stack faults instead of scribbling over a neighbour */
+    if (mprotect(memory, guard_size(), PROT_NONE) != 0) {
+        munmap(memory, mapping_size());
+        return NULL;
+    }
+    return memory;
+}
+
+static void give_mapping(lfScheduler *S, char *memory) {
+    if (length(&S->pool) < LF_CORO_POOL) {
+        array_push(&S->pool, memory);
+    } else {
+        munmap(memory, mapping_size());
+    }
+}
+
+/* registers */
+
+static void save_registers(const lfState *L, lfRegisters *regs) {
+    regs->stack = L->stack;
+    regs->stack_end = L->stack_end;
+    regs->top = L->top;
+    regs->base = L->base;
+    regs->closure = L->closure;
+    regs->frames = L->frames;
+    regs->nframes = L->nframes;
+    regs->max_frames = L->max_frames;
+    regs->frame = L->frame;
+    regs->stack_limit = L->stack_limit;
+    regs->returning = L->returning;
+    regs->retval = L->retval;
+    regs->error_jmp = L->error_jmp;
+}
+
+static void load_registers(lfState *L, const lfRegisters *regs) {
+    /* the profiler must never pair one thread's frames with another's count */
+    L->nframes = 0;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    L->stack = regs->stack;
+    L->stack_end = regs->stack_end;
+    L->top = regs->top;
+    L->base = regs->base;
+    L->closure = regs->closure;
+    L->frames = regs->frames;
+    L->max_frames = regs->max_frames;
+    L->frame = regs->frame;
+    L->stack_limit = regs->stack_limit;
+    L->returning = regs->returning;
+    L->retval = regs->retval;
+    L->error_jmp = regs->error_jmp;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    L->nframes = regs->nframes;
+}
+
+/* queues */
+
+static void enqueue(lfScheduler *S, lfCoroutine *co) {
+    co->state = CO_READY;
+    co->next = NULL;
+    if (S->tail) {
+        S->tail->next = co;
+    } else {
+        S->head = co;
+    }
+    S->tail = co;
+    S->nready += 1;
+}
+
+static lfCoroutine *dequeue(lfScheduler *S) {
+    lfCoroutine *co = S->head;
+    S->head = co->next;
+    if (S->head == NULL) {
+        S->tail = NULL;
+    }
+    S->nready -= 1;
+    return co;
+}
+
+static void timer_push(lfScheduler *S, lfCoroutine *co) {
+    array_push(&S->timers, co);
+    int i = length(&S->timers) - 1;
+    while (i > 0 && S->timers[(i - 1) / 2]->wake > co->wake) {
+        S->timers[i] = S->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    S->timers[i] = co;
+}
+
+static lfCoroutine *timer_pop(lfScheduler *S) {
+    lfCoroutine *first = S->timers[0];
+    lfCoroutine *last = S->timers[--length(&S->timers)];
+    int n = length(&S->timers);
+    int i = 0;
+    while (n > 0) {
+        int child = 2 * i + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n && S->timers[child + 1]->wake < S->timers[child]->wake) {
+            child += 1;
+        }
+        if (S->timers[child]->wake >= last->wake) {
+            break;
+        }
+        S->timers[i] = S->timers[child];
+        i = child;
+    }
+    if (n > 0) {
+        S->timers[i] = last;
+    }
+    return first;
+}
+
+/* switching */
+
+static lfScheduler *scheduler(lfState *L) {
+    if (L->scheduler == NULL) {
+        lfScheduler *S = lf_malloc(&L->allocator, sizeof(lfScheduler));
+        if (S == NULL) {
+            lf_runtime_error(L, "out of memory");
+        }
+        memset(S, 0, sizeof(lfScheduler));
+        S->live = array_new(&L->allocator, lfCoroutine *);
+        S->timers = array_new(&L->allocator, lfCoroutine *);
+        S->pool = array_new(&L->allocator, char *);
+        S->epoll = -1;
+        L->scheduler = S;
+    }
+    return L->scheduler;
+}
+
+/* from a coroutine back to the loop, until the loop resumes it */
+static void suspend(lfScheduler *S, lfCoroutine *co) {
+    start_switch(co->state == CO_DONE ? NULL : &co->fake_stack, S->main_stack, S->main_stack_size);
+#if LF_CORO_UCONTEXT
+    swapcontext(&co->context, &S->context);
+#else
+    lf_coro_switch(&co->sp, S->sp);
+#endif
+    finish_switch(co->fake_stack, &S->main_stack, &S->main_stack_size);
+}
+
+static void wake_waiters(lfScheduler *S, lfCoroutine *co) {
+    /* they were pushed in front, so reverse them to wake the first one first */
+    lfCoroutine *first = NULL;
+    while (co->waiters) {
+        lfCoroutine *waiter = co->waiters;
+        co->waiters = waiter->next;
+        waiter->next = first;
+        first = waiter;
+    }
+    while (first) {
+        lfCoroutine *next = first->next;
+        enqueue(S, first);
+        first = next;
+    }
+}
+
+static void coro_main(lfCoroutine *co) {
+    lfState *L = co->L;
+    lfScheduler *S = L->scheduler;
+    finish_switch(NULL, &S->main_stack, &S->main_stack_size);
+
+    L->error_jmp = &co->handler;
+    if (setjmp(co->handler) == 0) {
+        lfValue *callee = L->stack;
+        co->task->result = lf_call(L, callee, (int)(L->top - callee - 1));
+    } else {
+        co->failed = true;
+    }
+    co->task->coro = NULL;
+    wake_waiters(S, co);
+    co->state = CO_DONE;
+    suspend(S, co);
+    abort(); /* never resumed */
+}
+
+#if LF_CORO_UCONTEXT
+static void coro_entry(unsigned int hi, unsigned int lo) {
+    coro_main((lfCoroutine *)(uintptr_t)(((uint64_t)hi << 32) | lo));
+}
+#endif
+
+static void release(lfState *L, lfScheduler *S, lfCoroutine *co) {
+    lfCoroutine *last = S->live[--length(&S->live)];
+    S->live[co->index] = last;
+    last->index = co->index;
+    give_mapping(S, co->memory);
+    lf_free(&L->allocator, co, sizeof(lfCoroutine));
+}
+
+/* from the main thread into a coroutine, until it suspends or ends */
+static void resume(lfState *L, lfScheduler *S, lfCoroutine *co) {
+    save_registers(L, &S->main);
+    load_registers(L, &co->regs);
+    co->state = CO_RUNNING;
+    S->current = co;
+    start_switch(&S->fake_stack, c_stack(co), LF_CORO_CSTACK);
+#if LF_CORO_UCONTEXT
+    swapcontext(&S->context, &co->context);
+#else
+    lf_coro_switch(&S->sp, co->sp);
+#endif
+    finish_switch(S->fake_stack, NULL, NULL);
+    S->current = NULL;
+    save_registers(L, &co->regs);
+    load_registers(L, &S->main);
+
+    if (co->state == CO_DONE) {
+        bool failed = co->failed;
+        release(L, S, co);
+        if (failed) {
+            /* reported where it happened; the main thread unwinds as if it were its own */
+            if (L->error_jmp == NULL) {
+                abort();
+            }
+            longjmp(*L->error_jmp, 1);
+        }
+    }
+}
+
+/* the loop */
+
+/* moves due timers and ready descriptors to the run queue, waiting at most until until */
+static void wait_events(lfScheduler *S, uint64_t until) {
+    uint64_t now = now_ns();
+    uint64_t deadline = until;
+    if (length(&S->timers) > 0 && S->timers[0]->wake < deadline) {
+        deadline = S->timers[0]->wake;
+    }
+    int timeout = 0;
+    if (deadline == NEVER) {
+        timeout = -1;
+    } else if (deadline > now) {
+        uint64_t ms = (deadline - now + 999999) / 1000000;
+        timeout = ms > 86400000 ? 86400000 : (int)ms;
+    }
+
+#ifdef __linux__
+    if (S->nfds > 0) {
+        struct epoll_event events[64];
+        int n = epoll_wait(S->epoll, events, 64, timeout);
+        for (int i = 0; i < n; i++) {
+            lfCoroutine *co = events[i].data.ptr;
+            int fd = co ? co->fd : S->main_fd;
+            epoll_ctl(S->epoll, EPOLL_CTL_DEL, fd, NULL);
+            S->nfds -= 1;
+            if (co) {
+                enqueue(S, co);
+            } else {
+                S->main_woken = true;
+            }
+        }
+    } else
+#endif
+    if (timeout != 0) {
+        poll(NULL, 0, timeout); /* a signal may cut it short, which the callers' loops allow for */
+    }
+
+    now = now_ns();
+    while (length(&S->timers) > 0 && S->timers[0]->wake <= now) {
+        enqueue(S, timer_pop(S));
+    }
+}
+
+/*
+ * one step of the loop on the main thread: runs a coroutine, or waits for
+ * one to become runnable, at most until until. false when there is nothing
+ * left to run or wait for
+ */
+static bool step(lfState *L, lfScheduler *S, uint64_t until) {
+    if (S->head) {
+        /* busy coroutines must not starve the ones waiting on timers and descriptors */
+        if (++S->resumes % LF_CORO_BATCH == 0 && (length(&S->timers) > 0 || S->nfds > 0)) {
+            wait_events(S, 0);
+        }
+        resume(L, S, dequeue(S));
+        return true;
+    }
+    if (length(&S->timers) == 0 && S->nfds == 0 && until == NEVER) {
+        return false;
+    }
+    wait_events(S, until);
+    return true;
+}
+
+/* api */
+
+lfTask *lf_coro_spawn(lfState *L, lfValue fn, const lfValue *args, int argc) {
+    if (argc + 1 > LF_CORO_VALUES) {
+        lf_runtime_error(L, "too many arguments for a coroutine");
+    }
+    lfScheduler *S = scheduler(L);
+    lfTask *task = lf_task_new(L);
+    char *memory = take_mapping(S);
+    lfCoroutine *co = lf_malloc(&L->allocator, sizeof(lfCoroutine));
+    if (memory == NULL || co == NULL) {
+        if (memory) {
+            give_mapping(S, memory);
+        }
+        lf_runtime_error(L, "out of memory for a coroutine");
+    }
+    memset(co, 0, sizeof(lfCoroutine));
+    co->L = L;
+    co->task = task;
+    co->memory = memory;
+
+    /* the entry function and its arguments start the value stack, like a call */
+    lfValue *values = (lfValue *)(c_stack(co) + LF_CORO_CSTACK);
+    values[0] = fn;
+    memcpy(values + 1, args, argc * sizeof(lfValue));
+    co->regs = (lfRegisters) {
+        .stack = values,
+        .stack_end = values + LF_CORO_VALUES,
+        .top = values + 1 + argc,
+        .base = values,
+        .closure = NULL,
+        .frames = (lfFrame *)(values + LF_CORO_VALUES),
+        .nframes = 0,
+        .max_frames = LF_CORO_FRAMES,
+        .frame = NULL,
+        .stack_limit = c_stack(co) + LF_STACK_MARGIN,
+        .returning = false,
+        .retval = lf_null(),
+        .error_jmp = NULL
+    };
+
+#if LF_CORO_UCONTEXT
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp = c_stack(co);
+    co->context.uc_stack.ss_size = LF_CORO_CSTACK;
+    co->context.uc_link = NULL;
+    uint64_t address = (uint64_t)(uintptr_t)co;
+    makecontext(&co->context, (void (*)(void))coro_entry, 2, (unsigned int)(address >> 32), (unsigned int)address);
+#else
+    uint64_t *sp = (uint64_t *)(c_stack(co) + LF_CORO_CSTACK);
+    *--sp = (uint64_t)(uintptr_t)lf_coro_boot;
+    *--sp = 0; /* rbp */
+    *--sp = 0; /* rbx */
+    *--sp = (uint64_t)(uintptr_t)co; /* r12 */
+    *--sp = (uint64_t)(uintptr_t)coro_main; /* r13 */
+    *--sp = 0; /* r14 */
+    *--sp = 0; /* r15 */
+    *--sp = (uint64_t)FPUCW_DEFAULT << 32 | MXCSR_DEFAULT;
+    co->sp = sp;
+#endif
+
+    co->index = length(&S->live);
+    array_push(&S->live, co);
+    task->coro = co;
+    enqueue(S, co);
+    return task;
+}
+
+void lf_coro_yield(lfState *L) {
+    lfScheduler *S = L->scheduler;
+    if (S == NULL) {
+        return;
+    }
+    if (S->current) {
+        lfCoroutine *co = S->current;
+        enqueue(S, co);
+        suspend(S, co);
+        return;
+    }
+    if (length(&S->timers) > 0 || S->nfds > 0) {
+        wait_events(S, 0);
+    }
+    /* the ones queued now, not the ones they queue in turn */
+    for (int n = S->nready; n > 0 && S->head; n--) {
+        resume(L, S, dequeue(S));
+    }
+}
+
+lfValue lf_coro_await(lfState *L, lfTask *task) {
+    lfScheduler *S = L->scheduler;
+    if (task->coro == NULL) {
+        return task->result;
+    }
+    if (S->current) {
+        lfCoroutine *co = S->current;
+        if (task->coro == co) {
+            lf_runtime_error(L, "a task cannot await itself");
+        }
+        co->state = CO_WAITING;
+        co->next = task->coro->waiters;
+        task->coro->waiters = co;
+        suspend(S, co);
+        return task->result;
+    }
+    while (task->coro != NULL) {
+        if (!step(L, S, NEVER)) {
+            lf_runtime_error(L, "awaited task is blocked forever");
+        }
+    }
+    return task->result;
+}
+
+void lf_coro_sleep(lfState *L, double seconds) {
+    lfScheduler *S = scheduler(L);
+    uint64_t until = now_ns() + (seconds > 0 ? (uint64_t)(seconds * 1e9) : 0);
+    if (S->current) {
+        lfCoroutine *co = S->current;
+        co->state = CO_WAITING;
+        co->wake = until;
+        timer_push(S, co);
+        suspend(S, co);
+        return;
+    }
+    while (now_ns() < until) {
+        step(L, S, until);
+    }
+}
+
+void lf_coro_wait_fd(lfState *L, int fd, bool write) {
+#ifdef __linux__
+    lfScheduler *S = scheduler(L);
+    if (S->epoll < 0) {
+        S->epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (S->epoll < 0) {
+            lf_runtime_error(L, "cannot create an epoll instance");
+        }
+    }
+    struct epoll_event event;
+    event.events = (write ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    event.data.ptr = S->current;
+    if (epoll_ctl(S->epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+        if (errno == EPERM) {
+            return; /* a regular file, never worth waiting for */
+        }
+        lf_runtime_error(L, errno == EEXIST ? "file descriptor %d is already waited on" : "cannot wait on file descriptor %d", fd);
+    }
+    S->nfds += 1;
+    if (S->current) {
+        lfCoroutine *co = S->current;
+        co->state = CO_WAITING;
+        co->fd = fd;
+        suspend(S, co);
+        return;
+    }
+    S->main_fd = fd;
+    S->main_woken = false;
+    while (!S->main_woken) {
+        step(L, S, NEVER);
+    }
+#else
+    (void)L;
+    (void)fd;
+    (void)write;
+#endif
+}
+
+void lf_coro_run(lfState *L) {
+    lfScheduler *S = L->scheduler;
+    if (S == NULL) {
+        return;
+    }
+    while (step(L, S, NEVER)) {
+        continue;
+    }
+}
+
+void lf_coro_free(lfState *L) {
+    lfScheduler *S = L->scheduler;
+    if (S == NULL) {
+        return;
+    }
+    /* coroutines still waiting when the state goes away never finish */
+    for (int i = 0; i < length(&S->live); i++) {
+        munmap(S->live[i]->memory, mapping_size());
+        lf_free(&L->allocator, S->live[i], sizeof(lfCoroutine));
+    }
+    for (int i = 0; i < length(&S->pool); i++) {
+        munmap(S->pool[i], mapping_size());
+    }
+    array_delete(&S->live);
+    array_delete(&S->timers);
+    array_delete(&S->pool);
+    if (S->epoll >= 0) {
+        close(S->epoll);
+    }
+    lf_free(&L->allocator, S, sizeof(lfScheduler));
+    L->scheduler = NULL;
+}
+
+#else
+
+lfTask *lf_coro_spawn(lfState *L, lfValue fn, const lfValue *args, int argc) {
+    (void)fn;
+    (void)args;
+    (void)argc;
+    lf_runtime_error(L, "coroutines are not supported on this platform");
+}
+
+void lf_coro_yield(lfState *L) {
+    (void)L;
+}
+
+lfValue lf_coro_await(lfState *L, lfTask *task) {
+    (void)L;
+    return task->result;
+}
+
+void lf_coro_sleep(lfState *L, double seconds) {
+    (void)L;
+    (void)seconds;
+}
+
+void lf_coro_wait_fd(lfState *L, int fd, bool write) {
+    (void)L;
+    (void)fd;
+    (void)write;
+}
+
+void lf_coro_run(lfState *L) {
+    (void)L;
+}
+
+void lf_coro_free(lfState *L) {
+    (void)L;
+}
+
+#endif /* LF_CORO_SUPPORTED */
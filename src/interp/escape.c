@@ -0,0 +1,381 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "interp/escape.h"
+#include "interp/state.h"
+#include "parser/node.h"
+#include "lib/alloc.h"
+#include "lib/array.h"
+
+/* a read or write of a candidate at a constant key */
+typedef struct lfAccess {
+    lfNode **site;
+    int slot;
+    lfNode *key;
+} lfAccess;
+
+/* what a body does with a local */
+typedef struct lfCandidate {
+    int decls;
+    bool escapes;
+    lfVarDeclNode *decl; /* its declaration, if that is a literal in a statement list */
+    lfNode **site;
+    lfArray(lfNode *) fields; /* keys, for maps: the literal's, then the ones only written */
+    lfArray(lfToken) names; /* of the locals the fields become, once it is replaceable */
+    int base; /* the first of those locals' slots */
+} lfCandidate;
+
+typedef struct lfEscape {
+    lfState *L;
+    int nslots;
+    lfArray(lfCandidate) candidates; /* by slot */
+    lfArray(lfAccess) accesses;
+} lfEscape;
+
+static lfCandidate *candidate(lfEscape *E, const lfVarRef *ref) {
+    if (ref->kind != VK_LOCAL || ref->captured || ref->slot >= E->nslots) {
+        return NULL;
+    }
+    return &E->candidates[ref->slot];
+}
+
+static bool constant_key(const lfNode *key) {
+    return key->type == NT_STRING || key->type == NT_INT;
+}
+
+/* strings are interned, so equal ones are the same object */
+static bool same_key(const lfNode *a, const lfNode *b) {
+    if (a->type != b->type) {
+        return false;
+    }
+    const lfLiteralNode *x = (const lfLiteralNode *)a, *y = (const lfLiteralNode *)b;
+    return a->type == NT_INT ? x->constant.i == y->constant.i : x->constant.object == y->constant.object;
+}
+
+static void walk(lfEscape *E, lfNode **site);
+
+static void walk_nodes(lfEscape *E, lfArray(lfNode *) nodes) {
+    for (int i = 0; i < length(&nodes); i++) {
+        walk(E, &nodes[i]);
+    }
+}
+
+/* object[key] at site, where object may be a candidate */
+static void access(lfEscape *E, lfNode **site, lfNode **object, lfNode *key) {
+    if ((*object)->type == NT_VARACCESS && constant_key(key)) {
+        lfVarAccessNode *var = (lfVarAccessNode *)*object;
+        if (candidate(E, &var->ref)) {
+            lfAccess use = {.site = site, .slot = var->ref.slot, .key = key};
+            array_push(&E->accesses, use);
+            return;
+        }
+    }
+    walk(E, object);
+}
+
+static void walk_statements(lfEscape *E, lfArray(lfNode *) *list) {
+    for (int i = 0; i < length(list); i++) {
+        lfNode *node = (*list)[i];
+        if (node->type != NT_VARDECL) {
+            walk(E, &(*list)[i]);
+            continue;
+        }
+        lfVarDeclNode *decl = (lfVarDeclNode *)node;
+        lfCandidate *c = candidate(E, &decl->ref);
+        if (c) {
+            c->decls++;
+            c->decl = decl;
+            c->site = &(*list)[i];
+        }
+        if (decl->initializer) {
+            walk(E, &decl->initializer);
+        }
+    }
+}
+
+static void walk(lfEscape *E, lfNode **site) {
+    lfNode *node = *site;
+    if (node == NULL) {
+        return;
+    }
+    switch (node->type) {
+        case NT_VARACCESS: {
+            lfCandidate *c = candidate(E, &((lfVarAccessNode *)node)->ref);
+            if (c) {
+                c->escapes = true;
+            }
+            break;
+        }
+        case NT_VARDECL: {
+            /* one that is not in a statement list */
+            lfVarDeclNode *decl = (lfVarDeclNode *)node;
+            lfCandidate *c = candidate(E, &decl->ref);
+            if (c) {
+                c->decls++;
+                c->escapes = true;
+            }
+            walk(E, &decl->initializer);
+            break;
+        }
+        case NT_ASSIGN: {
+            lfCandidate *c = candidate(E, &((lfAssignNode *)node)->ref);
+            if (c) {
+                c->escapes = true;
+            }
+            walk(E, &((lfAssignNode *)node)->value);
+            break;
+        }
+        case NT_SUBSCRIBE: {
+            lfSubscriptionNode *sub = (lfSubscriptionNode *)node;
+            access(E, site, &sub->object, sub->index);
+            walk(E, &sub->index);
+            break;
+        }
+        case NT_OBJASSIGN: {
+            lfObjectAssignNode *assign = (lfObjectAssignNode *)node;
+            access(E, site, &assign->object, assign->key);
+            walk(E, &assign->key);
+            walk(E, &assign->value);
+            break;
+        }
+        case NT_CALL: {
+            /* v.f(...) may be a method call, which passes v along */
+            lfCallNode *call = (lfCallNode *)node;
+            if (call->func->type == NT_SUBSCRIBE) {
+                walk(E, &((lfSubscriptionNode *)call->func)->object);
+                walk(E, &((lfSubscriptionNode *)call->func)->index);
+            } else {
+                walk(E, &call->func);
+            }
+            walk_nodes(E, call->args);
+            break;
+        }
+        case NT_ARRAY:
+            walk_nodes(E, ((lfArrayNode *)node)->values);
+            break;
+        case NT_MAP:
+            walk_nodes(E, ((lfMapNode *)node)->keys);
+            walk_nodes(E, ((lfMapNode *)node)->values);
+            break;
+        case NT_UNARYOP:
+            walk(E, &((lfUnaryOpNode *)node)->value);
+            break;
+        case NT_BINARYOP:
+            walk(E, &((lfBinaryOpNode *)node)->lhs);
+            walk(E, &((lfBinaryOpNode *)node)->rhs);
+            break;
+        case NT_IF:
+            walk(E, &((lfIfNode *)node)->condition);
+            walk(E, &((lfIfNode *)node)->body);
+            walk(E, &((lfIfNode *)node)->else_body);
+            break;
+        case NT_WHILE:
+            walk(E, &((lfWhileNode *)node)->condition);
+            walk(E, &((lfWhileNode *)node)->body);
+            break;
+        case NT_RETURN:
+            walk(E, &((lfReturnNode *)node)->value);
+            break;
+        case NT_AWAIT:
+            walk(E, &((lfAwaitNode *)node)->value);
+            break;
+        case NT_COMPOUND:
+            walk_statements(E, &((lfCompoundNode *)node)->statements);
+            break;
+        case NT_CLASS: {
+            /* field defaults are evaluated in this frame, methods in their own */
+            lfClassNode *cls = (lfClassNode *)node;
+            for (int i = 0; i < length(&cls->body); i++) {
+                if (cls->body[i]->type == NT_VARDECL) {
+                    walk(E, &((lfVarDeclNode *)cls->body[i])->initializer);
+                }
+            }
+            break;
+        }
+        default:
+            /* literals, and functions, whose bodies run in frames of their own */
+            break;
+    }
+}
+
+/* the index of key among c's fields, added if a map lacks it; -1 where it would raise */
+static int field(lfCandidate *c, lfNode *key) {
+    for (int i = 0; i < length(&c->fields); i++) {
+        if (same_key(c->fields[i], key)) {
+            return i;
+        }
+    }
+    if (c->decl->initializer->type == NT_ARRAY) {
+        return -1;
+    }
+    array_push(&c->fields, key);
+    return length(&c->fields) - 1;
+}
+
+/* whether c is a literal nothing lets out, with its fields gathered */
+static bool replaceable(lfEscape *E, lfCandidate *c, int slot) {
+    if (c->decls != 1 || c->escapes || c->decl == NULL || c->decl->guard || c->decl->initializer == NULL) {
+        return false;
+    }
+    lfNode *literal = c->decl->initializer;
+    if (literal->type == NT_MAP) {
+        lfMapNode *map = (lfMapNode *)literal;
+        for (int i = 0; i < length(&map->keys); i++) {
+            if (!constant_key(map->keys[i])) {
+                return false;
+            }
+            for (int j = 0; j < i; j++) {
+                if (same_key(map->keys[i], map->keys[j])) {
+                    return false;
+                }
+            }
+        }
+        c->fields = array_new(&E->L->allocator, lfNode *);
+        for (int i = 0; i < length(&map->keys); i++) {
+            array_push(&c->fields, map->keys[i]);
+        }
+    } else if (literal->type == NT_ARRAY) {
+        /* the elements stand in for their indices */
+        c->fields = array_new(&E->L->allocator, lfNode *);
+        lfArrayNode *array = (lfArrayNode *)literal;
+        for (int i = 0; i < length(&array->values); i++) {
+            array_push(&c->fields, NULL);
+        }
+    } else {
+        return false;
+    }
+    for (int i = 0; i < length(&E->accesses); i++) {
+        const lfAccess *use = &E->accesses[i];
+        if (use->slot != slot) {
+            continue;
+        }
+        if (literal->type == NT_ARRAY) {
+            const lfLiteralNode *index = (const lfLiteralNode *)use->key;
+            if (use->key->type != NT_INT || index->constant.i < 0 || index->constant.i >= length(&c->fields)) {
+                return false;
+            }
+        } else if (field(c, use->key) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static lfToken field_name(lfEscape *E, const lfVarDeclNode *decl, int i, const lfNode *key) {
+    char buffer[128];
+    int n = key ? snprintf(buffer, sizeof(buffer), "%s.%s", decl->name.value, ((const lfLiteralNode *)key)->value.value)
+                : snprintf(buffer, sizeof(buffer), "%s[%d]", decl->name.value, i);
+    n = n < (int)sizeof(buffer) ? n : (int)sizeof(buffer) - 1;
+    lfArray(char) name = array_new(&E->L->parser->arena_allocator, char);
+    array_reserve(&name, n + 1);
+    memcpy(name, buffer, n);
+    name[n] = 0;
+    length(&name) = n;
+    return (lfToken) {.type = TT_IDENTIFIER, .value = name};
+}
+
+static void *node_new(lfEscape *E, size_t size, lfNodeType type, int lineno) {
+    lfNode *node = lf_malloc(&E->L->parser->arena_allocator, size);
+    memset(node, 0, size);
+    node->type = type;
+    node->lineno = lineno;
+    return node;
+}
+
+/* the locals c's fields become */
+static void allocate(lfEscape *E, lfCandidate *c, int *nslots) {
+    c->base = *nslots;
+    *nslots += length(&c->fields);
+    c->names = array_new(&E->L->allocator, lfToken);
+    for (int i = 0; i < length(&c->fields); i++) {
+        array_push(&c->names, field_name(E, c->decl, i, c->fields[i]));
+    }
+    E->L->opt_stats.scalars++;
+    E->L->opt_stats.scalar_locals += length(&c->fields);
+}
+
+/* points an access at its field's local */
+static void rewrite(lfEscape *E, lfCandidate *c, const lfAccess *use) {
+    int i = c->decl->initializer->type == NT_ARRAY ? (int)((const lfLiteralNode *)use->key)->constant.i : field(c, use->key);
+    lfNode *node = *use->site;
+    lfVarRef ref = {.kind = VK_LOCAL, .depth = 0, .slot = c->base + i, .captured = false};
+    if (node->type == NT_SUBSCRIBE) {
+        lfVarAccessNode *read = node_new(E, sizeof(lfVarAccessNode), NT_VARACCESS, node->lineno);
+        read->var = c->names[i];
+        read->ref = ref;
+        *use->site = (lfNode *)read;
+    } else {
+        lfAssignNode *write = node_new(E, sizeof(lfAssignNode), NT_ASSIGN, node->lineno);
+        write->var = c->names[i];
+        write->value = ((lfObjectAssignNode *)node)->value;
+        write->ref = ref;
+        *use->site = (lfNode *)write;
+    }
+}
+
+/* declares the locals where the literal was, in the order its values were evaluated */
+static void declare(lfEscape *E, lfCandidate *c) {
+    lfVarDeclNode *decl = c->decl;
+    lfNode *literal = decl->initializer;
+    lfArray(lfNode *) values = literal->type == NT_MAP ? ((lfMapNode *)literal)->values : ((lfArrayNode *)literal)->values;
+    lfCompoundNode *comp = node_new(E, sizeof(lfCompoundNode), NT_COMPOUND, decl->lineno);
+    comp->statements = array_new(&E->L->parser->arena_allocator, lfNode *);
+    for (int i = 0; i < length(&c->fields); i++) {
+        lfVarDeclNode *local = node_new(E, sizeof(lfVarDeclNode), NT_VARDECL, decl->lineno);
+        local->name = c->names[i];
+        local->initializer = i < length(&values) ? values[i] : NULL;
+        local->ref = (lfVarRef) {.kind = VK_LOCAL, .depth = 0, .slot = c->base + i, .captured = false};
+        array_push(&comp->statements, (lfNode *)local);
+    }
+    *c->site = (lfNode *)comp;
+}
+
+int lf_scalar_replace(lfState *L, lfArray(lfNode *) *body, int *nslots) {
+    lfEscape E = {
+        .L = L,
+        .nslots = *nslots,
+        .candidates = array_new(&L->allocator, lfCandidate),
+        .accesses = array_new(&L->allocator, lfAccess)
+    };
+    array_reserve(&E.candidates, E.nslots);
+    length(&E.candidates) = E.nslots;
+    memset(E.candidates, 0, E.nslots * sizeof(lfCandidate));
+    walk_statements(&E, body);
+
+    int replaced = 0;
+    for (int slot = 0; slot < E.nslots; slot++) {
+        lfCandidate *c = &E.candidates[slot];
+        if (replaceable(&E, c, slot)) {
+            allocate(&E, c, nslots);
+            replaced++;
+        }
+    }
+    /*
+     * accesses were found outside in, so going backwards every inner one is
+     * rewritten before a node holding it is replaced, and the literals'
+     * values are final before the declarations take them over
+     */
+    for (int i = length(&E.accesses) - 1; i >= 0 && replaced > 0; i--) {
+        lfCandidate *c = &E.candidates[E.accesses[i].slot];
+        if (c->names) {
+            rewrite(&E, c, &E.accesses[i]);
+        }
+    }
+    for (int slot = 0; slot < E.nslots; slot++) {
+        lfCandidate *c = &E.candidates[slot];
+        if (c->names) {
+            declare(&E, c);
+            array_delete(&c->names);
+        }
+        if (c->fields) {
+            array_delete(&c->fields);
+        }
+    }
+    array_delete(&E.candidates);
+    array_delete(&E.accesses);
+    return replaced;
+}
@@ -0,0 +1,1157 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <string.h>
+
+#include "interp/eval.h"
+#include "interp/state.h"
+#include "interp/value.h"
+#include "interp/gc.h"
+#include "interp/jit.h"
+#include "interp/inline.h"
+#include "interp/coro.h"
+#include "interp/typecheck.h"
+#include "parser/node.h"
+#include "parser/token.h"
+#include "lib/array.h"
+
+static const char *op_name(lfTokenType op) {
+    switch (op) {
+        case TT_ADD: return "+";
+        case TT_SUB: return "-";
+        case TT_MUL: return "*";
+        case TT_DIV: return "/";
+        case TT_POW: return "**";
+        case TT_LSHIFT: return "<<";
+        case TT_RSHIFT: return ">>";
+        case TT_EQ: return "==";
+        case TT_NE: return "!=";
+        case TT_LT: return "<";
+        case TT_GT: return ">";
+        case TT_LE: return "<=";
+        case TT_GE: return ">=";
+        case TT_NOT: return "!";
+        default: return "?";
+    }
+}
+
+/* ints wrap around instead of overflowing */
+#define wrap(OP, A, B) (int64_t)((uint64_t)(A) OP (uint64_t)(B))
+
+static lfValue arith_int(lfState *L, lfTokenType op, int64_t a, int64_t b) {
+    switch (op) {
+        case TT_ADD: return lf_int(wrap(+, a, b));
+        case TT_SUB: return lf_int(wrap(-, a, b));
+        case TT_MUL: return lf_int(wrap(*, a, b));
+        case TT_DIV:
+            if (b == 0) {
+                lf_runtime_error(L, "integer division by zero");
+            }
+            return lf_int(b == -1 ? wrap(-, 0, a) : a / b);
+        case TT_LSHIFT: return lf_int(wrap(<<, a, b & 63));
+        case TT_RSHIFT: return lf_int(a >> (b & 63));
+        case TT_EQ: return lf_int(a == b);
+        case TT_NE: return lf_int(a != b);
+        case TT_LT: return lf_int(a < b);
+        case TT_GT: return lf_int(a > b);
+        case TT_LE: return lf_int(a <= b);
+        case TT_GE: return lf_int(a >= b);
+        default: break;
+    }
+    lf_runtime_error(L, "unsupported operator '%s' for int and int", op_name(op));
+}
+
+static lfValue arith_float(lfState *L, lfTokenType op, double a, double b) {
+    switch (op) {
+        case TT_ADD: return lf_float(a + b);
+        case TT_SUB: return lf_float(a - b);
+        case TT_MUL: return lf_float(a * b);
+        case TT_DIV: return lf_float(a / b);
+        case TT_EQ: return lf_int(a == b);
+        case TT_NE: return lf_int(a != b);
+        case TT_LT: return lf_int(a < b);
+        case TT_GT: return lf_int(a > b);
+        case TT_LE: return lf_int(a <= b);
+        case TT_GE: return lf_int(a >= b);
+        default: break;
+    }
+    lf_runtime_error(L, "unsupported operator '%s' for floats", op_name(op));
+}
+
+#define is_number(V) ((V).type == LF_INT || (V).type == LF_FLOAT)
+#define to_float(V) ((V).type == LF_INT ? (double)(V).as.i : (V).as.f)
+
+lfValue lf_arith(lfState *L, lfTokenType op, lfValue a, lfValue b) {
+    if (a.type == LF_INT && b.type == LF_INT) {
+        return arith_int(L, op, a.as.i, b.as.i);
+    }
+    if (is_number(a) && is_number(b)) {
+        return arith_float(L, op, to_float(a), to_float(b));
+    }
+    switch (op) {
+        case TT_ADD:
+            if (a.type == LF_STRING || b.type == LF_STRING) {
+                return lf_obj(LF_STRING, lf_string_concat(L, lf_value_tostring(L, a), lf_value_tostring(L, b)));
+            }
+            break;
+        case TT_EQ:
+            return lf_int(lf_values_equal(L, a, b));
+        case TT_NE:
+            return lf_int(!lf_values_equal(L, a, b));
+        case TT_LT:
+        case TT_GT:
+        case TT_LE:
+        case TT_GE:
+            if (a.type == LF_STRING && b.type == LF_STRING) {
+                int cmp = strcmp(lf_string_chars(L, as_string(a)), lf_string_chars(L, as_string(b)));
+                return lf_int(op == TT_LT ? cmp < 0 : op == TT_GT ? cmp > 0 : op == TT_LE ? cmp <= 0 : cmp >= 0);
+            }
+            break;
+        default:
+            break;
+    }
+    lf_runtime_error(L, "unsupported operator '%s' for %s and %s", op_name(op), lf_type_name(a), lf_type_name(b));
+}
+
+/* declared types */
+
+static const lfTypeSet type_sets[] = {
+    [LF_UNDEFINED] = 0,
+    [LF_NULL] = TS_NULL,
+    [LF_INT] = TS_INT,
+    [LF_FLOAT] = TS_FLOAT,
+    [LF_NATIVE] = TS_FUNCTION,
+    [LF_STRING] = TS_STRING,
+    [LF_ARRAY] = TS_ARRAY,
+    [LF_MAP] = TS_MAP,
+    [LF_FUNCTION] = TS_FUNCTION,
+    [LF_METHOD] = TS_FUNCTION,
+    [LF_CLASS] = TS_CLASS,
+    [LF_INSTANCE] = TS_INSTANCE,
+    [LF_TASK] = TS_TASK,
+    [LF_BOX] = 0
+};
+
+/* checks a value against the type it is stored as, turning ints into floats where needed */
+static lfValue guard(lfState *L, lfTypeSet type, lfValue v, const char *what, const char *name) {
+    if (type_sets[v.type] & type) {
+        return v;
+    }
+    if (v.type == LF_INT && type & TS_FLOAT) {
+        return lf_float((double)v.as.i);
+    }
+    char declared[64];
+    lf_typeset_format(type, declared, sizeof(declared));
+    lf_runtime_error(L, "%s'%s' is declared %s, got %s", what, name, declared, lf_type_name(v));
+}
+
+static int64_t to_index(lfState *L, lfValue index, int length) {
+    if (index.type != LF_INT) {
+        lf_runtime_error(L, "index must be an int, not %s", lf_type_name(index));
+    }
+    if (index.as.i < 0 || index.as.i >= length) {
+        lf_runtime_error(L, "index %lld out of range for length %d", (long long)index.as.i, length);
+    }
+    return index.as.i;
+}
+
+lfValue lf_index(lfState *L, lfValue object, lfValue index) {
+    switch (object.type) {
+        case LF_ARRAY: {
+            lfArrayObject *array = as_array(object);
+            return lf_array_get(array, to_index(L, index, array->length));
+        }
+        case LF_MAP: {
+            lfValue v;
+            if (lf_map_get(L, as_map(object), index, &v)) {
+                return v;
+            }
+            return lf_null();
+        }
+        case LF_STRING: {
+            lfString *str = as_string(object);
+            int64_t i = to_index(L, index, str->length);
+            return lf_obj(LF_STRING, lf_string_new(L, lf_string_chars(L, str) + i, 1));
+        }
+        case LF_INSTANCE: {
+            lfInstance *instance = as_instance(object);
+            if (index.type == LF_STRING) {
+                int field = lf_class_field(instance->cls, lf_string_chars(L, as_string(index)));
+                if (field >= 0) {
+                    return instance->fields[field];
+                }
+                lfFunction *method = lf_class_method(instance->cls, lf_string_chars(L, as_string(index)));
+                if (method) {
+                    return lf_obj(LF_METHOD, lf_bound_method_new(L, object, method));
+                }
+                lf_runtime_error(L, "%s has no member '%s'", instance->cls->name->chars, lf_string_chars(L, as_string(index)));
+            }
+        } break;
+        case LF_CLASS: {
+            if (index.type == LF_STRING) {
+                lfFunction *method = lf_class_method(as_class(object), lf_string_chars(L, as_string(index)));
+                if (method) {
+                    return lf_obj(LF_FUNCTION, method);
+                }
+                lf_runtime_error(L, "%s has no method '%s'", as_class(object)->name->chars, lf_string_chars(L, as_string(index)));
+            }
+        } break;
+        default:
+            break;
+    }
+    lf_runtime_error(L, "cannot index %s with %s", lf_type_name(object), lf_type_name(index));
+}
+
+void lf_set_index(lfState *L, lfValue object, lfValue index, lfValue value) {
+    switch (object.type) {
+        case LF_ARRAY: {
+            lfArrayObject *array = as_array(object);
+            /* assigning one past the end appends */
+            if (index.type == LF_INT && index.as.i == array->length) {
+                lf_array_push(L, array, value);
+                return;
+            }
+            lf_array_set(L, array, to_index(L, index, array->length), value);
+            return;
+        }
+        case LF_MAP:
+            lf_map_set(L, as_map(object), index, value);
+            return;
+        case LF_INSTANCE: {
+            lfInstance *instance = as_instance(object);
+            if (index.type == LF_STRING) {
+                int field = lf_class_field(instance->cls, lf_string_chars(L, as_string(index)));
+                if (field < 0) {
+                    lf_runtime_error(L, "%s has no field '%s'", instance->cls->name->chars, lf_string_chars(L, as_string(index)));
+                }
+                if (instance->cls->field_types[field]) {
+                    value = guard(L, instance->cls->field_types[field], value, "field ", instance->cls->field_names[field]);
+                }
+                instance->fields[field] = value;
+                return;
+            }
+        } break;
+        default:
+            break;
+    }
+    lf_runtime_error(L, "cannot assign to %s with a %s index", lf_type_name(object), lf_type_name(index));
+}
+
+/* variables */
+
+/* the type checker marks every use of a boxed local as captured */
+static inline lfValue load(lfState *L, const lfVarRef *ref, const char *name) {
+    switch (ref->kind) {
+        case VK_LOCAL:
+            return ref->captured ? as_box(L->base[ref->slot])->value : L->base[ref->slot];
+        case VK_UPVALUE:
+            return L->closure->captures[ref->slot]->value;
+        case VK_GLOBAL: {
+            lfValue v = L->globals[ref->slot];
+            if (v.type == LF_UNDEFINED) {
+                lf_runtime_error(L, "undefined variable '%s'", name);
+            }
+            return v;
+        }
+        default:
+            lf_runtime_error(L, "unresolved variable '%s'", name);
+    }
+}
+
+static inline void store(lfState *L, const lfVarRef *ref, lfValue value) {
+    switch (ref->kind) {
+        case VK_LOCAL:
+            if (ref->captured) {
+                as_box(L->base[ref->slot])->value = value;
+            } else {
+                L->base[ref->slot] = value;
+            }
+            break;
+        case VK_UPVALUE:
+            L->closure->captures[ref->slot]->value = value;
+            break;
+        case VK_GLOBAL:
+            L->globals[ref->slot] = value;
+            break;
+        default:
+            break;
+    }
+}
+
+/* initializes a freshly declared variable, boxing it if a closure captures it */
+static inline void define(lfState *L, const lfVarRef *ref, lfValue value) {
+    if (ref->kind == VK_LOCAL && ref->captured) {
+        L->base[ref->slot] = lf_obj(LF_BOX, lf_box_new(L, value));
+    } else if (ref->kind == VK_LOCAL) {
+        L->base[ref->slot] = value;
+    } else {
+        store(L, ref, value);
+    }
+}
+
+/* fused reads */
+
+/*
+ * locals and int literals are most of what operators, subscripts and calls
+ * evaluate, so those read them in place instead of dispatching to another
+ * evaluator. a build with LEAF_DISPATCH_STATS shows which pairs are worth it
+ */
+static inline lfValue eval_operand(lfState *L, lfNode *node) {
+    if (node->type == NT_VARACCESS) {
+        lfVarAccessNode *access = (lfVarAccessNode *)node;
+        if (access->ref.kind == VK_LOCAL && !access->ref.captured) {
+            return L->base[access->ref.slot];
+        }
+    } else if (node->type == NT_INT) {
+        return lf_int(((lfLiteralNode *)node)->constant.i);
+    }
+    return lf_eval(L, node);
+}
+
+/* a comparison of proven ints or floats branches on its operands without making a value */
+static inline bool eval_condition(lfState *L, lfNode *node) {
+    if (node->type != NT_BINARYOP) {
+        return lf_value_truthy(lf_eval(L, node));
+    }
+    lfBinaryOpNode *binop = (lfBinaryOpNode *)node;
+    if (binop->operands == TS_INT) {
+        int64_t a = eval_operand(L, binop->lhs).as.i;
+        int64_t b = eval_operand(L, binop->rhs).as.i;
+        switch (binop->op.type) {
+            case TT_EQ: return a == b;
+            case TT_NE: return a != b;
+            case TT_LT: return a < b;
+            case TT_GT: return a > b;
+            case TT_LE: return a <= b;
+            case TT_GE: return a >= b;
+            default: return lf_value_truthy(arith_int(L, binop->op.type, a, b));
+        }
+    } else if (binop->operands == TS_FLOAT) {
+        double a = eval_operand(L, binop->lhs).as.f;
+        double b = eval_operand(L, binop->rhs).as.f;
+        switch (binop->op.type) {
+            case TT_EQ: return a == b;
+            case TT_NE: return a != b;
+            case TT_LT: return a < b;
+            case TT_GT: return a > b;
+            case TT_LE: return a <= b;
+            case TT_GE: return a >= b;
+            default: return lf_value_truthy(arith_float(L, binop->op.type, a, b));
+        }
+    }
+    return lf_value_truthy(lf_eval(L, node));
+}
+
+/* evaluators */
+
+static lfValue eval_int(lfState *L, lfNode *node) {
+    (void)L;
+    return lf_int(((lfLiteralNode *)node)->constant.i);
+}
+
+static lfValue eval_float(lfState *L, lfNode *node) {
+    (void)L;
+    return lf_float(((lfLiteralNode *)node)->constant.f);
+}
+
+static lfValue eval_string(lfState *L, lfNode *node) {
+    (void)L;
+    return lf_obj(LF_STRING, ((lfLiteralNode *)node)->constant.object);
+}
+
+static lfValue eval_array(lfState *L, lfNode *node) {
+    lfArrayNode *arr = (lfArrayNode *)node;
+    lfArrayObject *array = lf_array_new(L, length(&arr->values));
+    lfValue result = lf_obj(LF_ARRAY, array);
+    lf_push(L, result);
+    for (int i = 0; i < length(&arr->values); i++) {
+        lfValue v = lf_eval(L, arr->values[i]);
+        lf_array_push(L, array, v);
+    }
+    L->top -= 1;
+    return result;
+}
+
+static lfValue eval_map(lfState *L, lfNode *node) {
+    lfMapNode *m = (lfMapNode *)node;
+    lfMap *map = lf_map_new(L);
+    lfValue result = lf_obj(LF_MAP, map);
+    lf_push(L, result);
+    for (int i = 0; i < length(&m->keys); i++) {
+        lfValue key = lf_eval(L, m->keys[i]);
+        lf_push(L, key);
+        lfValue value = lf_eval(L, m->values[i]);
+        L->top -= 1;
+        lf_map_set(L, map, key, value);
+    }
+    L->top -= 1;
+    return result;
+}
+
+static lfValue eval_unaryop(lfState *L, lfNode *node) {
+    lfUnaryOpNode *unop = (lfUnaryOpNode *)node;
+    lfValue v = eval_operand(L, unop->value);
+    if (unop->operand == TS_INT && unop->op.type == TT_SUB) {
+        return lf_int(wrap(-, 0, v.as.i));
+    }
+    if (unop->op.type == TT_NOT) {
+        return lf_int(!lf_value_truthy(v));
+    }
+    if (v.type == LF_INT) {
+        return lf_int(wrap(-, 0, v.as.i));
+    } else if (v.type == LF_FLOAT) {
+        return lf_float(-v.as.f);
+    }
+    lf_runtime_error(L, "unsupported operator '-' for %s", lf_type_name(v));
+}
+
+static lfValue eval_binaryop(lfState *L, lfNode *node) {
+    lfBinaryOpNode *binop = (lfBinaryOpNode *)node;
+    /* proven operands need neither type checks nor a stack slot to survive a collection */
+    if (binop->operands == TS_INT) {
+        int64_t a = eval_operand(L, binop->lhs).as.i;
+        int64_t b = eval_operand(L, binop->rhs).as.i;
+        return arith_int(L, binop->op.type, a, b);
+    } else if (binop->operands == TS_FLOAT) {
+        double a = eval_operand(L, binop->lhs).as.f;
+        double b = eval_operand(L, binop->rhs).as.f;
+        return arith_float(L, binop->op.type, a, b);
+    }
+    lfValue lhs = eval_operand(L, binop->lhs);
+    lf_push(L, lhs);
+    lfValue rhs = eval_operand(L, binop->rhs);
+    L->top -= 1;
+    if (lhs.type == LF_INT && rhs.type == LF_INT) {
+        return arith_int(L, binop->op.type, lhs.as.i, rhs.as.i);
+    }
+    return lf_arith(L, binop->op.type, lhs, rhs);
+}
+
+static lfValue eval_varaccess(lfState *L, lfNode *node) {
+    lfVarAccessNode *access = (lfVarAccessNode *)node;
+    return load(L, &access->ref, access->var.value);
+}
+
+static lfValue eval_vardecl(lfState *L, lfNode *node) {
+    lfVarDeclNode *decl = (lfVarDeclNode *)node;
+    lfValue v = decl->initializer ? lf_eval(L, decl->initializer) : lf_null();
+    if (decl->guard) {
+        v = guard(L, decl->guard, v, "", decl->name.value);
+    }
+    define(L, &decl->ref, v);
+    return lf_null();
+}
+
+#define MEMBER_MISSING INT32_MIN
+
+/* where name lives on cls, a field index or -1 - a method index, or MEMBER_MISSING */
+static inline int find_member(lfClass *cls, lfMemberCache *cache, lfNode *name) {
+    if (cache->cls == cls->node) {
+        return cache->slot;
+    }
+    const char *chars = ((lfString *)((lfLiteralNode *)name)->constant.object)->chars;
+    int slot = lf_class_field(cls, chars);
+    if (slot < 0) {
+        slot = MEMBER_MISSING;
+        for (int i = 0; i < length(&cls->methods); i++) {
+            if (!strcmp(cls->methods[i]->node->name.value, chars)) {
+                slot = -1 - i;
+                break;
+            }
+        }
+    }
+    if (slot != MEMBER_MISSING) {
+        cache->cls = cls->node;
+        cache->slot = slot;
+    }
+    return slot;
+}
+
+static lfValue eval_subscribe(lfState *L, lfNode *node) {
+    lfSubscriptionNode *sub = (lfSubscriptionNode *)node;
+    lfValue object = eval_operand(L, sub->object);
+    if (object.type == LF_INSTANCE && sub->index->type == NT_STRING) {
+        /* obj.name */
+        lfInstance *instance = as_instance(object);
+        int slot = find_member(instance->cls, &sub->cache, sub->index);
+        if (slot >= 0) {
+            return instance->fields[slot];
+        } else if (slot != MEMBER_MISSING) {
+            return lf_obj(LF_METHOD, lf_bound_method_new(L, object, instance->cls->methods[-1 - slot]));
+        }
+    }
+    lf_push(L, object);
+    lfValue index = eval_operand(L, sub->index);
+    L->top -= 1;
+    return lf_index(L, object, index);
+}
+
+static lfValue eval_assign(lfState *L, lfNode *node) {
+    lfAssignNode *assign = (lfAssignNode *)node;
+    lfValue v = eval_operand(L, assign->value);
+    if (assign->guard) {
+        v = guard(L, assign->guard, v, "", assign->var.value);
+    }
+    store(L, &assign->ref, v);
+    return v;
+}
+
+static lfValue eval_objassign(lfState *L, lfNode *node) {
+    lfObjectAssignNode *assign = (lfObjectAssignNode *)node;
+    lfValue object = eval_operand(L, assign->object);
+    lf_push(L, object);
+    lfValue key = eval_operand(L, assign->key);
+    lf_push(L, key);
+    lfValue value = eval_operand(L, assign->value);
+    L->top -= 2;
+    if (object.type == LF_INSTANCE && assign->key->type == NT_STRING) {
+        /* obj.name = value */
+        lfClass *cls = as_instance(object)->cls;
+        int slot = find_member(cls, &assign->cache, assign->key);
+        if (slot >= 0) {
+            if (cls->field_types[slot]) {
+                value = guard(L, cls->field_types[slot], value, "field ", cls->field_names[slot]);
+            }
+            as_instance(object)->fields[slot] = value;
+            return value;
+        }
+    }
+    lf_set_index(L, object, key, value);
+    return value;
+}
+
+/* whether a call from here would leave less than LF_STACK_MARGIN of the C stack */
+static inline bool c_stack_low(const lfState *L) {
+    return (char *)__builtin_frame_address(0) < L->stack_limit;
+}
+
+/*
+ * checks node can run with argc arguments in a frame at base, moving them
+ * there from args, and clears its other slots. push is set for a new frame
+ * rather than one handed over
+ */
+static inline void prepare_frame(lfState *L, lfFunction *fn, lfFunctionNode *node, lfValue *base, const lfValue *args, int argc, bool push) {
+    if (push && c_stack_low(L)) {
+        lf_runtime_error(L, "stack overflow");
+    }
+    if (node->lazy && !lf_load_body(L, fn->chunk, node)) {
+        lf_runtime_error(L, "%s() does not compile", node->name.value);
+    }
+    int offset = node->is_method ? 1 : 0;
+    int nparams = length(&node->params) + offset;
+    if (argc > nparams) {
+        lf_runtime_error(L, "%s() takes %d arguments, got %d", node->name.value, nparams - offset, argc - offset);
+    }
+    if ((push && L->nframes >= L->max_frames) || base + node->nslots >= L->stack_end) {
+        lf_runtime_error(L, "stack overflow");
+    }
+    if (args != base) {
+        memmove(base, args, argc * sizeof(lfValue));
+    }
+    for (int i = argc; i < node->nslots; i++) {
+        base[i] = lf_null();
+    }
+    L->top = base + node->nslots;
+}
+
+/* binds the parameters the arguments left out or need boxed, then runs node's body in frame */
+static inline void run_body(lfState *L, lfFunctionNode *node, lfValue *base, int argc, lfFrame *frame) {
+    int offset = node->is_method ? 1 : 0;
+    int nparams = length(&node->params) + offset;
+    for (int i = argc - offset; i < nparams - offset; i++) {
+        lfVarDeclNode *param = node->params[i];
+        if (param->initializer == NULL) {
+            lf_runtime_error(L, "%s() missing argument '%s'", node->name.value, param->name.value);
+        }
+        base[offset + i] = lf_eval(L, param->initializer);
+    }
+    for (int i = 0; i < nparams - offset; i++) {
+        lfVarDeclNode *param = node->params[i];
+        if (param->guard) {
+            base[offset + i] = guard(L, param->guard, base[offset + i], "", param->name.value);
+        }
+    }
+    if (offset && node->self.captured) {
+        base[0] = lf_obj(LF_BOX, lf_box_new(L, base[0]));
+    }
+    for (int i = 0; i < nparams - offset; i++) {
+        lfVarDeclNode *param = node->params[i];
+        if (param->ref.captured) {
+            base[param->ref.slot] = lf_obj(LF_BOX, lf_box_new(L, base[param->ref.slot]));
+        }
+    }
+
+    lf_gc_check(L);
+
+    if (node->native == NULL && L->jit && node->hotness >= 0 && ++node->hotness >= LF_JIT_CALLS) {
+        lf_jit_function(L, node);
+    }
+    if (node->native) {
+        ((lfNativeCode)node->native)(L);
+    } else {
+        for (int i = 0; i < length(&node->body); i++) {
+            lfNode *statement = node->body[i];
+            frame->line = statement->lineno;
+            lf_eval(L, statement);
+            if (L->returning) {
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * runs the call in tail position a body ended in, return g(...), in its
+ * place in frame, and the one g's body ended in, and so on. kept apart
+ * from call_function, which runs every other call
+ */
+__attribute__((noinline))
+static void run_tail_calls(lfState *L, lfFrame *frame, lfValue *base) {
+    while (L->tail.function) {
+        lfTailCall tail = L->tail;
+        L->tail.function = NULL;
+        L->retval = lf_null();
+        L->returning = false;
+        prepare_frame(L, tail.function, tail.node, base, tail.args, tail.argc, false);
+        /* the profiler may be reading the frame meanwhile */
+        frame->native = NULL;
+        frame->function = tail.function;
+        frame->chunk = tail.function->chunk;
+        frame->line = tail.node->lineno;
+        L->closure = tail.function;
+        run_body(L, tail.node, base, tail.argc, frame);
+    }
+}
+
+/* node is fn's own tree, or a specialized copy of it */
+static lfValue call_function(lfState *L, lfFunction *fn, lfFunctionNode *node, lfValue *base, int argc) {
+    /* the arguments already sit in the first slots of the new frame */
+    prepare_frame(L, fn, node, base, base, argc, true);
+
+    lfValue *old_base = L->base;
+    lfFunction *old_closure = L->closure;
+    lfFrame *frame = &L->frames[L->nframes];
+    *frame = (lfFrame) {
+        .function = fn,
+        .chunk = fn->chunk,
+        .base = base,
+        .line = node->lineno
+    };
+    /* the profiler reads frames from a signal handler, so count this one only once it is whole */
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    L->nframes += 1;
+    L->frame = frame;
+    L->base = base;
+    L->closure = fn;
+
+    run_body(L, node, base, argc, frame);
+    if (L->tail.function) {
+        run_tail_calls(L, frame, base);
+    }
+
+    lfValue result = lf_null();
+    if (L->returning) {
+        result = L->retval;
+        L->retval = lf_null();
+        L->returning = false;
+    }
+
+    L->nframes -= 1;
+    L->frame = L->nframes > 0 ? &L->frames[L->nframes - 1] : NULL;
+    L->base = old_base;
+    L->closure = old_closure;
+    return result;
+}
+
+/* slides the arguments up one slot to make room for a receiver */
+static void insert_receiver(lfState *L, lfValue *callee, int argc, lfValue receiver) {
+    if (callee + argc + 2 >= L->stack_end) {
+        lf_runtime_error(L, "stack overflow");
+    }
+    memmove(callee + 2, callee + 1, argc * sizeof(lfValue));
+    callee[1] = receiver;
+    L->top = callee + argc + 2;
+}
+
+lfValue lf_call(lfState *L, lfValue *callee, int argc) {
+    switch (callee->type) {
+        case LF_FUNCTION:
+            return call_function(L, as_function(*callee), as_function(*callee)->node, callee + 1, argc);
+        case LF_METHOD: {
+            lfBoundMethod *m = as_method(*callee);
+            insert_receiver(L, callee, argc, m->receiver);
+            return call_function(L, m->method, m->method->node, callee + 1, argc + 1);
+        }
+        case LF_NATIVE:
+            return as_native(*callee)->fn(L, callee + 1, argc);
+        case LF_CLASS: {
+            lfClass *cls = as_class(*callee);
+            lfValue instance = lf_obj(LF_INSTANCE, lf_instance_new(L, cls));
+            if (cls->init) {
+                /* the callee slot keeps the class alive, the receiver slot the instance */
+                insert_receiver(L, callee, argc, instance);
+                call_function(L, cls->init, cls->init->node, callee + 1, argc + 1);
+            } else if (argc > 0) {
+                lf_runtime_error(L, "%s has no init() to take arguments", cls->name->chars);
+            }
+            return instance;
+        }
+        default:
+            break;
+    }
+    lf_runtime_error(L, "cannot call %s", lf_type_name(*callee));
+}
+
+/*
+ * runs call's copy of fn in place of calling it. the arguments at base
+ * are already the copy's slots, so it runs with them as the base. it
+ * still gets a frame, and nothing else of a call, so that errors and
+ * profiler samples name fn above its caller
+ */
+static lfValue run_inlined(lfState *L, lfCallNode *call, lfFunction *fn, lfValue *base) {
+    lfFunctionNode *node = call->inlined;
+    if (L->nframes >= L->max_frames || c_stack_low(L)) {
+        lf_runtime_error(L, "stack overflow");
+    }
+    lfFrame *caller = L->frame;
+    lfValue *old_base = L->base;
+    lfFrame *frame = &L->frames[L->nframes];
+    *frame = (lfFrame) {
+        .function = fn,
+        .chunk = fn->chunk,
+        .base = base,
+        .line = node->lineno
+    };
+    /* as in call_function, the frame is counted only once it is whole */
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    L->nframes += 1;
+    L->frame = frame;
+    L->base = base;
+
+    int offset = node->is_method ? 1 : 0;
+    for (int i = 0; i < length(&node->params); i++) {
+        lfVarDeclNode *param = node->params[i];
+        if (param->guard) {
+            base[offset + i] = guard(L, param->guard, base[offset + i], "", param->name.value);
+        }
+    }
+
+    if (node->native == NULL && L->jit && node->hotness >= 0 && ++node->hotness >= LF_JIT_CALLS) {
+        lf_jit_function(L, node);
+    }
+    if (node->native) {
+        ((lfNativeCode)node->native)(L);
+    } else {
+        frame->line = node->body[0]->lineno;
+        lf_eval(L, node->body[0]);
+    }
+
+    lfValue result = lf_null();
+    if (L->returning) {
+        result = L->retval;
+        L->retval = lf_null();
+        L->returning = false;
+    }
+
+    L->nframes -= 1;
+    L->frame = caller;
+    L->base = old_base;
+    return result;
+}
+
+/* evaluates call's callee and arguments onto the stack, returning the callee's slot */
+static inline lfValue *push_call(lfState *L, lfCallNode *call, int *extra) {
+    lfValue *callee = L->top;
+    int argc = length(&call->args);
+    *extra = 0;
+
+    if (call->func->type == NT_SUBSCRIBE) {
+        /* obj.method(...) calls the method directly instead of binding it first */
+        lfSubscriptionNode *sub = (lfSubscriptionNode *)call->func;
+        lfValue object = lf_eval(L, sub->object);
+        lf_push(L, object);
+        lfFunction *method = NULL;
+        if (object.type == LF_INSTANCE && sub->index->type == NT_STRING) {
+            int slot = find_member(as_instance(object)->cls, &sub->cache, sub->index);
+            if (slot < 0 && slot != MEMBER_MISSING) {
+                method = as_instance(object)->cls->methods[-1 - slot];
+            }
+        }
+        if (method) {
+            *callee = lf_obj(LF_FUNCTION, method);
+            lf_push(L, object);
+            *extra = 1;
+        } else {
+            lfValue index = lf_eval(L, sub->index);
+            *callee = lf_index(L, object, index);
+        }
+    } else {
+        lfValue func = lf_eval(L, call->func);
+        lf_push(L, func);
+    }
+
+    for (int i = 0; i < argc; i++) {
+        lfValue arg = eval_operand(L, call->args[i]);
+        lf_push(L, arg);
+    }
+    return callee;
+}
+
+static lfValue eval_call(lfState *L, lfNode *node) {
+    lfCallNode *call = (lfCallNode *)node;
+    int argc = length(&call->args);
+    int extra;
+    lfValue *callee = push_call(L, call, &extra);
+
+    lfValue result;
+    lfFunction *fn = callee->type == LF_FUNCTION ? as_function(*callee) : NULL;
+    lfFunctionNode *specialized = fn && call->specialized && fn->node == call->target ? call->specialized : NULL;
+    if (fn && call->inline_target == NULL && L->inline_calls && fn->node->inlinable >= 0) {
+        lf_inline(L, call, fn->node, specialized ? specialized : fn->node, argc + extra);
+    }
+    if (fn && fn->node == call->inline_target && argc + extra == fn->node->nslots) {
+        result = run_inlined(L, call, fn, callee + 1);
+    } else if (specialized) {
+        /* the checker's copy of the callee for the argument types seen here */
+        result = call_function(L, fn, specialized, callee + 1, argc);
+    } else {
+        result = lf_call(L, callee, argc + extra);
+    }
+    L->top = callee;
+    return result;
+}
+
+/*
+ * the value of a return in tail position. a function or method it calls
+ * is left in L->tail instead, with its arguments where they were pushed,
+ * for call_function to run in the frame the return unwinds to. with a
+ * guard, only the callee the checker found to check the same itself is.
+ * kept out of eval_return, which every other return runs through
+ */
+__attribute__((noinline))
+static lfValue tail_call(lfState *L, lfCallNode *call, lfTypeSet guard) {
+    int extra;
+    lfValue *callee = push_call(L, call, &extra);
+    int argc = length(&call->args);
+    lfFunction *fn = callee->type == LF_FUNCTION ? as_function(*callee) : NULL;
+    if (fn == NULL && callee->type == LF_METHOD && guard == 0) {
+        lfBoundMethod *m = as_method(*callee);
+        insert_receiver(L, callee, argc, m->receiver);
+        fn = m->method;
+        extra = 1;
+    } else if (fn && guard && fn->node != call->target) {
+        fn = NULL;
+    }
+    if (fn == NULL) {
+        /* a class, a native, or not the callee checked: nothing a copy or specialization is made for */
+        lfValue result = lf_call(L, callee, argc + extra);
+        L->top = callee;
+        return result;
+    }
+    lfFunctionNode *specialized = call->specialized && fn->node == call->target ? call->specialized : NULL;
+    L->tail = (lfTailCall) {
+        .function = fn,
+        .node = specialized ? specialized : fn->node,
+        .args = callee + 1,
+        .argc = specialized ? argc : argc + extra
+    };
+    return lf_null();
+}
+
+static lfFunction *make_closure(lfState *L, lfFunctionNode *node) {
+    lfFunction *fn = lf_function_new(L, node, L->frame->chunk);
+    for (int i = 0; i < fn->ncaptures; i++) {
+        lfCapture capture = node->captures[i];
+        if (capture.local) {
+            fn->captures[i] = as_box(L->base[capture.slot]);
+        } else {
+            fn->captures[i] = L->closure->captures[capture.slot];
+        }
+    }
+    return fn;
+}
+
+static lfValue eval_func(lfState *L, lfNode *node) {
+    lfFunctionNode *f = (lfFunctionNode *)node;
+    if (f->ref.kind == VK_LOCAL && f->ref.captured) {
+        /* the function captures itself, so its box has to exist first */
+        lfBox *box = lf_box_new(L, lf_null());
+        L->base[f->ref.slot] = lf_obj(LF_BOX, box);
+        box->value = lf_obj(LF_FUNCTION, make_closure(L, f));
+    } else {
+        define(L, &f->ref, lf_obj(LF_FUNCTION, make_closure(L, f)));
+    }
+    return lf_null();
+}
+
+static lfValue eval_if(lfState *L, lfNode *node) {
+    lfIfNode *ifnode = (lfIfNode *)node;
+    if (eval_condition(L, ifnode->condition)) {
+        lf_eval(L, ifnode->body);
+    } else if (ifnode->else_body) {
+        lf_eval(L, ifnode->else_body);
+    }
+    return lf_null();
+}
+
+static lfValue eval_while(lfState *L, lfNode *node) {
+    lfWhileNode *whilenode = (lfWhileNode *)node;
+    if (whilenode->native == NULL && L->jit && whilenode->hotness >= 0 && ++whilenode->hotness >= LF_JIT_ENTRIES) {
+        lf_jit_loop(L, whilenode);
+    }
+    if (whilenode->native) {
+        ((lfNativeCode)whilenode->native)(L);
+        return lf_null();
+    }
+    while (eval_condition(L, whilenode->condition)) {
+        lf_eval(L, whilenode->body);
+        if (L->returning) {
+            break;
+        }
+        lf_gc_check(L);
+        /* a loop entered once, like a script's main loop, moves to machine code mid-run */
+        if (whilenode->native || (L->jit && whilenode->hotness >= 0 && ++whilenode->backedges >= LF_JIT_BACKEDGES && lf_jit_loop(L, whilenode))) {
+            ((lfNativeCode)whilenode->native)(L);
+            break;
+        }
+        /* errors in the condition are the loop's, as in compiled code */
+        L->frame->line = node->lineno;
+    }
+    return lf_null();
+}
+
+static lfValue eval_return(lfState *L, lfNode *node) {
+    lfReturnNode *ret = (lfReturnNode *)node;
+    if (ret->tail) {
+        L->retval = tail_call(L, (lfCallNode *)ret->value, ret->guard);
+        if (L->tail.function) {
+            L->returning = true;
+            return lf_null();
+        }
+    } else {
+        L->retval = ret->value ? eval_operand(L, ret->value) : lf_null();
+    }
+    if (ret->guard) {
+        L->retval = guard(L, ret->guard, L->retval, "return value of ", L->frame->function->node->name.value);
+    }
+    L->returning = true;
+    return lf_null();
+}
+
+static lfValue eval_yield(lfState *L, lfNode *node) {
+    (void)node;
+    lf_coro_yield(L);
+    return lf_null();
+}
+
+static lfValue eval_await(lfState *L, lfNode *node) {
+    lfValue task = lf_eval(L, ((lfAwaitNode *)node)->value);
+    if (task.type != LF_TASK) {
+        lf_runtime_error(L, "cannot await %s", lf_type_name(task));
+    }
+    /* the task has to outlive the collections other coroutines run into */
+    lf_push(L, task);
+    lfValue result = lf_coro_await(L, as_task(task));
+    L->top -= 1;
+    return result;
+}
+
+static lfValue eval_class(lfState *L, lfNode *node) {
+    lfClassNode *c = (lfClassNode *)node;
+    lfClass *cls = lf_class_new(L, c);
+    lf_push(L, lf_obj(LF_CLASS, cls));
+    cls->name = lf_string_new(L, c->name.value, strlen(c->name.value));
+    for (int i = 0; i < length(&c->body); i++) {
+        lfNode *member = c->body[i];
+        if (member->type == NT_FUNC) {
+            lfFunction *method = make_closure(L, (lfFunctionNode *)member);
+            array_push(&cls->methods, method);
+            if (!strcmp(method->node->name.value, "init")) {
+                cls->init = method;
+            }
+        } else {
+            lfVarDeclNode *field = (lfVarDeclNode *)member;
+            lfValue v = field->initializer ? lf_eval(L, field->initializer) : lf_null();
+            if (field->guard) {
+                v = guard(L, field->guard, v, "field ", field->name.value);
+            }
+            array_push(&cls->field_names, field->name.value);
+            array_push(&cls->field_defaults, v);
+            array_push(&cls->field_types, field->declared);
+        }
+    }
+    L->top -= 1;
+    define(L, &c->ref, lf_obj(LF_CLASS, cls));
+    return lf_null();
+}
+
+static lfValue eval_compound(lfState *L, lfNode *node) {
+    lfCompoundNode *comp = (lfCompoundNode *)node;
+    for (int i = 0; i < length(&comp->statements); i++) {
+        lfNode *statement = comp->statements[i];
+        L->frame->line = statement->lineno;
+        lf_eval(L, statement);
+        if (L->returning) {
+            break;
+        }
+    }
+    return lf_null();
+}
+
+/* the resolver has already loaded the chunk, running it is all that is left */
+static lfValue eval_import(lfState *L, lfNode *node) {
+    lfChunk *chunk = ((lfImportNode *)node)->module;
+    if (!chunk->executed) {
+        chunk->executed = true;
+        lf_exec_chunk(L, chunk);
+    }
+    return lf_null();
+}
+
+const lfEvaluator lf_evaluators[] = {
+    [NT_INT] = eval_int,
+    [NT_FLOAT] = eval_float,
+    [NT_STRING] = eval_string,
+    [NT_ARRAY] = eval_array,
+    [NT_MAP] = eval_map,
+    [NT_UNARYOP] = eval_unaryop,
+    [NT_BINARYOP] = eval_binaryop,
+    [NT_VARACCESS] = eval_varaccess,
+    [NT_VARDECL] = eval_vardecl,
+    [NT_SUBSCRIBE] = eval_subscribe,
+    [NT_ASSIGN] = eval_assign,
+    [NT_OBJASSIGN] = eval_objassign,
+    [NT_CALL] = eval_call,
+    [NT_FUNC] = eval_func,
+    [NT_IF] = eval_if,
+    [NT_WHILE] = eval_while,
+    [NT_RETURN] = eval_return,
+    [NT_YIELD] = eval_yield,
+    [NT_AWAIT] = eval_await,
+    [NT_CLASS] = eval_class,
+    [NT_COMPOUND] = eval_compound,
+    [NT_IMPORT] = eval_import
+};
+
+#ifdef LF_DISPATCH_STATS
+static const char *const node_names[LF_NODE_TYPES] = {
+    [NT_INT] = "int",
+    [NT_FLOAT] = "float",
+    [NT_STRING] = "string",
+    [NT_ARRAY] = "array",
+    [NT_MAP] = "map",
+    [NT_UNARYOP] = "unaryop",
+    [NT_BINARYOP] = "binaryop",
+    [NT_VARACCESS] = "varaccess",
+    [NT_VARDECL] = "vardecl",
+    [NT_SUBSCRIBE] = "subscribe",
+    [NT_ASSIGN] = "assign",
+    [NT_OBJASSIGN] = "objassign",
+    [NT_CALL] = "call",
+    [NT_FUNC] = "func",
+    [NT_IF] = "if",
+    [NT_WHILE] = "while",
+    [NT_RETURN] = "return",
+    [NT_YIELD] = "yield",
+    [NT_AWAIT] = "await",
+    [NT_CLASS] = "class",
+    [NT_COMPOUND] = "compound",
+    [NT_IMPORT] = "import"
+};
+
+lfValue lf_eval_counted(lfState *L, lfNode *node) {
+    int parent = L->dispatch_path[0];
+    int grandparent = L->dispatch_path[1];
+    L->dispatches[node->type] += 1;
+    if (parent >= 0) {
+        L->dispatch_pairs[parent][node->type] += 1;
+    }
+    if (grandparent >= 0) {
+        L->dispatch_triples[grandparent][parent][node->type] += 1;
+    }
+    L->dispatch_path[0] = node->type;
+    L->dispatch_path[1] = parent;
+    lfValue v = lf_evaluators[node->type](L, node);
+    L->dispatch_path[0] = parent;
+    L->dispatch_path[1] = grandparent;
+    return v;
+}
+
+#define REPORT_TOP 12
+
+/* prints the REPORT_TOP largest of counts, a flattened table of n entries */
+static void report_top(FILE *out, const char *title, const uint64_t *counts, int n, int depth) {
+    fprintf(out, "%s:\n", title);
+    bool shown[LF_NODE_TYPES * LF_NODE_TYPES * LF_NODE_TYPES] = { false };
+    for (int k = 0; k < REPORT_TOP; k++) {
+        int best = -1;
+        for (int i = 0; i < n; i++) {
+            if (!shown[i] && counts[i] > 0 && (best < 0 || counts[i] > counts[best])) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        shown[best] = true;
+        const char *names[3];
+        for (int d = depth - 1, i = best; d >= 0; d--, i /= LF_NODE_TYPES) {
+            names[d] = node_names[i % LF_NODE_TYPES];
+        }
+        fprintf(out, "  %12llu  %s", (unsigned long long)counts[best], names[0]);
+        for (int d = 1; d < depth; d++) {
+            fprintf(out, " > %s", names[d]);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+void lf_dispatch_report(lfState *L, FILE *out) {
+    uint64_t total = 0;
+    for (int i = 0; i < LF_NODE_TYPES; i++) {
+        total += L->dispatches[i];
+    }
+    fprintf(out, "%llu dispatches\n", (unsigned long long)total);
+    report_top(out, "node types", L->dispatches, LF_NODE_TYPES, 1);
+    report_top(out, "parent > child", &L->dispatch_pairs[0][0], LF_NODE_TYPES * LF_NODE_TYPES, 2);
+    report_top(out, "grandparent > parent > child", &L->dispatch_triples[0][0][0], LF_NODE_TYPES * LF_NODE_TYPES * LF_NODE_TYPES, 3);
+}
+#endif
+
+void lf_exec_chunk(lfState *L, lfChunk *chunk) {
+    lfValue *base = L->top;
+    if (L->nframes >= L->max_frames || base + chunk->nslots >= L->stack_end || c_stack_low(L)) {
+        lf_runtime_error(L, "stack overflow");
+    }
+    for (int i = 0; i < chunk->nslots; i++) {
+        base[i] = lf_null();
+    }
+    L->top = base + chunk->nslots;
+
+    lfValue *old_base = L->base;
+    lfFunction *old_closure = L->closure;
+    lfFrame *frame = &L->frames[L->nframes];
+    *frame = (lfFrame) {
+        .function = NULL,
+        .chunk = chunk,
+        .base = base,
+        .line = 1
+    };
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    L->nframes += 1;
+    L->frame = frame;
+    L->base = base;
+    L->closure = NULL;
+
+    /* a top level return ends the chunk */
+    lf_eval(L, chunk->ast);
+    L->returning = false;
+    L->retval = lf_null();
+
+    L->nframes -= 1;
+    L->frame = L->nframes > 0 ? &L->frames[L->nframes - 1] : NULL;
+    L->base = old_base;
+    L->closure = old_closure;
+    L->top = base;
+}
@@ -0,0 +1,232 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include "interp/gc.h"
+#include "interp/coro.h"
+#include "interp/state.h"
+#include "interp/value.h"
+#include "lib/alloc.h"
+#include "lib/array.h"
+
+void *lf_gc_alloc(lfState *L, lfValueType type, size_t size) {
+    lfObject *obj = lf_malloc(&L->allocator, size);
+    if (obj == NULL) {
+        lf_runtime_error(L, "out of memory");
+    }
+    obj->type = type;
+    obj->marked = false;
+    obj->next = L->objects;
+    L->objects = obj;
+    L->allocated += size;
+    return obj;
+}
+
+static void mark_object(lfState *L, lfObject *obj) {
+    if (obj == NULL || obj->marked) {
+        return;
+    }
+    obj->marked = true;
+    array_push(&L->gray, obj);
+}
+
+static void mark_value(lfState *L, lfValue v) {
+    if (is_object(v)) {
+        mark_object(L, v.as.o);
+    }
+}
+
+static void mark_values(lfState *L, const lfValue *values, int count) {
+    for (int i = 0; i < count; i++) {
+        mark_value(L, values[i]);
+    }
+}
+
+static void blacken(lfState *L, lfObject *obj) {
+    switch (obj->type) {
+        case LF_STRING:
+            mark_object(L, (lfObject *)((lfString *)obj)->left);
+            mark_object(L, (lfObject *)((lfString *)obj)->right);
+            break;
+        case LF_ARRAY: {
+            lfArrayObject *array = (lfArrayObject *)obj;
+            if (array->kind == AK_VALUE) {
+                mark_values(L, array->as.values, array->length);
+            }
+        } break;
+        case LF_MAP: {
+            lfMap *map = (lfMap *)obj;
+            for (int i = 0; i < map->count; i++) {
+                mark_value(L, map->entries[i].key);
+                mark_value(L, map->entries[i].value);
+            }
+        } break;
+        case LF_BOX:
+            mark_value(L, ((lfBox *)obj)->value);
+            break;
+        case LF_FUNCTION: {
+            lfFunction *f = (lfFunction *)obj;
+            for (int i = 0; i < f->ncaptures; i++) {
+                mark_object(L, (lfObject *)f->captures[i]);
+            }
+        } break;
+        case LF_METHOD: {
+            lfBoundMethod *m = (lfBoundMethod *)obj;
+            mark_value(L, m->receiver);
+            mark_object(L, (lfObject *)m->method);
+        } break;
+        case LF_CLASS: {
+            lfClass *cls = (lfClass *)obj;
+            mark_object(L, (lfObject *)cls->name);
+            mark_values(L, cls->field_defaults, length(&cls->field_defaults));
+            for (int i = 0; i < length(&cls->methods); i++) {
+                mark_object(L, (lfObject *)cls->methods[i]);
+            }
+        } break;
+        case LF_INSTANCE: {
+            lfInstance *instance = (lfInstance *)obj;
+            mark_object(L, (lfObject *)instance->cls);
+            mark_values(L, instance->fields, instance->nfields);
+        } break;
+        case LF_TASK:
+            mark_value(L, ((lfTask *)obj)->result);
+            break;
+        default:
+            break;
+    }
+}
+
+static size_t object_size(lfObject *obj) {
+    switch (obj->type) {
+        case LF_STRING: {
+            lfString *str = (lfString *)obj;
+            return str->chars == str->data ? sizeof(lfString) + str->length + 1 : sizeof(lfString);
+        }
+        case LF_ARRAY:
+            return sizeof(lfArrayObject);
+        case LF_MAP:
+            return sizeof(lfMap);
+        case LF_BOX:
+            return sizeof(lfBox);
+        case LF_FUNCTION:
+            return sizeof(lfFunction) + ((lfFunction *)obj)->ncaptures * sizeof(lfBox *);
+        case LF_METHOD:
+            return sizeof(lfBoundMethod);
+        case LF_CLASS:
+            return sizeof(lfClass);
+        case LF_INSTANCE:
+            return sizeof(lfInstance) + ((lfInstance *)obj)->nfields * sizeof(lfValue);
+        case LF_TASK:
+            return sizeof(lfTask);
+        default:
+            return 0;
+    }
+}
+
+static void free_object(lfState *L, lfObject *obj) {
+    size_t size = object_size(obj);
+    switch (obj->type) {
+        case LF_STRING: {
+            lfString *str = (lfString *)obj;
+            /* a flattened rope's characters */
+            if (str->chars != NULL && str->chars != str->data) {
+                lf_free(&L->allocator, (char *)str->chars, str->length + 1);
+                L->allocated -= str->length + 1;
+            }
+        } break;
+        case LF_ARRAY: {
+            lfArrayObject *array = (lfArrayObject *)obj;
+            size_t storage = array->capacity * (array->kind == AK_VALUE ? sizeof(lfValue) : sizeof(int64_t));
+            if (array->as.ints) {
+                lf_free(&L->allocator, array->as.ints, storage);
+                L->allocated -= storage;
+            }
+        } break;
+        case LF_MAP: {
+            lfMap *map = (lfMap *)obj;
+            if (map->entries) {
+                lf_free(&L->allocator, map->entries, map->capacity * sizeof(lfMapEntry));
+            }
+            if (map->ctrl) {
+                lf_free(&L->allocator, map->ctrl, map->nslots * (sizeof(uint8_t) + sizeof(int32_t)));
+            }
+            L->allocated -= lf_map_storage(map);
+        } break;
+        case LF_CLASS: {
+            lfClass *cls = (lfClass *)obj;
+            array_delete(&cls->field_names);
+            array_delete(&cls->field_defaults);
+            array_delete(&cls->field_types);
+            array_delete(&cls->methods);
+        } break;
+        default:
+            break;
+    }
+    L->allocated -= size;
+    lf_free(&L->allocator, obj, size);
+}
+
+static void mark_registers(lfState *L, const lfRegisters *regs) {
+    mark_values(L, regs->stack, regs->top - regs->stack);
+    mark_value(L, regs->retval);
+    for (int i = 0; i < regs->nframes; i++) {
+        mark_object(L, (lfObject *)regs->frames[i].function);
+    }
+}
+
+/* every coroutine is a root until it ends, and so is the main thread while one of them runs */
+static void mark_scheduler(lfState *L, lfScheduler *S) {
+    for (int i = 0; i < length(&S->live); i++) {
+        lfCoroutine *co = S->live[i];
+        mark_object(L, (lfObject *)co->task);
+        if (co != S->current) {
+            mark_registers(L, &co->regs);
+        }
+    }
+    if (S->current) {
+        mark_registers(L, &S->main);
+    }
+}
+
+void lf_gc_collect(lfState *L) {
+    /* roots */
+    mark_values(L, L->stack, L->top - L->stack);
+    mark_values(L, L->globals, length(&L->globals));
+    mark_object(L, (lfObject *)L->strings);
+    mark_value(L, L->retval);
+    for (int i = 0; i < L->nframes; i++) {
+        mark_object(L, (lfObject *)L->frames[i].function);
+    }
+    if (L->scheduler) {
+        mark_scheduler(L, L->scheduler);
+    }
+
+    while (length(&L->gray) > 0) {
+        lfObject *obj = L->gray[--length(&L->gray)];
+        blacken(L, obj);
+    }
+
+    lfObject **link = &L->objects;
+    while (*link) {
+        lfObject *obj = *link;
+        if (obj->marked) {
+            obj->marked = false;
+            link = &obj->next;
+        } else {
+            *link = obj->next;
+            free_object(L, obj);
+        }
+    }
+
+    L->next_gc = L->allocated * 2 > LF_GC_INITIAL ? L->allocated * 2 : LF_GC_INITIAL;
+}
+
+void lf_gc_free_all(lfState *L) {
+    lfObject *obj = L->objects;
+    while (obj) {
+        lfObject *next = obj->next;
+        free_object(L, obj);
+        obj = next;
+    }
+    L->objects = NULL;
+}
@@ -0,0 +1,149 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <string.h>
+
+#include "interp/inline.h"
+#include "interp/state.h"
+#include "interp/value.h"
+#include "parser/node.h"
+#include "lib/array.h"
+
+static int walk(lfNode *node, const lfFunctionNode *f, int depth);
+
+static int walk_nodes(lfArray(lfNode *) nodes, const lfFunctionNode *f, int depth) {
+    int n = 0;
+    for (int i = 0; i < length(&nodes) && n >= 0; i++) {
+        int size = walk(nodes[i], f, depth);
+        n = size < 0 ? -1 : n + size;
+    }
+    return n;
+}
+
+static int walk_pair(lfNode *a, lfNode *b, const lfFunctionNode *f, int depth) {
+    int lhs = walk(a, f, depth);
+    int rhs = lhs < 0 ? -1 : walk(b, f, depth);
+    return rhs < 0 ? -1 : 1 + lhs + rhs;
+}
+
+/* a local of the copy is one of the callee's parameters, which are never boxed when nothing captures them */
+static bool plain_ref(const lfVarRef *ref) {
+    return (ref->kind == VK_LOCAL && !ref->captured) || ref->kind == VK_GLOBAL;
+}
+
+/* whether call names f: f(...) or obj.f(...) */
+static bool calls_itself(lfCallNode *call, const lfFunctionNode *f) {
+    if (call->func->type == NT_VARACCESS) {
+        return !strcmp(((lfVarAccessNode *)call->func)->var.value, f->name.value);
+    }
+    if (call->func->type == NT_SUBSCRIBE) {
+        lfNode *index = ((lfSubscriptionNode *)call->func)->index;
+        return index->type == NT_STRING && !strcmp(((lfString *)((lfLiteralNode *)index)->constant.object)->chars, f->name.value);
+    }
+    return false;
+}
+
+/*
+ * the nodes in an expression of f, or -1 if it holds anything a copy in
+ * another frame could not run. with a depth, the calls in it are marked as
+ * being nested that many copies deep
+ */
+static int walk(lfNode *node, const lfFunctionNode *f, int depth) {
+    switch (node->type) {
+        case NT_INT:
+        case NT_FLOAT:
+        case NT_STRING:
+            return 1;
+        case NT_ARRAY: {
+            int n = walk_nodes(((lfArrayNode *)node)->values, f, depth);
+            return n < 0 ? -1 : 1 + n;
+        }
+        case NT_MAP: {
+            int keys = walk_nodes(((lfMapNode *)node)->keys, f, depth);
+            int values = keys < 0 ? -1 : walk_nodes(((lfMapNode *)node)->values, f, depth);
+            return values < 0 ? -1 : 1 + keys + values;
+        }
+        case NT_UNARYOP: {
+            int n = walk(((lfUnaryOpNode *)node)->value, f, depth);
+            return n < 0 ? -1 : 1 + n;
+        }
+        case NT_BINARYOP:
+            return walk_pair(((lfBinaryOpNode *)node)->lhs, ((lfBinaryOpNode *)node)->rhs, f, depth);
+        case NT_VARACCESS:
+            return plain_ref(&((lfVarAccessNode *)node)->ref) ? 1 : -1;
+        case NT_SUBSCRIBE:
+            return walk_pair(((lfSubscriptionNode *)node)->object, ((lfSubscriptionNode *)node)->index, f, depth);
+        case NT_ASSIGN: {
+            lfAssignNode *assign = (lfAssignNode *)node;
+            int n = plain_ref(&assign->ref) ? walk(assign->value, f, depth) : -1;
+            return n < 0 ? -1 : 1 + n;
+        }
+        case NT_OBJASSIGN: {
+            lfObjectAssignNode *assign = (lfObjectAssignNode *)node;
+            int n = walk_pair(assign->object, assign->key, f, depth);
+            int value = n < 0 ? -1 : walk(assign->value, f, depth);
+            return value < 0 ? -1 : n + value;
+        }
+        case NT_CALL: {
+            lfCallNode *call = (lfCallNode *)node;
+            if (calls_itself(call, f)) {
+                return -1;
+            }
+            if (depth > 0) {
+                call->inline_depth = depth;
+            }
+            int callee = walk(call->func, f, depth);
+            int args = callee < 0 ? -1 : walk_nodes(call->args, f, depth);
+            return args < 0 ? -1 : 1 + callee + args;
+        }
+        default:
+            /* declarations, control flow, and awaits, which would suspend in the middle of a copy */
+            return -1;
+    }
+}
+
+/* the expression a one statement body evaluates, NULL for a bare return */
+static lfNode *statement_value(lfNode *statement) {
+    return statement->type == NT_RETURN ? ((lfReturnNode *)statement)->value : statement;
+}
+
+bool lf_inlinable(lfFunctionNode *f) {
+    if (f->inlinable == 0 && !f->lazy) {
+        f->inlinable = -1;
+        bool captures = f->captures != NULL && length(&f->captures) > 0;
+        int nparams = length(&f->params) + (f->is_method ? 1 : 0);
+        if (!captures && f->nslots == nparams && length(&f->body) == 1) {
+            lfNode *value = statement_value(f->body[0]);
+            int size = value ? walk(value, f, 0) : 1;
+            if (size > 0 && size <= LF_INLINE_NODES) {
+                f->inlinable = 1;
+            }
+        }
+    }
+    return f->inlinable > 0;
+}
+
+bool lf_inline(lfState *L, lfCallNode *call, lfFunctionNode *target, lfFunctionNode *body, int argc) {
+    if (call->inline_depth >= LF_INLINE_DEPTH || call->inline_target != NULL || argc != body->nslots || !lf_inlinable(body)) {
+        return false;
+    }
+    int size = lf_node_count((lfNode *)body);
+    if (L->inlined_nodes + size > LF_INLINE_BUDGET) {
+        return false;
+    }
+    L->inlined_nodes += size;
+
+    lfFunctionNode *copy = (lfFunctionNode *)lf_node_clone(&L->parser->arena_allocator, (lfNode *)body);
+    if (copy->body[0]->type == NT_RETURN) {
+        /* the copy is never called, so it has no call for a frame to be handed over by */
+        ((lfReturnNode *)copy->body[0])->tail = false;
+    }
+    lfNode *value = statement_value(copy->body[0]);
+    if (value) {
+        walk(value, copy, call->inline_depth + 1);
+    }
+    call->inline_target = target;
+    call->inlined = copy;
+    return true;
+}
@@ -0,0 +1,510 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "interp/isolate.h"
+#include "interp/coro.h"
+#include "interp/jit.h"
+#include "interp/state.h"
+#include "interp/value.h"
+#include "lib/alloc.h"
+
+/* messages */
+
+static size_t encoded_size(lfState *L, lfValue v, int depth) {
+    switch (v.type) {
+        case LF_NULL:
+            return 1;
+        case LF_INT:
+        case LF_FLOAT:
+            return 1 + 8;
+        case LF_STRING:
+            return 1 + sizeof(int32_t) + as_string(v)->length;
+        case LF_ARRAY: {
+            if (depth >= LF_MESSAGE_DEPTH) {
+                lf_runtime_error(L, "cannot send values nested deeper than %d", LF_MESSAGE_DEPTH);
+            }
+            lfArrayObject *array = as_array(v);
+            size_t size = 1 + sizeof(int32_t);
+            for (int i = 0; i < array->length; i++) {
+                size += encoded_size(L, lf_array_get(array, i), depth + 1);
+            }
+            return size;
+        }
+        case LF_MAP: {
+            if (depth >= LF_MESSAGE_DEPTH) {
+                lf_runtime_error(L, "cannot send values nested deeper than %d", LF_MESSAGE_DEPTH);
+            }
+            lfMap *map = as_map(v);
+            size_t size = 1 + sizeof(int32_t);
+            for (int i = 0; i < map->count; i++) {
+                size += encoded_size(L, map->entries[i].key, depth + 1);
+                size += encoded_size(L, map->entries[i].value, depth + 1);
+            }
+            return size;
+        }
+        default:
+            lf_runtime_error(L, "cannot send %s", lf_type_name(v));
+    }
+}
+
+/* a type byte, then the payload; sizes were checked by encoded_size */
+static char *encode(lfState *L, char *out, lfValue v) {
+    *out++ = (char)v.type;
+    switch (v.type) {
+        case LF_INT:
+        case LF_FLOAT:
+            memcpy(out, &v.as, 8);
+            return out + 8;
+        case LF_STRING: {
+            lfString *str = as_string(v);
+            int32_t length = str->length;
+            memcpy(out, &length, sizeof(length));
+            memcpy(out + sizeof(length), lf_string_chars(L, str), length);
+            return out + sizeof(length) + length;
+        }
+        case LF_ARRAY: {
+            lfArrayObject *array = as_array(v);
+            int32_t length = array->length;
+            memcpy(out, &length, sizeof(length));
+            out += sizeof(length);
+            for (int i = 0; i < length; i++) {
+                out = encode(L, out, lf_array_get(array, i));
+            }
+            return out;
+        }
+        case LF_MAP: {
+            lfMap *map = as_map(v);
+            int32_t count = map->count;
+            memcpy(out, &count, sizeof(count));
+            out += sizeof(count);
+            for (int i = 0; i < count; i++) {
+                out = encode(L, out, map->entries[i].key);
+                out = encode(L, out, map->entries[i].value);
+            }
+            return out;
+        }
+        default:
+            return out;
+    }
+}
+
+/* rebuilds a value in L's heap; nothing here reaches a safepoint, so the parts need no rooting */
+static const char *decode(lfState *L, const char *in, lfValue *v) {
+    lfValueType type = (lfValueType)(unsigned char)*in++;
+    switch (type) {
+        case LF_INT:
+        case LF_FLOAT:
+            v->type = type;
+            memcpy(&v->as, in, 8);
+            return in + 8;
+        case LF_STRING: {
+            int32_t length;
+            memcpy(&length, in, sizeof(length));
+            in += sizeof(length);
+            *v = lf_obj(LF_STRING, lf_string_new(L, in, length));
+            return in + length;
+        }
+        case LF_ARRAY: {
+            int32_t length;
+            memcpy(&length, in, sizeof(length));
+            in += sizeof(length);
+            lfArrayObject *array = lf_array_new(L, length);
+            for (int i = 0; i < length; i++) {
+                lfValue element;
+                in = decode(L, in, &element);
+                lf_array_push(L, array, element);
+            }
+            *v = lf_obj(LF_ARRAY, array);
+            return in;
+        }
+        case LF_MAP: {
+            int32_t count;
+            memcpy(&count, in, sizeof(count));
+            in += sizeof(count);
+            lfMap *map = lf_map_new(L);
+            for (int i = 0; i < count; i++) {
+                lfValue key, value;
+                in = decode(L, in, &key);
+                in = decode(L, in, &value);
+                lf_map_set(L, map, key, value);
+            }
+            *v = lf_obj(LF_MAP, map);
+            return in;
+        }
+        default:
+            *v = lf_null();
+            return in;
+    }
+}
+
+#if LF_ISOLATE_SUPPORTED
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+/* the mailbox, after Dmitry Vyukov's intrusive MPSC queue */
+
+static void mailbox_init(lfMailbox *box) {
+    box->stub.next = NULL;
+    box->head = &box->stub;
+    box->tail = &box->stub;
+}
+
+static void mailbox_push(lfMailbox *box, lfMessage *message) {
+    __atomic_store_n(&message->next, NULL, __ATOMIC_RELAXED);
+    lfMessage *prev = __atomic_exchange_n(&box->head, message, __ATOMIC_ACQ_REL);
+    /* until this store the receiver sees the queue end at prev */
+    __atomic_store_n(&prev->next, message, __ATOMIC_RELEASE);
+}
+
+/* NULL when empty, and also while a sender is between its two steps; it wakes the receiver after them */
+static lfMessage *mailbox_pop(lfMailbox *box) {
+    lfMessage *tail = box->tail;
+    lfMessage *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &box->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        box->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        box->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&box->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    /* tail is the only message; the stub goes behind it so it can be taken */
+    mailbox_push(box, &box->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        box->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* waking */
+
+static bool open_wake(lfIsolate *I) {
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    I->wake[0] = fd;
+    I->wake[1] = fd;
+    return fd >= 0;
+#else
+    if (pipe(I->wake) != 0) {
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(I->wake[i], F_SETFL, fcntl(I->wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(I->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    return true;
+#endif
+}
+
+static void close_wake(lfIsolate *I) {
+    close(I->wake[0]);
+    if (I->wake[1] != I->wake[0]) {
+        close(I->wake[1]);
+    }
+}
+
+static void signal_wake(lfIsolate *I) {
+    uint64_t one = 1;
+    ssize_t written;
+    do {
+        written = write(I->wake[1], &one, sizeof(one));
+    } while (written < 0 && errno == EINTR);
+    /* a full pipe or counter already means a wakeup is pending */
+}
+
+static void drain_wake(lfIsolate *I) {
+    uint64_t buffer[8];
+    while (read(I->wake[0], buffer, sizeof(buffer)) > 0) {
+        continue;
+    }
+}
+
+/* the group */
+
+lfIsolateGroup *lf_isolate_group_new(const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, FILE *out) {
+    lfIsolateGroup *G = lf_malloc(allocator, sizeof(lfIsolateGroup));
+    if (G == NULL) {
+        return NULL;
+    }
+    memset(G, 0, sizeof(lfIsolateGroup));
+    G->allocator = *allocator;
+    G->diagnostics = *diagnostics;
+    G->out = out;
+    G->jit = LF_JIT_SUPPORTED;
+    G->inline_calls = true;
+    G->tail_calls = true;
+    G->optimize = true;
+    G->lazy = false;
+    G->shake = NULL;
+    G->count = 0;
+    return G;
+}
+
+/* reserves an id and sets up everything but the thread */
+static lfIsolate *isolate_new(lfIsolateGroup *G, const char *path) {
+    lfIsolate *I = lf_malloc(&G->allocator, sizeof(lfIsolate));
+    if (I == NULL) {
+        return NULL;
+    }
+    memset(I, 0, sizeof(lfIsolate));
+    if (!open_wake(I)) {
+        lf_free(&G->allocator, I, sizeof(lfIsolate));
+        return NULL;
+    }
+    I->group = G;
+    I->ok = true;
+    mailbox_init(&I->inbox);
+    if (path) {
+        size_t length = strlen(path);
+        I->path = lf_malloc(&G->allocator, length + 1);
+        memcpy(I->path, path, length + 1);
+    }
+
+    int id = __atomic_fetch_add(&G->count, 1, __ATOMIC_ACQ_REL);
+    if (id >= LF_MAX_ISOLATES) {
+        __atomic_fetch_sub(&G->count, 1, __ATOMIC_ACQ_REL);
+        if (I->path) {
+            lf_free(&G->allocator, I->path, strlen(I->path) + 1);
+        }
+        close_wake(I);
+        lf_free(&G->allocator, I, sizeof(lfIsolate));
+        return NULL;
+    }
+    I->id = id;
+    return I;
+}
+
+/* an id counts from the moment it is taken, but can only be sent to once published */
+static void publish(lfIsolateGroup *G, lfIsolate *I) {
+    __atomic_store_n(&G->isolates[I->id], I, __ATOMIC_RELEASE);
+}
+
+int lf_isolate_attach(lfIsolateGroup *G, lfState *L) {
+    lfIsolate *I = isolate_new(G, NULL);
+    if (I == NULL) {
+        return -1;
+    }
+    I->L = L;
+    L->isolate = I;
+    publish(G, I);
+    return I->id;
+}
+
+static void *isolate_main(void *arg) {
+    lfIsolate *I = arg;
+    lfIsolateGroup *G = I->group;
+    lfState *L = lf_state_new(&G->allocator, &G->diagnostics);
+    if (L == NULL) {
+        I->ok = false;
+        return NULL;
+    }
+    L->out = G->out;
+    L->jit = L->jit && G->jit;
+    L->inline_calls = G->inline_calls;
+    L->tail_calls = G->tail_calls;
+    L->optimize = G->optimize;
+    L->parser->lazy = G->lazy;
+    L->shake = G->shake;
+    L->isolate = I;
+    I->L = L;
+    I->ok = lf_run_file(L, I->path);
+    I->L = NULL;
+    lf_state_delete(L);
+    return NULL;
+}
+
+int lf_isolate_start(lfIsolateGroup *G, const char *path) {
+    lfIsolate *I = isolate_new(G, path);
+    if (I == NULL) {
+        return -1;
+    }
+    /* published first, so the new script can be sent to as soon as anyone knows its id */
+    publish(G, I);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LF_ISOLATE_CSTACK);
+    if (pthread_create(&I->thread, &attr, isolate_main, I) != 0) {
+        /* the id stays taken, by an isolate that failed at once */
+        I->ok = false;
+        lf_free(&G->allocator, I->path, strlen(I->path) + 1);
+        I->path = NULL;
+    }
+    pthread_attr_destroy(&attr);
+    return I->id;
+}
+
+bool lf_isolate_group_wait(lfIsolateGroup *G) {
+    bool ok = true;
+    /* isolates being waited for may start more, which get higher ids */
+    for (int id = 0; id < __atomic_load_n(&G->count, __ATOMIC_ACQUIRE); id++) {
+        lfIsolate *I;
+        while ((I = __atomic_load_n(&G->isolates[id], __ATOMIC_ACQUIRE)) == NULL) {
+            sched_yield(); /* taken but not yet published */
+        }
+        if (I->path) {
+            pthread_join(I->thread, NULL);
+        }
+        ok = ok && I->ok;
+    }
+    return ok;
+}
+
+void lf_isolate_group_delete(lfIsolateGroup *G) {
+    lfAllocator allocator = G->allocator;
+    for (int id = 0; id < G->count; id++) {
+        lfIsolate *I = G->isolates[id];
+        lfMessage *message;
+        while ((message = mailbox_pop(&I->inbox)) != NULL) {
+            lf_free(&allocator, message, sizeof(lfMessage) + message->size);
+        }
+        if (I->path) {
+            lf_free(&allocator, I->path, strlen(I->path) + 1);
+        }
+        if (I->L) {
+            I->L->isolate = NULL; /* an attached state may outlive its group */
+        }
+        close_wake(I);
+        lf_free(&allocator, I, sizeof(lfIsolate));
+    }
+    lf_free(&allocator, G, sizeof(lfIsolateGroup));
+}
+
+/* sending and receiving */
+
+void lf_isolate_send(lfState *L, int id, lfValue value) {
+    lfIsolate *self = L->isolate;
+    if (self == NULL) {
+        lf_runtime_error(L, "send() outside of an isolate group");
+    }
+    lfIsolateGroup *G = self->group;
+    lfIsolate *target = NULL;
+    if (id >= 0 && id < LF_MAX_ISOLATES) {
+        target = __atomic_load_n(&G->isolates[id], __ATOMIC_ACQUIRE);
+    }
+    if (target == NULL) {
+        lf_runtime_error(L, "no isolate %d", id);
+    }
+
+    /* sized first, so an unsendable value fails before anything is allocated */
+    size_t size = encoded_size(L, value, 0);
+    lfMessage *message = lf_malloc(&G->allocator, sizeof(lfMessage) + size);
+    if (message == NULL) {
+        lf_runtime_error(L, "out of memory");
+    }
+    message->size = size;
+    encode(L, (char *)(message + 1), value);
+
+    mailbox_push(&target->inbox, message);
+    /* pairs with the fence in lf_isolate_receive: either it sees the message or this sees it parked */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&target->parked, __ATOMIC_RELAXED) && __atomic_exchange_n(&target->parked, false, __ATOMIC_ACQ_REL)) {
+        signal_wake(target);
+    }
+}
+
+static void wait_wake(lfState *L, lfIsolate *I) {
+#ifdef __linux__
+    /* through the event loop, so the isolate's other coroutines keep running */
+    lf_coro_wait_fd(L, I->wake[0], false);
+#else
+    /* without epoll the loop cannot watch it, so the whole isolate blocks */
+    (void)L;
+    struct pollfd pfd = { .fd = I->wake[0], .events = POLLIN };
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+        continue;
+    }
+#endif
+}
+
+lfValue lf_isolate_receive(lfState *L) {
+    lfIsolate *I = L->isolate;
+    if (I == NULL) {
+        lf_runtime_error(L, "receive() outside of an isolate group");
+    }
+    if (I->receiving) {
+        lf_runtime_error(L, "receive() is already waiting in another coroutine");
+    }
+    lfMessage *message;
+    while ((message = mailbox_pop(&I->inbox)) == NULL) {
+        __atomic_store_n(&I->parked, true, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        message = mailbox_pop(&I->inbox);
+        if (message != NULL) {
+            __atomic_store_n(&I->parked, false, __ATOMIC_RELAXED);
+            break;
+        }
+        I->receiving = true;
+        wait_wake(L, I);
+        I->receiving = false;
+        drain_wake(I);
+    }
+    lfValue value;
+    decode(L, (const char *)(message + 1), &value);
+    lf_free(&I->group->allocator, message, sizeof(lfMessage) + message->size);
+    return value;
+}
+
+#else
+
+lfIsolateGroup *lf_isolate_group_new(const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, FILE *out) {
+    (void)allocator;
+    (void)diagnostics;
+    (void)out;
+    return NULL;
+}
+
+int lf_isolate_attach(lfIsolateGroup *G, lfState *L) {
+    (void)G;
+    (void)L;
+    return -1;
+}
+
+int lf_isolate_start(lfIsolateGroup *G, const char *path) {
+    (void)G;
+    (void)path;
+    return -1;
+}
+
+bool lf_isolate_group_wait(lfIsolateGroup *G) {
+    (void)G;
+    return true;
+}
+
+void lf_isolate_group_delete(lfIsolateGroup *G) {
+    (void)G;
+}
+
+void lf_isolate_send(lfState *L, int id, lfValue value) {
+    (void)id;
+    (void)value;
+    (void)encode;
+    lf_runtime_error(L, "isolates are not supported here");
+}
+
+lfValue lf_isolate_receive(lfState *L) {
+    (void)decode;
+    lf_runtime_error(L, "isolates are not supported here");
+}
+
+#endif /* LF_ISOLATE_SUPPORTED */
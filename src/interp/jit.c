@@ -0,0 +1,1193 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interp/jit.h"
+#include "interp/eval.h"
+#include "interp/gc.h"
+#include "interp/state.h"
+#include "interp/value.h"
+#include "parser/node.h"
+#include "lib/alloc.h"
+#include "lib/array.h"
+
+#if LF_JIT_SUPPORTED
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * register use: rbx holds L, r12 the frame's slots (L->base) and r13 the
+ * frame (L->frame). every expression leaves its value in eax (type) and rdx
+ * (payload), the same two registers an lfValue is returned in, so helpers
+ * returning one need no shuffling. temporaries live in the native frame
+ * unless a collection may happen before they are used, in which case they
+ * go on the value stack like the evaluators' do
+ */
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { XMM0, XMM1 };
+
+/* condition codes; flipping the low bit negates one */
+enum {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+    CC_P = 0xa, CC_NP = 0xb, CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf,
+    CC_ALWAYS = -1
+};
+
+#define SAVED_REGISTERS 5 /* rbp, rbx, r12, r13, r14 */
+#define LINE_STORE 11 /* bytes of mov dword [r13 + disp32], imm32, which position tables replace */
+
+typedef struct lfJit {
+    lfState *L;
+    lfArray(uint8_t) code;
+    lfArray(int) exits; /* jumps to the epilogue */
+    int temps; /* native temporaries in use, in eightbytes */
+    int max_temps;
+    int spills; /* values pushed on the value stack */
+    int max_spills;
+    int frame_size_at[2]; /* prologue and epilogue stack adjustments */
+    int spill_check_at;
+    int info_at; /* the lfCodeInfo pointer the prologue stores into the frame */
+    lfArray(uint8_t) positions; /* see lfCodeInfo */
+    int statements;
+    int frame_code;
+    int position_offset; /* where the latest statement starts, and its line */
+    int position_line;
+} lfJit;
+
+/* encoding */
+
+static void emit(lfJit *J, uint8_t byte) {
+    array_push(&J->code, byte);
+}
+
+static void emit32(lfJit *J, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        emit(J, (uint8_t)(v >> (i * 8)));
+    }
+}
+
+static void emit64(lfJit *J, uint64_t v) {
+    emit32(J, (uint32_t)v);
+    emit32(J, (uint32_t)(v >> 32));
+}
+
+static void put32(lfJit *J, int at, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        J->code[at + i] = (uint8_t)(v >> (i * 8));
+    }
+}
+
+static inline int here(lfJit *J) {
+    return length(&J->code);
+}
+
+static void rex(lfJit *J, bool w, int reg, int rm) {
+    uint8_t prefix = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (prefix != 0x40) {
+        emit(J, prefix);
+    }
+}
+
+static void modrm_reg(lfJit *J, int reg, int rm) {
+    emit(J, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* [base + disp32] */
+static void modrm_mem(lfJit *J, int reg, int base, int32_t disp) {
+    emit(J, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit(J, 0x24);
+    }
+    emit32(J, (uint32_t)disp);
+}
+
+/* op r/m64, r64: add 01, or 09, and 21, sub 29, xor 31, cmp 39, test 85, mov 89 */
+static void op_rr(lfJit *J, uint8_t op, int dst, int src) {
+    rex(J, true, src, dst);
+    emit(J, op);
+    modrm_reg(J, src, dst);
+}
+
+static void mov_rr(lfJit *J, int dst, int src) {
+    op_rr(J, 0x89, dst, src);
+}
+
+static void load(lfJit *J, bool wide, int dst, int base, int32_t disp) {
+    rex(J, wide, dst, base);
+    emit(J, 0x8b);
+    modrm_mem(J, dst, base, disp);
+}
+
+static void store(lfJit *J, bool wide, int base, int32_t disp, int src) {
+    rex(J, wide, src, base);
+    emit(J, 0x89);
+    modrm_mem(J, src, base, disp);
+}
+
+static void store_imm8(lfJit *J, int base, int32_t disp, uint8_t imm) {
+    rex(J, false, 0, base);
+    emit(J, 0xc6);
+    modrm_mem(J, 0, base, disp);
+    emit(J, imm);
+}
+
+/* add (ext 0) or sub (ext 5) an imm8 to a qword in memory */
+static void arith_mem_imm8(lfJit *J, int ext, int base, int32_t disp, int8_t imm) {
+    rex(J, true, 0, base);
+    emit(J, 0x83);
+    modrm_mem(J, ext, base, disp);
+    emit(J, (uint8_t)imm);
+}
+
+/* mov reg, [base + index * 8 + disp8] */
+static void load_indexed(lfJit *J, bool wide, int dst, int base, int index, int8_t disp) {
+    emit(J, 0x40 | (wide << 3) | ((dst >> 3) << 2) | ((index >> 3) << 1) | (base >> 3));
+    emit(J, 0x8b);
+    emit(J, 0x44 | ((dst & 7) << 3));
+    emit(J, 0xc0 | ((index & 7) << 3) | (base & 7));
+    emit(J, (uint8_t)disp);
+}
+
+/* cmp dword [base + disp32], imm32 */
+static void cmp_mem_imm32(lfJit *J, int base, int32_t disp, uint32_t imm) {
+    rex(J, false, 0, base);
+    emit(J, 0x81);
+    modrm_mem(J, 7, base, disp);
+    emit32(J, imm);
+}
+
+static void cmp_mem(lfJit *J, int reg, int base, int32_t disp) {
+    rex(J, true, reg, base);
+    emit(J, 0x3b);
+    modrm_mem(J, reg, base, disp);
+}
+
+static void mov_imm(lfJit *J, int reg, uint64_t imm) {
+    if (imm <= UINT32_MAX) {
+        rex(J, false, 0, reg);
+        emit(J, 0xb8 + (reg & 7));
+        emit32(J, (uint32_t)imm);
+    } else {
+        rex(J, true, 0, reg);
+        emit(J, 0xb8 + (reg & 7));
+        emit64(J, imm);
+    }
+}
+
+/* cmp r32, imm32, for value types */
+static void cmp_imm32(lfJit *J, int reg, uint32_t imm) {
+    rex(J, false, 0, reg);
+    emit(J, 0x81);
+    modrm_reg(J, 7, reg);
+    emit32(J, imm);
+}
+
+static void imul_rr(lfJit *J, int dst, int src) {
+    rex(J, true, dst, src);
+    emit(J, 0x0f);
+    emit(J, 0xaf);
+    modrm_reg(J, dst, src);
+}
+
+/* neg (ext 3) */
+static void unary_r(lfJit *J, int ext, int reg) {
+    rex(J, true, 0, reg);
+    emit(J, 0xf7);
+    modrm_reg(J, ext, reg);
+}
+
+/* shl (ext 4) or sar (ext 7) by cl */
+static void shift_cl(lfJit *J, int ext, int reg) {
+    rex(J, true, 0, reg);
+    emit(J, 0xd3);
+    modrm_reg(J, ext, reg);
+}
+
+/* setcc into the low byte of rax, rcx, rdx or rbx, zero extended to 32 bits */
+static void setcc(lfJit *J, int cc, int reg) {
+    emit(J, 0x0f);
+    emit(J, 0x90 | cc);
+    modrm_reg(J, 0, reg);
+    emit(J, 0x0f);
+    emit(J, 0xb6);
+    modrm_reg(J, reg, reg);
+}
+
+static void movq_to_xmm(lfJit *J, int xmm, int reg) {
+    emit(J, 0x66);
+    rex(J, true, xmm, reg);
+    emit(J, 0x0f);
+    emit(J, 0x6e);
+    modrm_reg(J, xmm, reg);
+}
+
+static void movq_from_xmm(lfJit *J, int reg, int xmm) {
+    emit(J, 0x66);
+    rex(J, true, xmm, reg);
+    emit(J, 0x0f);
+    emit(J, 0x7e);
+    modrm_reg(J, xmm, reg);
+}
+
+/* addsd 58, mulsd 59, subsd 5c, divsd 5e with prefix f2; ucomisd 2e with prefix 66 */
+static void sse_rr(lfJit *J, uint8_t prefix, uint8_t op, int dst, int src) {
+    emit(J, prefix);
+    emit(J, 0x0f);
+    emit(J, op);
+    modrm_reg(J, dst, src);
+}
+
+static void push(lfJit *J, int reg) {
+    rex(J, false, 0, reg);
+    emit(J, 0x50 + (reg & 7));
+}
+
+static void pop(lfJit *J, int reg) {
+    rex(J, false, 0, reg);
+    emit(J, 0x58 + (reg & 7));
+}
+
+/* sub rsp (ext 5) or add rsp (ext 0) with an imm32 patched in later */
+static int adjust_rsp(lfJit *J, int ext) {
+    rex(J, true, 0, RSP);
+    emit(J, 0x81);
+    modrm_reg(J, ext, RSP);
+    int at = here(J);
+    emit32(J, 0);
+    return at;
+}
+
+static void call(lfJit *J, void *fn) {
+    rex(J, true, 0, R11);
+    emit(J, 0xb8 + (R11 & 7));
+    emit64(J, (uint64_t)(uintptr_t)fn);
+    rex(J, false, 0, R11);
+    emit(J, 0xff);
+    modrm_reg(J, 2, R11);
+}
+
+/* a jump with its target left open; returns where to patch it */
+static int jump(lfJit *J, int cc) {
+    if (cc == CC_ALWAYS) {
+        emit(J, 0xe9);
+    } else {
+        emit(J, 0x0f);
+        emit(J, 0x80 | cc);
+    }
+    int at = here(J);
+    emit32(J, 0);
+    return at;
+}
+
+static void patch(lfJit *J, int at, int target) {
+    put32(J, at, (uint32_t)(target - (at + 4)));
+}
+
+static void jump_to(lfJit *J, int cc, int target) {
+    patch(J, jump(J, cc), target);
+}
+
+/* runtime helpers */
+
+static void jit_stack_overflow(lfState *L) {
+    lf_runtime_error(L, "stack overflow");
+}
+
+static void jit_undefined(lfState *L, const char *name) {
+    lf_runtime_error(L, "undefined variable '%s'", name);
+}
+
+static int64_t jit_int_div(lfState *L, int64_t a, int64_t b) {
+    if (b == 0) {
+        lf_runtime_error(L, "integer division by zero");
+    }
+    return b == -1 ? (int64_t)(0 - (uint64_t)a) : a / b;
+}
+
+/* values */
+
+#define SLOT(I) ((int32_t)((I) * sizeof(lfValue)))
+#define TYPE_AT(DISP) (DISP)
+#define PAYLOAD_AT(DISP) ((DISP) + (int32_t)offsetof(lfValue, as))
+#define STATE(FIELD) ((int32_t)offsetof(lfState, FIELD))
+
+static void load_value(lfJit *J, int base, int32_t disp) {
+    load(J, false, RAX, base, TYPE_AT(disp));
+    load(J, true, RDX, base, PAYLOAD_AT(disp));
+}
+
+static void store_value(lfJit *J, int base, int32_t disp) {
+    store(J, false, base, TYPE_AT(disp), RAX);
+    store(J, true, base, PAYLOAD_AT(disp), RDX);
+}
+
+static void set_value(lfJit *J, lfValueType type, uint64_t payload) {
+    mov_imm(J, RAX, type);
+    if (payload == 0) {
+        op_rr(J, 0x31, RDX, RDX);
+    } else {
+        mov_imm(J, RDX, payload);
+    }
+}
+
+static int temp(lfJit *J, int n) {
+    int at = J->temps;
+    J->temps += n;
+    if (J->temps > J->max_temps) {
+        J->max_temps = J->temps;
+    }
+    return at * 8;
+}
+
+/* sets ZF when the value in eax:rdx is falsy */
+static void test_truthy(lfJit *J) {
+    cmp_imm32(J, RAX, LF_INT);
+    int slow = jump(J, CC_NE);
+    op_rr(J, 0x85, RDX, RDX);
+    int done = jump(J, CC_ALWAYS);
+    patch(J, slow, here(J));
+    mov_rr(J, RDI, RAX);
+    mov_rr(J, RSI, RDX);
+    call(J, (void *)lf_value_truthy);
+    emit(J, 0x84); /* test al, al */
+    modrm_reg(J, RAX, RAX);
+    patch(J, done, here(J));
+}
+
+/* whether evaluating node may call a function, and so collect */
+static bool may_collect(lfNode *node) {
+    switch (node->type) {
+        case NT_CALL:
+        case NT_AWAIT: /* other coroutines run meanwhile */
+            return true;
+        case NT_UNARYOP:
+            return may_collect(((lfUnaryOpNode *)node)->value);
+        case NT_BINARYOP:
+            return may_collect(((lfBinaryOpNode *)node)->lhs) || may_collect(((lfBinaryOpNode *)node)->rhs);
+        case NT_ASSIGN:
+            return may_collect(((lfAssignNode *)node)->value);
+        case NT_SUBSCRIBE:
+            return may_collect(((lfSubscriptionNode *)node)->object) || may_collect(((lfSubscriptionNode *)node)->index);
+        case NT_OBJASSIGN: {
+            lfObjectAssignNode *assign = (lfObjectAssignNode *)node;
+            return may_collect(assign->object) || may_collect(assign->key) || may_collect(assign->value);
+        }
+        case NT_ARRAY: {
+            lfArrayNode *arr = (lfArrayNode *)node;
+            for (int i = 0; i < length(&arr->values); i++) {
+                if (may_collect(arr->values[i])) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        case NT_MAP: {
+            lfMapNode *map = (lfMapNode *)node;
+            for (int i = 0; i < length(&map->keys); i++) {
+                if (may_collect(map->keys[i]) || may_collect(map->values[i])) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        default:
+            return false;
+    }
+}
+
+/* positions */
+
+static void position_varint(lfJit *J, uint32_t v) {
+    while (v >= 0x80) {
+        array_push(&J->positions, (uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    array_push(&J->positions, (uint8_t)v);
+}
+
+/* the code from here until the next statement's is for one on line */
+static void position(lfJit *J, int line) {
+    int delta = line - J->position_line;
+    position_varint(J, (uint32_t)(here(J) - J->position_offset));
+    position_varint(J, delta < 0 ? ((uint32_t)-delta << 1) - 1 : (uint32_t)delta << 1);
+    J->position_offset = here(J);
+    J->position_line = line;
+    J->statements += 1;
+}
+
+/* expressions */
+
+static void compile_expr(lfJit *J, lfNode *node);
+
+static void fallback(lfJit *J, lfNode *node) {
+    mov_rr(J, RDI, RBX);
+    mov_imm(J, RSI, (uint64_t)(uintptr_t)node);
+    call(J, (void *)lf_evaluators[node->type]);
+}
+
+static bool compilable_ref(const lfVarRef *ref) {
+    return ref->kind == VK_LOCAL || ref->kind == VK_UPVALUE || ref->kind == VK_GLOBAL;
+}
+
+/* leaves the box a captured variable lives in in rcx */
+static void load_box(lfJit *J, const lfVarRef *ref) {
+    if (ref->kind == VK_LOCAL) {
+        load(J, true, RCX, R12, PAYLOAD_AT(SLOT(ref->slot)));
+    } else {
+        load(J, true, RCX, RBX, STATE(closure));
+        load(J, true, RCX, RCX, (int32_t)(offsetof(lfFunction, captures) + ref->slot * sizeof(lfBox *)));
+    }
+}
+
+static void load_var(lfJit *J, const lfVarRef *ref, const char *name) {
+    if (ref->kind == VK_GLOBAL) {
+        load(J, true, RCX, RBX, STATE(globals));
+        load_value(J, RCX, SLOT(ref->slot));
+        op_rr(J, 0x85, RAX, RAX); /* LF_UNDEFINED is 0 */
+        int defined = jump(J, CC_NE);
+        mov_rr(J, RDI, RBX);
+        mov_imm(J, RSI, (uint64_t)(uintptr_t)name);
+        call(J, (void *)jit_undefined);
+        patch(J, defined, here(J));
+    } else if (ref->kind == VK_LOCAL && !ref->captured) {
+        load_value(J, R12, SLOT(ref->slot));
+    } else {
+        load_box(J, ref);
+        load_value(J, RCX, (int32_t)offsetof(lfBox, value));
+    }
+}
+
+static void store_var(lfJit *J, const lfVarRef *ref) {
+    if (ref->kind == VK_GLOBAL) {
+        load(J, true, RCX, RBX, STATE(globals));
+        store_value(J, RCX, SLOT(ref->slot));
+    } else if (ref->kind == VK_LOCAL && !ref->captured) {
+        store_value(J, R12, SLOT(ref->slot));
+    } else {
+        load_box(J, ref);
+        store_value(J, RCX, (int32_t)offsetof(lfBox, value));
+    }
+}
+
+static int int_condition(lfTokenType op) {
+    switch (op) {
+        case TT_EQ: return CC_E;
+        case TT_NE: return CC_NE;
+        case TT_LT: return CC_L;
+        case TT_GT: return CC_G;
+        case TT_LE: return CC_LE;
+        case TT_GE: return CC_GE;
+        default: return CC_ALWAYS;
+    }
+}
+
+/* the ordered float comparisons, after ucomisd of the operands, swapped when *swap is set */
+static int float_condition(lfTokenType op, bool *swap) {
+    *swap = op == TT_LT || op == TT_LE;
+    switch (op) {
+        case TT_GT:
+        case TT_LT:
+            return CC_A;
+        case TT_GE:
+        case TT_LE:
+            return CC_AE;
+        default:
+            return CC_ALWAYS;
+    }
+}
+
+/* rdx = rcx op r9, false if op has no inline form */
+static bool int_op(lfJit *J, lfTokenType op) {
+    int cc = int_condition(op);
+    if (cc != CC_ALWAYS) {
+        op_rr(J, 0x39, RCX, R9);
+        setcc(J, cc, RDX);
+        return true;
+    }
+    switch (op) {
+        case TT_ADD:
+            mov_rr(J, RDX, RCX);
+            op_rr(J, 0x01, RDX, R9);
+            return true;
+        case TT_SUB:
+            mov_rr(J, RDX, RCX);
+            op_rr(J, 0x29, RDX, R9);
+            return true;
+        case TT_MUL:
+            mov_rr(J, RDX, RCX);
+            imul_rr(J, RDX, R9);
+            return true;
+        case TT_LSHIFT:
+        case TT_RSHIFT:
+            /* the hardware masks the count to 6 bits, like the evaluator does */
+            mov_rr(J, RDX, RCX);
+            mov_rr(J, RCX, R9);
+            shift_cl(J, op == TT_LSHIFT ? 4 : 7, RDX);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* evaluates both operands of a proven binary op, leaving their payloads in rcx and r9 */
+static void compile_operands(lfJit *J, lfBinaryOpNode *binop) {
+    compile_expr(J, binop->lhs);
+    int t = temp(J, 1);
+    store(J, true, RSP, t, RDX);
+    compile_expr(J, binop->rhs);
+    mov_rr(J, R9, RDX);
+    load(J, true, RCX, RSP, t);
+    J->temps -= 1;
+}
+
+static bool compile_int_binop(lfJit *J, lfBinaryOpNode *binop) {
+    lfTokenType op = binop->op.type;
+    if (int_condition(op) == CC_ALWAYS && op != TT_ADD && op != TT_SUB && op != TT_MUL && op != TT_DIV && op != TT_LSHIFT && op != TT_RSHIFT) {
+        return false;
+    }
+    compile_operands(J, binop);
+    if (op == TT_DIV) {
+        mov_rr(J, RDI, RBX);
+        mov_rr(J, RSI, RCX);
+        mov_rr(J, RDX, R9);
+        call(J, (void *)jit_int_div);
+        mov_rr(J, RDX, RAX);
+    } else {
+        int_op(J, op);
+    }
+    mov_imm(J, RAX, LF_INT);
+    return true;
+}
+
+static bool compile_float_binop(lfJit *J, lfBinaryOpNode *binop) {
+    lfTokenType op = binop->op.type;
+    uint8_t sse = op == TT_ADD ? 0x58 : op == TT_MUL ? 0x59 : op == TT_SUB ? 0x5c : op == TT_DIV ? 0x5e : 0;
+    bool swap;
+    int cc = float_condition(op, &swap);
+    if (sse == 0 && cc == CC_ALWAYS && op != TT_EQ && op != TT_NE) {
+        return false;
+    }
+    compile_operands(J, binop);
+    movq_to_xmm(J, XMM0, RCX);
+    movq_to_xmm(J, XMM1, R9);
+    if (sse) {
+        sse_rr(J, 0xf2, sse, XMM0, XMM1);
+        movq_from_xmm(J, RDX, XMM0);
+        mov_imm(J, RAX, LF_FLOAT);
+        return true;
+    }
+    if (op == TT_EQ || op == TT_NE) {
+        /* unordered operands compare unequal */
+        sse_rr(J, 0x66, 0x2e, XMM0, XMM1);
+        setcc(J, op == TT_EQ ? CC_E : CC_NE, RDX);
+        setcc(J, op == TT_EQ ? CC_NP : CC_P, RCX);
+        op_rr(J, op == TT_EQ ? 0x21 : 0x09, RDX, RCX);
+    } else {
+        sse_rr(J, 0x66, 0x2e, swap ? XMM1 : XMM0, swap ? XMM0 : XMM1);
+        setcc(J, cc, RDX);
+    }
+    mov_imm(J, RAX, LF_INT);
+    return true;
+}
+
+/* evaluates two operands as full values, leaving the first in edx:rcx and the second in r8d:r9 */
+static void compile_pair(lfJit *J, lfNode *lhs, lfNode *rhs) {
+    compile_expr(J, lhs);
+    bool spill = may_collect(rhs);
+    int t = 0;
+    if (spill) {
+        /* the collector only sees the value stack */
+        load(J, true, RCX, RBX, STATE(top));
+        store_value(J, RCX, 0);
+        arith_mem_imm8(J, 0, RBX, STATE(top), sizeof(lfValue));
+        if (++J->spills > J->max_spills) {
+            J->max_spills = J->spills;
+        }
+    } else {
+        t = temp(J, 2);
+        store_value(J, RSP, t);
+    }
+    compile_expr(J, rhs);
+    mov_rr(J, R8, RAX);
+    mov_rr(J, R9, RDX);
+    if (spill) {
+        arith_mem_imm8(J, 5, RBX, STATE(top), sizeof(lfValue));
+        load(J, true, RCX, RBX, STATE(top));
+        load(J, false, RDX, RCX, TYPE_AT(0));
+        load(J, true, RCX, RCX, PAYLOAD_AT(0));
+        J->spills -= 1;
+    } else {
+        load(J, false, RDX, RSP, TYPE_AT(t));
+        load(J, true, RCX, RSP, PAYLOAD_AT(t));
+        J->temps -= 2;
+    }
+}
+
+/* both operands as full values, with an inline path for two ints */
+static void compile_generic_binop(lfJit *J, lfBinaryOpNode *binop) {
+    compile_pair(J, binop->lhs, binop->rhs);
+
+    /* lf_arith(L, op, a = edx:rcx, b = r8d:r9) */
+    lfTokenType op = binop->op.type;
+    int slow[2] = { -1, -1 };
+    int done = -1;
+    if (op != TT_DIV) {
+        cmp_imm32(J, RDX, LF_INT);
+        slow[0] = jump(J, CC_NE);
+        cmp_imm32(J, R8, LF_INT);
+        slow[1] = jump(J, CC_NE);
+        if (int_op(J, op)) {
+            mov_imm(J, RAX, LF_INT);
+            done = jump(J, CC_ALWAYS);
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (slow[i] >= 0) {
+            patch(J, slow[i], here(J));
+        }
+    }
+    mov_rr(J, RDI, RBX);
+    mov_imm(J, RSI, op);
+    call(J, (void *)lf_arith);
+    if (done >= 0) {
+        patch(J, done, here(J));
+    }
+}
+
+/* array[int] reads the element in place, whatever the array's storage; anything else calls lf_index */
+static void compile_subscript(lfJit *J, lfSubscriptionNode *sub) {
+    compile_pair(J, sub->object, sub->index);
+    cmp_imm32(J, RDX, LF_ARRAY);
+    int slow[3];
+    slow[0] = jump(J, CC_NE);
+    cmp_imm32(J, R8, LF_INT);
+    slow[1] = jump(J, CC_NE);
+    load(J, false, R10, RCX, (int32_t)offsetof(lfArrayObject, length));
+    op_rr(J, 0x39, R9, R10); /* unsigned, so negative indices fail too */
+    slow[2] = jump(J, CC_AE);
+    load(J, true, R10, RCX, (int32_t)offsetof(lfArrayObject, as));
+    int done[3];
+    cmp_mem_imm32(J, RCX, (int32_t)offsetof(lfArrayObject, kind), AK_INT);
+    int not_ints = jump(J, CC_NE);
+    load_indexed(J, true, RDX, R10, R9, 0);
+    mov_imm(J, RAX, LF_INT);
+    done[0] = jump(J, CC_ALWAYS);
+    patch(J, not_ints, here(J));
+    cmp_mem_imm32(J, RCX, (int32_t)offsetof(lfArrayObject, kind), AK_FLOAT);
+    int not_floats = jump(J, CC_NE);
+    load_indexed(J, true, RDX, R10, R9, 0);
+    mov_imm(J, RAX, LF_FLOAT);
+    done[1] = jump(J, CC_ALWAYS);
+    patch(J, not_floats, here(J));
+    /* tagged values are two eightbytes each */
+    op_rr(J, 0x01, R9, R9);
+    load_indexed(J, false, RAX, R10, R9, TYPE_AT(0));
+    load_indexed(J, true, RDX, R10, R9, PAYLOAD_AT(0));
+    done[2] = jump(J, CC_ALWAYS);
+
+    /* lf_index(L, object = esi:rdx, index = ecx:r8) */
+    for (int i = 0; i < 3; i++) {
+        patch(J, slow[i], here(J));
+    }
+    mov_rr(J, RSI, RDX);
+    mov_rr(J, RDX, RCX);
+    mov_rr(J, RCX, R8);
+    mov_rr(J, R8, R9);
+    mov_rr(J, RDI, RBX);
+    call(J, (void *)lf_index);
+    for (int i = 0; i < 3; i++) {
+        patch(J, done[i], here(J));
+    }
+}
+
+static void compile_binop(lfJit *J, lfBinaryOpNode *binop) {
+    if (binop->operands == TS_INT && compile_int_binop(J, binop)) {
+        return;
+    }
+    if (binop->operands == TS_FLOAT && compile_float_binop(J, binop)) {
+        return;
+    }
+    compile_generic_binop(J, binop);
+}
+
+static void compile_unop(lfJit *J, lfUnaryOpNode *unop) {
+    if (unop->op.type == TT_NOT) {
+        compile_expr(J, unop->value);
+        test_truthy(J);
+        setcc(J, CC_E, RDX);
+        mov_imm(J, RAX, LF_INT);
+    } else if (unop->operand == TS_INT) {
+        compile_expr(J, unop->value);
+        unary_r(J, 3, RDX);
+        mov_imm(J, RAX, LF_INT);
+    } else if (unop->operand == TS_FLOAT) {
+        compile_expr(J, unop->value);
+        mov_imm(J, RCX, (uint64_t)1 << 63);
+        op_rr(J, 0x31, RDX, RCX);
+        mov_imm(J, RAX, LF_FLOAT);
+    } else {
+        fallback(J, (lfNode *)unop);
+    }
+}
+
+static void compile_expr(lfJit *J, lfNode *node) {
+    switch (node->type) {
+        case NT_INT:
+            set_value(J, LF_INT, (uint64_t)((lfLiteralNode *)node)->constant.i);
+            return;
+        case NT_FLOAT: {
+            uint64_t bits;
+            memcpy(&bits, &((lfLiteralNode *)node)->constant.f, sizeof(bits));
+            set_value(J, LF_FLOAT, bits);
+            return;
+        }
+        case NT_STRING:
+            set_value(J, LF_STRING, (uint64_t)(uintptr_t)((lfLiteralNode *)node)->constant.object);
+            return;
+        case NT_VARACCESS: {
+            lfVarAccessNode *access = (lfVarAccessNode *)node;
+            if (compilable_ref(&access->ref)) {
+                load_var(J, &access->ref, access->var.value);
+                return;
+            }
+        } break;
+        case NT_UNARYOP:
+            compile_unop(J, (lfUnaryOpNode *)node);
+            return;
+        case NT_BINARYOP:
+            compile_binop(J, (lfBinaryOpNode *)node);
+            return;
+        case NT_SUBSCRIBE:
+            compile_subscript(J, (lfSubscriptionNode *)node);
+            return;
+        case NT_ASSIGN: {
+            lfAssignNode *assign = (lfAssignNode *)node;
+            if (assign->guard == 0 && compilable_ref(&assign->ref)) {
+                compile_expr(J, assign->value);
+                store_var(J, &assign->ref);
+                return;
+            }
+        } break;
+        default:
+            break;
+    }
+    fallback(J, node);
+}
+
+/* statements */
+
+static void compile_statement(lfJit *J, lfNode *node);
+
+static void compile_block(lfJit *J, lfNode *node) {
+    if (node->type != NT_COMPOUND) {
+        compile_statement(J, node);
+        return;
+    }
+    lfCompoundNode *comp = (lfCompoundNode *)node;
+    for (int i = 0; i < length(&comp->statements); i++) {
+        compile_statement(J, comp->statements[i]);
+    }
+}
+
+/* evaluates a condition, returning the jump taken when it is false */
+static int compile_condition(lfJit *J, lfNode *node) {
+    if (node->type == NT_BINARYOP) {
+        lfBinaryOpNode *binop = (lfBinaryOpNode *)node;
+        bool swap;
+        int cc;
+        if (binop->operands == TS_INT && (cc = int_condition(binop->op.type)) != CC_ALWAYS) {
+            compile_operands(J, binop);
+            op_rr(J, 0x39, RCX, R9);
+            return jump(J, cc ^ 1);
+        }
+        if (binop->operands == TS_FLOAT && (cc = float_condition(binop->op.type, &swap)) != CC_ALWAYS) {
+            compile_operands(J, binop);
+            movq_to_xmm(J, XMM0, RCX);
+            movq_to_xmm(J, XMM1, R9);
+            sse_rr(J, 0x66, 0x2e, swap ? XMM1 : XMM0, swap ? XMM0 : XMM1);
+            return jump(J, cc ^ 1);
+        }
+    }
+    compile_expr(J, node);
+    test_truthy(J);
+    return jump(J, CC_E);
+}
+
+static void exit_jump(lfJit *J) {
+    int at = jump(J, CC_ALWAYS);
+    array_push(&J->exits, at);
+}
+
+static void compile_while(lfJit *J, lfWhileNode *loop) {
+    int top = here(J);
+    int done = compile_condition(J, loop->condition);
+    compile_block(J, loop->body);
+    /* safepoint on the back edge */
+    load(J, true, RAX, RBX, STATE(allocated));
+    cmp_mem(J, RAX, RBX, STATE(next_gc));
+    jump_to(J, CC_BE, top);
+    mov_rr(J, RDI, RBX);
+    call(J, (void *)lf_gc_collect);
+    jump_to(J, CC_ALWAYS, top);
+    patch(J, done, here(J));
+}
+
+static void compile_statement(lfJit *J, lfNode *node) {
+    position(J, node->lineno);
+    switch (node->type) {
+        case NT_VARDECL: {
+            lfVarDeclNode *decl = (lfVarDeclNode *)node;
+            /* boxing a fresh local allocates; leave that to the evaluator */
+            if (decl->guard == 0 && compilable_ref(&decl->ref) && !(decl->ref.kind == VK_LOCAL && decl->ref.captured)) {
+                if (decl->initializer) {
+                    compile_expr(J, decl->initializer);
+                } else {
+                    set_value(J, LF_NULL, 0);
+                }
+                store_var(J, &decl->ref);
+                return;
+            }
+        } break;
+        case NT_IF: {
+            lfIfNode *ifnode = (lfIfNode *)node;
+            int otherwise = compile_condition(J, ifnode->condition);
+            compile_block(J, ifnode->body);
+            if (ifnode->else_body) {
+                int done = jump(J, CC_ALWAYS);
+                patch(J, otherwise, here(J));
+                compile_block(J, ifnode->else_body);
+                patch(J, done, here(J));
+            } else {
+                patch(J, otherwise, here(J));
+            }
+            return;
+        }
+        case NT_WHILE:
+            compile_while(J, (lfWhileNode *)node);
+            return;
+        case NT_COMPOUND:
+            compile_block(J, node);
+            return;
+        case NT_RETURN: {
+            lfReturnNode *ret = (lfReturnNode *)node;
+            /* calls in tail position leave the frame to call_function, through eval_return */
+            if (ret->guard == 0 && !ret->tail) {
+                if (ret->value) {
+                    compile_expr(J, ret->value);
+                } else {
+                    set_value(J, LF_NULL, 0);
+                }
+                store_value(J, RBX, STATE(retval));
+                store_imm8(J, RBX, STATE(returning), 1);
+            } else {
+                fallback(J, node);
+            }
+            exit_jump(J);
+            return;
+        }
+        default:
+            break;
+    }
+    compile_expr(J, node);
+}
+
+/* code */
+
+static void prologue(lfJit *J) {
+    push(J, RBP);
+    mov_rr(J, RBP, RSP);
+    push(J, RBX);
+    push(J, R12);
+    push(J, R13);
+    push(J, R14); /* keeps the stack 16 byte aligned at calls */
+    J->frame_size_at[0] = adjust_rsp(J, 5);
+    mov_rr(J, RBX, RDI);
+    load(J, true, R12, RBX, STATE(base));
+    load(J, true, R13, RBX, STATE(frame));
+
+    /* room for the deepest run of value stack temporaries */
+    load(J, true, RAX, RBX, STATE(top));
+    emit(J, 0x48); /* add rax, imm32 */
+    emit(J, 0x05);
+    J->spill_check_at = here(J);
+    emit32(J, 0);
+    cmp_mem(J, RAX, RBX, STATE(stack_end));
+    int fits = jump(J, CC_B);
+    mov_rr(J, RDI, RBX);
+    call(J, (void *)jit_stack_overflow);
+    patch(J, fits, here(J));
+
+    /* the frame's line comes from the position table from here on */
+    int from = here(J);
+    store(J, true, R13, (int32_t)offsetof(lfFrame, native_sp), RSP);
+    rex(J, true, 0, RAX);
+    emit(J, 0xb8 + RAX);
+    J->info_at = here(J);
+    emit64(J, 0);
+    store(J, true, R13, (int32_t)offsetof(lfFrame, native), RAX);
+    J->frame_code += here(J) - from;
+}
+
+static void epilogue(lfJit *J) {
+    for (int i = 0; i < length(&J->exits); i++) {
+        patch(J, J->exits[i], here(J));
+    }
+    int from = here(J);
+    op_rr(J, 0x31, RAX, RAX);
+    store(J, true, R13, (int32_t)offsetof(lfFrame, native), RAX);
+    J->frame_code += here(J) - from;
+    J->frame_size_at[1] = adjust_rsp(J, 0);
+    pop(J, R14);
+    pop(J, R13);
+    pop(J, R12);
+    pop(J, RBX);
+    pop(J, RBP);
+    emit(J, 0xc3);
+
+    uint32_t frame_size = (uint32_t)((J->max_temps * 8 + 15) & ~15);
+    put32(J, J->frame_size_at[0], frame_size);
+    put32(J, J->frame_size_at[1], frame_size);
+    put32(J, J->spill_check_at, (uint32_t)(J->max_spills * sizeof(lfValue)));
+}
+
+/*
+ * makes pages executable again after writing to them. the first may hold
+ * earlier functions, even ones on the stack, which would fault on their
+ * next instruction without it, so failing for good here is fatal
+ */
+static void restore_exec(void *pages, size_t span) {
+    for (int tries = 0; mprotect(pages, span, PROT_READ | PROT_EXEC) != 0; tries++) {
+        if (tries == LF_JIT_PROTECT_TRIES) {
+            fprintf(stderr, "fatal: cannot make compiled code executable again: %s\n", strerror(errno));
+            abort();
+        }
+    }
+}
+
+/*
+ * copies the code in after the state's latest, on pages only writable
+ * while it does, and maps more pages when it does not fit
+ */
+static void *install(lfJit *J) {
+    lfState *L = J->L;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = length(&J->code);
+    lfCodeRegion *region = length(&L->code) > 0 ? &L->code[length(&L->code) - 1] : NULL;
+    size_t at = region ? (region->used + 15) & ~(size_t)15 : 0;
+    if (region == NULL || at + size > region->size) {
+        size_t mapped = size > LF_JIT_REGION ? (size + page - 1) / page * page : LF_JIT_REGION;
+        void *start = mmap(NULL, mapped, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (start == MAP_FAILED) {
+            return NULL;
+        }
+        lfCodeRegion fresh = (lfCodeRegion) {
+            .start = start,
+            .size = mapped,
+            .used = 0
+        };
+        array_push(&L->code, fresh);
+        region = &L->code[length(&L->code) - 1];
+        at = 0;
+    }
+    uint8_t *pages = (uint8_t *)region->start + at / page * page;
+    size_t span = (at + size + page - 1) / page * page - at / page * page;
+    if (mprotect(pages, span, PROT_READ | PROT_WRITE) != 0) {
+        /* a failed call may still have changed some of the pages */
+        restore_exec(pages, span);
+        return NULL;
+    }
+    memcpy((uint8_t *)region->start + at, J->code, size);
+    restore_exec(pages, span);
+    region->used = at + size;
+    return (uint8_t *)region->start + at;
+}
+
+static void *compile(lfState *L, lfNode *node) {
+    lfJit J = (lfJit) {
+        .L = L,
+        .code = array_new(&L->allocator, uint8_t),
+        .exits = array_new(&L->allocator, int),
+        .temps = 0,
+        .max_temps = 0,
+        .spills = 0,
+        .max_spills = 0,
+        .positions = array_new(&L->allocator, uint8_t),
+        .statements = 0,
+        .frame_code = 0,
+        .position_offset = 0,
+        .position_line = 0
+    };
+    prologue(&J);
+    if (node->type == NT_FUNC) {
+        lfFunctionNode *f = (lfFunctionNode *)node;
+        for (int i = 0; i < length(&f->body); i++) {
+            compile_statement(&J, f->body[i]);
+        }
+    } else {
+        compile_while(&J, (lfWhileNode *)node);
+    }
+    epilogue(&J);
+
+    size_t npositions = length(&J.positions);
+    lfCodeInfo *info = lf_malloc(&L->allocator, sizeof(lfCodeInfo) + npositions);
+    if (info == NULL) {
+        array_delete(&J.code);
+        array_delete(&J.exits);
+        array_delete(&J.positions);
+        return NULL;
+    }
+    info->size = length(&J.code);
+    info->statements = J.statements;
+    info->frame_code = J.frame_code;
+    info->npositions = npositions;
+    memcpy(info->positions, J.positions, npositions);
+    uint64_t address = (uint64_t)(uintptr_t)info;
+    put32(&J, J.info_at, (uint32_t)address);
+    put32(&J, J.info_at + 4, (uint32_t)(address >> 32));
+
+    void *code = install(&J);
+    if (code) {
+        info->start = code;
+        array_push(&L->compiled, info);
+    } else {
+        lf_free(&L->allocator, info, sizeof(lfCodeInfo) + npositions);
+    }
+    array_delete(&J.code);
+    array_delete(&J.exits);
+    array_delete(&J.positions);
+    return code;
+}
+
+bool lf_jit_function(lfState *L, lfFunctionNode *f) {
+    f->native = compile(L, (lfNode *)f);
+    if (f->native == NULL) {
+        f->hotness = -1;
+    }
+    return f->native != NULL;
+}
+
+bool lf_jit_loop(lfState *L, lfWhileNode *loop) {
+    loop->native = compile(L, (lfNode *)loop);
+    if (loop->native == NULL) {
+        loop->hotness = -1;
+    }
+    return loop->native != NULL;
+}
+
+void lf_jit_report(lfState *L, FILE *out) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t code = 0;
+    size_t positions = 0;
+    size_t stores = 0;
+    size_t frame_code = 0;
+    size_t own_pages = 0;
+    int statements = 0;
+    for (int i = 0; i < length(&L->compiled); i++) {
+        const lfCodeInfo *info = L->compiled[i];
+        size_t stored = info->statements * LINE_STORE;
+        size_t size = info->size - info->frame_code + stored;
+        code += info->size;
+        positions += sizeof(lfCodeInfo) + info->npositions;
+        stores += stored;
+        frame_code += info->frame_code;
+        own_pages += (size + page - 1) / page * page;
+        statements += info->statements;
+    }
+    size_t pages = 0;
+    for (int i = 0; i < length(&L->code); i++) {
+        pages += (L->code[i].used + page - 1) / page * page;
+    }
+    fprintf(out, "jit: %d functions and loops, %d statements: %zu bytes of code on %zu bytes of pages, and %zu bytes of position tables\n",
+            length(&L->compiled), statements, code, pages, positions);
+    fprintf(out, "jit: storing lines as they run, on pages of their own, would take %zu bytes of code on %zu bytes of pages (%ld bytes saved)\n",
+            code - frame_code + stores, own_pages, (long)own_pages - (long)(pages + positions));
+}
+
+void lf_jit_free(lfState *L) {
+    for (int i = 0; i < length(&L->code); i++) {
+        munmap(L->code[i].start, L->code[i].size);
+    }
+    length(&L->code) = 0;
+    for (int i = 0; i < length(&L->compiled); i++) {
+        lfCodeInfo *info = L->compiled[i];
+        lf_free(&L->allocator, info, sizeof(lfCodeInfo) + info->npositions);
+    }
+    length(&L->compiled) = 0;
+}
+
+#else
+
+bool lf_jit_function(lfState *L, lfFunctionNode *f) {
+    (void)L;
+    f->hotness = -1;
+    return false;
+}
+
+bool lf_jit_loop(lfState *L, lfWhileNode *loop) {
+    (void)L;
+    loop->hotness = -1;
+    return false;
+}
+
+void lf_jit_report(lfState *L, FILE *out) {
+    (void)L;
+    fprintf(out, "jit: not supported on this platform\n");
+}
+
+void lf_jit_free(lfState *L) {
+    (void)L;
+}
+
+#endif /* LF_JIT_SUPPORTED */
+
+static uint32_t read_varint(const uint8_t **p) {
+    uint32_t v = 0;
+    int shift = 0;
+    while (**p & 0x80) {
+        v |= (uint32_t)(**p & 0x7f) << shift;
+        shift += 7;
+        *p += 1;
+    }
+    v |= (uint32_t)**p << shift;
+    *p += 1;
+    return v;
+}
+
+/* runs in signal handlers too, so it only reads */
+int lf_jit_line(const lfFrame *frame, const void *pc) {
+    const lfCodeInfo *info = frame->native;
+    if (info == NULL) {
+        return frame->line;
+    }
+    uintptr_t start = (uintptr_t)info->start;
+    uintptr_t at = (uintptr_t)pc;
+    if (at - start >= info->size) {
+        at = (uintptr_t)frame->native_sp[-1] - 1; /* the call itself */
+    }
+    size_t offset = at - start;
+    /* before the first statement, the frame's line is still the caller's */
+    int line = frame->line;
+    int entry_line = 0;
+    size_t entry_offset = 0;
+    const uint8_t *p = info->positions;
+    const uint8_t *end = p + info->npositions;
+    while (p < end) {
+        entry_offset += read_varint(&p);
+        if (entry_offset > offset) {
+            break;
+        }
+        uint32_t delta = read_varint(&p);
+        entry_line += (delta & 1) ? -(int)((delta + 1) >> 1) : (int)(delta >> 1);
+        line = entry_line;
+    }
+    return line;
+}
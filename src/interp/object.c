@@ -0,0 +1,640 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "interp/value.h"
+#include "interp/state.h"
+#include "interp/gc.h"
+#include "lib/array.h"
+
+#define MAP_MIN_CAPACITY 4
+#define MAP_MIN_SLOTS 32
+#define MAP_EMPTY 0x80
+#define ROPE_MIN_LENGTH 64
+#define TOSTRING_MAX_DEPTH 16
+
+static uint32_t hash_bytes(const char *data, int length) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static lfString *string_alloc(lfState *L, int length) {
+    lfString *str = lf_gc_alloc(L, LF_STRING, sizeof(lfString) + length + 1);
+    str->length = length;
+    str->hash = 0;
+    str->chars = str->data;
+    str->left = NULL;
+    str->right = NULL;
+    str->data[length] = 0;
+    return str;
+}
+
+lfString *lf_string_new(lfState *L, const char *data, int length) {
+    lfString *str = string_alloc(L, length);
+    memcpy(str->data, data, length);
+    return str;
+}
+
+/* short results are copied right away, a rope would be bigger than them */
+lfString *lf_string_concat(lfState *L, lfString *a, lfString *b) {
+    int length = a->length + b->length;
+    if (length < ROPE_MIN_LENGTH) {
+        lfString *str = string_alloc(L, length);
+        memcpy(str->data, lf_string_chars(L, a), a->length);
+        memcpy(str->data + a->length, lf_string_chars(L, b), b->length);
+        return str;
+    }
+    lfString *rope = lf_gc_alloc(L, LF_STRING, sizeof(lfString));
+    rope->length = length;
+    rope->hash = 0;
+    rope->chars = NULL;
+    rope->left = a;
+    rope->right = b;
+    return rope;
+}
+
+/*
+ * copies a rope's leaves out in order. `s = s + x` in a loop builds a rope
+ * as deep as the loop is long, so this keeps its own stack
+ */
+static void flatten(lfState *L, lfString *rope) {
+    char *chars = lf_malloc(&L->allocator, rope->length + 1);
+    if (chars == NULL) {
+        lf_runtime_error(L, "out of memory");
+    }
+    lfArray(lfString *) pending = array_new(&L->allocator, lfString *);
+    array_push(&pending, rope);
+    int at = 0;
+    while (length(&pending) > 0) {
+        lfString *str = pending[--length(&pending)];
+        if (str->chars) {
+            memcpy(chars + at, str->chars, str->length);
+            at += str->length;
+        } else {
+            array_push(&pending, str->right);
+            array_push(&pending, str->left);
+        }
+    }
+    array_delete(&pending);
+    chars[at] = 0;
+    L->allocated += rope->length + 1;
+    rope->chars = chars;
+    rope->left = NULL;
+    rope->right = NULL;
+}
+
+const char *lf_string_chars(lfState *L, lfString *str) {
+    if (str->chars == NULL) {
+        flatten(L, str);
+    }
+    return str->chars;
+}
+
+static uint32_t string_hash(lfState *L, lfString *str) {
+    if (str->hash == 0) {
+        uint32_t hash = hash_bytes(lf_string_chars(L, str), str->length);
+        str->hash = hash != 0 ? hash : 1;
+    }
+    return str->hash;
+}
+
+static void buffer_append(lfArray(char) *buffer, const char *data, int n) {
+    array_reserve(buffer, length(buffer) + n);
+    memcpy(*buffer + length(buffer), data, n);
+    length(buffer) += n;
+}
+
+static void buffer_append_value(lfState *L, lfArray(char) *buffer, lfValue v, int depth) {
+    char tmp[64];
+    switch (v.type) {
+        case LF_UNDEFINED:
+        case LF_NULL:
+            buffer_append(buffer, "null", 4);
+            break;
+        case LF_INT:
+            buffer_append(buffer, tmp, snprintf(tmp, sizeof(tmp), "%" PRId64, v.as.i));
+            break;
+        case LF_FLOAT:
+            buffer_append(buffer, tmp, snprintf(tmp, sizeof(tmp), "%.14g", v.as.f));
+            break;
+        case LF_STRING:
+            if (depth > 0) {
+                buffer_append(buffer, "\"", 1);
+            }
+            buffer_append(buffer, lf_string_chars(L, as_string(v)), as_string(v)->length);
+            if (depth > 0) {
+                buffer_append(buffer, "\"", 1);
+            }
+            break;
+        case LF_ARRAY: {
+            lfArrayObject *array = as_array(v);
+            if (depth >= TOSTRING_MAX_DEPTH) {
+                buffer_append(buffer, "{...}", 5);
+                break;
+            }
+            buffer_append(buffer, "{", 1);
+            for (int i = 0; i < array->length; i++) {
+                if (i > 0) {
+                    buffer_append(buffer, ", ", 2);
+                }
+                buffer_append_value(L, buffer, lf_array_get(array, i), depth + 1);
+            }
+            buffer_append(buffer, "}", 1);
+        } break;
+        case LF_MAP: {
+            lfMap *map = as_map(v);
+            if (depth >= TOSTRING_MAX_DEPTH) {
+                buffer_append(buffer, "{...}", 5);
+                break;
+            }
+            buffer_append(buffer, "{", 1);
+            for (int i = 0; i < map->count; i++) {
+                if (i > 0) {
+                    buffer_append(buffer, ", ", 2);
+                }
+                buffer_append_value(L, buffer, map->entries[i].key, depth + 1);
+                buffer_append(buffer, ": ", 2);
+                buffer_append_value(L, buffer, map->entries[i].value, depth + 1);
+            }
+            buffer_append(buffer, "}", 1);
+        } break;
+        case LF_FUNCTION: {
+            lfFunctionNode *node = as_function(v)->node;
+            buffer_append(buffer, tmp, snprintf(tmp, sizeof(tmp), "<fn %.48s>", node->name.value));
+        } break;
+        case LF_METHOD: {
+            lfFunctionNode *node = as_method(v)->method->node;
+            buffer_append(buffer, tmp, snprintf(tmp, sizeof(tmp), "<method %.48s>", node->name.value));
+        } break;
+        case LF_NATIVE:
+            buffer_append(buffer, tmp, snprintf(tmp, sizeof(tmp), "<native %.48s>", as_native(v)->name));
+            break;
+        case LF_CLASS:
+            buffer_append(buffer, tmp, snprintf(tmp, sizeof(tmp), "<class %.48s>", as_class(v)->name->chars));
+            break;
+        case LF_INSTANCE:
+            buffer_append(buffer, tmp, snprintf(tmp, sizeof(tmp), "<%.48s instance>", as_instance(v)->cls->name->chars));
+            break;
+        case LF_TASK:
+            buffer_append(buffer, tmp, snprintf(tmp, sizeof(tmp), "<task %s>", as_task(v)->coro ? "running" : "done"));
+            break;
+        case LF_BOX:
+            buffer_append_value(L, buffer, as_box(v)->value, depth);
+            break;
+    }
+}
+
+lfString *lf_value_tostring(lfState *L, lfValue v) {
+    if (v.type == LF_STRING) {
+        return as_string(v);
+    }
+    lfArray(char) buffer = array_new(&L->allocator, char);
+    buffer_append_value(L, &buffer, v, 0);
+    lfString *str = lf_string_new(L, buffer, length(&buffer));
+    array_delete(&buffer);
+    return str;
+}
+
+static size_t element_size(lfArrayKind kind) {
+    return kind == AK_VALUE ? sizeof(lfValue) : sizeof(int64_t);
+}
+
+/* the storage counts towards the next collection, like map entries do */
+static void array_resize(lfState *L, lfArrayObject *array, int capacity) {
+    size_t size = element_size(array->kind);
+    int64_t *elements = lf_realloc(&L->allocator, array->as.ints, array->capacity * size, capacity * size);
+    if (elements == NULL && capacity > 0) {
+        /* the old storage is still the array's, as it was */
+        lf_runtime_error(L, "out of memory");
+    }
+    array->as.ints = elements;
+    L->allocated += (capacity - array->capacity) * size;
+    array->capacity = capacity;
+}
+
+lfArrayObject *lf_array_new(lfState *L, int reserve) {
+    lfArrayObject *array = lf_gc_alloc(L, LF_ARRAY, sizeof(lfArrayObject));
+    array->kind = AK_INT;
+    array->length = 0;
+    array->capacity = 0;
+    array->as.ints = NULL;
+    if (reserve > 0) {
+        array_resize(L, array, reserve);
+    }
+    return array;
+}
+
+static bool fits(lfArrayKind kind, lfValue v) {
+    return kind == AK_VALUE || (kind == AK_INT && v.type == LF_INT) || (kind == AK_FLOAT && v.type == LF_FLOAT);
+}
+
+/* moves an array to kind, which must hold every element it has */
+static void array_transition(lfState *L, lfArrayObject *array, lfArrayKind kind) {
+    if (array->length == 0) {
+        /* nothing to convert, only the room to keep */
+        int capacity = array->capacity;
+        if (element_size(kind) != element_size(array->kind)) {
+            array_resize(L, array, 0);
+            array->kind = kind;
+            array_resize(L, array, capacity);
+        }
+        array->kind = kind;
+        return;
+    }
+    lfValue *values = lf_malloc(&L->allocator, array->capacity * sizeof(lfValue));
+    if (values == NULL) {
+        lf_runtime_error(L, "out of memory");
+    }
+    for (int i = 0; i < array->length; i++) {
+        values[i] = lf_array_get(array, i);
+    }
+    lf_free(&L->allocator, array->as.ints, array->capacity * sizeof(int64_t));
+    L->allocated += array->capacity * (sizeof(lfValue) - sizeof(int64_t));
+    array->as.values = values;
+    array->kind = kind;
+}
+
+static void store_element(lfArrayObject *array, int index, lfValue v) {
+    switch (array->kind) {
+        case AK_INT:
+            array->as.ints[index] = v.as.i;
+            break;
+        case AK_FLOAT:
+            array->as.floats[index] = v.as.f;
+            break;
+        default:
+            array->as.values[index] = v;
+            break;
+    }
+}
+
+void lf_array_push(lfState *L, lfArrayObject *array, lfValue v) {
+    if (!fits(array->kind, v)) {
+        /* an empty array takes the kind of its first element */
+        lfArrayKind kind = array->length > 0 ? AK_VALUE : v.type == LF_INT ? AK_INT : v.type == LF_FLOAT ? AK_FLOAT : AK_VALUE;
+        array_transition(L, array, kind);
+    }
+    if (array->length == array->capacity) {
+        array_resize(L, array, array->capacity > 0 ? array->capacity * 2 : 4);
+    }
+    store_element(array, array->length++, v);
+}
+
+void lf_array_set(lfState *L, lfArrayObject *array, int index, lfValue v) {
+    if (!fits(array->kind, v)) {
+        array_transition(L, array, AK_VALUE);
+    }
+    store_element(array, index, v);
+}
+
+lfValue lf_array_pop(lfArrayObject *array) {
+    lfValue v = lf_array_get(array, array->length - 1);
+    array->length -= 1;
+    return v;
+}
+
+/* the table uses the low bits and the next ones separately, so every bit has to be mixed */
+static uint32_t hash_bits(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return (uint32_t)x;
+}
+
+static uint32_t hash_value(lfState *L, lfValue v) {
+    switch (v.type) {
+        case LF_STRING:
+            return string_hash(L, as_string(v));
+        case LF_FLOAT:
+            if (v.as.f > -9.2e18 && v.as.f < 9.2e18 && v.as.f == (double)(int64_t)v.as.f) {
+                /* equal to an int, so it has to hash like one */
+                return hash_bits((uint64_t)(int64_t)v.as.f);
+            } else {
+                uint64_t bits;
+                memcpy(&bits, &v.as.f, sizeof(bits));
+                return hash_bits(bits);
+            }
+        case LF_INT:
+            return hash_bits((uint64_t)v.as.i);
+        default:
+            return hash_bits((uintptr_t)v.as.o);
+    }
+}
+
+lfMap *lf_map_new(lfState *L) {
+    lfMap *map = lf_gc_alloc(L, LF_MAP, sizeof(lfMap));
+    map->count = 0;
+    map->capacity = 0;
+    map->entries = NULL;
+    map->nslots = 0;
+    map->ctrl = NULL;
+    map->slots = NULL;
+    return map;
+}
+
+size_t lf_map_storage(const lfMap *map) {
+    return map->capacity * sizeof(lfMapEntry) + map->nslots * (sizeof(uint8_t) + sizeof(int32_t));
+}
+
+static inline bool entry_matches(lfState *L, const lfMapEntry *entry, lfValue key, uint32_t hash) {
+    return entry->hash == hash && lf_values_equal(L, entry->key, key);
+}
+
+/* a bit per byte of the group at ctrl that equals byte */
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < LF_MAP_GROUP; i++) {
+        bits |= (uint32_t)(ctrl[i] == byte) << i;
+    }
+    return bits;
+#endif
+}
+
+/*
+ * the slot holding key, or the empty slot it would go in, as -1 - slot.
+ * groups are visited in triangular order, which reaches every group of a
+ * power of two table; maps never delete, so an empty slot ends the search
+ */
+static int table_find(lfState *L, const lfMap *map, lfValue key, uint32_t hash) {
+    uint32_t mask = map->nslots / LF_MAP_GROUP - 1;
+    uint32_t group = (hash >> 7) & mask;
+    uint8_t h2 = hash & 0x7f;
+    for (uint32_t step = 1;; step++) {
+        const uint8_t *ctrl = map->ctrl + group * LF_MAP_GROUP;
+        for (uint32_t bits = group_match(ctrl, h2); bits != 0; bits &= bits - 1) {
+            int slot = group * LF_MAP_GROUP + __builtin_ctz(bits);
+            if (entry_matches(L, &map->entries[map->slots[slot]], key, hash)) {
+                return slot;
+            }
+        }
+        uint32_t empty = group_match(ctrl, MAP_EMPTY);
+        if (empty != 0) {
+            return -1 - (int)(group * LF_MAP_GROUP + __builtin_ctz(empty));
+        }
+        group = (group + step) & mask;
+    }
+}
+
+/* the entry for key, or -1 */
+static int map_find(lfState *L, const lfMap *map, lfValue key, uint32_t hash) {
+    if (map->nslots == 0) {
+        for (int i = 0; i < map->count; i++) {
+            if (entry_matches(L, &map->entries[i], key, hash)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    int slot = table_find(L, map, key, hash);
+    return slot >= 0 ? map->slots[slot] : -1;
+}
+
+bool lf_map_get(lfState *L, lfMap *map, lfValue key, lfValue *out) {
+    if (map->count == 0) {
+        return false;
+    }
+    int i = map_find(L, map, key, hash_value(L, key));
+    if (i < 0) {
+        return false;
+    }
+    *out = map->entries[i].value;
+    return true;
+}
+
+static void table_insert(lfState *L, lfMap *map, int index) {
+    int slot = -1 - table_find(L, map, map->entries[index].key, map->entries[index].hash);
+    map->ctrl[slot] = map->entries[index].hash & 0x7f;
+    map->slots[slot] = index;
+}
+
+/* rebuilds the table with nslots slots, indexing every entry again */
+static void table_resize(lfState *L, lfMap *map, int nslots) {
+    size_t size = nslots * (sizeof(uint8_t) + sizeof(int32_t));
+    uint8_t *ctrl = lf_malloc(&L->allocator, size);
+    if (ctrl == NULL) {
+        lf_runtime_error(L, "out of memory");
+    }
+    if (map->ctrl) {
+        size_t old = map->nslots * (sizeof(uint8_t) + sizeof(int32_t));
+        lf_free(&L->allocator, map->ctrl, old);
+        L->allocated -= old;
+    }
+    L->allocated += size;
+    memset(ctrl, MAP_EMPTY, nslots);
+    map->ctrl = ctrl;
+    map->slots = (int32_t *)(ctrl + nslots);
+    map->nslots = nslots;
+    for (int i = 0; i < map->count; i++) {
+        table_insert(L, map, i);
+    }
+}
+
+static void map_grow(lfState *L, lfMap *map) {
+    int capacity = map->capacity > 0 ? map->capacity * 2 : MAP_MIN_CAPACITY;
+    lfMapEntry *entries = lf_realloc(&L->allocator, map->entries, map->capacity * sizeof(lfMapEntry), capacity * sizeof(lfMapEntry));
+    if (entries == NULL) {
+        /* the old entries are still the map's, as they were */
+        lf_runtime_error(L, "out of memory");
+    }
+    map->entries = entries;
+    L->allocated += (capacity - map->capacity) * sizeof(lfMapEntry);
+    map->capacity = capacity;
+}
+
+void lf_map_set(lfState *L, lfMap *map, lfValue key, lfValue value) {
+    uint32_t hash = hash_value(L, key);
+    int i = map_find(L, map, key, hash);
+    if (i >= 0) {
+        map->entries[i].value = value;
+        return;
+    }
+    if (map->count == map->capacity) {
+        map_grow(L, map);
+    }
+    i = map->count++;
+    map->entries[i] = (lfMapEntry) { .key = key, .value = value, .hash = hash };
+    /* keep the table under 7/8 full */
+    if (map->count > LF_MAP_LINEAR && map->count * 8 > map->nslots * 7) {
+        table_resize(L, map, map->nslots > 0 ? map->nslots * 2 : MAP_MIN_SLOTS);
+    } else if (map->nslots > 0) {
+        table_insert(L, map, i);
+    }
+}
+
+/* a repeated literal leaves its fresh copy to the collector */
+lfString *lf_string_intern(lfState *L, const char *data, int length) {
+    lfValue v = lf_obj(LF_STRING, lf_string_new(L, data, length));
+    int i = map_find(L, L->strings, v, string_hash(L, as_string(v)));
+    if (i >= 0) {
+        return as_string(L->strings->entries[i].key);
+    }
+    lf_map_set(L, L->strings, v, v);
+    return as_string(v);
+}
+
+lfBox *lf_box_new(lfState *L, lfValue value) {
+    lfBox *box = lf_gc_alloc(L, LF_BOX, sizeof(lfBox));
+    box->value = value;
+    return box;
+}
+
+lfFunction *lf_function_new(lfState *L, lfFunctionNode *node, lfChunk *chunk) {
+    int ncaptures = node->captures ? length(&node->captures) : 0;
+    lfFunction *f = lf_gc_alloc(L, LF_FUNCTION, sizeof(lfFunction) + ncaptures * sizeof(lfBox *));
+    f->node = node;
+    f->chunk = chunk;
+    f->ncaptures = ncaptures;
+    for (int i = 0; i < ncaptures; i++) {
+        f->captures[i] = NULL;
+    }
+    return f;
+}
+
+lfBoundMethod *lf_bound_method_new(lfState *L, lfValue receiver, lfFunction *method) {
+    lfBoundMethod *m = lf_gc_alloc(L, LF_METHOD, sizeof(lfBoundMethod));
+    m->receiver = receiver;
+    m->method = method;
+    return m;
+}
+
+lfClass *lf_class_new(lfState *L, lfClassNode *node) {
+    lfClass *cls = lf_gc_alloc(L, LF_CLASS, sizeof(lfClass));
+    cls->node = node;
+    cls->name = NULL;
+    cls->field_names = array_new(&L->allocator, const char *);
+    cls->field_defaults = array_new(&L->allocator, lfValue);
+    cls->field_types = array_new(&L->allocator, lfTypeSet);
+    cls->methods = array_new(&L->allocator, lfFunction *);
+    cls->init = NULL;
+    return cls;
+}
+
+lfInstance *lf_instance_new(lfState *L, lfClass *cls) {
+    int nfields = length(&cls->field_defaults);
+    lfInstance *instance = lf_gc_alloc(L, LF_INSTANCE, sizeof(lfInstance) + nfields * sizeof(lfValue));
+    instance->cls = cls;
+    instance->nfields = nfields;
+    memcpy(instance->fields, cls->field_defaults, nfields * sizeof(lfValue));
+    return instance;
+}
+
+lfTask *lf_task_new(lfState *L) {
+    lfTask *task = lf_gc_alloc(L, LF_TASK, sizeof(lfTask));
+    task->coro = NULL;
+    task->result = lf_null();
+    return task;
+}
+
+int lf_class_field(lfClass *cls, const char *name) {
+    for (int i = 0; i < length(&cls->field_names); i++) {
+        if (!strcmp(cls->field_names[i], name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+lfFunction *lf_class_method(lfClass *cls, const char *name) {
+    for (int i = 0; i < length(&cls->methods); i++) {
+        if (!strcmp(cls->methods[i]->node->name.value, name)) {
+            return cls->methods[i];
+        }
+    }
+    return NULL;
+}
+
+bool lf_values_equal(lfState *L, lfValue a, lfValue b) {
+    if (a.type != b.type) {
+        if (a.type == LF_INT && b.type == LF_FLOAT) {
+            return (double)a.as.i == b.as.f;
+        } else if (a.type == LF_FLOAT && b.type == LF_INT) {
+            return a.as.f == (double)b.as.i;
+        }
+        return false;
+    }
+    switch (a.type) {
+        case LF_UNDEFINED:
+        case LF_NULL:
+            return true;
+        case LF_INT:
+            return a.as.i == b.as.i;
+        case LF_FLOAT:
+            return a.as.f == b.as.f;
+        case LF_NATIVE:
+            return a.as.native == b.as.native;
+        case LF_STRING: {
+            lfString *x = as_string(a);
+            lfString *y = as_string(b);
+            if (x == y) {
+                return true;
+            }
+            if (x->length != y->length || (x->hash != 0 && y->hash != 0 && x->hash != y->hash)) {
+                return false;
+            }
+            return !memcmp(lf_string_chars(L, x), lf_string_chars(L, y), x->length);
+        }
+        default:
+            return a.as.o == b.as.o;
+    }
+}
+
+bool lf_value_truthy(lfValue v) {
+    switch (v.type) {
+        case LF_UNDEFINED:
+        case LF_NULL:
+            return false;
+        case LF_INT:
+            return v.as.i != 0;
+        case LF_FLOAT:
+            return v.as.f != 0.0;
+        default:
+            return true;
+    }
+}
+
+const char *lf_type_name(lfValue v) {
+    switch (v.type) {
+        case LF_UNDEFINED:
+        case LF_NULL:
+            return "null";
+        case LF_INT:
+            return "int";
+        case LF_FLOAT:
+            return "float";
+        case LF_STRING:
+            return "string";
+        case LF_ARRAY:
+            return "array";
+        case LF_MAP:
+            return "map";
+        case LF_FUNCTION:
+        case LF_METHOD:
+        case LF_NATIVE:
+            return "function";
+        case LF_CLASS:
+            return "class";
+        case LF_INSTANCE:
+            return "instance";
+        case LF_TASK:
+            return "task";
+        case LF_BOX:
+            return "box";
+    }
+    return "unknown";
+}
@@ -0,0 +1,283 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* REG_RIP */
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include "interp/profile.h"
+#include "interp/jit.h"
+#include "interp/state.h"
+#include "interp/value.h"
+#include "parser/node.h"
+#include "lib/alloc.h"
+
+#if LF_PROFILE_SUPPORTED
+
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#ifdef __APPLE__
+#include <sys/ucontext.h>
+#else
+#include <ucontext.h>
+#endif
+
+typedef struct lfProfileFrame {
+    const lfFunctionNode *function; /* NULL for a chunk's top level */
+    const lfChunk *chunk;
+    int line;
+} lfProfileFrame;
+
+typedef struct lfProfileStack {
+    uint32_t hash;
+    int depth; /* 0 for an empty slot */
+    int frames; /* the first of them in lfProfile.frames, outermost first */
+    uint64_t samples;
+} lfProfileStack;
+
+struct lfProfile {
+    lfProfileStack stacks[LF_PROFILE_STACKS]; /* open addressing with linear probing */
+    lfProfileFrame frames[LF_PROFILE_FRAMES];
+    int nstacks;
+    int nframes;
+    uint64_t outside; /* samples taken while no leaf code was running */
+    uint64_t dropped; /* samples of new stacks once the tables were full */
+    uint64_t elsewhere; /* samples landing on other threads, like other isolates' */
+    pthread_t thread; /* the one running the profiled state */
+    bool running;
+    struct sigaction old_action;
+    struct itimerval old_timer;
+};
+
+static lfState *volatile profiled = NULL;
+
+static uint32_t hash_frames(const lfProfileFrame *frames, int depth) {
+    /* FNV-1a over the fields */
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < depth; i++) {
+        uint64_t words[3] = {
+            (uint64_t)(uintptr_t)frames[i].function,
+            (uint64_t)(uintptr_t)frames[i].chunk,
+            (uint64_t)frames[i].line
+        };
+        for (int j = 0; j < 3; j++) {
+            for (int k = 0; k < 64; k += 8) {
+                hash ^= (uint8_t)(words[j] >> k);
+                hash *= 16777619u;
+            }
+        }
+    }
+    return hash;
+}
+
+static bool same_frames(const lfProfileFrame *a, const lfProfileFrame *b, int depth) {
+    for (int i = 0; i < depth; i++) {
+        if (a[i].function != b[i].function || a[i].chunk != b[i].chunk || a[i].line != b[i].line) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* runs in the signal handler, so it only ever touches the preallocated tables */
+static void record(lfProfile *P, const lfProfileFrame *sample, int depth) {
+    uint32_t hash = hash_frames(sample, depth);
+    uint32_t mask = LF_PROFILE_STACKS - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        lfProfileStack *stack = &P->stacks[i];
+        if (stack->depth == 0) {
+            /* a new stack, if there is room for it */
+            if (P->nstacks * 4 >= LF_PROFILE_STACKS * 3 || P->nframes + depth > LF_PROFILE_FRAMES) {
+                P->dropped += 1;
+                return;
+            }
+            for (int j = 0; j < depth; j++) {
+                P->frames[P->nframes + j] = sample[j];
+            }
+            stack->hash = hash;
+            stack->frames = P->nframes;
+            stack->samples = 1;
+            stack->depth = depth;
+            P->nframes += depth;
+            P->nstacks += 1;
+            return;
+        }
+        if (stack->hash == hash && stack->depth == depth && same_frames(&P->frames[stack->frames], sample, depth)) {
+            stack->samples += 1;
+            return;
+        }
+    }
+}
+
+/* where the signal interrupted, to find lines in compiled code; NULL if unknown */
+static const void *interrupted_at(void *context) {
+    const ucontext_t *uc = context;
+#if LF_JIT_SUPPORTED && defined(__linux__)
+    return (const void *)uc->uc_mcontext.gregs[REG_RIP];
+#elif LF_JIT_SUPPORTED && defined(__APPLE__)
+    return (const void *)uc->uc_mcontext->__ss.__rip;
+#elif LF_JIT_SUPPORTED && defined(__FreeBSD__)
+    return (const void *)uc->uc_mcontext.mc_rip;
+#else
+    (void)uc;
+    return NULL;
+#endif
+}
+
+/*
+ * the interpreter fills in a frame before counting it in L->nframes, so
+ * every frame below that count is whole and its function is alive
+ */
+static void on_sigprof(int sig, siginfo_t *info, void *context) {
+    (void)sig;
+    (void)info;
+    lfState *L = profiled;
+    if (L == NULL) {
+        return;
+    }
+    lfProfile *P = L->profile;
+    if (!pthread_equal(pthread_self(), P->thread)) {
+        /* the timer counts the whole process' time, and any thread may take the signal */
+        __atomic_fetch_add(&P->elsewhere, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    int nframes = L->nframes;
+    if (nframes == 0) {
+        P->outside += 1;
+        return;
+    }
+    lfProfileFrame sample[LF_PROFILE_DEPTH];
+    int first = nframes > LF_PROFILE_DEPTH ? nframes - LF_PROFILE_DEPTH : 0;
+    int depth = 0;
+    for (int i = first; i < nframes; i++) {
+        const lfFrame *frame = &L->frames[i];
+        sample[depth++] = (lfProfileFrame) {
+            .function = frame->function ? frame->function->node : NULL,
+            .chunk = frame->chunk,
+            .line = lf_jit_line(frame, i == nframes - 1 ? interrupted_at(context) : NULL)
+        };
+    }
+    record(P, sample, depth);
+}
+
+bool lf_profile_start(lfState *L, int hz) {
+    if (hz <= 0) {
+        return false;
+    }
+    /* claimed first, since isolates on other threads may be starting too */
+    lfState *none = NULL;
+    if (!__atomic_compare_exchange_n(&profiled, &none, L, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    if (L->profile == NULL) {
+        L->profile = lf_malloc(&L->allocator, sizeof(lfProfile));
+        if (L->profile == NULL) {
+            __atomic_store_n(&profiled, NULL, __ATOMIC_RELEASE);
+            return false;
+        }
+        memset(L->profile, 0, sizeof(lfProfile));
+    }
+    lfProfile *P = L->profile;
+    P->thread = pthread_self();
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_sigprof;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigaction(SIGPROF, &action, &P->old_action);
+
+    long period = 1000000L / hz;
+    struct itimerval timer;
+    timer.it_interval.tv_sec = period / 1000000L;
+    timer.it_interval.tv_usec = period % 1000000L;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, &P->old_timer) != 0) {
+        sigaction(SIGPROF, &P->old_action, NULL);
+        profiled = NULL;
+        return false;
+    }
+    P->running = true;
+    return true;
+}
+
+void lf_profile_stop(lfState *L) {
+    lfProfile *P = L->profile;
+    if (P == NULL || !P->running) {
+        return;
+    }
+    setitimer(ITIMER_PROF, &P->old_timer, NULL);
+    sigaction(SIGPROF, &P->old_action, NULL);
+    profiled = NULL;
+    P->running = false;
+}
+
+static void write_frame(FILE *out, const lfProfileFrame *frame) {
+    const char *name = frame->function ? frame->function->name.value : "<top level>";
+    fprintf(out, "%s (%s:%d)", name, frame->chunk->file, frame->line);
+}
+
+void lf_profile_write(lfState *L, FILE *out) {
+    lfProfile *P = L->profile;
+    if (P == NULL) {
+        return;
+    }
+    for (int i = 0; i < LF_PROFILE_STACKS; i++) {
+        const lfProfileStack *stack = &P->stacks[i];
+        if (stack->depth == 0) {
+            continue;
+        }
+        for (int j = 0; j < stack->depth; j++) {
+            if (j > 0) {
+                fputc(';', out);
+            }
+            write_frame(out, &P->frames[stack->frames + j]);
+        }
+        fprintf(out, " %llu\n", (unsigned long long)stack->samples);
+    }
+    if (P->outside > 0) {
+        fprintf(out, "[outside leaf code] %llu\n", (unsigned long long)P->outside);
+    }
+    if (P->dropped > 0) {
+        fprintf(out, "[dropped] %llu\n", (unsigned long long)P->dropped);
+    }
+    if (P->elsewhere > 0) {
+        fprintf(out, "[other threads] %llu\n", (unsigned long long)P->elsewhere);
+    }
+}
+
+void lf_profile_free(lfState *L) {
+    if (L->profile) {
+        lf_profile_stop(L);
+        lf_free(&L->allocator, L->profile, sizeof(lfProfile));
+        L->profile = NULL;
+    }
+}
+
+#else
+
+bool lf_profile_start(lfState *L, int hz) {
+    (void)L;
+    (void)hz;
+    return false;
+}
+
+void lf_profile_stop(lfState *L) {
+    (void)L;
+}
+
+void lf_profile_write(lfState *L, FILE *out) {
+    (void)L;
+    (void)out;
+}
+
+void lf_profile_free(lfState *L) {
+    (void)L;
+}
+
+#endif /* LF_PROFILE_SUPPORTED */
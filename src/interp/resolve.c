@@ -0,0 +1,426 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interp/resolve.h"
+#include "interp/state.h"
+#include "interp/value.h"
+#include "parser/node.h"
+#include "lib/array.h"
+#include "lib/error.h"
+
+typedef struct lfLocal {
+    const char *name;
+    int slot;
+    int depth; /* block nesting it was declared at */
+    lfVarRef *decl;
+} lfLocal;
+
+typedef struct lfFuncScope {
+    struct lfFuncScope *enclosing;
+    lfFunctionNode *node; /* NULL for a chunk's top level */
+    lfArray(lfLocal) locals;
+    int depth;
+    int nslots;
+    int max_slots;
+} lfFuncScope;
+
+/* a global that nothing may declare, checked once every chunk is resolved */
+typedef struct lfGlobalUse {
+    lfChunk *chunk;
+    lfToken name;
+    int slot;
+} lfGlobalUse;
+
+typedef struct lfResolver {
+    lfState *L;
+    const lfAllocator *allocator; /* annotations live with the tree */
+    lfChunk *chunk;
+    lfFuncScope *fn;
+    lfArray(lfGlobalUse) *uses; /* shared with the chunks this one includes */
+    bool errored;
+} lfResolver;
+
+static void resolver_error(lfResolver *R, lfToken at, const char *fmt, const char *name) {
+    char message[256];
+    snprintf(message, sizeof(message), fmt, name);
+    lf_error_report(&R->L->diagnostics, R->chunk->file, R->chunk->source, at.idx_start, at.idx_end, message);
+    R->errored = true;
+}
+
+static void resolve_node(lfResolver *R, lfNode *node);
+
+static void scope_enter(lfResolver *R, lfFuncScope *fn, lfFunctionNode *node) {
+    *fn = (lfFuncScope) {
+        .enclosing = R->fn,
+        .node = node,
+        .locals = array_new(&R->L->allocator, lfLocal),
+        .depth = 0,
+        .nslots = 0,
+        .max_slots = 0
+    };
+    R->fn = fn;
+}
+
+static int scope_leave(lfResolver *R) {
+    lfFuncScope *fn = R->fn;
+    int nslots = fn->max_slots;
+    array_delete(&fn->locals);
+    R->fn = fn->enclosing;
+    return nslots;
+}
+
+static void block_enter(lfResolver *R) {
+    R->fn->depth += 1;
+}
+
+static void block_leave(lfResolver *R) {
+    lfFuncScope *fn = R->fn;
+    while (length(&fn->locals) > 0 && fn->locals[length(&fn->locals) - 1].depth == fn->depth) {
+        length(&fn->locals) -= 1;
+        fn->nslots -= 1;
+    }
+    fn->depth -= 1;
+}
+
+static void declare(lfResolver *R, const char *name, lfVarRef *ref) {
+    lfFuncScope *fn = R->fn;
+    if (fn->node == NULL && fn->depth == 0) {
+        ref->kind = VK_GLOBAL;
+        ref->slot = lf_global_slot(R->L, name);
+        R->L->global_declared[ref->slot] = true;
+        return;
+    }
+    ref->kind = VK_LOCAL;
+    ref->slot = fn->nslots++;
+    if (fn->nslots > fn->max_slots) {
+        fn->max_slots = fn->nslots;
+    }
+    lfLocal local = (lfLocal) {
+        .name = name,
+        .slot = ref->slot,
+        .depth = fn->depth,
+        .decl = ref
+    };
+    array_push(&fn->locals, local);
+}
+
+static lfLocal *find_local(lfFuncScope *fn, const char *name) {
+    for (int i = length(&fn->locals) - 1; i >= 0; i--) {
+        if (!strcmp(fn->locals[i].name, name)) {
+            return &fn->locals[i];
+        }
+    }
+    return NULL;
+}
+
+static int add_capture(lfResolver *R, lfFuncScope *fn, bool local, int slot) {
+    lfFunctionNode *node = fn->node;
+    if (node->captures == NULL) {
+        node->captures = array_new(R->allocator, lfCapture);
+    }
+    for (int i = 0; i < length(&node->captures); i++) {
+        if (node->captures[i].local == local && node->captures[i].slot == slot) {
+            return i;
+        }
+    }
+    lfCapture capture = (lfCapture) {
+        .local = local,
+        .slot = slot
+    };
+    array_push(&node->captures, capture);
+    return length(&node->captures) - 1;
+}
+
+/* returns the capture index in fn, counting the functions crossed into depth */
+static int resolve_capture(lfResolver *R, lfFuncScope *fn, const char *name, int *depth) {
+    if (fn->enclosing == NULL) {
+        return -1;
+    }
+    *depth += 1;
+    lfLocal *local = find_local(fn->enclosing, name);
+    if (local != NULL) {
+        local->decl->captured = true;
+        return add_capture(R, fn, true, local->slot);
+    }
+    int slot = resolve_capture(R, fn->enclosing, name, depth);
+    if (slot >= 0) {
+        return add_capture(R, fn, false, slot);
+    }
+    return -1;
+}
+
+static void lookup(lfResolver *R, lfToken name, lfVarRef *ref) {
+    lfLocal *local = find_local(R->fn, name.value);
+    if (local != NULL) {
+        ref->kind = VK_LOCAL;
+        ref->depth = 0;
+        ref->slot = local->slot;
+        return;
+    }
+    int depth = 0;
+    int capture = resolve_capture(R, R->fn, name.value, &depth);
+    if (capture >= 0) {
+        ref->kind = VK_UPVALUE;
+        ref->depth = depth;
+        ref->slot = capture;
+        return;
+    }
+    /* anything else is a global, possibly one that is declared later */
+    ref->kind = VK_GLOBAL;
+    ref->depth = 0;
+    ref->slot = lf_global_slot(R->L, name.value);
+    lfGlobalUse use = (lfGlobalUse) {
+        .chunk = R->chunk,
+        .name = name,
+        .slot = ref->slot
+    };
+    array_push(R->uses, use);
+}
+
+static void resolve_function(lfResolver *R, lfFunctionNode *f, bool is_method) {
+    f->is_method = is_method;
+    if (f->lazy) {
+        return; /* see lf_resolve_function */
+    }
+    lfFuncScope fn;
+    scope_enter(R, &fn, f);
+    block_enter(R);
+    if (is_method) {
+        declare(R, "self", &f->self);
+    }
+    for (int i = 0; i < length(&f->params); i++) {
+        lfVarDeclNode *param = f->params[i];
+        if (param->initializer) {
+            resolve_node(R, param->initializer);
+        }
+        declare(R, param->name.value, &param->ref);
+    }
+    for (int i = 0; i < length(&f->body); i++) {
+        resolve_node(R, f->body[i]);
+    }
+    block_leave(R);
+    f->nslots = scope_leave(R);
+}
+
+/*
+ * members form their own scope: fields are numbered in declaration order,
+ * which is the layout of every instance, and no two members share a name.
+ * members are only reachable through self, so the scope is never searched
+ * by plain variable lookups
+ */
+static void resolve_class(lfResolver *R, lfClassNode *cls) {
+    declare(R, cls->name.value, &cls->ref);
+    lfArray(lfToken) members = array_new(&R->L->allocator, lfToken);
+    int nfields = 0;
+    for (int i = 0; i < length(&cls->body); i++) {
+        lfNode *member = cls->body[i];
+        lfToken name = member->type == NT_FUNC ? ((lfFunctionNode *)member)->name : ((lfVarDeclNode *)member)->name;
+        for (int j = 0; j < length(&members); j++) {
+            if (!strcmp(members[j].value, name.value)) {
+                resolver_error(R, name, "duplicate member '%s'", name.value);
+            }
+        }
+        array_push(&members, name);
+
+        if (member->type == NT_FUNC) {
+            resolve_function(R, (lfFunctionNode *)member, true);
+        } else {
+            /* field defaults are evaluated in the declaring scope */
+            lfVarDeclNode *field = (lfVarDeclNode *)member;
+            if (field->initializer) {
+                resolve_node(R, field->initializer);
+            }
+            field->ref.kind = VK_FIELD;
+            field->ref.slot = nfields++;
+        }
+    }
+    array_delete(&members);
+}
+
+static bool resolve_chunk(lfState *L, lfChunk *chunk, lfArray(lfGlobalUse) *uses);
+
+/* included chunks are loaded and resolved up front so their globals count as declared */
+static void resolve_import(lfResolver *R, lfImportNode *import) {
+    lfChunk *chunk = lf_load_include(R->L, R->chunk, import);
+    import->module = chunk;
+    if (chunk == NULL) {
+        R->errored = true;
+    } else if (!chunk->resolved && !resolve_chunk(R->L, chunk, R->uses)) {
+        R->errored = true;
+    }
+}
+
+static void resolve_nodes(lfResolver *R, lfArray(lfNode *) nodes) {
+    for (int i = 0; i < length(&nodes); i++) {
+        resolve_node(R, nodes[i]);
+    }
+}
+
+static void resolve_node(lfResolver *R, lfNode *node) {
+    switch (node->type) {
+        case NT_INT: {
+            lfLiteralNode *lit = (lfLiteralNode *)node;
+            lit->constant.i = strtoll(lit->value.value, NULL, 10);
+        } break;
+        case NT_FLOAT: {
+            lfLiteralNode *lit = (lfLiteralNode *)node;
+            lit->constant.f = strtod(lit->value.value, NULL);
+        } break;
+        case NT_STRING: {
+            lfLiteralNode *lit = (lfLiteralNode *)node;
+            /* obj.name keys reuse the identifier token, which is nul terminated */
+            int n = lit->value.type == TT_STRING ? length(&lit->value.value) : (int)strlen(lit->value.value);
+            lit->constant.object = lf_string_intern(R->L, lit->value.value, n);
+        } break;
+        case NT_ARRAY:
+            resolve_nodes(R, ((lfArrayNode *)node)->values);
+            break;
+        case NT_MAP:
+            resolve_nodes(R, ((lfMapNode *)node)->keys);
+            resolve_nodes(R, ((lfMapNode *)node)->values);
+            break;
+        case NT_UNARYOP:
+            resolve_node(R, ((lfUnaryOpNode *)node)->value);
+            break;
+        case NT_BINARYOP:
+            resolve_node(R, ((lfBinaryOpNode *)node)->lhs);
+            resolve_node(R, ((lfBinaryOpNode *)node)->rhs);
+            break;
+        case NT_VARACCESS: {
+            lfVarAccessNode *access = (lfVarAccessNode *)node;
+            lookup(R, access->var, &access->ref);
+        } break;
+        case NT_VARDECL: {
+            lfVarDeclNode *decl = (lfVarDeclNode *)node;
+            if (decl->initializer) {
+                resolve_node(R, decl->initializer);
+            }
+            declare(R, decl->name.value, &decl->ref);
+        } break;
+        case NT_SUBSCRIBE:
+            resolve_node(R, ((lfSubscriptionNode *)node)->object);
+            resolve_node(R, ((lfSubscriptionNode *)node)->index);
+            break;
+        case NT_ASSIGN: {
+            lfAssignNode *assign = (lfAssignNode *)node;
+            resolve_node(R, assign->value);
+            lookup(R, assign->var, &assign->ref);
+        } break;
+        case NT_OBJASSIGN:
+            resolve_node(R, ((lfObjectAssignNode *)node)->object);
+            resolve_node(R, ((lfObjectAssignNode *)node)->key);
+            resolve_node(R, ((lfObjectAssignNode *)node)->value);
+            break;
+        case NT_CALL:
+            resolve_node(R, ((lfCallNode *)node)->func);
+            resolve_nodes(R, ((lfCallNode *)node)->args);
+            break;
+        case NT_FUNC: {
+            lfFunctionNode *f = (lfFunctionNode *)node;
+            /* declared before the body so that it can call itself */
+            declare(R, f->name.value, &f->ref);
+            resolve_function(R, f, false);
+        } break;
+        case NT_IF: {
+            lfIfNode *ifnode = (lfIfNode *)node;
+            resolve_node(R, ifnode->condition);
+            resolve_node(R, ifnode->body);
+            if (ifnode->else_body) {
+                resolve_node(R, ifnode->else_body);
+            }
+        } break;
+        case NT_WHILE:
+            resolve_node(R, ((lfWhileNode *)node)->condition);
+            resolve_node(R, ((lfWhileNode *)node)->body);
+            break;
+        case NT_RETURN: {
+            lfReturnNode *ret = (lfReturnNode *)node;
+            if (ret->value) {
+                resolve_node(R, ret->value);
+            }
+        } break;
+        case NT_YIELD:
+            break;
+        case NT_AWAIT:
+            resolve_node(R, ((lfAwaitNode *)node)->value);
+            break;
+        case NT_CLASS:
+            resolve_class(R, (lfClassNode *)node);
+            break;
+        case NT_COMPOUND:
+            block_enter(R);
+            resolve_nodes(R, ((lfCompoundNode *)node)->statements);
+            block_leave(R);
+            break;
+        case NT_IMPORT:
+            resolve_import(R, (lfImportNode *)node);
+            break;
+    }
+}
+
+static bool resolve_chunk(lfState *L, lfChunk *chunk, lfArray(lfGlobalUse) *uses) {
+    lfResolver R = (lfResolver) {
+        .L = L,
+        .allocator = &L->parser->arena_allocator,
+        .chunk = chunk,
+        .fn = NULL,
+        .uses = uses,
+        .errored = false
+    };
+    chunk->resolved = true;
+    lfFuncScope top;
+    scope_enter(&R, &top, NULL);
+    /* the chunk's own statements are at depth 0, so they declare globals */
+    resolve_nodes(&R, ((lfCompoundNode *)chunk->ast)->statements);
+    chunk->nslots = scope_leave(&R);
+    return !R.errored;
+}
+
+/* reports the names none of the chunks resolved so far declare */
+static bool check_uses(lfState *L, lfArray(lfGlobalUse) uses) {
+    bool ok = true;
+    for (int i = 0; i < length(&uses); i++) {
+        lfGlobalUse *use = &uses[i];
+        if (!L->global_declared[use->slot]) {
+            char message[256];
+            snprintf(message, sizeof(message), "unresolved name '%s'", use->name.value);
+            lf_error_report(&L->diagnostics, use->chunk->file, use->chunk->source, use->name.idx_start, use->name.idx_end, message);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool lf_resolve_chunk(lfState *L, lfChunk *chunk) {
+    lfArray(lfGlobalUse) uses = array_new(&L->allocator, lfGlobalUse);
+    bool ok = resolve_chunk(L, chunk, &uses);
+    /* every chunk this one can reach is resolved now */
+    ok = check_uses(L, uses) && ok;
+    array_delete(&uses);
+    return ok;
+}
+
+bool lf_resolve_function(lfState *L, lfChunk *chunk, lfFunctionNode *f) {
+    lfArray(lfGlobalUse) uses = array_new(&L->allocator, lfGlobalUse);
+    lfResolver R = (lfResolver) {
+        .L = L,
+        .allocator = &L->parser->arena_allocator,
+        .chunk = chunk,
+        .fn = NULL,
+        .uses = &uses,
+        .errored = false
+    };
+    /* lazy functions sit at a chunk's top level, where no locals are in scope */
+    lfFuncScope top;
+    scope_enter(&R, &top, NULL);
+    resolve_function(&R, f, f->is_method);
+    scope_leave(&R);
+    bool ok = check_uses(L, uses) && !R.errored;
+    array_delete(&uses);
+    return ok;
+}
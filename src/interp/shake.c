@@ -0,0 +1,431 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "interp/shake.h"
+#include "interp/state.h"
+#include "parser/node.h"
+#include "parser/tokenize.h"
+#include "lib/array.h"
+#include "lib/error.h"
+
+#define SHAKE_MIN_NAMES 256 /* a power of two */
+
+/* a top level function or class, which is dropped unless reached */
+typedef struct lfShakeDecl {
+    lfChunk *chunk;
+    lfNode *node;
+    const char *name;
+    int next; /* the previous declaration of the same name, or -1 */
+    bool reached;
+} lfShakeDecl;
+
+typedef struct lfShakeName {
+    const char *name; /* NULL for a free entry */
+    uint32_t hash;
+    bool used; /* by reachable code */
+    int decls; /* the last top level declaration of the name, or -1 */
+} lfShakeName;
+
+typedef struct lfShaker {
+    lfState *L;
+    lfShakeName *names; /* open addressed, at most half full */
+    int capacity;
+    int count;
+    lfArray(lfShakeDecl) decls;
+    lfArray(int) reached; /* declarations reached, and not walked yet */
+    lfArray(lfChunk *) chunks; /* in the order they were reached */
+    int scanned; /* chunks whose top levels have been walked */
+    lfChunk *chunk; /* of the code being walked, which its includes are relative to */
+    bool errored;
+} lfShaker;
+
+static uint32_t hash_name(const char *name) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int find_name(lfShaker *S, const char *name, uint32_t hash) {
+    int i = hash & (S->capacity - 1);
+    while (S->names[i].name != NULL && (S->names[i].hash != hash || strcmp(S->names[i].name, name))) {
+        i = (i + 1) & (S->capacity - 1);
+    }
+    return i;
+}
+
+/* the entry for name, added unused and undeclared if it is new */
+static int intern_name(lfShaker *S, const char *name) {
+    uint32_t hash = hash_name(name);
+    int i = find_name(S, name, hash);
+    if (S->names[i].name != NULL) {
+        return i;
+    }
+    if ((S->count + 1) * 2 > S->capacity) {
+        lfShakeName *old = S->names;
+        int old_capacity = S->capacity;
+        S->capacity *= 2;
+        S->names = lf_malloc(&S->L->allocator, S->capacity * sizeof(lfShakeName));
+        memset(S->names, 0, S->capacity * sizeof(lfShakeName));
+        for (int j = 0; j < old_capacity; j++) {
+            if (old[j].name != NULL) {
+                S->names[find_name(S, old[j].name, old[j].hash)] = old[j];
+            }
+        }
+        lf_free(&S->L->allocator, old, old_capacity * sizeof(lfShakeName));
+        i = find_name(S, name, hash);
+    }
+    S->names[i] = (lfShakeName) {
+        .name = name,
+        .hash = hash,
+        .used = false,
+        .decls = -1
+    };
+    S->count += 1;
+    return i;
+}
+
+static void reach(lfShaker *S, int decl) {
+    if (!S->decls[decl].reached) {
+        S->decls[decl].reached = true;
+        array_push(&S->reached, decl);
+    }
+}
+
+/* reachable code names a global, which reaches every top level declaration of it */
+static void use(lfShaker *S, const char *name) {
+    int i = intern_name(S, name);
+    if (S->names[i].used) {
+        return;
+    }
+    S->names[i].used = true;
+    for (int d = S->names[i].decls; d >= 0; d = S->decls[d].next) {
+        reach(S, d);
+    }
+}
+
+static void declare(lfShaker *S, lfNode *node, const char *name) {
+    int i = intern_name(S, name);
+    lfShakeDecl decl = (lfShakeDecl) {
+        .chunk = S->chunk,
+        .node = node,
+        .name = name,
+        .next = S->names[i].decls,
+        .reached = false
+    };
+    array_push(&S->decls, decl);
+    S->names[i].decls = length(&S->decls) - 1;
+    if (S->names[i].used) {
+        reach(S, length(&S->decls) - 1);
+    }
+}
+
+/* the chunk an include names, to be walked unless it already was or ran before this program */
+static void include(lfShaker *S, lfImportNode *import) {
+    lfChunk *chunk = lf_load_include(S->L, S->chunk, import);
+    import->module = chunk;
+    if (chunk == NULL) {
+        S->errored = true;
+        return;
+    }
+    if (chunk->resolved) {
+        return;
+    }
+    for (int i = 0; i < length(&S->chunks); i++) {
+        if (S->chunks[i] == chunk) {
+            return;
+        }
+    }
+    array_push(&S->chunks, chunk);
+}
+
+static void walk_node(lfShaker *S, lfNode *node);
+
+static void walk_nodes(lfShaker *S, lfArray(lfNode *) nodes) {
+    for (int i = 0; i < length(&nodes); i++) {
+        walk_node(S, nodes[i]);
+    }
+}
+
+/* class names are types too */
+static void walk_type(lfShaker *S, lfType *t) {
+    if (t == NULL) {
+        return;
+    }
+    switch (t->type) {
+        case VT_TYPENAME:
+            use(S, ((lfTypeName *)t)->typename.value);
+            break;
+        case VT_UNION:
+        case VT_INTERSECTION:
+            walk_type(S, ((lfTypeOp *)t)->lhs);
+            walk_type(S, ((lfTypeOp *)t)->rhs);
+            break;
+        case VT_FUNC: {
+            lfFuncType *f = (lfFuncType *)t;
+            for (int i = 0; i < length(&f->params); i++) {
+                walk_type(S, f->params[i]);
+            }
+            walk_type(S, f->ret);
+        } break;
+        case VT_ARRAY: {
+            lfArrayType *arr = (lfArrayType *)t;
+            for (int i = 0; i < length(&arr->values); i++) {
+                walk_type(S, arr->values[i]);
+            }
+        } break;
+        case VT_MAP: {
+            lfMapType *map = (lfMapType *)t;
+            for (int i = 0; i < length(&map->keys); i++) {
+                walk_type(S, map->keys[i]);
+            }
+            for (int i = 0; i < length(&map->values); i++) {
+                walk_type(S, map->values[i]);
+            }
+        } break;
+        case VT_ANY:
+            break;
+    }
+}
+
+/*
+ * an unparsed body is only tokenized: every identifier in it counts as
+ * used, and includes are found by their tokens. its token values go to
+ * the parser's arena, like the ones lf_parse_body would make
+ */
+static void walk_lazy_body(lfShaker *S, lfFunctionNode *f) {
+    lfParser *parser = S->L->parser;
+    lfArray(lfToken) tokens = array_new(&S->L->allocator, lfToken);
+    if (!lf_tokenize_range(&tokens, &parser->arena_allocator, &parser->diagnostics, S->chunk->source, f->body_start, f->body_end, S->chunk->file)) {
+        /* the preparse tokenized the same range, so this never happens */
+        S->errored = true;
+        array_delete(&tokens);
+        return;
+    }
+    lfArray(lfImportNode) imports = array_new(&S->L->allocator, lfImportNode);
+    for (int i = 0; i < length(&tokens); i++) {
+        if (tokens[i].type == TT_IDENTIFIER) {
+            use(S, tokens[i].value);
+        } else if (tokens[i].type == TT_KEYWORD && !strcmp(tokens[i].value, "include") && tokens[i + 1].type == TT_IDENTIFIER) {
+            /* enough of the node lf_parse_body will make for lf_load_include */
+            lfImportNode import = (lfImportNode) {
+                .type = NT_IMPORT,
+                .lineno = 0,
+                .path = array_new(&S->L->allocator, lfToken),
+                .module = NULL
+            };
+            array_push(&import.path, tokens[i + 1]);
+            i += 1;
+            while (tokens[i + 1].type == TT_DOT && tokens[i + 2].type == TT_IDENTIFIER) {
+                array_push(&import.path, tokens[i + 2]);
+                i += 2;
+            }
+            array_push(&imports, import);
+        }
+    }
+    array_delete(&tokens);
+    /* loading parses, which reuses the parser's token buffer but not its arena */
+    for (int i = 0; i < length(&imports); i++) {
+        include(S, &imports[i]);
+        array_delete(&imports[i].path);
+    }
+    array_delete(&imports);
+}
+
+static void walk_function(lfShaker *S, lfFunctionNode *f) {
+    for (int i = 0; i < length(&f->params); i++) {
+        walk_node(S, (lfNode *)f->params[i]);
+    }
+    walk_type(S, f->return_type);
+    if (f->lazy) {
+        walk_lazy_body(S, f);
+    } else {
+        walk_nodes(S, f->body);
+    }
+}
+
+static void walk_node(lfShaker *S, lfNode *node) {
+    switch (node->type) {
+        case NT_INT:
+        case NT_FLOAT:
+        case NT_STRING:
+        case NT_YIELD:
+            break;
+        case NT_ARRAY:
+            walk_nodes(S, ((lfArrayNode *)node)->values);
+            break;
+        case NT_MAP:
+            walk_nodes(S, ((lfMapNode *)node)->keys);
+            walk_nodes(S, ((lfMapNode *)node)->values);
+            break;
+        case NT_UNARYOP:
+            walk_node(S, ((lfUnaryOpNode *)node)->value);
+            break;
+        case NT_BINARYOP:
+            walk_node(S, ((lfBinaryOpNode *)node)->lhs);
+            walk_node(S, ((lfBinaryOpNode *)node)->rhs);
+            break;
+        case NT_VARACCESS:
+            use(S, ((lfVarAccessNode *)node)->var.value);
+            break;
+        case NT_VARDECL: {
+            lfVarDeclNode *decl = (lfVarDeclNode *)node;
+            walk_type(S, decl->vartype);
+            if (decl->initializer) {
+                walk_node(S, decl->initializer);
+            }
+        } break;
+        case NT_SUBSCRIBE:
+            walk_node(S, ((lfSubscriptionNode *)node)->object);
+            walk_node(S, ((lfSubscriptionNode *)node)->index);
+            break;
+        case NT_ASSIGN: {
+            lfAssignNode *assign = (lfAssignNode *)node;
+            use(S, assign->var.value);
+            walk_node(S, assign->value);
+        } break;
+        case NT_OBJASSIGN:
+            walk_node(S, ((lfObjectAssignNode *)node)->object);
+            walk_node(S, ((lfObjectAssignNode *)node)->key);
+            walk_node(S, ((lfObjectAssignNode *)node)->value);
+            break;
+        case NT_CALL:
+            walk_node(S, ((lfCallNode *)node)->func);
+            walk_nodes(S, ((lfCallNode *)node)->args);
+            break;
+        case NT_FUNC:
+            walk_function(S, (lfFunctionNode *)node);
+            break;
+        case NT_IF: {
+            lfIfNode *ifnode = (lfIfNode *)node;
+            walk_node(S, ifnode->condition);
+            walk_node(S, ifnode->body);
+            if (ifnode->else_body) {
+                walk_node(S, ifnode->else_body);
+            }
+        } break;
+        case NT_WHILE:
+            walk_node(S, ((lfWhileNode *)node)->condition);
+            walk_node(S, ((lfWhileNode *)node)->body);
+            break;
+        case NT_RETURN: {
+            lfReturnNode *ret = (lfReturnNode *)node;
+            if (ret->value) {
+                walk_node(S, ret->value);
+            }
+        } break;
+        case NT_AWAIT:
+            walk_node(S, ((lfAwaitNode *)node)->value);
+            break;
+        case NT_CLASS:
+            /* members are only reached through instances, so a class is kept whole */
+            walk_nodes(S, ((lfClassNode *)node)->body);
+            break;
+        case NT_COMPOUND:
+            walk_nodes(S, ((lfCompoundNode *)node)->statements);
+            break;
+        case NT_IMPORT:
+            include(S, (lfImportNode *)node);
+            break;
+    }
+}
+
+/* everything at a chunk's top level runs when it is included, except declarations */
+static void scan_chunk(lfShaker *S, lfChunk *chunk) {
+    S->chunk = chunk;
+    lfArray(lfNode *) statements = ((lfCompoundNode *)chunk->ast)->statements;
+    for (int i = 0; i < length(&statements); i++) {
+        lfNode *node = statements[i];
+        if (node->type == NT_FUNC) {
+            declare(S, node, ((lfFunctionNode *)node)->name.value);
+        } else if (node->type == NT_CLASS) {
+            declare(S, node, ((lfClassNode *)node)->name.value);
+        } else {
+            walk_node(S, node);
+        }
+    }
+}
+
+/* drops the declarations never reached from the chunks' top levels */
+static void remove_unreached(lfShaker *S, FILE *report) {
+    int removed[2] = { 0, 0 }; /* functions, classes */
+    int total[2] = { 0, 0 };
+    int nodes = 0;
+    int decl = 0;
+    for (int c = 0; c < length(&S->chunks); c++) {
+        lfChunk *chunk = S->chunks[c];
+        lfArray(lfNode *) *statements = &((lfCompoundNode *)chunk->ast)->statements;
+        int kept = 0;
+        for (int i = 0; i < length(statements); i++) {
+            lfNode *node = (*statements)[i];
+            if (node->type == NT_FUNC || node->type == NT_CLASS) {
+                int kind = node->type == NT_CLASS;
+                total[kind] += 1;
+                /* chunks were scanned in this order, declaring as they went */
+                bool reached = S->decls[decl++].reached;
+                if (!reached) {
+                    removed[kind] += 1;
+                    nodes += lf_node_count(node);
+                    if (report) {
+                        const char *name = kind ? ((lfClassNode *)node)->name.value : ((lfFunctionNode *)node)->name.value;
+                        fprintf(report, "shake: %s:%d: removed %s %s\n", chunk->file, node->lineno, kind ? "class" : "fn", name);
+                    }
+                    continue;
+                }
+            }
+            (*statements)[kept++] = node;
+        }
+        length(statements) = kept;
+    }
+    if (report) {
+        fprintf(
+            report, "shake: removed %d of %d functions and %d of %d classes, %d nodes, from %d files\n",
+            removed[0], total[0], removed[1], total[1], nodes, length(&S->chunks)
+        );
+    }
+}
+
+bool lf_shake(lfState *L, lfChunk *chunk, FILE *report) {
+    lfShaker S = (lfShaker) {
+        .L = L,
+        .names = lf_malloc(&L->allocator, SHAKE_MIN_NAMES * sizeof(lfShakeName)),
+        .capacity = SHAKE_MIN_NAMES,
+        .count = 0,
+        .decls = array_new(&L->allocator, lfShakeDecl),
+        .reached = array_new(&L->allocator, int),
+        .chunks = array_new(&L->allocator, lfChunk *),
+        .scanned = 0,
+        .chunk = chunk,
+        .errored = false
+    };
+    memset(S.names, 0, SHAKE_MIN_NAMES * sizeof(lfShakeName));
+    array_push(&S.chunks, chunk);
+
+    /* walks whatever was reached last, so a long call chain never recurses */
+    while (!S.errored && (length(&S.reached) > 0 || S.scanned < length(&S.chunks))) {
+        if (length(&S.reached) > 0) {
+            lfShakeDecl *decl = &S.decls[S.reached[--length(&S.reached)]];
+            S.chunk = decl->chunk;
+            walk_node(&S, decl->node);
+        } else {
+            scan_chunk(&S, S.chunks[S.scanned++]);
+        }
+    }
+    if (!S.errored) {
+        remove_unreached(&S, report);
+    }
+
+    lf_free(&L->allocator, S.names, S.capacity * sizeof(lfShakeName));
+    array_delete(&S.decls);
+    array_delete(&S.reached);
+    array_delete(&S.chunks);
+    return !S.errored;
+}
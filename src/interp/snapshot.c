@@ -0,0 +1,424 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* dl_iterate_phdr */
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "interp/snapshot.h"
+#include "interp/coro.h"
+#include "interp/gc.h"
+#include "interp/jit.h"
+#include "parser/parse.h"
+#include "lib/alloc.h"
+#include "lib/arena.h"
+#include "lib/array.h"
+
+static void report(const lfDiagnosticSink *sink, const char *path, const char *message) {
+    lfDiagnostic diagnostic = (lfDiagnostic) {
+        .file = path,
+        .source = "",
+        .idx_start = 0,
+        .idx_end = 0,
+        .line = 0,
+        .column = 0,
+        .message = message
+    };
+    sink->report(sink->userdata, &diagnostic);
+}
+
+#if LF_SNAPSHOT_SUPPORTED
+
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
+#define REGION_ALIGN 16
+#define align_up(N) (((N) + (REGION_ALIGN - 1)) & ~(size_t)(REGION_ALIGN - 1))
+#define BUILD_ID_MAX 32
+
+/* the loaded object leaf is part of: the executable, or libleaf */
+typedef struct lfImage {
+    uintptr_t anchor; /* an address inside, to find it by */
+    uintptr_t start;
+    uintptr_t end;
+    uint8_t build_id[BUILD_ID_MAX];
+    uint32_t build_id_length; /* 0 if it was linked without one */
+} lfImage;
+
+/*
+ * the start of the region, and so of the file: what the image must match
+ * for the snapshot to be loaded, then the allocator handing out the rest
+ */
+typedef struct lfRegion {
+    char magic[8];
+    uint32_t version;
+    uint32_t state_size;
+    uintptr_t image_start; /* where the image was when the snapshot was written */
+    uintptr_t image_size;
+    uintptr_t anchor_offset;
+    uint8_t build_id[BUILD_ID_MAX];
+    uint32_t build_id_length;
+    lfState *L;
+    size_t relocations; /* word indices into the region, as uint32_t, following it in the file */
+    size_t relocations_at; /* file offset, past the region's last page */
+
+    bool filling; /* false once loaded */
+    size_t used; /* bytes, this header included */
+    size_t last; /* offset of the latest allocation, the only one that can grow in place or be given back */
+    size_t mapped;
+    lfAllocator host; /* what a loaded state allocates from */
+} lfRegion;
+
+static const char magic[8] = { 'l', 'e', 'a', 'f', 's', 'n', 'a', 'p' };
+
+/*
+ * while filling, a bump allocator, which zeroes what is freed so that
+ * pages of nothing but garbage become holes in the file. once loaded,
+ * everything new comes from the host allocator, and the snapshot's blocks
+ * are copied out of it when they grow and left alone when they are freed
+ */
+static void *region_realloc(void *userdata, void *ptr, size_t old_size, size_t new_size) {
+    lfRegion *R = userdata;
+    uint8_t *base = (uint8_t *)R;
+    if (!R->filling) {
+        if (ptr == NULL || (uint8_t *)ptr < base || (uint8_t *)ptr >= base + R->mapped) {
+            return lf_realloc(&R->host, ptr, old_size, new_size);
+        }
+        if (new_size == 0) {
+            return NULL;
+        }
+        void *moved = lf_malloc(&R->host, new_size);
+        if (moved) {
+            memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+        }
+        return moved;
+    }
+
+    size_t at = ptr ? (size_t)((uint8_t *)ptr - base) : 0;
+    if (new_size == 0) {
+        if (ptr && at == R->last) {
+            R->used = R->last;
+        }
+        if (ptr) {
+            memset(ptr, 0, old_size);
+        }
+        return NULL;
+    }
+    if (ptr && at == R->last && at + new_size <= R->mapped) {
+        R->used = align_up(at + new_size);
+        return ptr;
+    }
+    if (R->used + new_size > R->mapped) {
+        return NULL;
+    }
+    void *block = base + R->used;
+    if (ptr) {
+        memcpy(block, ptr, old_size < new_size ? old_size : new_size);
+        memset(ptr, 0, old_size);
+    }
+    R->last = R->used;
+    R->used = align_up(R->used + new_size);
+    return block;
+}
+
+static int find_image_in(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    lfImage *image = data;
+    uintptr_t start = UINTPTR_MAX;
+    uintptr_t end = 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_LOAD) {
+            uintptr_t from = info->dlpi_addr + phdr->p_vaddr;
+            start = from < start ? from : start;
+            end = from + phdr->p_memsz > end ? from + phdr->p_memsz : end;
+        }
+    }
+    if (image->anchor < start || image->anchor >= end) {
+        return 0;
+    }
+    image->start = start;
+    image->end = end;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_NOTE) {
+            continue;
+        }
+        const uint8_t *p = (const uint8_t *)(info->dlpi_addr + phdr->p_vaddr);
+        const uint8_t *stop = p + phdr->p_memsz;
+        while (p + sizeof(ElfW(Nhdr)) <= stop) {
+            const ElfW(Nhdr) *note = (const ElfW(Nhdr) *)p;
+            const uint8_t *name = p + sizeof(ElfW(Nhdr));
+            const uint8_t *desc = name + ((note->n_namesz + 3) & ~3u);
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && !memcmp(name, "GNU", 4)) {
+                image->build_id_length = note->n_descsz < BUILD_ID_MAX ? note->n_descsz : BUILD_ID_MAX;
+                memcpy(image->build_id, desc, image->build_id_length);
+            }
+            p = desc + ((note->n_descsz + 3) & ~3u);
+        }
+    }
+    return 1;
+}
+
+static bool find_image(lfImage *image) {
+    memset(image, 0, sizeof(lfImage));
+    image->anchor = (uintptr_t)(void *)&region_realloc;
+    return dl_iterate_phdr(find_image_in, image) != 0;
+}
+
+/* a region at the fixed address, or NULL if that is taken */
+static void *map_at_base(size_t size, int prot, int flags, int fd) {
+    void *base = mmap((void *)LF_SNAPSHOT_BASE, size, prot, flags, fd, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    if ((uintptr_t)base != LF_SNAPSHOT_BASE) {
+        munmap(base, size);
+        return NULL;
+    }
+    return base;
+}
+
+lfState *lf_snapshot_state_new(const lfDiagnosticSink *diagnostics) {
+    lfRegion *R = map_at_base(LF_SNAPSHOT_RESERVE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1);
+    if (R == NULL) {
+        report(diagnostics, "<snapshot>", "cannot reserve the address range snapshots live at");
+        return NULL;
+    }
+    R->filling = true;
+    R->used = align_up(sizeof(lfRegion));
+    R->last = R->used;
+    R->mapped = LF_SNAPSHOT_RESERVE;
+    lfAllocator allocator = (lfAllocator) {
+        .realloc = region_realloc,
+        .userdata = R
+    };
+    lfState *L = lf_state_new(&allocator, diagnostics);
+    if (L == NULL) {
+        munmap(R, LF_SNAPSHOT_RESERVE);
+        return NULL;
+    }
+    L->jit = false;
+    R->L = L;
+    return L;
+}
+
+static bool all_zero(const uint8_t *p, size_t n) {
+    const uint64_t *words = (const uint64_t *)p;
+    for (size_t i = 0; i < n / 8; i++) {
+        if (words[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void relocate(lfRegion *R, lfArray(uint32_t) *relocations, const void *word) {
+    uint32_t index = (uint32_t)(((const uint8_t *)word - (const uint8_t *)R) / sizeof(uintptr_t));
+    array_push(relocations, index);
+}
+
+/*
+ * the words of the region holding addresses of leaf's code: those of the
+ * allocators and diagnostic sinks of the state and its parser. nothing
+ * else may hold one; arrays keep their deleters as offsets and values
+ * their natives as indices
+ */
+static void collect_relocations(lfRegion *R, lfState *L, lfArray(uint32_t) *relocations) {
+    lfParser *parser = L->parser;
+    relocate(R, relocations, &L->allocator.realloc);
+    relocate(R, relocations, &L->diagnostics.report);
+    relocate(R, relocations, &parser->allocator.realloc);
+    relocate(R, relocations, &parser->diagnostics.report);
+    relocate(R, relocations, &parser->arena.parent.realloc);
+    relocate(R, relocations, &parser->arena_allocator.realloc);
+    for (int i = 0; i < LF_TOKENIZE_MAX_THREADS; i++) {
+        relocate(R, relocations, &parser->lexer_allocators[i].realloc);
+    }
+    for (int i = 0; i < LF_TOKENIZE_MAX_THREADS - 1; i++) {
+        relocate(R, relocations, &parser->lexer_arenas[i].parent.realloc);
+    }
+}
+
+static bool write_at(int fd, const void *data, size_t n, size_t at) {
+    const uint8_t *p = data;
+    while (n > 0) {
+        ssize_t written = pwrite(fd, p, n, (off_t)at);
+        if (written <= 0) {
+            return false;
+        }
+        p += written;
+        at += written;
+        n -= written;
+    }
+    return true;
+}
+
+bool lf_snapshot_write(lfState *L, const char *path) {
+    lfRegion *R = L->allocator.userdata;
+    if (L->allocator.realloc != region_realloc || !R->filling) {
+        report(&L->diagnostics, path, "only a state made for a snapshot can be written to one");
+        return false;
+    }
+    if (L->nframes > 0 || L->isolate || L->profile || length(&L->code) > 0) {
+        report(&L->diagnostics, path, "cannot snapshot a state that is running, in an isolate group, profiled or holding machine code");
+        return false;
+    }
+    if (L->scheduler && length(&L->scheduler->live) > 0) {
+        report(&L->diagnostics, path, "cannot snapshot coroutines that never finished");
+        return false;
+    }
+    /* its stacks and event loop are made again once something spawns */
+    lf_coro_free(L);
+    lf_gc_collect(L);
+
+    lfImage image;
+    if (!find_image(&image)) {
+        report(&L->diagnostics, path, "cannot find leaf's own image to relocate against");
+        return false;
+    }
+    memcpy(R->magic, magic, sizeof(magic));
+    R->version = LF_SNAPSHOT_VERSION;
+    R->state_size = sizeof(lfState);
+    R->image_start = image.start;
+    R->image_size = image.end - image.start;
+    R->anchor_offset = image.anchor - image.start;
+    memcpy(R->build_id, image.build_id, BUILD_ID_MAX);
+    R->build_id_length = image.build_id_length;
+
+    lfArray(uint32_t) relocations = array_new(&lf_default_allocator, uint32_t);
+    collect_relocations(R, L, &relocations);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t used = R->used;
+    R->relocations = length(&relocations);
+    R->relocations_at = (used + page - 1) / page * page;
+
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.%ld", path, (long)getpid());
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0;
+    for (size_t at = 0; ok && at < used; at += page) {
+        size_t n = used - at < page ? used - at : page;
+        if (at == 0 || !all_zero((const uint8_t *)R + at, n)) {
+            ok = write_at(fd, (const uint8_t *)R + at, n, at);
+        }
+    }
+    size_t table = R->relocations * sizeof(uint32_t);
+    ok = ok && write_at(fd, relocations, table, R->relocations_at);
+    ok = ok && ftruncate(fd, (off_t)(R->relocations_at + table)) == 0;
+    if (fd >= 0) {
+        ok = close(fd) == 0 && ok;
+    }
+    ok = ok && rename(temporary, path) == 0;
+    if (!ok) {
+        unlink(temporary);
+        report(&L->diagnostics, path, "cannot write snapshot");
+    }
+    array_delete(&relocations);
+    return ok;
+}
+
+lfState *lf_snapshot_load(const char *path, const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, FILE *out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        report(diagnostics, path, "cannot read snapshot");
+        return NULL;
+    }
+    lfRegion header;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+        || memcmp(header.magic, magic, sizeof(magic)) || header.version != LF_SNAPSHOT_VERSION) {
+        close(fd);
+        report(diagnostics, path, "not a snapshot");
+        return NULL;
+    }
+    lfImage image;
+    if (!find_image(&image) || header.state_size != sizeof(lfState) || header.image_size != image.end - image.start
+        || header.anchor_offset != image.anchor - image.start || header.build_id_length != image.build_id_length
+        || memcmp(header.build_id, image.build_id, image.build_id_length)) {
+        close(fd);
+        report(diagnostics, path, "snapshot was written by another build of leaf");
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < header.relocations_at + header.relocations * sizeof(uint32_t)) {
+        close(fd);
+        report(diagnostics, path, "snapshot is truncated");
+        return NULL;
+    }
+    lfRegion *R = map_at_base(size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd);
+    close(fd);
+    if (R == NULL) {
+        report(diagnostics, path, "cannot map snapshot at the address it was written from");
+        return NULL;
+    }
+
+    uintptr_t delta = image.start - header.image_start;
+    if (delta != 0) {
+        uintptr_t *words = (uintptr_t *)R;
+        const uint32_t *relocations = (const uint32_t *)((uint8_t *)R + R->relocations_at);
+        for (size_t i = 0; i < R->relocations; i++) {
+            words[relocations[i]] += delta;
+        }
+    }
+    R->filling = false;
+    R->mapped = size;
+    R->host = *allocator;
+
+    lfState *L = R->L;
+    L->diagnostics = *diagnostics;
+    L->parser->diagnostics = *diagnostics;
+    L->out = out;
+    L->jit = LF_JIT_SUPPORTED;
+    L->shake = NULL;
+    L->ir_dump = NULL;
+    L->opt_stats = (lfOptStats) {0};
+    return L;
+}
+
+void lf_snapshot_state_delete(lfState *L) {
+    lfRegion *R = L->allocator.userdata;
+    size_t mapped = R->mapped;
+    lf_state_delete(L);
+    munmap(R, mapped);
+}
+
+#else
+
+lfState *lf_snapshot_state_new(const lfDiagnosticSink *diagnostics) {
+    report(diagnostics, "<snapshot>", "snapshots are not supported here");
+    return NULL;
+}
+
+bool lf_snapshot_write(lfState *L, const char *path) {
+    report(&L->diagnostics, path, "snapshots are not supported here");
+    return false;
+}
+
+lfState *lf_snapshot_load(const char *path, const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, FILE *out) {
+    (void)allocator;
+    (void)out;
+    report(diagnostics, path, "snapshots are not supported here");
+    return NULL;
+}
+
+void lf_snapshot_state_delete(lfState *L) {
+    lf_state_delete(L);
+}
+
+#endif /* LF_SNAPSHOT_SUPPORTED */
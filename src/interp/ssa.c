@@ -0,0 +1,1198 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "interp/escape.h"
+#include "interp/ssa.h"
+#include "interp/state.h"
+#include "parser/node.h"
+#include "lib/alloc.h"
+#include "lib/array.h"
+
+/*
+ * a body is walked once in evaluation order and put in SSA form as it goes,
+ * after Braun et al.: a read looks for the latest definition in its block,
+ * then in its predecessors, placing a phi where they join, and a loop
+ * header's phis are completed once its back edge is known. phis that only
+ * ever see one definition are folded away. leaf has no break or continue,
+ * so blocks are made in an order where a block's dominators come before it,
+ * and instructions in the order they run
+ */
+
+typedef enum lfIrKind {
+    IR_ENTRY, /* a variable on entry: an argument, or null */
+    IR_CONST, /* a literal, or null */
+    IR_READ, /* a use of a variable, seeing one of its definitions */
+    IR_STORE, /* a definition of a variable, by assignment or declaration */
+    IR_PHI,
+    IR_ARITH, /* proven int or float arithmetic, or a not, none of which has side effects */
+    IR_OPAQUE /* anything else, a value of its own */
+} lfIrKind;
+
+typedef struct lfIrInst {
+    lfIrKind kind;
+    int block;
+    int var; /* entry, read, store, phi: the slot */
+    int a; /* read: the definition it sees; store: the value; phi: the definition it was folded into, or -1; arith: an operand */
+    int b; /* arith: the second operand, -1 for a unary one */
+    lfArray(int) operands; /* phi: a definition per predecessor */
+    lfNode *node;
+    lfNode **site; /* arith: where node sits, to be rewritten */
+    int statement; /* read: the removable statement it is in, -1 for none */
+    int parent; /* arith: the arith using it, or -1 */
+    int number; /* arith: the earliest equal arith dominating it, itself if none */
+    int temp; /* arith: the slot its value is kept in, or -1 */
+    bool fails; /* arith: int division, which raises on zero */
+    bool hoisted; /* arith: moved before its loop */
+    bool eliminated; /* arith: replaced by number's value */
+} lfIrInst;
+
+typedef struct lfIrBlock {
+    lfArray(int) preds;
+    lfArray(int) defs; /* by slot: the latest definition in the block, or -1 */
+    lfArray(int) incomplete; /* phis waiting for the block to be sealed */
+    lfArray(int) stores; /* in the order they run */
+    int idom; /* a block dominating it, -1 for the entry */
+    int loop; /* the innermost loop it is in, or -1 */
+    bool sealed; /* all its predecessors are known */
+} lfIrBlock;
+
+typedef struct lfIrLoop {
+    lfNode **site; /* of the while statement */
+    int preheader; /* the block the loop is entered from */
+    lfArray(lfNode *) hoisted; /* computations placed before it, NULL for none */
+} lfIrLoop;
+
+/* a statement that may turn out to be removable */
+typedef struct lfIrStatement {
+    lfArray(lfNode *) *list;
+    int index;
+    int def; /* the store it makes, or -1 */
+    bool unreachable;
+    bool removed;
+} lfIrStatement;
+
+typedef struct lfSsa {
+    lfState *L;
+    const char *name;
+    int lineno;
+    int nvars; /* slots before temporaries were added */
+    int *nslots; /* of the body, which temporaries are added to */
+    lfArray(lfIrInst) insts;
+    lfArray(lfIrBlock) blocks;
+    lfArray(lfIrLoop) loops;
+    lfArray(lfIrStatement) statements;
+    lfArray(int) entries; /* by slot: its entry definition, or -1 */
+    lfArray(const char *) names; /* by slot, for dumps */
+    int current; /* the block being walked, -1 past a return */
+    int loop; /* the innermost loop being walked, or -1 */
+    int statement; /* see lfIrInst.statement */
+} lfSsa;
+
+static bool tracked(const lfSsa *S, const lfVarRef *ref) {
+    return ref->kind == VK_LOCAL && !ref->captured && ref->slot < S->nvars;
+}
+
+static int inst_new(lfSsa *S, lfIrKind kind, int var, lfNode *node) {
+    lfIrInst inst = {
+        .kind = kind,
+        .block = S->current,
+        .var = var,
+        .a = -1,
+        .b = -1,
+        .operands = NULL,
+        .node = node,
+        .site = NULL,
+        .statement = -1,
+        .parent = -1,
+        .number = -1,
+        .temp = -1
+    };
+    array_push(&S->insts, inst);
+    return length(&S->insts) - 1;
+}
+
+static int block_new(lfSsa *S, int idom, int loop, bool sealed) {
+    lfIrBlock block = {
+        .preds = array_new(&S->L->allocator, int),
+        .defs = array_new(&S->L->allocator, int),
+        .incomplete = array_new(&S->L->allocator, int),
+        .stores = array_new(&S->L->allocator, int),
+        .idom = idom,
+        .loop = loop,
+        .sealed = sealed
+    };
+    array_reserve(&block.defs, S->nvars);
+    for (int i = 0; i < S->nvars; i++) {
+        block.defs[i] = -1;
+    }
+    length(&block.defs) = S->nvars;
+    array_push(&S->blocks, block);
+    return length(&S->blocks) - 1;
+}
+
+static void edge(lfSsa *S, int from, int to) {
+    array_push(&S->blocks[to].preds, from);
+}
+
+static void name_slot(lfSsa *S, int slot, const char *name) {
+    if (S->names[slot] == NULL) {
+        S->names[slot] = name;
+    }
+}
+
+/* a folded phi stands for the definition it was folded into */
+static int find(const lfSsa *S, int def) {
+    while (S->insts[def].kind == IR_PHI && S->insts[def].a >= 0) {
+        def = S->insts[def].a;
+    }
+    return def;
+}
+
+/* the instruction whose value a read, store or folded phi has */
+static int value_of(const lfSsa *S, int i) {
+    for (;;) {
+        const lfIrInst *inst = &S->insts[i];
+        if (inst->kind == IR_READ || inst->kind == IR_STORE || (inst->kind == IR_PHI && inst->a >= 0)) {
+            i = inst->a;
+        } else {
+            return i;
+        }
+    }
+}
+
+static int entry(lfSsa *S, int var) {
+    if (S->entries[var] < 0) {
+        int current = S->current;
+        S->current = 0;
+        S->entries[var] = inst_new(S, IR_ENTRY, var, NULL);
+        S->current = current;
+    }
+    return S->entries[var];
+}
+
+static int read_variable(lfSsa *S, int var, int block);
+
+/* folds phi into the one definition its operands see besides itself, if there is just one */
+static int fold_phi(lfSsa *S, int phi) {
+    int same = -1;
+    lfArray(int) operands = S->insts[phi].operands;
+    for (int i = 0; i < length(&operands); i++) {
+        int op = find(S, operands[i]);
+        if (op == same || op == phi) {
+            continue;
+        }
+        if (same >= 0) {
+            return phi;
+        }
+        same = op;
+    }
+    if (same < 0) {
+        same = entry(S, S->insts[phi].var);
+    }
+    S->insts[phi].a = same;
+    return same;
+}
+
+static int complete_phi(lfSsa *S, int phi) {
+    int block = S->insts[phi].block;
+    int var = S->insts[phi].var;
+    for (int i = 0; i < length(&S->blocks[block].preds); i++) {
+        int op = read_variable(S, var, S->blocks[block].preds[i]);
+        array_push(&S->insts[phi].operands, op);
+    }
+    return fold_phi(S, phi);
+}
+
+static int phi_new(lfSsa *S, int var, int block) {
+    int current = S->current;
+    S->current = block;
+    int phi = inst_new(S, IR_PHI, var, NULL);
+    S->current = current;
+    S->insts[phi].operands = array_new(&S->L->allocator, int);
+    return phi;
+}
+
+static int read_variable(lfSsa *S, int var, int block) {
+    int def = S->blocks[block].defs[var];
+    if (def >= 0) {
+        return def;
+    }
+    if (!S->blocks[block].sealed) {
+        def = phi_new(S, var, block);
+        array_push(&S->blocks[block].incomplete, def);
+    } else if (length(&S->blocks[block].preds) == 0) {
+        def = entry(S, var);
+    } else if (length(&S->blocks[block].preds) == 1) {
+        def = read_variable(S, var, S->blocks[block].preds[0]);
+    } else {
+        /* in place before its operands are read, which may lead back here around a loop */
+        def = phi_new(S, var, block);
+        S->blocks[block].defs[var] = def;
+        def = complete_phi(S, def);
+    }
+    S->blocks[block].defs[var] = def;
+    return def;
+}
+
+static void seal(lfSsa *S, int block) {
+    for (int i = 0; i < length(&S->blocks[block].incomplete); i++) {
+        complete_phi(S, S->blocks[block].incomplete[i]);
+    }
+    S->blocks[block].sealed = true;
+}
+
+static int store(lfSsa *S, int var, int value, lfNode *node, const char *name) {
+    int def = inst_new(S, IR_STORE, var, node);
+    S->insts[def].a = value;
+    S->blocks[S->current].defs[var] = def;
+    array_push(&S->blocks[S->current].stores, def);
+    name_slot(S, var, name);
+    return def;
+}
+
+static int opaque(lfSsa *S, lfNode *node) {
+    return inst_new(S, IR_OPAQUE, -1, node);
+}
+
+static int arith(lfSsa *S, lfNode **site, int a, int b, bool fails) {
+    int i = inst_new(S, IR_ARITH, -1, *site);
+    lfIrInst *inst = &S->insts[i];
+    inst->a = a;
+    inst->b = b;
+    inst->site = site;
+    inst->number = i;
+    inst->fails = fails;
+    if (S->insts[a].kind == IR_ARITH) {
+        S->insts[a].parent = i;
+    }
+    if (b >= 0 && S->insts[b].kind == IR_ARITH) {
+        S->insts[b].parent = i;
+    }
+    return i;
+}
+
+/* binary operators of proven operands that can neither fail nor have side effects; int division only fails */
+static bool pure_binary(const lfBinaryOpNode *binop) {
+    switch (binop->op.type) {
+        case TT_ADD: case TT_SUB: case TT_MUL: case TT_DIV:
+        case TT_EQ: case TT_NE: case TT_LT: case TT_GT: case TT_LE: case TT_GE:
+            return binop->operands == TS_INT || binop->operands == TS_FLOAT;
+        case TT_LSHIFT: case TT_RSHIFT:
+            return binop->operands == TS_INT;
+        default:
+            return false;
+    }
+}
+
+static bool pure_unary(const lfUnaryOpNode *unop) {
+    return unop->op.type == TT_NOT || unop->operand == TS_INT || unop->operand == TS_FLOAT;
+}
+
+static int walk_expr(lfSsa *S, lfNode **site);
+
+static void walk_exprs(lfSsa *S, lfArray(lfNode *) nodes) {
+    for (int i = 0; i < length(&nodes); i++) {
+        walk_expr(S, &nodes[i]);
+    }
+}
+
+static int walk_read(lfSsa *S, lfVarAccessNode *access) {
+    int var = access->ref.slot;
+    name_slot(S, var, access->var.value);
+    int def = read_variable(S, var, S->current);
+    int read = inst_new(S, IR_READ, var, (lfNode *)access);
+    S->insts[read].a = def;
+    S->insts[read].statement = S->statement;
+    return read;
+}
+
+/* the instruction giving the value of the expression at *site, in evaluation order */
+static int walk_expr(lfSsa *S, lfNode **site) {
+    lfNode *node = *site;
+    switch (node->type) {
+        case NT_INT:
+        case NT_FLOAT:
+            return inst_new(S, IR_CONST, -1, node);
+        case NT_VARACCESS: {
+            lfVarAccessNode *access = (lfVarAccessNode *)node;
+            return tracked(S, &access->ref) ? walk_read(S, access) : opaque(S, node);
+        }
+        case NT_UNARYOP: {
+            lfUnaryOpNode *unop = (lfUnaryOpNode *)node;
+            int a = walk_expr(S, &unop->value);
+            return pure_unary(unop) ? arith(S, site, a, -1, false) : opaque(S, node);
+        }
+        case NT_BINARYOP: {
+            lfBinaryOpNode *binop = (lfBinaryOpNode *)node;
+            int a = walk_expr(S, &binop->lhs);
+            int b = walk_expr(S, &binop->rhs);
+            if (!pure_binary(binop)) {
+                return opaque(S, node);
+            }
+            return arith(S, site, a, b, binop->operands == TS_INT && binop->op.type == TT_DIV);
+        }
+        case NT_ASSIGN: {
+            lfAssignNode *assign = (lfAssignNode *)node;
+            int value = walk_expr(S, &assign->value);
+            if (!tracked(S, &assign->ref)) {
+                return opaque(S, node);
+            }
+            /* a guard may turn an int into a float */
+            if (assign->guard) {
+                value = opaque(S, node);
+            }
+            return store(S, assign->ref.slot, value, node, assign->var.value);
+        }
+        case NT_SUBSCRIBE: {
+            lfSubscriptionNode *sub = (lfSubscriptionNode *)node;
+            walk_expr(S, &sub->object);
+            walk_expr(S, &sub->index);
+            return opaque(S, node);
+        }
+        case NT_OBJASSIGN: {
+            lfObjectAssignNode *assign = (lfObjectAssignNode *)node;
+            walk_expr(S, &assign->object);
+            walk_expr(S, &assign->key);
+            walk_expr(S, &assign->value);
+            return opaque(S, node);
+        }
+        case NT_CALL: {
+            lfCallNode *call = (lfCallNode *)node;
+            walk_expr(S, &call->func);
+            walk_exprs(S, call->args);
+            return opaque(S, node);
+        }
+        case NT_ARRAY:
+            walk_exprs(S, ((lfArrayNode *)node)->values);
+            return opaque(S, node);
+        case NT_MAP: {
+            lfMapNode *map = (lfMapNode *)node;
+            for (int i = 0; i < length(&map->keys); i++) {
+                walk_expr(S, &map->keys[i]);
+                walk_expr(S, &map->values[i]);
+            }
+            return opaque(S, node);
+        }
+        case NT_AWAIT:
+            walk_expr(S, &((lfAwaitNode *)node)->value);
+            return opaque(S, node);
+        default:
+            return opaque(S, node);
+    }
+}
+
+static int statement_new(lfSsa *S, lfArray(lfNode *) *list, int index, bool unreachable) {
+    lfIrStatement statement = {.list = list, .index = index, .def = -1, .unreachable = unreachable, .removed = false};
+    array_push(&S->statements, statement);
+    return length(&S->statements) - 1;
+}
+
+static void walk_statement(lfSsa *S, lfArray(lfNode *) *list, int index, lfNode **site);
+
+static void walk_list(lfSsa *S, lfArray(lfNode *) *list) {
+    for (int i = 0; i < length(list); i++) {
+        if (S->current < 0) {
+            statement_new(S, list, i, true);
+        } else {
+            walk_statement(S, list, i, &(*list)[i]);
+        }
+    }
+}
+
+static void walk_if(lfSsa *S, lfIfNode *ifnode) {
+    walk_expr(S, &ifnode->condition);
+    int cond = S->current;
+
+    S->current = block_new(S, cond, S->loop, true);
+    edge(S, cond, S->current);
+    walk_statement(S, NULL, 0, &ifnode->body);
+    int then_end = S->current;
+
+    int else_end = cond;
+    if (ifnode->else_body) {
+        S->current = block_new(S, cond, S->loop, true);
+        edge(S, cond, S->current);
+        walk_statement(S, NULL, 0, &ifnode->else_body);
+        else_end = S->current;
+    }
+
+    if (then_end < 0 && else_end < 0) {
+        S->current = -1;
+        return;
+    }
+    S->current = block_new(S, cond, S->loop, true);
+    if (then_end >= 0) {
+        edge(S, then_end, S->current);
+    }
+    if (else_end >= 0) {
+        edge(S, else_end, S->current);
+    }
+}
+
+static void walk_while(lfSsa *S, lfWhileNode *whilenode, lfNode **site) {
+    int preheader = S->current;
+    lfIrLoop loop = {.site = site, .preheader = preheader, .hoisted = NULL};
+    array_push(&S->loops, loop);
+    int outer = S->loop;
+    S->loop = length(&S->loops) - 1;
+
+    /* the header's back edge is only known after the body */
+    int header = block_new(S, preheader, S->loop, false);
+    edge(S, preheader, header);
+    S->current = header;
+    walk_expr(S, &whilenode->condition);
+
+    S->current = block_new(S, header, S->loop, true);
+    edge(S, header, S->current);
+    walk_statement(S, NULL, 0, &whilenode->body);
+    if (S->current >= 0) {
+        edge(S, S->current, header);
+    }
+    seal(S, header);
+
+    S->loop = outer;
+    S->current = block_new(S, header, outer, true);
+    edge(S, header, S->current);
+}
+
+/* list and index locate a statement that could be removed, list is NULL for one that cannot */
+static void walk_statement(lfSsa *S, lfArray(lfNode *) *list, int index, lfNode **site) {
+    lfNode *node = *site;
+    S->statement = -1;
+    switch (node->type) {
+        case NT_VARDECL: {
+            lfVarDeclNode *decl = (lfVarDeclNode *)node;
+            int statement = list ? statement_new(S, list, index, false) : -1;
+            S->statement = statement;
+            int value = decl->initializer ? walk_expr(S, &decl->initializer) : inst_new(S, IR_CONST, -1, NULL);
+            S->statement = -1;
+            if (tracked(S, &decl->ref)) {
+                if (decl->guard) {
+                    value = opaque(S, node);
+                }
+                int def = store(S, decl->ref.slot, value, node, decl->name.value);
+                if (statement >= 0) {
+                    S->statements[statement].def = def;
+                }
+            }
+            break;
+        }
+        case NT_IF:
+            walk_if(S, (lfIfNode *)node);
+            break;
+        case NT_WHILE:
+            walk_while(S, (lfWhileNode *)node, site);
+            break;
+        case NT_RETURN:
+            if (((lfReturnNode *)node)->value) {
+                walk_expr(S, &((lfReturnNode *)node)->value);
+            }
+            S->current = -1;
+            break;
+        case NT_COMPOUND:
+            walk_list(S, &((lfCompoundNode *)node)->statements);
+            break;
+        case NT_FUNC: {
+            /* its body is a body of its own */
+            lfFunctionNode *f = (lfFunctionNode *)node;
+            if (tracked(S, &f->ref)) {
+                store(S, f->ref.slot, opaque(S, node), node, f->name.value);
+            }
+            break;
+        }
+        case NT_CLASS: {
+            /* field defaults are evaluated here, methods are bodies of their own */
+            lfClassNode *cls = (lfClassNode *)node;
+            for (int i = 0; i < length(&cls->body); i++) {
+                if (cls->body[i]->type == NT_VARDECL && ((lfVarDeclNode *)cls->body[i])->initializer) {
+                    walk_expr(S, &((lfVarDeclNode *)cls->body[i])->initializer);
+                }
+            }
+            if (tracked(S, &cls->ref)) {
+                store(S, cls->ref.slot, opaque(S, node), node, cls->name.value);
+            }
+            break;
+        }
+        case NT_YIELD:
+        case NT_IMPORT:
+            break;
+        default: {
+            int statement = list ? statement_new(S, list, index, false) : -1;
+            S->statement = statement;
+            int value = walk_expr(S, site);
+            S->statement = -1;
+            if (statement >= 0 && S->insts[value].kind == IR_STORE) {
+                S->statements[statement].def = value;
+            }
+            break;
+        }
+    }
+}
+
+/* folds phis that only turned out trivial once the phis they see were folded */
+static void fold_phis(lfSsa *S) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < length(&S->insts); i++) {
+            if (S->insts[i].kind == IR_PHI && S->insts[i].a < 0 && fold_phi(S, i) != i) {
+                changed = true;
+            }
+        }
+    }
+}
+
+static lfToken temp_name(lfSsa *S, int slot) {
+    char buffer[16];
+    int n = snprintf(buffer, sizeof(buffer), ".t%d", slot);
+    lfArray(char) name = array_new(&S->L->parser->arena_allocator, char);
+    array_reserve(&name, n + 1);
+    memcpy(name, buffer, n + 1);
+    length(&name) = n;
+    return (lfToken) {.type = TT_IDENTIFIER, .value = name};
+}
+
+static lfNode *read_node(lfSsa *S, int slot, int lineno) {
+    lfVarAccessNode *access = lf_malloc(&S->L->parser->arena_allocator, sizeof(lfVarAccessNode));
+    memset(access, 0, sizeof(lfVarAccessNode));
+    access->type = NT_VARACCESS;
+    access->lineno = lineno;
+    access->var = temp_name(S, slot);
+    access->ref = (lfVarRef) {.kind = VK_LOCAL, .depth = 0, .slot = slot, .captured = false};
+    return (lfNode *)access;
+}
+
+static lfNode *assign_node(lfSsa *S, int slot, lfNode *value) {
+    lfAssignNode *assign = lf_malloc(&S->L->parser->arena_allocator, sizeof(lfAssignNode));
+    memset(assign, 0, sizeof(lfAssignNode));
+    assign->type = NT_ASSIGN;
+    assign->lineno = value->lineno;
+    assign->var = temp_name(S, slot);
+    assign->value = value;
+    assign->ref = (lfVarRef) {.kind = VK_LOCAL, .depth = 0, .slot = slot, .captured = false};
+    return (lfNode *)assign;
+}
+
+/* the definition of var that instruction at, in block, sees; once every block is sealed */
+static int definition_at(lfSsa *S, int var, int block, int at) {
+    lfArray(int) stores = S->blocks[block].stores;
+    for (int i = length(&stores) - 1; i >= 0; i--) {
+        if (stores[i] < at && S->insts[stores[i]].var == var) {
+            return stores[i];
+        }
+    }
+    int def = S->blocks[block].defs[var];
+    if (def < 0 || S->insts[def].block != block || S->insts[def].kind == IR_PHI) {
+        return read_variable(S, var, block);
+    }
+    /* a store later in the block hides what it was entered with */
+    lfArray(int) preds = S->blocks[block].preds;
+    if (length(&preds) == 0) {
+        return entry(S, var);
+    }
+    if (length(&preds) == 1) {
+        return read_variable(S, var, preds[0]);
+    }
+    return complete_phi(S, phi_new(S, var, block));
+}
+
+/* after x = y, a read of x reads y instead, if y still holds the same value there */
+static void propagate_copies(lfSsa *S) {
+    for (int i = 0; i < length(&S->insts); i++) {
+        if (S->insts[i].kind != IR_READ) {
+            continue;
+        }
+        int copy = find(S, S->insts[i].a);
+        if (S->insts[copy].kind != IR_STORE || S->insts[S->insts[copy].a].kind != IR_READ) {
+            continue;
+        }
+        int source = S->insts[copy].a;
+        int var = S->insts[source].var;
+        if (var == S->insts[i].var) {
+            continue;
+        }
+        int def = definition_at(S, var, S->insts[i].block, i);
+        if (value_of(S, def) != value_of(S, copy)) {
+            continue;
+        }
+        lfVarAccessNode *access = (lfVarAccessNode *)S->insts[i].node;
+        const lfVarAccessNode *from = (const lfVarAccessNode *)S->insts[source].node;
+        access->var = from->var;
+        access->ref = from->ref;
+        S->insts[i].var = var;
+        S->insts[i].a = def;
+        S->L->opt_stats.copies++;
+    }
+}
+
+static bool dominates(const lfSsa *S, int a, int b) {
+    for (; b >= 0; b = S->blocks[b].idom) {
+        if (b == a) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* the value number of an operand: equal numbers, equal values */
+static int number_of(const lfSsa *S, int i) {
+    i = value_of(S, i);
+    const lfIrInst *inst = &S->insts[i];
+    if (inst->kind == IR_ARITH) {
+        return inst->number;
+    }
+    if (inst->kind != IR_CONST) {
+        return i;
+    }
+    /* the first equal literal */
+    for (int j = 0; j < i; j++) {
+        const lfIrInst *other = &S->insts[j];
+        if (other->kind != IR_CONST) {
+            continue;
+        }
+        if (inst->node == NULL || other->node == NULL) {
+            if (inst->node == other->node) {
+                return j;
+            }
+        } else if (inst->node->type == other->node->type
+                   && ((const lfLiteralNode *)inst->node)->constant.i == ((const lfLiteralNode *)other->node)->constant.i) {
+            return j;
+        }
+    }
+    return i;
+}
+
+typedef struct lfIrKey {
+    lfNodeType type;
+    lfTokenType op;
+    lfTypeSet operands;
+    int a, b;
+} lfIrKey;
+
+static lfIrKey key_of(const lfSsa *S, int i) {
+    const lfIrInst *inst = &S->insts[i];
+    lfIrKey key = {.type = inst->node->type, .a = number_of(S, inst->a), .b = inst->b >= 0 ? number_of(S, inst->b) : -1};
+    if (inst->node->type == NT_BINARYOP) {
+        key.op = ((const lfBinaryOpNode *)inst->node)->op.type;
+        key.operands = ((const lfBinaryOpNode *)inst->node)->operands;
+    } else {
+        key.op = ((const lfUnaryOpNode *)inst->node)->op.type;
+        key.operands = ((const lfUnaryOpNode *)inst->node)->operand;
+    }
+    return key;
+}
+
+static unsigned key_hash(const lfIrKey *key) {
+    unsigned h = (unsigned)key->type * 31u + (unsigned)key->op;
+    h = h * 31u + key->operands;
+    h = h * 2654435761u + (unsigned)key->a;
+    return h * 2654435761u + (unsigned)key->b;
+}
+
+/*
+ * value numbering in dominator order. an arith with the number of an earlier
+ * one dominating it is to take that one's value; as its operands are equal
+ * to that one's operands, they are all replaced along with it, and the first
+ * of each number is never inside a replaced expression
+ */
+static void number_values(lfSsa *S) {
+    int n = length(&S->insts);
+    int nbuckets = 16;
+    while (nbuckets < n * 2) {
+        nbuckets *= 2;
+    }
+    lfArray(int) buckets = array_new(&S->L->allocator, int);
+    lfArray(int) next = array_new(&S->L->allocator, int);
+    lfArray(lfIrKey) keys = array_new(&S->L->allocator, lfIrKey);
+    array_reserve(&buckets, nbuckets);
+    array_reserve(&next, n);
+    array_reserve(&keys, n);
+    length(&buckets) = nbuckets;
+    length(&next) = n;
+    length(&keys) = n;
+    for (int i = 0; i < nbuckets; i++) {
+        buckets[i] = -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        lfIrInst *inst = &S->insts[i];
+        if (inst->kind != IR_ARITH) {
+            continue;
+        }
+        keys[i] = key_of(S, i);
+        unsigned bucket = key_hash(&keys[i]) & (nbuckets - 1);
+        int found = -1;
+        for (int j = buckets[bucket]; j >= 0 && found < 0; j = next[j]) {
+            if (!memcmp(&keys[j], &keys[i], sizeof(lfIrKey)) && dominates(S, S->insts[j].block, inst->block)) {
+                found = j;
+            }
+        }
+        if (found >= 0) {
+            inst->number = found;
+            inst->eliminated = true;
+        } else {
+            next[i] = buckets[bucket];
+            buckets[bucket] = i;
+        }
+    }
+    array_delete(&buckets);
+    array_delete(&next);
+    array_delete(&keys);
+}
+
+/* whether arithmetic i, with everything it is made of, has the same value before loop as in it */
+static bool invariant(lfSsa *S, int i, int loop) {
+    switch (S->insts[i].kind) {
+        case IR_CONST:
+            return true;
+        case IR_READ: {
+            int before = read_variable(S, S->insts[i].var, S->loops[loop].preheader);
+            return value_of(S, before) == value_of(S, i);
+        }
+        case IR_ARITH:
+            /* one reusing another's value stays where that is computed */
+            return !S->insts[i].fails && !S->insts[i].eliminated
+                   && invariant(S, S->insts[i].a, loop) && (S->insts[i].b < 0 || invariant(S, S->insts[i].b, loop));
+        default:
+            return false;
+    }
+}
+
+/* marks what arithmetic i is made of as moved before loop, where its reads see other definitions */
+static void move(lfSsa *S, int i, int loop) {
+    if (S->insts[i].kind == IR_READ) {
+        int before = read_variable(S, S->insts[i].var, S->loops[loop].preheader);
+        S->insts[i].a = before;
+        S->insts[i].statement = -1;
+    } else if (S->insts[i].kind == IR_ARITH) {
+        S->insts[i].hoisted = true;
+        move(S, S->insts[i].a, loop);
+        if (S->insts[i].b >= 0) {
+            move(S, S->insts[i].b, loop);
+        }
+    }
+}
+
+static void hoist_invariants(lfSsa *S) {
+    int n = length(&S->insts);
+    lfArray(bool) movable = array_new(&S->L->allocator, bool);
+    array_reserve(&movable, n);
+    length(&movable) = n;
+    for (int i = 0; i < n; i++) {
+        int loop = S->insts[i].kind == IR_ARITH && S->insts[i].block >= 0 ? S->blocks[S->insts[i].block].loop : -1;
+        movable[i] = loop >= 0 && invariant(S, i, loop);
+    }
+    /* the largest invariant expressions; what they are made of moves along */
+    for (int i = 0; i < n; i++) {
+        if (!movable[i] || (S->insts[i].parent >= 0 && movable[S->insts[i].parent])) {
+            continue;
+        }
+        int loop = S->blocks[S->insts[i].block].loop;
+        if (S->loops[loop].hoisted == NULL) {
+            S->loops[loop].hoisted = array_new(&S->L->parser->arena_allocator, lfNode *);
+        }
+        int slot = (*S->nslots)++;
+        lfNode **site = S->insts[i].site;
+        int lineno = (*site)->lineno;
+        array_push(&S->loops[loop].hoisted, assign_node(S, slot, *site));
+        *site = read_node(S, slot, lineno);
+        S->insts[i].temp = slot;
+        move(S, i, loop);
+        S->L->opt_stats.hoisted++;
+    }
+    array_delete(&movable);
+
+    /* the computations go in a block of their own, in the loop's place */
+    for (int i = 0; i < length(&S->loops); i++) {
+        lfIrLoop *loop = &S->loops[i];
+        if (loop->hoisted == NULL) {
+            continue;
+        }
+        lfCompoundNode *comp = lf_malloc(&S->L->parser->arena_allocator, sizeof(lfCompoundNode));
+        memset(comp, 0, sizeof(lfCompoundNode));
+        comp->type = NT_COMPOUND;
+        comp->lineno = (*loop->site)->lineno;
+        comp->statements = loop->hoisted;
+        array_push(&comp->statements, *loop->site);
+        *loop->site = (lfNode *)comp;
+        S->L->opt_stats.loops++;
+    }
+}
+
+/* the first of a number keeps its value in a slot, hoisted ones already do, and the others read that */
+static void eliminate_common(lfSsa *S) {
+    for (int i = 0; i < length(&S->insts); i++) {
+        lfIrInst *inst = &S->insts[i];
+        if (!inst->eliminated || (inst->parent >= 0 && S->insts[inst->parent].eliminated)) {
+            continue;
+        }
+        lfIrInst *first = &S->insts[inst->number];
+        if (first->temp < 0) {
+            first->temp = (*S->nslots)++;
+            *first->site = assign_node(S, first->temp, *first->site);
+        }
+        *inst->site = read_node(S, first->temp, inst->node->lineno);
+        S->L->opt_stats.common++;
+    }
+}
+
+/* whether evaluating node does nothing but produce a value */
+static bool pure(const lfSsa *S, const lfNode *node) {
+    switch (node->type) {
+        case NT_INT:
+        case NT_FLOAT:
+        case NT_STRING:
+            return true;
+        case NT_VARACCESS:
+            /* temporaries included */
+            return ((const lfVarAccessNode *)node)->ref.kind == VK_LOCAL && !((const lfVarAccessNode *)node)->ref.captured;
+        case NT_UNARYOP:
+            return pure_unary((const lfUnaryOpNode *)node) && pure(S, ((const lfUnaryOpNode *)node)->value);
+        case NT_BINARYOP: {
+            const lfBinaryOpNode *binop = (const lfBinaryOpNode *)node;
+            return pure_binary(binop) && !(binop->operands == TS_INT && binop->op.type == TT_DIV)
+                   && pure(S, binop->lhs) && pure(S, binop->rhs);
+        }
+        default:
+            return false;
+    }
+}
+
+static bool removable(const lfSsa *S, const lfIrStatement *statement, const lfArray(bool) live) {
+    if (statement->unreachable) {
+        return true;
+    }
+    const lfNode *node = (*statement->list)[statement->index];
+    if (node->type == NT_VARDECL) {
+        const lfVarDeclNode *decl = (const lfVarDeclNode *)node;
+        return statement->def >= 0 && !live[statement->def] && !decl->guard && (!decl->initializer || pure(S, decl->initializer));
+    }
+    if (node->type == NT_ASSIGN) {
+        const lfAssignNode *assign = (const lfAssignNode *)node;
+        return statement->def >= 0 && !live[statement->def] && !assign->guard && pure(S, assign->value);
+    }
+    return pure(S, node);
+}
+
+/* the definitions some read that is still there may see, directly or through phis */
+static void mark_live(const lfSsa *S, lfArray(bool) live) {
+    int n = length(&S->insts);
+    memset(live, 0, n * sizeof(bool));
+    lfArray(int) work = array_new(&S->L->allocator, int);
+    for (int i = 0; i < n; i++) {
+        const lfIrInst *inst = &S->insts[i];
+        if (inst->kind == IR_READ && (inst->statement < 0 || !S->statements[inst->statement].removed)) {
+            int def = find(S, inst->a);
+            if (!live[def]) {
+                live[def] = true;
+                array_push(&work, def);
+            }
+        }
+    }
+    while (length(&work) > 0) {
+        const lfIrInst *phi = &S->insts[work[--length(&work)]];
+        if (phi->kind != IR_PHI) {
+            continue;
+        }
+        for (int i = 0; i < length(&phi->operands); i++) {
+            int def = find(S, phi->operands[i]);
+            if (!live[def]) {
+                live[def] = true;
+                array_push(&work, def);
+            }
+        }
+    }
+    array_delete(&work);
+}
+
+static void eliminate_dead(lfSsa *S) {
+    int n = length(&S->insts);
+    lfArray(bool) live = array_new(&S->L->allocator, bool);
+    array_reserve(&live, n);
+    length(&live) = n;
+
+    /* a removed store may have held the last read of another */
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        mark_live(S, live);
+        for (int i = 0; i < length(&S->statements); i++) {
+            lfIrStatement *statement = &S->statements[i];
+            if (!statement->removed && removable(S, statement, live)) {
+                statement->removed = true;
+                changed = true;
+            }
+        }
+    }
+    array_delete(&live);
+
+    for (int i = 0; i < length(&S->statements); i++) {
+        lfIrStatement *statement = &S->statements[i];
+        if (statement->removed) {
+            (*statement->list)[statement->index] = NULL;
+            S->L->opt_stats.dead++;
+        }
+    }
+    for (int i = 0; i < length(&S->statements); i++) {
+        lfArray(lfNode *) *list = S->statements[i].list;
+        if (!S->statements[i].removed || length(list) == 0) {
+            continue;
+        }
+        int kept = 0;
+        for (int j = 0; j < length(list); j++) {
+            if ((*list)[j] != NULL) {
+                (*list)[kept++] = (*list)[j];
+            }
+        }
+        length(list) = kept;
+    }
+}
+
+static const char *op_name(lfTokenType op) {
+    switch (op) {
+        case TT_ADD: return "add";
+        case TT_SUB: return "sub";
+        case TT_MUL: return "mul";
+        case TT_DIV: return "div";
+        case TT_NOT: return "not";
+        case TT_LSHIFT: return "shl";
+        case TT_RSHIFT: return "shr";
+        case TT_EQ: return "eq";
+        case TT_NE: return "ne";
+        case TT_LT: return "lt";
+        case TT_GT: return "gt";
+        case TT_LE: return "le";
+        case TT_GE: return "ge";
+        default: return "?";
+    }
+}
+
+static const char *node_name(lfNodeType type) {
+    static const char *names[LF_NODE_TYPES] = {
+        "int", "float", "string", "array", "map", "unary", "binary", "var", "decl", "subscript", "assign",
+        "objassign", "call", "func", "if", "while", "return", "yield", "await", "class", "compound", "include"
+    };
+    return names[type];
+}
+
+static const char *var_name(const lfSsa *S, int var) {
+    return var < length(&S->names) && S->names[var] ? S->names[var] : "?";
+}
+
+static void dump_inst(const lfSsa *S, int i, FILE *out) {
+    const lfIrInst *inst = &S->insts[i];
+    fprintf(out, "    v%d = ", i);
+    switch (inst->kind) {
+        case IR_ENTRY:
+            fprintf(out, "entry %s\n", var_name(S, inst->var));
+            return;
+        case IR_CONST:
+            fprintf(out, "const %s\n", inst->node ? ((const lfLiteralNode *)inst->node)->value.value : "null");
+            return;
+        case IR_READ:
+            fprintf(out, "read %s v%d\n", var_name(S, inst->var), find(S, inst->a));
+            return;
+        case IR_STORE:
+            fprintf(out, "store %s v%d\n", var_name(S, inst->var), value_of(S, inst->a));
+            return;
+        case IR_PHI:
+            fprintf(out, "phi %s", var_name(S, inst->var));
+            if (inst->a >= 0) {
+                fprintf(out, " = v%d\n", find(S, inst->a));
+                return;
+            }
+            for (int j = 0; j < length(&inst->operands); j++) {
+                fprintf(out, " v%d", find(S, inst->operands[j]));
+            }
+            fputc('\n', out);
+            return;
+        case IR_ARITH: {
+            lfTokenType op = inst->node->type == NT_BINARYOP ? ((const lfBinaryOpNode *)inst->node)->op.type : ((const lfUnaryOpNode *)inst->node)->op.type;
+            fprintf(out, "%s v%d", inst->node->type == NT_UNARYOP && op == TT_SUB ? "neg" : op_name(op), value_of(S, inst->a));
+            if (inst->b >= 0) {
+                fprintf(out, " v%d", value_of(S, inst->b));
+            }
+            if (inst->hoisted) {
+                fprintf(out, " ; hoisted");
+            } else if (inst->eliminated) {
+                fprintf(out, " ; = v%d", inst->number);
+            }
+            fputc('\n', out);
+            return;
+        }
+        case IR_OPAQUE:
+            fprintf(out, "opaque %s\n", node_name(inst->node->type));
+            return;
+    }
+}
+
+static void dump(const lfSsa *S, const char *file, FILE *out) {
+    fprintf(out, "ir %s (%s:%d)\n", S->name, file, S->lineno);
+    for (int b = 0; b < length(&S->blocks); b++) {
+        const lfIrBlock *block = &S->blocks[b];
+        fprintf(out, "  b%d:", b);
+        for (int i = 0; i < length(&block->preds); i++) {
+            fprintf(out, "%s b%d", i == 0 ? " from" : ",", block->preds[i]);
+        }
+        if (block->loop >= 0) {
+            fprintf(out, " (loop %d)", block->loop);
+        }
+        fputc('\n', out);
+        for (int i = 0; i < length(&S->insts); i++) {
+            if (S->insts[i].block == b && !(S->insts[i].kind == IR_PHI && S->insts[i].a >= 0)) {
+                dump_inst(S, i, out);
+            }
+        }
+    }
+}
+
+static void optimize_body(lfState *L, lfChunk *chunk, const char *name, int lineno, lfArray(lfNode *) *body, int *nslots) {
+    /* first, so the fields of the literals it takes apart are variables to the rest */
+    lf_scalar_replace(L, body, nslots);
+    lfSsa S = {
+        .L = L,
+        .name = name,
+        .lineno = lineno,
+        .nvars = *nslots,
+        .nslots = nslots,
+        .insts = array_new(&L->allocator, lfIrInst),
+        .blocks = array_new(&L->allocator, lfIrBlock),
+        .loops = array_new(&L->allocator, lfIrLoop),
+        .statements = array_new(&L->allocator, lfIrStatement),
+        .entries = array_new(&L->allocator, int),
+        .names = array_new(&L->allocator, const char *),
+        .current = 0,
+        .loop = -1,
+        .statement = -1
+    };
+    array_reserve(&S.entries, S.nvars);
+    array_reserve(&S.names, S.nvars);
+    length(&S.entries) = S.nvars;
+    length(&S.names) = S.nvars;
+    for (int i = 0; i < S.nvars; i++) {
+        S.entries[i] = -1;
+        S.names[i] = NULL;
+    }
+
+    block_new(&S, -1, -1, true);
+    walk_list(&S, body);
+    fold_phis(&S);
+
+    propagate_copies(&S);
+    number_values(&S);
+    hoist_invariants(&S);
+    eliminate_common(&S);
+    eliminate_dead(&S);
+
+    L->opt_stats.bodies++;
+    L->opt_stats.blocks += length(&S.blocks);
+    L->opt_stats.instructions += length(&S.insts);
+    for (int i = 0; i < length(&S.insts); i++) {
+        if (S.insts[i].kind == IR_PHI && S.insts[i].a < 0) {
+            L->opt_stats.phis++;
+        }
+    }
+    if (L->ir_dump) {
+        dump(&S, chunk->file, L->ir_dump);
+    }
+
+    for (int i = 0; i < length(&S.insts); i++) {
+        if (S.insts[i].operands) {
+            array_delete(&S.insts[i].operands);
+        }
+    }
+    for (int i = 0; i < length(&S.blocks); i++) {
+        array_delete(&S.blocks[i].preds);
+        array_delete(&S.blocks[i].defs);
+        array_delete(&S.blocks[i].incomplete);
+        array_delete(&S.blocks[i].stores);
+    }
+    array_delete(&S.insts);
+    array_delete(&S.blocks);
+    array_delete(&S.loops);
+    array_delete(&S.statements);
+    array_delete(&S.entries);
+    array_delete(&S.names);
+}
+
+static void optimize_nodes(lfState *L, lfChunk *chunk, lfArray(lfNode *) nodes);
+
+/* the functions declared in node, found the way the resolver walks */
+static void optimize_node(lfState *L, lfChunk *chunk, lfNode *node) {
+    if (node == NULL) {
+        return;
+    }
+    switch (node->type) {
+        case NT_FUNC:
+            lf_optimize_function(L, chunk, (lfFunctionNode *)node);
+            break;
+        case NT_CLASS:
+            optimize_nodes(L, chunk, ((lfClassNode *)node)->body);
+            break;
+        case NT_IF:
+            optimize_node(L, chunk, ((lfIfNode *)node)->body);
+            optimize_node(L, chunk, ((lfIfNode *)node)->else_body);
+            break;
+        case NT_WHILE:
+            optimize_node(L, chunk, ((lfWhileNode *)node)->body);
+            break;
+        case NT_COMPOUND:
+            optimize_nodes(L, chunk, ((lfCompoundNode *)node)->statements);
+            break;
+        default:
+            break;
+    }
+}
+
+static void optimize_nodes(lfState *L, lfChunk *chunk, lfArray(lfNode *) nodes) {
+    for (int i = 0; i < length(&nodes); i++) {
+        optimize_node(L, chunk, nodes[i]);
+    }
+}
+
+void lf_optimize_function(lfState *L, lfChunk *chunk, lfFunctionNode *f) {
+    if (!L->optimize || f->lazy) {
+        return;
+    }
+    optimize_nodes(L, chunk, f->body);
+    optimize_body(L, chunk, f->name.value, f->lineno, &f->body, &f->nslots);
+    if (f->specializations) {
+        for (int i = 0; i < length(&f->specializations); i++) {
+            lfFunctionNode *copy = f->specializations[i].node;
+            if (copy) {
+                optimize_nodes(L, chunk, copy->body);
+                optimize_body(L, chunk, copy->name.value, copy->lineno, &copy->body, &copy->nslots);
+            }
+        }
+    }
+}
+
+void lf_optimize(lfState *L) {
+    for (int i = 0; i < length(&L->chunks); i++) {
+        lfChunk *chunk = L->chunks[i];
+        if (!chunk->checked || chunk->optimized) {
+            continue;
+        }
+        chunk->optimized = true;
+        if (!L->optimize) {
+            continue;
+        }
+        lfArray(lfNode *) *statements = &((lfCompoundNode *)chunk->ast)->statements;
+        optimize_nodes(L, chunk, *statements);
+        optimize_body(L, chunk, "<top level>", 1, statements, &chunk->nslots);
+    }
+}
+
+void lf_optimize_report(lfState *L, FILE *out) {
+    const lfOptStats *stats = &L->opt_stats;
+    fprintf(out, "escape analysis: %d literals replaced by %d locals\n", stats->scalars, stats->scalar_locals);
+    fprintf(out, "ssa: %d bodies, %d blocks, %d instructions, %d phis\n", stats->bodies, stats->blocks, stats->instructions, stats->phis);
+    fprintf(out, "copy propagation: %d reads\n", stats->copies);
+    fprintf(out, "licm: %d expressions out of %d loops\n", stats->hoisted, stats->loops);
+    fprintf(out, "cse: %d expressions\n", stats->common);
+    fprintf(out, "dce: %d statements\n", stats->dead);
+}
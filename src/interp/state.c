@@ -0,0 +1,368 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* pthread_getattr_np */
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "interp/state.h"
+#include "interp/eval.h"
+#include "interp/gc.h"
+#include "interp/resolve.h"
+#include "interp/shake.h"
+#include "interp/typecheck.h"
+#include "interp/ssa.h"
+#include "interp/jit.h"
+#include "interp/profile.h"
+#include "interp/coro.h"
+#include "interp/builtins.h"
+#include "parser/parse.h"
+#include "lib/alloc.h"
+#include "lib/array.h"
+#include "lib/error.h"
+
+static char *string_dup(const lfAllocator *allocator, const char *str, size_t length) {
+    char *copy = lf_malloc(allocator, length + 1);
+    memcpy(copy, str, length);
+    copy[length] = 0;
+    return copy;
+}
+
+/* the lowest address of the calling thread's C stack, or a guess at it */
+static char *stack_bottom(void) {
+#if defined(__linux__) && defined(__GLIBC__)
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void *addr;
+        size_t size;
+        int got = pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+        if (got == 0) {
+            return addr;
+        }
+    }
+#elif defined(__APPLE__)
+    return (char *)pthread_get_stackaddr_np(pthread_self()) - pthread_get_stacksize_np(pthread_self());
+#endif
+    /* the usual 8MB, counted from a frame near the top */
+    return (char *)__builtin_frame_address(0) - (8 << 20);
+}
+
+lfState *lf_state_new(const lfAllocator *allocator, const lfDiagnosticSink *diagnostics) {
+    lfState *L = lf_malloc(allocator, sizeof(lfState));
+    if (L == NULL) {
+        return NULL;
+    }
+    memset(L, 0, sizeof(lfState));
+    L->allocator = *allocator;
+    L->diagnostics = *diagnostics;
+    L->parser = lf_parser_new(allocator, diagnostics);
+    L->chunks = array_new(&L->allocator, lfChunk *);
+    L->out = stdout;
+
+    L->stack = lf_malloc(allocator, LF_STACK_SIZE * sizeof(lfValue));
+    L->stack_end = L->stack + LF_STACK_SIZE;
+    L->top = L->stack;
+    L->base = L->stack;
+    L->closure = NULL;
+    L->frames = lf_malloc(allocator, LF_MAX_FRAMES * sizeof(lfFrame));
+    L->nframes = 0;
+    L->max_frames = LF_MAX_FRAMES;
+    L->frame = NULL;
+    L->stack_limit = stack_bottom() + LF_STACK_MARGIN; /* the state runs on the thread that makes it */
+
+    L->returning = false;
+    L->retval = lf_null();
+    L->tail = (lfTailCall) {0};
+
+    L->globals = array_new(&L->allocator, lfValue);
+    L->global_names = array_new(&L->allocator, const char *);
+    L->global_declared = array_new(&L->allocator, bool);
+    L->global_types = array_new(&L->allocator, lfGlobalType);
+    L->class_names = array_new(&L->allocator, const char *);
+    L->specialized_nodes = 0;
+    L->inlined_nodes = 0;
+
+    L->objects = NULL;
+    L->allocated = 0;
+    L->next_gc = LF_GC_INITIAL;
+    L->gray = array_new(&L->allocator, lfObject *);
+    L->strings = lf_map_new(L);
+
+    L->jit = LF_JIT_SUPPORTED;
+    L->inline_calls = true;
+    L->tail_calls = true;
+    L->optimize = true;
+    L->ir_dump = NULL;
+    L->opt_stats = (lfOptStats) {0};
+    L->shake = NULL;
+    L->code = array_new(&L->allocator, lfCodeRegion);
+    L->compiled = array_new(&L->allocator, lfCodeInfo *);
+    L->profile = NULL;
+    L->scheduler = NULL;
+    L->isolate = NULL;
+#ifdef LF_DISPATCH_STATS
+    L->dispatch_path[0] = -1;
+    L->dispatch_path[1] = -1;
+#endif
+
+    L->error_jmp = NULL;
+
+    lf_open_builtins(L);
+    return L;
+}
+
+void lf_state_delete(lfState *L) {
+    lfAllocator allocator = L->allocator;
+    lf_gc_free_all(L);
+    for (int i = 0; i < length(&L->chunks); i++) {
+        lfChunk *chunk = L->chunks[i];
+        lf_free(&allocator, chunk->file, strlen(chunk->file) + 1);
+        lf_free(&allocator, chunk->source, strlen(chunk->source) + 1);
+        lf_free(&allocator, chunk, sizeof(lfChunk));
+    }
+    array_delete(&L->chunks);
+    for (int i = 0; i < length(&L->global_names); i++) {
+        lf_free(&allocator, (char *)L->global_names[i], strlen(L->global_names[i]) + 1);
+    }
+    array_delete(&L->global_names);
+    array_delete(&L->globals);
+    array_delete(&L->global_declared);
+    array_delete(&L->global_types);
+    array_delete(&L->class_names);
+    array_delete(&L->gray);
+    lf_jit_free(L);
+    array_delete(&L->code);
+    array_delete(&L->compiled);
+    lf_profile_free(L);
+    lf_coro_free(L);
+    lf_free(&allocator, L->stack, LF_STACK_SIZE * sizeof(lfValue));
+    lf_free(&allocator, L->frames, LF_MAX_FRAMES * sizeof(lfFrame));
+    lf_parser_delete(L->parser);
+    lf_free(&allocator, L, sizeof(lfState));
+}
+
+int lf_global_slot(lfState *L, const char *name) {
+    for (int i = 0; i < length(&L->global_names); i++) {
+        if (!strcmp(L->global_names[i], name)) {
+            return i;
+        }
+    }
+    const char *copy = string_dup(&L->allocator, name, strlen(name));
+    array_push(&L->global_names, copy);
+    lfValue undefined = (lfValue) { .type = LF_UNDEFINED };
+    array_push(&L->globals, undefined);
+    bool declared = false;
+    array_push(&L->global_declared, declared);
+    lfGlobalType type = (lfGlobalType) { .type = TS_ANY, .declared = 0, .function = NULL };
+    array_push(&L->global_types, type);
+    return length(&L->globals) - 1;
+}
+
+void lf_global_set(lfState *L, const char *name, lfValue value) {
+    int slot = lf_global_slot(L, name); /* may grow the table */
+    L->globals[slot] = value;
+    L->global_declared[slot] = true;
+}
+
+void lf_runtime_error(lfState *L, const char *fmt, ...) {
+    char message[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+
+    if (L->frame != NULL) {
+        lf_error_report_line(&L->diagnostics, L->frame->chunk->file, L->frame->chunk->source, lf_jit_line(L->frame, NULL), message);
+    } else {
+        lfDiagnostic diagnostic = (lfDiagnostic) {
+            .file = "<leaf>",
+            .source = "",
+            .idx_start = 0,
+            .idx_end = 0,
+            .line = 0,
+            .column = 0,
+            .message = message
+        };
+        L->diagnostics.report(L->diagnostics.userdata, &diagnostic);
+    }
+
+    if (L->error_jmp == NULL) {
+        abort();
+    }
+    longjmp(*L->error_jmp, 1);
+}
+
+/* parses source, which the new chunk takes ownership of */
+static lfChunk *load_chunk(lfState *L, char *source, const char *file) {
+    lfNode *ast = lf_parse(L->parser, source, file);
+    if (ast == NULL) {
+        lf_free(&L->allocator, source, strlen(source) + 1);
+        return NULL;
+    }
+    lfChunk *chunk = lf_malloc(&L->allocator, sizeof(lfChunk));
+    chunk->file = string_dup(&L->allocator, file, strlen(file));
+    chunk->source = source;
+    chunk->ast = ast;
+    chunk->nslots = 0;
+    chunk->resolved = false;
+    chunk->checked = false;
+    chunk->optimized = false;
+    chunk->executed = false;
+    array_push(&L->chunks, chunk);
+    return chunk;
+}
+
+static char *read_file(lfState *L, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t sz = ftell(f);
+    rewind(f);
+    char *buffer = lf_malloc(&L->allocator, sz + 1);
+    if (fread(buffer, 1, sz, f) != sz) {
+        lf_free(&L->allocator, buffer, sz + 1);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    buffer[sz] = 0;
+    return buffer;
+}
+
+/*
+ * runs a chunk under a fresh error handler, unwinding the stack if it
+ * fails, and then whatever coroutines it left behind
+ */
+static bool protected_run(lfState *L, lfChunk *chunk) {
+    jmp_buf handler;
+    jmp_buf *old_handler = L->error_jmp;
+    lfValue *old_top = L->top;
+    lfValue *old_base = L->base;
+    lfFunction *old_closure = L->closure;
+    int old_nframes = L->nframes;
+
+    L->error_jmp = &handler;
+    bool ok = true;
+    if (setjmp(handler) == 0) {
+        lf_exec_chunk(L, chunk);
+        lf_coro_run(L);
+    } else {
+        ok = false;
+        L->top = old_top;
+        L->base = old_base;
+        L->closure = old_closure;
+        L->nframes = old_nframes;
+        L->frame = old_nframes > 0 ? &L->frames[old_nframes - 1] : NULL;
+        L->returning = false;
+        L->retval = lf_null();
+        L->tail = (lfTailCall) {0};
+    }
+    L->error_jmp = old_handler;
+    return ok;
+}
+
+bool lf_run_string(lfState *L, const char *source, const char *file) {
+    lfChunk *chunk = load_chunk(L, string_dup(&L->allocator, source, strlen(source)), file);
+    if (chunk == NULL || (L->shake && !lf_shake(L, chunk, L->shake)) || !lf_resolve_chunk(L, chunk) || !lf_typecheck(L)) {
+        return false;
+    }
+    lf_optimize(L);
+    chunk->executed = true;
+    return protected_run(L, chunk);
+}
+
+bool lf_run_file(lfState *L, const char *path) {
+    char *source = read_file(L, path);
+    if (source == NULL) {
+        lfDiagnostic diagnostic = (lfDiagnostic) {
+            .file = path,
+            .source = "",
+            .idx_start = 0,
+            .idx_end = 0,
+            .line = 0,
+            .column = 0,
+            .message = "failed to read file"
+        };
+        L->diagnostics.report(L->diagnostics.userdata, &diagnostic);
+        return false;
+    }
+    lfChunk *chunk = load_chunk(L, source, path);
+    if (chunk == NULL || (L->shake && !lf_shake(L, chunk, L->shake)) || !lf_resolve_chunk(L, chunk) || !lf_typecheck(L)) {
+        return false;
+    }
+    lf_optimize(L);
+    chunk->executed = true;
+    return protected_run(L, chunk);
+}
+
+bool lf_load_body(lfState *L, lfChunk *chunk, lfFunctionNode *f) {
+    if (!lf_parse_body(L->parser, f, chunk->source, chunk->file)) {
+        return false;
+    }
+    if (!lf_resolve_function(L, chunk, f) || !lf_typecheck_function(L, chunk, f)) {
+        /* back to unparsed, so every call reports the errors again rather than running */
+        length(&f->body) = 0;
+        f->lazy = true;
+        return false;
+    }
+    lf_optimize_function(L, chunk, f);
+    return true;
+}
+
+lfArray(char) lf_include_path(const lfAllocator *allocator, const char *from, const lfToken *path, int ntokens) {
+    const char *slash = strrchr(from, '/');
+    int dir_length = slash ? (int)(slash - from) + 1 : 0;
+
+    lfArray(char) file = array_new(allocator, char);
+    array_reserve(&file, dir_length + 4);
+    memcpy(file, from, dir_length);
+    length(&file) = dir_length;
+    for (int i = 0; i < ntokens; i++) {
+        if (path[i].type == TT_DOT) {
+            continue;
+        }
+        const char *part = path[i].value;
+        int n = strlen(part);
+        array_reserve(&file, length(&file) + n + 5);
+        if (length(&file) > dir_length) {
+            file[length(&file)++] = '/';
+        }
+        memcpy(file + length(&file), part, n);
+        length(&file) += n;
+    }
+    memcpy(file + length(&file), ".lf", 4);
+    return file;
+}
+
+lfChunk *lf_load_include(lfState *L, lfChunk *from, lfImportNode *import) {
+    lfArray(char) path = lf_include_path(&L->allocator, from->file, import->path, length(&import->path));
+
+    for (int i = 0; i < length(&L->chunks); i++) {
+        if (!strcmp(L->chunks[i]->file, path)) {
+            array_delete(&path);
+            return L->chunks[i];
+        }
+    }
+
+    lfChunk *chunk = NULL;
+    char *source = read_file(L, path);
+    if (source == NULL) {
+        char message[256];
+        snprintf(message, sizeof(message), "cannot include '%s'", path);
+        lfToken first = import->path[0];
+        lfToken last = import->path[length(&import->path) - 1];
+        lf_error_report(&L->diagnostics, from->file, from->source, first.idx_start, last.idx_end, message);
+    } else {
+        chunk = load_chunk(L, source, path);
+    }
+    array_delete(&path);
+    return chunk;
+}
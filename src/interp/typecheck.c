@@ -0,0 +1,852 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "interp/typecheck.h"
+#include "interp/state.h"
+#include "parser/node.h"
+#include "lib/array.h"
+#include "lib/error.h"
+
+#define TS_NUMBER (TS_INT | TS_FLOAT)
+
+static const struct {
+    const char *name;
+    lfTypeSet set;
+} builtin_types[] = {
+    { "any", TS_ANY },
+    { "null", TS_NULL },
+    { "int", TS_INT },
+    { "bool", TS_INT },
+    { "float", TS_FLOAT },
+    { "string", TS_STRING },
+    { "task", TS_TASK },
+    { NULL, 0 }
+};
+
+/* in bit order */
+static const char *const set_names[] = {
+    "null", "int", "float", "string", "array", "map", "function", "class", "instance", "task"
+};
+
+void lf_typeset_format(lfTypeSet set, char *buffer, size_t size) {
+    if (set == TS_ANY || set == 0) {
+        snprintf(buffer, size, "%s", set ? "any" : "nothing");
+        return;
+    }
+    size_t n = 0;
+    buffer[0] = 0;
+    for (int i = 0; i < (int)(sizeof(set_names) / sizeof(set_names[0])); i++) {
+        if (set & (1u << i) && n < size) {
+            n += snprintf(buffer + n, size - n, "%s%s", n > 0 ? "|" : "", set_names[i]);
+        }
+    }
+}
+
+/* a local declaration of the function being checked */
+typedef struct lfLocalType {
+    lfVarRef *decl;
+    lfTypeSet type; /* everything the variable may hold */
+    lfTypeSet declared; /* its annotation, 0 when it is inferred */
+} lfLocalType;
+
+typedef struct lfFuncCtx {
+    struct lfFuncCtx *enclosing;
+    lfFunctionNode *node; /* NULL for a chunk's top level */
+    lfArray(lfLocalType) locals; /* in the order the walk declares them */
+    lfArray(int) live; /* slot -> the local currently occupying it */
+    int next; /* locals declared by the current walk */
+    lfTypeSet ret; /* return annotation, 0 for none */
+    bool changed;
+} lfFuncCtx;
+
+typedef struct lfGeneric {
+    const char *name;
+    lfTypeSet type;
+} lfGeneric;
+
+typedef struct lfChecker {
+    lfState *L;
+    lfChunk *chunk;
+    lfFuncCtx *fn;
+    lfArray(lfGeneric) generics; /* type parameters in scope */
+    lfArray(const char *) *classes; /* class names, usable as types: the state's */
+    bool report; /* set on the last walk of a function, once its types are stable */
+    bool quiet; /* checking a specialized copy, whose original reports the errors */
+    bool errored;
+} lfChecker;
+
+static void check_error(lfChecker *C, const lfToken *at, int line, const char *fmt, ...) {
+    if (!C->report || C->quiet) {
+        return;
+    }
+    char message[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    if (at != NULL) {
+        lf_error_report(&C->L->diagnostics, C->chunk->file, C->chunk->source, at->idx_start, at->idx_end, message);
+    } else {
+        lf_error_report_line(&C->L->diagnostics, C->chunk->file, C->chunk->source, line, message);
+    }
+    C->errored = true;
+}
+
+/* annotations */
+
+static lfTypeSet type_set(lfChecker *C, lfType *t);
+
+static void type_sets(lfChecker *C, lfArray(lfType *) types) {
+    if (types == NULL) {
+        return;
+    }
+    for (int i = 0; i < length(&types); i++) {
+        type_set(C, types[i]);
+    }
+}
+
+static lfTypeSet type_set(lfChecker *C, lfType *t) {
+    switch (t->type) {
+        case VT_TYPENAME: {
+            lfToken *name = &((lfTypeName *)t)->typename;
+            for (int i = length(&C->generics) - 1; i >= 0; i--) {
+                if (!strcmp(C->generics[i].name, name->value)) {
+                    return C->generics[i].type;
+                }
+            }
+            for (int i = 0; builtin_types[i].name != NULL; i++) {
+                if (!strcmp(builtin_types[i].name, name->value)) {
+                    return builtin_types[i].set;
+                }
+            }
+            for (int i = 0; i < length(C->classes); i++) {
+                if (!strcmp((*C->classes)[i], name->value)) {
+                    return TS_INSTANCE;
+                }
+            }
+            check_error(C, name, 0, "unknown type '%s'", name->value);
+            return TS_ANY;
+        }
+        case VT_UNION:
+            return type_set(C, ((lfTypeOp *)t)->lhs) | type_set(C, ((lfTypeOp *)t)->rhs);
+        case VT_INTERSECTION:
+            return type_set(C, ((lfTypeOp *)t)->lhs) & type_set(C, ((lfTypeOp *)t)->rhs);
+        case VT_FUNC:
+            type_sets(C, ((lfFuncType *)t)->params);
+            type_set(C, ((lfFuncType *)t)->ret);
+            return TS_FUNCTION;
+        case VT_ARRAY:
+            type_sets(C, ((lfArrayType *)t)->values);
+            return TS_ARRAY;
+        case VT_MAP:
+            type_sets(C, ((lfMapType *)t)->keys);
+            type_sets(C, ((lfMapType *)t)->values);
+            return TS_MAP;
+        case VT_ANY:
+            return TS_ANY;
+    }
+    return TS_ANY;
+}
+
+/*
+ * checks a value going into something declared, returning the guard it
+ * needs at runtime: none when the value always fits, the declared type
+ * when it may not (or when an int has to become a float)
+ */
+static lfTypeSet check_store(lfChecker *C, lfTypeSet value, lfTypeSet declared, const lfToken *at, int line, const char *what) {
+    lfTypeSet accepted = declared & TS_FLOAT ? declared | TS_INT : declared;
+    if (value != 0 && (value & accepted) == 0) {
+        char have[64], want[64];
+        lf_typeset_format(value, have, sizeof(have));
+        lf_typeset_format(declared, want, sizeof(want));
+        check_error(C, at, line, "%s is declared %s, got %s", what, want, have);
+    }
+    return value & ~declared ? declared : 0;
+}
+
+/* locals */
+
+static void join(lfChecker *C, lfLocalType *local, lfTypeSet type) {
+    if (type & ~local->type) {
+        local->type |= type;
+        C->fn->changed = true;
+    }
+}
+
+static lfLocalType *declare(lfChecker *C, lfVarRef *ref, lfTypeSet type, lfTypeSet declared) {
+    lfFuncCtx *fn = C->fn;
+    if (fn->next == length(&fn->locals)) {
+        lfLocalType local = (lfLocalType) {
+            .decl = ref,
+            .type = 0,
+            .declared = declared
+        };
+        array_push(&fn->locals, local);
+    }
+    lfLocalType *local = &fn->locals[fn->next];
+    fn->live[ref->slot] = fn->next++;
+    /* captured locals may be assigned from closures, which are only walked once */
+    join(C, local, ref->captured && !declared ? TS_ANY : type);
+    return local;
+}
+
+/* the declaration a use refers to, marking the use as boxed if it is */
+static lfLocalType *local_of(lfFuncCtx *fn, lfVarRef *ref) {
+    lfLocalType *local = NULL;
+    if (ref->kind == VK_LOCAL) {
+        local = &fn->locals[fn->live[ref->slot]];
+    } else {
+        /* captures name a slot of the enclosing function, or one of its captures */
+        lfCapture capture = fn->node->captures[ref->slot];
+        lfVarRef outer = (lfVarRef) {
+            .kind = capture.local ? VK_LOCAL : VK_UPVALUE,
+            .slot = capture.slot
+        };
+        local = local_of(fn->enclosing, &outer);
+    }
+    ref->captured = local->decl->captured;
+    return local;
+}
+
+/* expressions and statements */
+
+static lfTypeSet check_node(lfChecker *C, lfNode *node);
+static void check_function(lfChecker *C, lfFunctionNode *f, bool is_method, const lfTypeSet *bindings);
+static lfTypeSet check_call(lfChecker *C, lfCallNode *call);
+
+static void check_nodes(lfChecker *C, lfArray(lfNode *) nodes) {
+    for (int i = 0; i < length(&nodes); i++) {
+        check_node(C, nodes[i]);
+    }
+}
+
+static lfTypeSet check_unaryop(lfChecker *C, lfUnaryOpNode *unop) {
+    lfTypeSet t = check_node(C, unop->value);
+    if (unop->op.type == TT_NOT) {
+        return TS_INT;
+    }
+    if (t != 0 && (t & TS_NUMBER) == 0) {
+        char name[64];
+        lf_typeset_format(t, name, sizeof(name));
+        check_error(C, &unop->op, 0, "unsupported operator '-' for %s", name);
+    }
+    unop->operand = t == TS_INT || t == TS_FLOAT ? t : 0;
+    return t & TS_NUMBER;
+}
+
+static lfTypeSet check_binaryop(lfChecker *C, lfBinaryOpNode *binop) {
+    lfTypeSet l = check_node(C, binop->lhs);
+    lfTypeSet r = check_node(C, binop->rhs);
+    binop->operands = (l == TS_INT || l == TS_FLOAT) && l == r ? l : 0;
+
+    /* what the operation can produce from the operand types it accepts */
+    bool ints = l & TS_INT && r & TS_INT;
+    bool floats = l & TS_NUMBER && r & TS_NUMBER && (l | r) & TS_FLOAT;
+    lfTypeSet result = 0;
+    switch (binop->op.type) {
+        case TT_EQ:
+        case TT_NE:
+            return TS_INT;
+        case TT_LT:
+        case TT_GT:
+        case TT_LE:
+        case TT_GE:
+            if (ints || floats || (l & TS_STRING && r & TS_STRING)) {
+                result = TS_INT;
+            }
+            break;
+        case TT_ADD:
+            if (l & TS_STRING || r & TS_STRING) {
+                result |= TS_STRING;
+            }
+            /* fallthrough */
+        case TT_SUB:
+        case TT_MUL:
+        case TT_DIV:
+            result |= (ints ? TS_INT : 0) | (floats ? TS_FLOAT : 0);
+            break;
+        case TT_LSHIFT:
+        case TT_RSHIFT:
+            result = ints ? TS_INT : 0;
+            break;
+        default:
+            return TS_ANY;
+    }
+    if (result == 0 && l != 0 && r != 0) {
+        char lname[64], rname[64];
+        lf_typeset_format(l, lname, sizeof(lname));
+        lf_typeset_format(r, rname, sizeof(rname));
+        lfToken op = binop->op;
+        check_error(C, &op, 0, "unsupported operator '%.*s' for %s and %s", op.idx_end - op.idx_start, C->chunk->source + op.idx_start, lname, rname);
+    }
+    return result;
+}
+
+static lfTypeSet check_vardecl(lfChecker *C, lfVarDeclNode *decl) {
+    lfTypeSet value = decl->initializer ? check_node(C, decl->initializer) : TS_NULL;
+    lfTypeSet declared = decl->vartype ? type_set(C, decl->vartype) : 0;
+    lfTypeSet type = value;
+    decl->guard = 0;
+    if (declared) {
+        char what[128];
+        snprintf(what, sizeof(what), "'%s'", decl->name.value);
+        if (decl->initializer) {
+            decl->guard = check_store(C, value, declared, &decl->name, 0, what);
+            type = declared;
+        } else {
+            type = declared | TS_NULL;
+        }
+    }
+    /* globals were typed up front, by collect_declarations */
+    if (decl->ref.kind == VK_LOCAL) {
+        declare(C, &decl->ref, type, declared);
+    }
+    return TS_NULL;
+}
+
+static lfTypeSet check_assign(lfChecker *C, lfAssignNode *assign) {
+    lfTypeSet value = check_node(C, assign->value);
+    lfTypeSet declared = 0;
+    lfLocalType *local = NULL;
+    if (assign->ref.kind == VK_GLOBAL) {
+        declared = C->L->global_types[assign->ref.slot].declared;
+    } else {
+        local = local_of(C->fn, &assign->ref);
+        declared = local->declared;
+    }
+    assign->guard = 0;
+    if (declared) {
+        char what[128];
+        snprintf(what, sizeof(what), "'%s'", assign->var.value);
+        assign->guard = check_store(C, value, declared, &assign->var, 0, what);
+        return value & declared ? value & declared : declared;
+    }
+    if (local != NULL) {
+        join(C, local, value);
+    }
+    return value;
+}
+
+static lfTypeSet check_varaccess(lfChecker *C, lfVarAccessNode *access) {
+    if (access->ref.kind == VK_GLOBAL) {
+        return C->L->global_types[access->ref.slot].type;
+    }
+    return local_of(C->fn, &access->ref)->type;
+}
+
+/*
+ * whether the function call was resolved to declares it returns only
+ * types in declared, and so checks that itself. a generic one only does
+ * through the specialized copy the call runs, with its bindings
+ */
+static bool returns_within(lfChecker *C, lfCallNode *call, lfTypeSet declared) {
+    lfFunctionNode *target = call->target;
+    if (target == NULL || target->return_type == NULL) {
+        return false;
+    }
+    lfSpecialization *spec = NULL;
+    for (int i = 0; call->specialized && target->specializations && i < length(&target->specializations); i++) {
+        if (target->specializations[i].node == call->specialized) {
+            spec = &target->specializations[i];
+        }
+    }
+    if (length(&target->type_names) > 0 && spec == NULL) {
+        return false;
+    }
+    /* read outside the caller's type parameters, and reported with the target */
+    lfArray(lfGeneric) generics = C->generics;
+    bool quiet = C->quiet;
+    C->generics = array_new(&C->L->allocator, lfGeneric);
+    C->quiet = true;
+    for (int i = 0; spec && i < length(&target->type_names); i++) {
+        lfGeneric generic = (lfGeneric) {.name = target->type_names[i].value, .type = spec->bindings[i]};
+        array_push(&C->generics, generic);
+    }
+    lfTypeSet returned = type_set(C, target->return_type);
+    array_delete(&C->generics);
+    C->generics = generics;
+    C->quiet = quiet;
+    return returned != TS_ANY && (returned & ~declared) == 0;
+}
+
+static lfTypeSet check_return(lfChecker *C, lfReturnNode *ret) {
+    lfTypeSet value = ret->value ? check_node(C, ret->value) : TS_NULL;
+    ret->guard = 0;
+    if (C->fn->ret) {
+        char what[128];
+        snprintf(what, sizeof(what), "return value of '%s'", C->fn->node->name.value);
+        ret->guard = check_store(C, value, C->fn->ret, NULL, ret->lineno, what);
+    }
+    /*
+     * a call can take over the frame when nothing is left to check of its
+     * result, or the callee checks it already, as long as it is the callee
+     * resolved here; see eval_return
+     */
+    ret->tail = C->L->tail_calls && C->fn->node != NULL && ret->value != NULL && ret->value->type == NT_CALL
+             && (ret->guard == 0 || returns_within(C, (lfCallNode *)ret->value, C->fn->ret));
+    return TS_NULL;
+}
+
+static lfTypeSet check_class(lfChecker *C, lfClassNode *cls) {
+    if (cls->ref.kind == VK_LOCAL) {
+        declare(C, &cls->ref, TS_CLASS, 0);
+    }
+    for (int i = 0; i < length(&cls->body); i++) {
+        lfNode *member = cls->body[i];
+        if (member->type == NT_FUNC) {
+            if (C->report) {
+                check_function(C, (lfFunctionNode *)member, true, NULL);
+            }
+        } else {
+            /* defaults are evaluated in the declaring scope, once */
+            lfVarDeclNode *field = (lfVarDeclNode *)member;
+            lfTypeSet value = field->initializer ? check_node(C, field->initializer) : TS_NULL;
+            field->guard = 0;
+            field->declared = 0;
+            if (field->vartype) {
+                char what[128];
+                snprintf(what, sizeof(what), "field '%s'", field->name.value);
+                field->declared = type_set(C, field->vartype);
+                field->guard = check_store(C, value, field->declared, &field->name, 0, what);
+            }
+        }
+    }
+    return TS_NULL;
+}
+
+static lfTypeSet check_node(lfChecker *C, lfNode *node) {
+    switch (node->type) {
+        case NT_INT:
+            return TS_INT;
+        case NT_FLOAT:
+            return TS_FLOAT;
+        case NT_STRING:
+            return TS_STRING;
+        case NT_ARRAY:
+            check_nodes(C, ((lfArrayNode *)node)->values);
+            return TS_ARRAY;
+        case NT_MAP:
+            check_nodes(C, ((lfMapNode *)node)->keys);
+            check_nodes(C, ((lfMapNode *)node)->values);
+            return TS_MAP;
+        case NT_UNARYOP:
+            return check_unaryop(C, (lfUnaryOpNode *)node);
+        case NT_BINARYOP:
+            return check_binaryop(C, (lfBinaryOpNode *)node);
+        case NT_VARACCESS:
+            return check_varaccess(C, (lfVarAccessNode *)node);
+        case NT_VARDECL:
+            return check_vardecl(C, (lfVarDeclNode *)node);
+        case NT_SUBSCRIBE:
+            check_node(C, ((lfSubscriptionNode *)node)->object);
+            check_node(C, ((lfSubscriptionNode *)node)->index);
+            return TS_ANY;
+        case NT_ASSIGN:
+            return check_assign(C, (lfAssignNode *)node);
+        case NT_OBJASSIGN: {
+            lfObjectAssignNode *assign = (lfObjectAssignNode *)node;
+            check_node(C, assign->object);
+            check_node(C, assign->key);
+            return check_node(C, assign->value);
+        }
+        case NT_CALL:
+            return check_call(C, (lfCallNode *)node);
+        case NT_FUNC: {
+            lfFunctionNode *f = (lfFunctionNode *)node;
+            if (f->ref.kind == VK_LOCAL) {
+                declare(C, &f->ref, TS_FUNCTION, 0);
+            }
+            /* bodies are walked once their enclosing function's types are stable */
+            if (C->report) {
+                check_function(C, f, false, NULL);
+            }
+            return TS_NULL;
+        }
+        case NT_IF: {
+            lfIfNode *ifnode = (lfIfNode *)node;
+            check_node(C, ifnode->condition);
+            check_node(C, ifnode->body);
+            if (ifnode->else_body) {
+                check_node(C, ifnode->else_body);
+            }
+            return TS_NULL;
+        }
+        case NT_WHILE:
+            check_node(C, ((lfWhileNode *)node)->condition);
+            check_node(C, ((lfWhileNode *)node)->body);
+            return TS_NULL;
+        case NT_RETURN:
+            return check_return(C, (lfReturnNode *)node);
+        case NT_YIELD:
+            return TS_NULL;
+        case NT_AWAIT:
+            check_node(C, ((lfAwaitNode *)node)->value);
+            return TS_ANY;
+        case NT_CLASS:
+            return check_class(C, (lfClassNode *)node);
+        case NT_COMPOUND:
+            check_nodes(C, ((lfCompoundNode *)node)->statements);
+            return TS_NULL;
+        case NT_IMPORT:
+            return TS_NULL;
+    }
+    return TS_ANY;
+}
+
+/* specialization */
+
+static lfSpecialization *find_specialization(lfFunctionNode *f, const lfTypeSet *bindings) {
+    if (f->specializations == NULL) {
+        return NULL;
+    }
+    int n = length(&f->type_names);
+    for (int i = 0; i < length(&f->specializations); i++) {
+        if (!memcmp(f->specializations[i].bindings, bindings, n * sizeof(lfTypeSet))) {
+            return &f->specializations[i];
+        }
+    }
+    return NULL;
+}
+
+/* copies f for bindings and checks the copy, or returns NULL if that would go over budget */
+static lfFunctionNode *specialize(lfChecker *C, lfFunctionNode *f, const lfTypeSet *bindings) {
+    lfSpecialization *existing = find_specialization(f, bindings);
+    if (existing != NULL) {
+        return existing->node;
+    }
+    lfState *L = C->L;
+    int size = lf_node_count((lfNode *)f);
+    if (f->specializations == NULL) {
+        f->specializations = array_new(&L->parser->arena_allocator, lfSpecialization);
+    }
+    if (length(&f->specializations) >= LF_MAX_SPECIALIZATIONS || L->specialized_nodes + size > LF_SPECIALIZE_BUDGET) {
+        return NULL;
+    }
+    L->specialized_nodes += size;
+
+    lfFunctionNode *copy = (lfFunctionNode *)lf_node_clone(&L->parser->arena_allocator, (lfNode *)f);
+    lfSpecialization spec = (lfSpecialization) {
+        .bindings = array_new(&L->parser->arena_allocator, lfTypeSet),
+        .node = copy
+    };
+    for (int i = 0; i < length(&f->type_names); i++) {
+        array_push(&spec.bindings, bindings[i]);
+    }
+    /* registered first, so recursive calls in the copy find it */
+    array_push(&f->specializations, spec);
+
+    /* f is a global without captures: nothing from the call site's scope is visible in it */
+    lfFuncCtx *fn = C->fn;
+    lfArray(lfGeneric) generics = C->generics;
+    bool quiet = C->quiet;
+    C->fn = NULL;
+    C->generics = array_new(&L->allocator, lfGeneric);
+    C->quiet = true;
+    check_function(C, copy, false, spec.bindings);
+    array_delete(&C->generics);
+    C->fn = fn;
+    C->generics = generics;
+    C->quiet = quiet;
+    return copy;
+}
+
+/*
+ * a call to a generic global function whose type parameters are each bound
+ * to a single type by the arguments gets a copy of the function checked with
+ * those types. the copy's guards still check its parameters on entry, and it
+ * is only used while the global still holds the function it was made from.
+ * a call to any other global function only records it as the target
+ */
+static lfTypeSet check_call(lfChecker *C, lfCallNode *call) {
+    check_node(C, call->func);
+    if (!C->report) {
+        check_nodes(C, call->args);
+        return TS_ANY;
+    }
+    call->target = NULL;
+    call->specialized = NULL;
+    lfFunctionNode *target = NULL;
+    if (call->func->type == NT_VARACCESS) {
+        lfVarRef *ref = &((lfVarAccessNode *)call->func)->ref;
+        if (ref->kind == VK_GLOBAL) {
+            target = C->L->global_types[ref->slot].function;
+        }
+    }
+    if (target == NULL || length(&target->type_names) == 0) {
+        check_nodes(C, call->args);
+        call->target = target;
+        return TS_ANY;
+    }
+
+    /* bind each type parameter to the argument types passed for it */
+    int ntypes = length(&target->type_names);
+    lfArray(lfTypeSet) bindings = array_new(&C->L->allocator, lfTypeSet);
+    array_reserve(&bindings, ntypes);
+    length(&bindings) = ntypes;
+    memset(bindings, 0, ntypes * sizeof(lfTypeSet));
+    bool bound = true;
+    for (int i = 0; i < length(&call->args); i++) {
+        lfTypeSet arg = check_node(C, call->args[i]);
+        if (i >= length(&target->params)) {
+            continue;
+        }
+        lfType *param = target->params[i]->vartype;
+        if (param == NULL || param->type != VT_TYPENAME) {
+            continue;
+        }
+        for (int j = 0; j < ntypes; j++) {
+            if (!strcmp(target->type_names[j].value, ((lfTypeName *)param)->typename.value)) {
+                bool single = arg != 0 && (arg & (arg - 1)) == 0;
+                if (!single || (bindings[j] && bindings[j] != arg)) {
+                    bound = false;
+                }
+                bindings[j] = arg;
+                break;
+            }
+        }
+    }
+
+    /* constraints are read outside the call site's type parameters, and were reported with the function */
+    lfArray(lfGeneric) generics = C->generics;
+    bool quiet = C->quiet;
+    C->generics = array_new(&C->L->allocator, lfGeneric);
+    C->quiet = true;
+    bool narrower = false;
+    for (int i = 0; i < ntypes && bound; i++) {
+        lfTypeSet constraint = type_set(C, target->types[i]);
+        if (bindings[i] == 0) {
+            bindings[i] = constraint;
+        } else if (bindings[i] & ~constraint) {
+            bound = false; /* the guards reject this call at runtime */
+        } else if (bindings[i] != constraint) {
+            narrower = true;
+        }
+    }
+    array_delete(&C->generics);
+    C->generics = generics;
+    C->quiet = quiet;
+
+    call->target = target;
+    if (bound && narrower) {
+        call->specialized = specialize(C, target, bindings);
+    }
+    array_delete(&bindings);
+    return TS_ANY;
+}
+
+/* functions */
+
+static void walk_function(lfChecker *C, lfFunctionNode *f, bool is_method) {
+    lfFuncCtx *fn = C->fn;
+    fn->next = 0;
+    if (is_method) {
+        declare(C, &f->self, TS_INSTANCE, TS_INSTANCE);
+    }
+    for (int i = 0; i < length(&f->params); i++) {
+        lfVarDeclNode *param = f->params[i];
+        lfTypeSet declared = param->vartype ? type_set(C, param->vartype) : 0;
+        param->guard = declared == TS_ANY ? 0 : declared;
+        if (param->initializer) {
+            lfTypeSet value = check_node(C, param->initializer);
+            if (declared) {
+                char what[128];
+                snprintf(what, sizeof(what), "default of '%s'", param->name.value);
+                check_store(C, value, declared, &param->name, 0, what);
+            }
+        }
+        /* arguments are checked against the annotation on entry */
+        declare(C, &param->ref, declared ? declared : TS_ANY, declared);
+    }
+    check_nodes(C, f->body);
+}
+
+static void ctx_enter(lfChecker *C, lfFuncCtx *fn, lfFunctionNode *node, int nslots, lfTypeSet ret) {
+    *fn = (lfFuncCtx) {
+        .enclosing = C->fn,
+        .node = node,
+        .locals = array_new(&C->L->allocator, lfLocalType),
+        .live = array_new(&C->L->allocator, int),
+        .next = 0,
+        .ret = ret,
+        .changed = false
+    };
+    array_reserve(&fn->live, nslots);
+    length(&fn->live) = nslots;
+    for (int i = 0; i < nslots; i++) {
+        fn->live[i] = -1;
+    }
+    C->fn = fn;
+}
+
+static void ctx_leave(lfChecker *C) {
+    lfFuncCtx *fn = C->fn;
+    array_delete(&fn->locals);
+    array_delete(&fn->live);
+    C->fn = fn->enclosing;
+}
+
+/*
+ * walks the body until the inferred local types stop growing, then once more
+ * to report and annotate. bindings, if given, replace the type parameters'
+ * constraints
+ */
+static void check_function(lfChecker *C, lfFunctionNode *f, bool is_method, const lfTypeSet *bindings) {
+    if (f->lazy) {
+        return; /* see lf_typecheck_function */
+    }
+    int ngenerics = length(&C->generics);
+    for (int i = 0; i < length(&f->type_names); i++) {
+        lfGeneric generic = (lfGeneric) {
+            .name = f->type_names[i].value,
+            .type = bindings ? bindings[i] : type_set(C, f->types[i])
+        };
+        array_push(&C->generics, generic);
+    }
+
+    lfFuncCtx fn;
+    ctx_enter(C, &fn, f, f->nslots, f->return_type ? type_set(C, f->return_type) : 0);
+    if (fn.ret == TS_ANY) {
+        fn.ret = 0;
+    }
+    C->report = false;
+    do {
+        fn.changed = false;
+        walk_function(C, f, is_method);
+    } while (fn.changed);
+    C->report = true;
+    walk_function(C, f, is_method);
+    ctx_leave(C);
+
+    length(&C->generics) = ngenerics;
+}
+
+static void check_chunk(lfChecker *C, lfChunk *chunk) {
+    C->chunk = chunk;
+    lfFuncCtx fn;
+    ctx_enter(C, &fn, NULL, chunk->nslots, 0);
+    lfArray(lfNode *) statements = ((lfCompoundNode *)chunk->ast)->statements;
+    C->report = false;
+    do {
+        fn.changed = false;
+        fn.next = 0;
+        check_nodes(C, statements);
+    } while (fn.changed);
+    C->report = true;
+    fn.next = 0;
+    check_nodes(C, statements);
+    ctx_leave(C);
+    chunk->checked = true;
+}
+
+/*
+ * class names have to be known before any annotation is read, and so do the
+ * types of annotated globals, since code anywhere may use them
+ */
+static void collect_declarations(lfChecker *C, lfArray(lfNode *) nodes, bool globals) {
+    for (int i = 0; i < length(&nodes); i++) {
+        lfNode *node = nodes[i];
+        switch (node->type) {
+            case NT_VARDECL: {
+                lfVarDeclNode *decl = (lfVarDeclNode *)node;
+                if (globals && decl->ref.kind == VK_GLOBAL && decl->vartype) {
+                    lfGlobalType *global = &C->L->global_types[decl->ref.slot];
+                    lfTypeSet declared = type_set(C, decl->vartype);
+                    lfTypeSet type = decl->initializer ? declared : declared | TS_NULL;
+                    if (global->declared && global->declared != declared) {
+                        /* declared twice, differently: only the guards are left */
+                        global->declared |= declared;
+                        global->type = TS_ANY;
+                    } else {
+                        global->type = global->declared ? global->type | type : type;
+                        global->declared = declared;
+                    }
+                }
+            } break;
+            case NT_CLASS: {
+                lfClassNode *cls = (lfClassNode *)node;
+                if (!globals) {
+                    array_push(C->classes, cls->name.value);
+                }
+                collect_declarations(C, cls->body, globals);
+            } break;
+            case NT_FUNC: {
+                lfFunctionNode *f = (lfFunctionNode *)node;
+                bool closure = f->captures != NULL && length(&f->captures) > 0;
+                if (globals && f->ref.kind == VK_GLOBAL && !closure) {
+                    C->L->global_types[f->ref.slot].function = f;
+                }
+                collect_declarations(C, f->body, globals);
+            } break;
+            case NT_COMPOUND:
+                collect_declarations(C, ((lfCompoundNode *)node)->statements, globals);
+                break;
+            case NT_IF: {
+                lfIfNode *ifnode = (lfIfNode *)node;
+                collect_declarations(C, ((lfCompoundNode *)ifnode->body)->statements, globals);
+                if (ifnode->else_body) {
+                    collect_declarations(C, ((lfCompoundNode *)ifnode->else_body)->statements, globals);
+                }
+            } break;
+            case NT_WHILE:
+                collect_declarations(C, ((lfCompoundNode *)((lfWhileNode *)node)->body)->statements, globals);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static lfChecker checker_new(lfState *L) {
+    return (lfChecker) {
+        .L = L,
+        .chunk = NULL,
+        .fn = NULL,
+        .generics = array_new(&L->allocator, lfGeneric),
+        .classes = &L->class_names,
+        .report = false,
+        .quiet = false,
+        .errored = false
+    };
+}
+
+static void checker_delete(lfChecker *C) {
+    array_delete(&C->generics);
+}
+
+bool lf_typecheck(lfState *L) {
+    lfChecker C = checker_new(L);
+    length(&L->class_names) = 0;
+    for (int i = 0; i < length(&L->chunks); i++) {
+        collect_declarations(&C, ((lfCompoundNode *)L->chunks[i]->ast)->statements, false);
+    }
+    for (int i = 0; i < length(&L->chunks); i++) {
+        lfChunk *chunk = L->chunks[i];
+        if (chunk->resolved && !chunk->checked) {
+            C.chunk = chunk;
+            collect_declarations(&C, ((lfCompoundNode *)chunk->ast)->statements, true);
+        }
+    }
+    for (int i = 0; i < length(&L->chunks); i++) {
+        lfChunk *chunk = L->chunks[i];
+        if (chunk->resolved && !chunk->checked) {
+            check_chunk(&C, chunk);
+        }
+    }
+    checker_delete(&C);
+    return !C.errored;
+}
+
+bool lf_typecheck_function(lfState *L, lfChunk *chunk, lfFunctionNode *f) {
+    lfChecker C = checker_new(L);
+    /* the classes elsewhere and the globals' types are known from lf_typecheck; these are new */
+    collect_declarations(&C, f->body, false);
+    C.chunk = chunk;
+    check_function(&C, f, f->is_method, NULL);
+    checker_delete(&C);
+    return !C.errored;
+}
@@ -3,45 +3,280 @@
  */
 
 #include <stdio.h>
-#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "parser/node.h"
-#include "parser/parse.h"
+#include "parser/events.h"
+#include "interp/state.h"
+#include "interp/eval.h"
+#include "interp/jit.h"
+#include "interp/profile.h"
+#include "interp/isolate.h"
+#include "interp/snapshot.h"
+#include "interp/ssa.h"
+#include "lib/alloc.h"
+#include "lib/array.h"
+#include "lib/error.h"
 #include "lib/ansi.h"
 
 #define FATAL FG_RED BOLD "fatal: " RESET
 
-int main(int argc, const char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, FATAL "no file provided\nsyntax: %s <file>\n", argv[0]);
-        return 1;
+/* includes are statements, so nothing inside an expression needs looking at */
+static bool deps_enter(void *userdata, const lfParseEvent *event) {
+    const char *file = userdata;
+    switch (event->type) {
+        case NT_IMPORT: {
+            /* the file a run would load, see lf_load_include */
+            lfArray(char) path = lf_include_path(&lf_default_allocator, file, event->tokens, event->ntokens);
+            printf(" %s", path);
+            array_delete(&path);
+            return false;
+        }
+        case NT_COMPOUND:
+        case NT_FUNC:
+        case NT_CLASS:
+        case NT_IF:
+        case NT_WHILE:
+            return true;
+        default:
+            return false;
     }
+}
 
-    const char *file = argv[1];
+/* prints a line per file, 'file: included files', like a makefile rule, and syntax errors on stderr */
+static bool print_dependencies(int argc, const char **argv) {
+    lfDiagnosticSink diagnostics = (lfDiagnosticSink) {
+        .report = lf_error_print_diagnostic,
+        .userdata = stderr
+    };
+    lfParser *parser = lf_parser_new(&lf_default_allocator, &diagnostics);
+    if (parser == NULL) {
+        return false;
+    }
+    parser->threads = lf_tokenize_threads();
+    bool ok = true;
+    for (int i = 0; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (f == NULL) {
+            fprintf(stderr, FATAL "cannot read '%s'\n", argv[i]);
+            ok = false;
+            continue;
+        }
+        long sz = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+        char *source = sz >= 0 ? malloc(sz + 1) : NULL;
+        if (source == NULL) {
+            fprintf(stderr, FATAL "cannot read '%s'\n", argv[i]);
+            fclose(f);
+            ok = false;
+            continue;
+        }
+        rewind(f);
+        size_t read = fread(source, 1, sz, f);
+        fclose(f);
+        source[read] = 0;
+
+        lfParseHandler handler = {
+            .enter = deps_enter,
+            .exit = NULL,
+            .userdata = (void *)argv[i]
+        };
+        printf("%s:", argv[i]);
+        ok = lf_parse_events(parser, source, argv[i], &handler) && ok;
+        printf("\n");
+        lf_parser_reset(parser);
+        free(source);
+    }
+    lf_parser_delete(parser);
+    return ok;
+}
 
-    FILE *f = fopen(file, "rb");
-    if (f == NULL) {
-        fprintf(stderr, FATAL "failed to open file %s\n", file);
+int main(int argc, const char **argv) {
+    /* --no-jit runs everything in the interpreter, for comparing the two */
+    bool jit = true;
+    /* --no-inline calls every function, for comparing with running small ones in place */
+    bool inline_calls = true;
+    /* --no-tail-calls gives every call a frame of its own, for comparing with calls in tail position reusing the caller's */
+    bool tail_calls = true;
+    /* --no-opt runs bodies as parsed, for comparing with the SSA passes */
+    bool optimize = true;
+    /* --opt-stats reports on stderr what the SSA passes did */
+    bool opt_stats = false;
+    /* --dump-ir writes the IR of every body the SSA passes ran on to stderr */
+    bool dump_ir = false;
+    /* --profile <file> samples the run and writes collapsed stacks there */
+    const char *profile = NULL;
+    /* --lazy builds top-level function bodies on first call, only checking their syntax up front */
+    bool lazy = false;
+    /* --deps prints what each file includes instead of running anything */
+    bool deps = false;
+    /* --shake drops functions and classes the program never names, listing them on stderr */
+    bool shake = false;
+    /* --jit-stats reports on stderr how much code the first file compiled, and its position tables */
+    bool jit_stats = false;
+    /* --write-snapshot <file> runs a file to initialize a state, then snapshots it there */
+    const char *write_snapshot = NULL;
+    /* --snapshot <file> starts from a snapshot's state instead of a fresh one */
+    const char *snapshot = NULL;
+    int arg = 1;
+    while (arg < argc && argv[arg][0] == '-' && argv[arg][1] == '-') {
+        if (!strcmp(argv[arg], "--no-jit")) {
+            jit = false;
+            arg += 1;
+        } else if (!strcmp(argv[arg], "--no-inline")) {
+            inline_calls = false;
+            arg += 1;
+        } else if (!strcmp(argv[arg], "--no-tail-calls")) {
+            tail_calls = false;
+            arg += 1;
+        } else if (!strcmp(argv[arg], "--no-opt")) {
+            optimize = false;
+            arg += 1;
+        } else if (!strcmp(argv[arg], "--opt-stats")) {
+            opt_stats = true;
+            arg += 1;
+        } else if (!strcmp(argv[arg], "--dump-ir")) {
+            dump_ir = true;
+            arg += 1;
+        } else if (!strcmp(argv[arg], "--lazy")) {
+            lazy = true;
+            arg += 1;
+        } else if (!strcmp(argv[arg], "--deps")) {
+            deps = true;
+            arg += 1;
+        } else if (!strcmp(argv[arg], "--shake")) {
+            shake = true;
+            arg += 1;
+        } else if (!strcmp(argv[arg], "--jit-stats")) {
+            jit_stats = true;
+            arg += 1;
+        } else if (!strcmp(argv[arg], "--profile") && arg + 1 < argc) {
+            profile = argv[arg + 1];
+            arg += 2;
+        } else if (!strcmp(argv[arg], "--write-snapshot") && arg + 1 < argc) {
+            write_snapshot = argv[arg + 1];
+            arg += 2;
+        } else if (!strcmp(argv[arg], "--snapshot") && arg + 1 < argc) {
+            snapshot = argv[arg + 1];
+            arg += 2;
+        } else {
+            fprintf(stderr, FATAL "unknown option '%s'\n", argv[arg]);
+            return 1;
+        }
+    }
+    if (arg >= argc) {
+        fprintf(stderr, FATAL "no file provided\nsyntax: %s [--no-jit] [--no-inline] [--no-tail-calls] [--no-opt] [--opt-stats] [--dump-ir] [--lazy] [--profile <out>] [--deps] [--shake] [--jit-stats] [--write-snapshot <out> | --snapshot <in>] <file> [<file>...]\n", argv[0]);
+        return 1;
+    }
+    if (profile && arg + 1 < argc) {
+        fprintf(stderr, FATAL "--profile takes a single file\n");
+        return 1;
+    }
+    if (write_snapshot && (arg + 1 < argc || profile || snapshot)) {
+        fprintf(stderr, FATAL "--write-snapshot takes a single file, and neither --profile nor --snapshot\n");
         return 1;
     }
 
-    fseek(f, 0, SEEK_END);
-    size_t sz = ftell(f);
-    rewind(f);
+    FILE *profile_out = NULL;
+    if (profile) {
+        profile_out = fopen(profile, "w");
+        if (profile_out == NULL) {
+            fprintf(stderr, FATAL "cannot write '%s'\n", profile);
+            return 1;
+        }
+    }
 
-    char *buffer = malloc(sz + 1);
-    if (fread(buffer, 1, sz, f) != sz) {
-        fprintf(stderr, FATAL "failed to read file %s\n", file);
-        fclose(f);
-        free(buffer);
+    lfDiagnosticSink diagnostics = (lfDiagnosticSink) {
+        .report = lf_error_print_diagnostic,
+        .userdata = stdout
+    };
+    if (deps) {
+        return print_dependencies(argc - arg, argv + arg) ? 0 : 1;
+    }
+    lfState *L;
+    if (write_snapshot) {
+        L = lf_snapshot_state_new(&diagnostics);
+    } else if (snapshot) {
+        L = lf_snapshot_load(snapshot, &lf_default_allocator, &diagnostics, stdout);
+    } else {
+        L = lf_state_new(&lf_default_allocator, &diagnostics);
+        if (L == NULL) {
+            fprintf(stderr, FATAL "out of memory\n");
+        }
+    }
+    if (L == NULL) {
         return 1;
     }
-    buffer[sz] = 0;
+    /* a snapshot cannot hold an isolate group */
+    lfIsolateGroup *G = write_snapshot ? NULL : lf_isolate_group_new(&lf_default_allocator, &diagnostics, stdout);
+
+    L->jit = L->jit && jit;
+    L->inline_calls = inline_calls;
+    L->tail_calls = tail_calls;
+    L->optimize = optimize;
+    L->ir_dump = dump_ir ? stderr : NULL;
+    L->parser->lazy = lazy;
+    L->shake = shake ? stderr : NULL;
+    if (!write_snapshot) {
+        L->parser->threads = lf_tokenize_threads(); /* lf_default_allocator is thread safe, a state being snapshotted's is not */
+    }
+#ifdef LF_DISPATCH_STATS
+    /* compiled code skips most dispatches, so the counts are the interpreter's alone */
+    L->jit = false;
+#endif
+    if (profile_out && !lf_profile_start(L, LF_PROFILE_HZ)) {
+        fprintf(stderr, FATAL "profiling is not supported here\n");
+    }
 
-    lfNode *ast = lf_parse(buffer, file);
+    /*
+     * the first file runs here as isolate 0, and every further one in an
+     * isolate on a thread of its own, all in parallel
+     */
+    bool ok = true;
+    if (G) {
+        G->jit = L->jit;
+        G->inline_calls = L->inline_calls;
+        G->tail_calls = L->tail_calls;
+        G->optimize = L->optimize;
+        G->lazy = L->parser->lazy;
+        G->shake = L->shake;
+        lf_isolate_attach(G, L);
+        for (int i = arg + 1; i < argc; i++) {
+            if (lf_isolate_start(G, argv[i]) < 0) {
+                fprintf(stderr, FATAL "cannot run '%s' in parallel\n", argv[i]);
+                ok = false;
+            }
+        }
+    } else if (arg + 1 < argc) {
+        fprintf(stderr, FATAL "running several files needs isolates, which are not supported here\n");
+        ok = false;
+    }
+    ok = lf_run_file(L, argv[arg]) && ok;
+    if (write_snapshot && ok) {
+        ok = lf_snapshot_write(L, write_snapshot);
+    }
+    if (profile_out) {
+        lf_profile_stop(L);
+        lf_profile_write(L, profile_out);
+        fclose(profile_out);
+    }
+    if (jit_stats) {
+        lf_jit_report(L, stderr);
+    }
+    if (opt_stats) {
+        lf_optimize_report(L, stderr);
+    }
+#ifdef LF_DISPATCH_STATS
+    lf_dispatch_report(L, stderr);
+#endif
 
-    if (ast) lf_node_deleter(&ast);
-    free(buffer);
-    return 0;
+    if (G) {
+        ok = lf_isolate_group_wait(G) && ok;
+        lf_isolate_group_delete(G);
+    }
+    if (write_snapshot || snapshot) {
+        lf_snapshot_state_delete(L);
+    } else {
+        lf_state_delete(L);
+    }
+    return ok ? 0 : 1;
 }
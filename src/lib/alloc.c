@@ -0,0 +1,22 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <stdlib.h>
+
+#include "lib/alloc.h"
+
+static void *default_realloc(void *userdata, void *ptr, size_t old_size, size_t new_size) {
+    (void)userdata;
+    (void)old_size;
+    if (new_size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, new_size);
+}
+
+const lfAllocator lf_default_allocator = {
+    .realloc = default_realloc,
+    .userdata = NULL
+};
@@ -0,0 +1,119 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lib/arena.h"
+
+#define ARENA_ALIGN 16
+#define align_up(N) (((N) + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* chunk data starts right after the (aligned) chunk header */
+#define chunk_data(C) ((uint8_t *)(C) + align_up(sizeof(lfArenaChunk)))
+
+void lf_arena_init(lfArena *arena, const lfAllocator *parent, size_t chunk_size) {
+    *arena = (lfArena) {
+        .parent = *parent,
+        .chunks = NULL,
+        .current = NULL,
+        .last = NULL,
+        .chunk_size = chunk_size
+    };
+}
+
+void lf_arena_reset(lfArena *arena) {
+    for (lfArenaChunk *chunk = arena->chunks; chunk != NULL; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->current = arena->chunks;
+    arena->last = NULL;
+}
+
+void lf_arena_free(lfArena *arena) {
+    lfArenaChunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        lfArenaChunk *next = chunk->next;
+        lf_free(&arena->parent, chunk, align_up(sizeof(lfArenaChunk)) + chunk->size);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->current = NULL;
+    arena->last = NULL;
+}
+
+static lfArenaChunk *arena_next_chunk(lfArena *arena, size_t size) {
+    /* reuse a chunk kept from before the last reset if it is large enough */
+    lfArenaChunk *next = arena->current ? arena->current->next : arena->chunks;
+    if (next != NULL && next->size >= size) {
+        return next;
+    }
+
+    size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+    lfArenaChunk *chunk = lf_malloc(&arena->parent, align_up(sizeof(lfArenaChunk)) + chunk_size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    chunk->next = next;
+    if (arena->current) {
+        arena->current->next = chunk;
+    } else {
+        arena->chunks = chunk;
+    }
+    return chunk;
+}
+
+void *lf_arena_alloc(lfArena *arena, size_t size) {
+    size = align_up(size);
+    lfArenaChunk *chunk = arena->current;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        chunk = arena_next_chunk(arena, size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        arena->current = chunk;
+    }
+    void *ptr = chunk_data(chunk) + chunk->used;
+    chunk->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+static void *arena_realloc(void *userdata, void *ptr, size_t old_size, size_t new_size) {
+    lfArena *arena = userdata;
+    if (new_size == 0) {
+        return NULL;
+    }
+    if (ptr == NULL) {
+        return lf_arena_alloc(arena, new_size);
+    }
+    if (new_size <= old_size) {
+        return ptr;
+    }
+
+    /* grow the most recent allocation in place when the chunk has room */
+    lfArenaChunk *chunk = arena->current;
+    if (ptr == arena->last) {
+        size_t offset = (uint8_t *)ptr - chunk_data(chunk);
+        if (offset + align_up(new_size) <= chunk->size) {
+            chunk->used = offset + align_up(new_size);
+            return ptr;
+        }
+    }
+
+    void *new_ptr = lf_arena_alloc(arena, new_size);
+    if (new_ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size);
+    }
+    return new_ptr;
+}
+
+lfAllocator lf_arena_allocator(lfArena *arena) {
+    return (lfAllocator) {
+        .realloc = arena_realloc,
+        .userdata = arena
+    };
+}
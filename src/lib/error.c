@@ -7,7 +7,12 @@
 #include "lib/error.h"
 #include "lib/ansi.h"
 
-void error_underline_code(const char *source, int idx_start, int idx_end) {
+#ifdef _WIN32
+#define flockfile _lock_file
+#define funlockfile _unlock_file
+#endif
+
+void lf_error_underline_code(FILE *out, const char *source, int idx_start, int idx_end) {
     /* find start of the line with the error */
     int line_start = idx_start;
     while (line_start > 0 && source[line_start] && source[line_start] != '\n') {
@@ -22,34 +27,34 @@ void error_underline_code(const char *source, int idx_start, int idx_end) {
     while (i < idx_end) {
         /* print the line of code */
         while (source[i] && source[i] != '\n') {
-            putc(source[i], stdout);
+            putc(source[i], out);
             i += 1;
         }
-        putc('\n', stdout);
+        putc('\n', out);
         i += 1;
 
         /* add underlines */
-        printf(FG_RED BOLD);
+        fprintf(out, FG_RED BOLD);
         while (j < idx_start) {
-            putc(' ', stdout);
+            putc(' ', out);
             j += 1;
         }
         if (j == idx_start) {
-            putc('^', stdout);
+            putc('^', out);
             j += 1;
         }
-        printf(CROSSED);
+        fprintf(out, CROSSED);
         while (source[j] && source[j] != '\n' && j < idx_end) {
-            putc('~', stdout);
+            putc('~', out);
             j += 1;
         }
-        printf(RESET);
-        putc('\n', stdout);
+        fprintf(out, RESET);
+        putc('\n', out);
         j += 1;
     }
 }
 
-void lf_error_print(const char *file, const char *source, int idx_start, int idx_end, const char *message) {
+void lf_error_report(const lfDiagnosticSink *sink, const char *file, const char *source, int idx_start, int idx_end, const char *message) {
     int line_start = idx_start;
     while (line_start > 0 && source[line_start] && source[line_start] != '\n') {
         line_start -= 1;
@@ -64,6 +69,39 @@ void lf_error_print(const char *file, const char *source, int idx_start, int idx
         line_start -= 1;
     }
 
-    printf("%s:%d:%d: %s:\n", file, line, column, message);
-    error_underline_code(source, idx_start, idx_end);
+    lfDiagnostic diagnostic = (lfDiagnostic) {
+        .file = file,
+        .source = source,
+        .idx_start = idx_start,
+        .idx_end = idx_end,
+        .line = line,
+        .column = column,
+        .message = message
+    };
+    sink->report(sink->userdata, &diagnostic);
+}
+
+void lf_error_report_line(const lfDiagnosticSink *sink, const char *file, const char *source, int line, const char *message) {
+    int idx_start = 0;
+    for (int l = 1; l < line && source[idx_start]; idx_start++) {
+        if (source[idx_start] == '\n') {
+            l += 1;
+        }
+    }
+    while (source[idx_start] == ' ' || source[idx_start] == '\t') {
+        idx_start += 1;
+    }
+    int idx_end = idx_start;
+    while (source[idx_end] && source[idx_end] != '\n') {
+        idx_end += 1;
+    }
+    lf_error_report(sink, file, source, idx_start, idx_end, message);
+}
+
+void lf_error_print_diagnostic(void *userdata, const lfDiagnostic *diagnostic) {
+    FILE *out = userdata ? (FILE *)userdata : stdout;
+    flockfile(out); /* whole, when isolates report to the same stream */
+    fprintf(out, "%s:%d:%d: %s:\n", diagnostic->file, diagnostic->line, diagnostic->column, diagnostic->message);
+    lf_error_underline_code(out, diagnostic->source, diagnostic->idx_start, diagnostic->idx_end);
+    funlockfile(out);
 }
@@ -0,0 +1,1084 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "parser/events.h"
+#include "parser/parse.h"
+#include "parser/node.h"
+#include "parser/token.h"
+#include "lib/array.h"
+#include "lib/error.h"
+
+/*
+ * the grammar of parse.c, consuming tokens without building anything.
+ * infix and postfix nodes are only known once their left operand has been
+ * parsed, so events are queued and their enter slotted in before the
+ * operand's. expressions hold no statements, so the queue is delivered at
+ * each statement and as soon as a statement's own node is entered. once a
+ * handler declines a node nothing inside it is queued, and its bodies are
+ * skipped rather than parsed
+ */
+
+/* queued, as indices so nothing points into the token buffer before it is final */
+typedef struct lfPendingEvent {
+    lfNodeType type;
+    bool exit;
+    int idx_start;
+    int idx_end;
+    int lineno;
+    int token; /* the first of the node's own */
+    int ntokens;
+} lfPendingEvent;
+
+typedef struct lfEventCtx {
+    const lfParseHandler *handler;
+    const lfDiagnosticSink *diagnostics;
+    const lfArray(lfToken) tokens;
+    int current_idx;
+    lfToken current;
+    int last_end; /* of the last token consumed */
+    lfArray(lfPendingEvent) pending;
+    lfArray(lfToken) *brackets; /* scratch for skipping bodies */
+    int open; /* nodes delivered or skipped, and not yet exited */
+    int skip_from; /* open when a handler declined to enter, or -1 */
+    int skipped; /* nodes entered since, inside the declined one, which are never queued */
+    int line; /* the line source[line_idx] is on */
+    int line_idx;
+    int depth; /* as parse.c's, for the same nesting errors */
+    int nesting;
+    int height;
+    bool errored;
+    bool described;
+    const char *file;
+    const char *source;
+} lfEventCtx;
+
+typedef struct lfEventCtxState {
+    int old_idx;
+    lfToken old;
+    int old_end;
+    int old_pending;
+    int old_skipped;
+} lfEventCtxState;
+
+/* counted on from the last position asked about, which is never far away */
+static int line_of(lfEventCtx *ctx, int idx) {
+    if (idx < 0) {
+        idx = 0; /* the end of an empty source */
+    }
+    while (ctx->line_idx < idx) {
+        if (ctx->source[ctx->line_idx] == '\n') {
+            ctx->line += 1;
+        }
+        ctx->line_idx += 1;
+    }
+    while (ctx->line_idx > idx) {
+        ctx->line_idx -= 1;
+        if (ctx->source[ctx->line_idx] == '\n') {
+            ctx->line -= 1;
+        }
+    }
+    return ctx->line;
+}
+
+static void advance(lfEventCtx *ctx) {
+    ctx->last_end = ctx->current.idx_end;
+    ctx->current_idx += 1;
+    ctx->current = ctx->tokens[ctx->current_idx];
+}
+
+static lfEventCtxState save(lfEventCtx *ctx) {
+    return (lfEventCtxState) {
+        .old_idx = ctx->current_idx,
+        .old = ctx->current,
+        .old_end = ctx->last_end,
+        .old_pending = length(&ctx->pending),
+        .old_skipped = ctx->skipped
+    };
+}
+
+static void restore(lfEventCtx *ctx, const lfEventCtxState *state) {
+    ctx->current = state->old;
+    ctx->current_idx = state->old_idx;
+    ctx->last_end = state->old_end;
+    length(&ctx->pending) = state->old_pending;
+    ctx->skipped = state->old_skipped;
+    ctx->errored = false;
+    ctx->described = false;
+}
+
+static void error_at(lfEventCtx *ctx, lfToken token, const char *message) {
+    lf_error_report(ctx->diagnostics, ctx->file, ctx->source, token.idx_start, token.idx_end, message);
+    ctx->errored = true;
+    ctx->described = true;
+}
+
+static void error_here(lfEventCtx *ctx, const char *message) {
+    error_at(ctx, ctx->current, message);
+}
+
+/* parse.c's nesting limits, checked at the same tokens */
+static bool nest(lfEventCtx *ctx, int height) {
+    ctx->height = height;
+    if (ctx->depth + height > LF_MAX_NESTING) {
+        error_here(ctx, "expression too deeply nested");
+        return false;
+    }
+    return true;
+}
+
+static bool enter_nesting(lfEventCtx *ctx) {
+    if (ctx->depth + ctx->nesting >= LF_MAX_NESTING) {
+        error_here(ctx, "expression too deeply nested");
+        return false;
+    }
+    ctx->nesting += 1;
+    return true;
+}
+
+static bool block_fits(lfEventCtx *ctx) {
+    if (ctx->depth + ctx->nesting >= LF_MAX_NESTING) {
+        error_here(ctx, "block too deeply nested");
+        return false;
+    }
+    return true;
+}
+
+#define higher(A, B) ((A) > (B) ? (A) : (B))
+
+static lfParseEvent event_for(lfEventCtx *ctx, const lfPendingEvent *pending) {
+    return (lfParseEvent) {
+        .type = pending->type,
+        .idx_start = pending->idx_start,
+        .idx_end = pending->idx_end,
+        .lineno = pending->lineno,
+        .tokens = ctx->tokens + pending->token,
+        .ntokens = pending->ntokens
+    };
+}
+
+/* delivers the queue, keeping track of which nodes are being skipped */
+static void flush(lfEventCtx *ctx) {
+    const lfParseHandler *handler = ctx->handler;
+    for (int i = 0; i < length(&ctx->pending); i++) {
+        lfPendingEvent *pending = &ctx->pending[i];
+        if (!pending->exit) {
+            if (ctx->skip_from < 0 && handler->enter) {
+                lfParseEvent event = event_for(ctx, pending);
+                if (!handler->enter(handler->userdata, &event)) {
+                    ctx->skip_from = ctx->open;
+                }
+            }
+            ctx->open += 1;
+        } else {
+            ctx->open -= 1;
+            if (ctx->skip_from == ctx->open) {
+                ctx->skip_from = -1;
+            }
+            if (ctx->skip_from < 0 && handler->exit) {
+                lfParseEvent event = event_for(ctx, pending);
+                handler->exit(handler->userdata, &event);
+            }
+        }
+    }
+    length(&ctx->pending) = 0;
+}
+
+/* a node starting at the given token, not yet queued */
+static lfPendingEvent node_at(lfEventCtx *ctx, lfNodeType type, int token) {
+    if (ctx->skip_from >= 0) return (lfPendingEvent) { .type = type }; /* never queued, so never counted */
+    int idx = ctx->tokens[token].idx_start;
+    return (lfPendingEvent) {
+        .type = type,
+        .exit = false,
+        .idx_start = idx,
+        .idx_end = idx,
+        .lineno = line_of(ctx, idx),
+        .token = token,
+        .ntokens = 0
+    };
+}
+
+/* queues entering node ahead of whatever was queued from mark on */
+static void enter_at(lfEventCtx *ctx, int mark, const lfPendingEvent *node) {
+    if (ctx->skip_from >= 0) {
+        ctx->skipped += 1;
+        return;
+    }
+    array_push(&ctx->pending, *node);
+    if (mark < length(&ctx->pending) - 1) {
+        memmove(ctx->pending + mark + 1, ctx->pending + mark, (length(&ctx->pending) - mark - 1) * sizeof(lfPendingEvent));
+        ctx->pending[mark] = *node;
+    }
+}
+
+/* a node starting at the current token, whose own tokens are ntokens from token */
+static lfPendingEvent enter(lfEventCtx *ctx, lfNodeType type, int token, int ntokens) {
+    lfPendingEvent node = node_at(ctx, type, ctx->current_idx);
+    node.token = token;
+    node.ntokens = ntokens;
+    enter_at(ctx, length(&ctx->pending), &node);
+    return node;
+}
+
+static void leave(lfEventCtx *ctx, const lfPendingEvent *node) {
+    if (ctx->skipped > 0) {
+        ctx->skipped -= 1;
+        return;
+    }
+    array_push(&ctx->pending, *node);
+    lfPendingEvent *exit = &ctx->pending[length(&ctx->pending) - 1];
+    exit->exit = true;
+    exit->idx_end = ctx->last_end;
+    /* the declined node's own exit, delivered now so its siblings are queued again */
+    if (ctx->skip_from >= 0) flush(ctx);
+}
+
+/* what can follow 'return' as its value, which parse.c finds out by trying */
+static bool starts_expression(const lfToken *token) {
+    switch (token->type) {
+        case TT_INT:
+        case TT_FLOAT:
+        case TT_STRING:
+        case TT_LPAREN:
+        case TT_SUB:
+        case TT_NOT:
+        case TT_IDENTIFIER:
+        case TT_LBRACE:
+            return true;
+        case TT_KEYWORD:
+            return !strcmp(token->value, "await");
+        default:
+            return false;
+    }
+}
+
+static void parse_expr(lfEventCtx *ctx);
+static void parse_subscriptive(lfEventCtx *ctx);
+static void parse_binary(lfEventCtx *ctx, int level);
+static void skip_type(lfEventCtx *ctx);
+static void parse_statement(lfEventCtx *ctx);
+
+static void skip_typename(lfEventCtx *ctx) {
+    if (ctx->current.type != TT_IDENTIFIER) {
+        error_here(ctx, "expected type");
+        return;
+    }
+    advance(ctx);
+    ctx->height = 1;
+}
+
+static void skip_nontrivial_type(lfEventCtx *ctx) {
+    if (ctx->current.type == TT_LBRACE) {
+        lfToken lbrace = ctx->current;
+        advance(ctx);
+        bool is_map = false;
+        bool is_array = false;
+        int height = 0;
+        if (ctx->current.type != TT_RBRACE && ctx->current.type != TT_COMMA) {
+            do {
+                if (ctx->current.type == TT_COMMA) {
+                    advance(ctx);
+                }
+                skip_type(ctx);
+                if (ctx->errored) {
+                    return;
+                }
+                height = higher(height, ctx->height);
+                if (ctx->current.type == TT_COLON) {
+                    is_map = true;
+                    if (is_array) {
+                        error_here(ctx, "invalid ':' in array type");
+                        return;
+                    }
+                    advance(ctx);
+                    skip_type(ctx);
+                    if (ctx->errored) {
+                        return;
+                    }
+                    height = higher(height, ctx->height);
+                } else {
+                    is_array = true;
+                    if (is_map) {
+                        error_here(ctx, "expected ':' in map type");
+                        return;
+                    }
+                }
+            } while (ctx->current.type == TT_COMMA);
+        }
+        if (ctx->current.type != TT_RBRACE) {
+            error_here(ctx, "expected '}'");
+            error_at(ctx, lbrace, "... to close");
+            return;
+        }
+        advance(ctx);
+        nest(ctx, height + 1);
+        return;
+    } else if (ctx->current.type == TT_LPAREN) {
+        lfToken lparen = ctx->current;
+        advance(ctx);
+        bool single = false; /* one type and no comma, which may just be parenthesized */
+        int height = 0;
+        if (ctx->current.type != TT_RPAREN) {
+            skip_type(ctx);
+            if (ctx->errored) {
+                return;
+            }
+            single = true;
+            height = ctx->height;
+        }
+        if (ctx->current.type == TT_COMMA) {
+            single = false;
+            do {
+                advance(ctx);
+                skip_type(ctx);
+                if (ctx->errored) {
+                    return;
+                }
+                height = higher(height, ctx->height);
+            } while (ctx->current.type == TT_COMMA);
+        }
+        if (ctx->current.type != TT_RPAREN) {
+            error_here(ctx, "expected ')'");
+            error_at(ctx, lparen, "... to close");
+            return;
+        }
+        advance(ctx);
+        if (ctx->current.type == TT_ARROW) {
+            advance(ctx);
+            skip_type(ctx);
+            if (!ctx->errored) {
+                nest(ctx, higher(height, ctx->height) + 1);
+            }
+        } else if (!single) {
+            error_here(ctx, "expected '->'");
+        }
+        return;
+    }
+
+    skip_typename(ctx);
+}
+
+static void skip_type(lfEventCtx *ctx) {
+    if (!enter_nesting(ctx)) {
+        return;
+    }
+    skip_nontrivial_type(ctx);
+    ctx->nesting -= 1;
+    while (!ctx->errored && (ctx->current.type == TT_BAND || ctx->current.type == TT_BOR)) {
+        int height = ctx->height;
+        advance(ctx);
+        skip_nontrivial_type(ctx);
+        if (!ctx->errored) {
+            nest(ctx, higher(height, ctx->height) + 1);
+        }
+    }
+}
+
+static void parse_literal(lfEventCtx *ctx) {
+    if (ctx->current.type == TT_INT || ctx->current.type == TT_FLOAT || ctx->current.type == TT_STRING) {
+        lfNodeType type = ctx->current.type == TT_INT ? NT_INT : ctx->current.type == TT_FLOAT ? NT_FLOAT : NT_STRING;
+        lfPendingEvent node = enter(ctx, type, ctx->current_idx, 1);
+        advance(ctx);
+        leave(ctx, &node);
+        ctx->height = 1;
+    } else if (ctx->current.type == TT_LPAREN) {
+        lfToken lparen = ctx->current;
+        advance(ctx);
+        parse_expr(ctx);
+        if (ctx->errored) return;
+        if (ctx->current.type != TT_RPAREN) {
+            error_here(ctx, "expected ')'");
+            error_at(ctx, lparen, "... to close");
+            return;
+        }
+        advance(ctx);
+    } else if (ctx->current.type == TT_SUB || ctx->current.type == TT_NOT) {
+        lfPendingEvent node = enter(ctx, NT_UNARYOP, ctx->current_idx, 1);
+        advance(ctx);
+        if (!enter_nesting(ctx)) {
+            return;
+        }
+        parse_literal(ctx);
+        ctx->nesting -= 1;
+        if (ctx->errored || !nest(ctx, ctx->height + 1)) {
+            return;
+        }
+        leave(ctx, &node);
+    } else if (ctx->current.type == TT_KEYWORD && !strcmp(ctx->current.value, "await")) {
+        lfPendingEvent node = enter(ctx, NT_AWAIT, ctx->current_idx, 0);
+        advance(ctx);
+        if (!enter_nesting(ctx)) {
+            return;
+        }
+        parse_subscriptive(ctx);
+        ctx->nesting -= 1;
+        if (ctx->errored || !nest(ctx, ctx->height + 1)) {
+            return;
+        }
+        leave(ctx, &node);
+    } else if (ctx->current.type == TT_IDENTIFIER) {
+        if (ctx->tokens[ctx->current_idx + 1].type == TT_ASSIGN) {
+            lfPendingEvent node = enter(ctx, NT_ASSIGN, ctx->current_idx, 1);
+            advance(ctx);
+            advance(ctx);
+            parse_expr(ctx);
+            if (ctx->errored || !nest(ctx, ctx->height + 1)) {
+                return;
+            }
+            leave(ctx, &node);
+        } else {
+            lfPendingEvent node = enter(ctx, NT_VARACCESS, ctx->current_idx, 1);
+            advance(ctx);
+            leave(ctx, &node);
+            ctx->height = 1;
+        }
+    } else if (ctx->current.type == TT_LBRACE) {
+        /* whether it is an array or a map shows after the first element */
+        int mark = length(&ctx->pending);
+        int first = ctx->current_idx;
+        lfToken lbrace = ctx->current;
+        bool is_arr = false;
+        bool is_map = false;
+        int height = 0;
+        advance(ctx);
+        if (ctx->current.type != TT_RBRACE && ctx->current.type != TT_COMMA) {
+            do {
+                if (ctx->current.type == TT_COMMA) {
+                    advance(ctx);
+                }
+                parse_expr(ctx);
+                if (ctx->errored) {
+                    return;
+                }
+                height = higher(height, ctx->height);
+                if (ctx->current.type == TT_COLON) {
+                    is_map = true;
+                    if (is_arr) {
+                        error_here(ctx, "invalid ':' in array");
+                        return;
+                    }
+                    advance(ctx);
+                    parse_expr(ctx);
+                    if (ctx->errored) {
+                        return;
+                    }
+                    height = higher(height, ctx->height);
+                } else {
+                    is_arr = true;
+                    if (is_map) {
+                        error_here(ctx, "expected ':' in map");
+                        return;
+                    }
+                }
+            } while (ctx->current.type == TT_COMMA);
+        }
+        if (ctx->current.type != TT_RBRACE) {
+            error_here(ctx, "expected '}'");
+            error_at(ctx, lbrace, "... to close");
+            return;
+        }
+        advance(ctx);
+        if (!nest(ctx, height + 1)) {
+            return;
+        }
+        lfPendingEvent node = node_at(ctx, is_map ? NT_MAP : NT_ARRAY, first);
+        enter_at(ctx, mark, &node);
+        leave(ctx, &node);
+    } else {
+        ctx->errored = true;
+        ctx->described = false;
+    }
+}
+
+static void parse_subscriptive(lfEventCtx *ctx) {
+    int mark = length(&ctx->pending);
+    int first = ctx->current_idx;
+    parse_literal(ctx);
+    if (ctx->errored) return;
+    int height = ctx->height;
+    while (ctx->current.type == TT_LBRACKET || ctx->current.type == TT_DOT || ctx->current.type == TT_LPAREN) {
+        if (ctx->current.type == TT_LBRACKET || ctx->current.type == TT_DOT) {
+            int index_height = 1; /* a name after a dot */
+            if (ctx->current.type == TT_LBRACKET) {
+                lfToken lbracket = ctx->current;
+                advance(ctx);
+                parse_expr(ctx);
+                if (ctx->errored) {
+                    return;
+                }
+                index_height = ctx->height;
+                if (ctx->current.type != TT_RBRACKET) {
+                    error_here(ctx, "expected ']'");
+                    error_at(ctx, lbracket, "... to close");
+                    return;
+                }
+                advance(ctx);
+            } else {
+                advance(ctx);
+                if (ctx->current.type != TT_IDENTIFIER) {
+                    error_here(ctx, "expected identifier");
+                    return;
+                }
+                lfPendingEvent index = enter(ctx, NT_STRING, ctx->current_idx, 1);
+                advance(ctx);
+                leave(ctx, &index);
+            }
+            if (ctx->current.type != TT_ASSIGN) {
+                if (!nest(ctx, higher(height, index_height) + 1)) {
+                    return;
+                }
+                height = ctx->height;
+                lfPendingEvent node = node_at(ctx, NT_SUBSCRIBE, first);
+                enter_at(ctx, mark, &node);
+                leave(ctx, &node);
+            } else {
+                advance(ctx);
+                parse_expr(ctx);
+                if (ctx->errored || !nest(ctx, higher(higher(height, index_height), ctx->height) + 1)) {
+                    return;
+                }
+                lfPendingEvent node = node_at(ctx, NT_OBJASSIGN, first);
+                enter_at(ctx, mark, &node);
+                leave(ctx, &node);
+                return;
+            }
+        } else {
+            lfToken lparen = ctx->current;
+            int args_height = 0;
+            advance(ctx);
+            if (ctx->current.type != TT_RPAREN && ctx->current.type != TT_COMMA) {
+                do {
+                    if (ctx->current.type == TT_COMMA) {
+                        advance(ctx);
+                    }
+                    parse_expr(ctx);
+                    if (ctx->errored) {
+                        return;
+                    }
+                    args_height = higher(args_height, ctx->height);
+                } while (ctx->current.type == TT_COMMA);
+            }
+            if (ctx->current.type != TT_RPAREN) {
+                error_here(ctx, "expected ')'");
+                error_at(ctx, lparen, "... to close");
+                return;
+            }
+            advance(ctx);
+            if (!nest(ctx, higher(height, args_height) + 1)) {
+                return;
+            }
+            height = ctx->height;
+            lfPendingEvent node = node_at(ctx, NT_CALL, first);
+            enter_at(ctx, mark, &node);
+            leave(ctx, &node);
+        }
+    }
+}
+
+/*
+ * the level parse_comparative, parse_additive, parse_multiplicative or
+ * parse_bitwise would take an operator at, loosest first, or -1. climbing
+ * them in one function builds the same left-leaning trees without five
+ * calls for every operand
+ */
+static int binary_level(lfTokenType type) {
+    switch (type) {
+        case TT_EQ:
+        case TT_NE:
+        case TT_LT:
+        case TT_GT:
+        case TT_LE:
+        case TT_GE:
+            return 0;
+        case TT_ADD:
+        case TT_SUB:
+            return 1;
+        case TT_MUL:
+        case TT_DIV:
+        case TT_POW:
+            return 2;
+        case TT_LSHIFT:
+        case TT_RSHIFT:
+            return 3;
+        default:
+            return -1;
+    }
+}
+
+/* operands with operators binding at least as tightly as level */
+static void parse_binary(lfEventCtx *ctx, int level) {
+    int mark = length(&ctx->pending);
+    int first = ctx->current_idx;
+    parse_subscriptive(ctx);
+    if (ctx->errored) return;
+    int height = ctx->height;
+    int at;
+    while ((at = binary_level(ctx->current.type)) >= level) {
+        lfPendingEvent node = node_at(ctx, NT_BINARYOP, first);
+        node.token = ctx->current_idx;
+        node.ntokens = 1;
+        enter_at(ctx, mark, &node);
+        advance(ctx);
+        parse_binary(ctx, at + 1);
+        if (ctx->errored || !nest(ctx, higher(height, ctx->height) + 1)) {
+            return;
+        }
+        height = ctx->height;
+        leave(ctx, &node);
+    }
+    ctx->height = height;
+}
+
+static void parse_expr(lfEventCtx *ctx) {
+    if (!enter_nesting(ctx)) {
+        return;
+    }
+    parse_binary(ctx, 0);
+    ctx->nesting -= 1;
+    if (ctx->errored && !ctx->described) {
+        error_here(ctx, "expected expression");
+    }
+}
+
+static void parse_vardecl(lfEventCtx *ctx, bool allow_ref) {
+    if (ctx->current.type != TT_KEYWORD) {
+        error_here(ctx, "expected 'var', 'const', or 'ref'");
+        return;
+    }
+    bool is_const = !strcmp(ctx->current.value, "const");
+    bool is_ref = !strcmp(ctx->current.value, "ref");
+    if (!allow_ref && is_ref) {
+        error_here(ctx, "unexpected 'ref'");
+        return;
+    }
+    if (!strcmp(ctx->current.value, "var") || is_const || is_ref) {
+        lfPendingEvent node = enter(ctx, NT_VARDECL, ctx->current_idx + 1, 1);
+        flush(ctx);
+        advance(ctx);
+        if (ctx->current.type != TT_IDENTIFIER) {
+            error_here(ctx, "expected variable name");
+            return;
+        }
+        advance(ctx);
+        if (ctx->current.type == TT_COLON) {
+            advance(ctx);
+            skip_type(ctx);
+            if (ctx->errored) {
+                return;
+            }
+        }
+        if (ctx->current.type == TT_ASSIGN) {
+            advance(ctx);
+            parse_expr(ctx);
+            if (ctx->errored) {
+                return;
+            }
+        }
+        leave(ctx, &node);
+        return;
+    }
+
+    ctx->errored = true;
+    ctx->described = false;
+}
+
+static void skip_generics(lfEventCtx *ctx) {
+    if (ctx->current.type == TT_LT) {
+        lfToken lt = ctx->current;
+        advance(ctx);
+        if (ctx->current.type == TT_COMMA) {
+            error_here(ctx, "unexpected ','");
+            return;
+        }
+        do {
+            if (ctx->current.type == TT_COMMA) {
+                advance(ctx);
+            }
+            if (ctx->current.type != TT_IDENTIFIER) {
+                error_here(ctx, "expected name");
+                return;
+            }
+            advance(ctx);
+            if (ctx->current.type == TT_COLON) {
+                advance(ctx);
+                skip_type(ctx);
+                if (ctx->errored) {
+                    return;
+                }
+            }
+        } while (ctx->current.type == TT_COMMA);
+        if (ctx->current.type != TT_GT) {
+            error_here(ctx, "expected '>'");
+            error_at(ctx, lt, "... to close");
+        } else {
+            advance(ctx);
+        }
+    }
+}
+
+/* from a '{' past its matching '}', as parse.c's preparse_body */
+static void skip_body(lfEventCtx *ctx) {
+    lfArray(lfToken) *open = ctx->brackets;
+    length(open) = 0;
+    do {
+        switch (ctx->current.type) {
+            case TT_LBRACE:
+            case TT_LPAREN:
+            case TT_LBRACKET:
+                array_push(open, ctx->current);
+                break;
+            case TT_RBRACE:
+            case TT_RPAREN:
+            case TT_RBRACKET: {
+                lfToken opener = (*open)[length(open) - 1];
+                lfTokenType expected = opener.type == TT_LBRACE ? TT_RBRACE : opener.type == TT_LPAREN ? TT_RPAREN : TT_RBRACKET;
+                if (ctx->current.type != expected) {
+                    error_here(ctx, expected == TT_RBRACE ? "expected '}'" : expected == TT_RPAREN ? "expected ')'" : "expected ']'");
+                    error_at(ctx, opener, "... to close");
+                    return;
+                }
+                length(open) -= 1;
+            } break;
+            case TT_EOF:
+                error_here(ctx, "expected '}'");
+                error_at(ctx, (*open)[length(open) - 1], "... to close");
+                return;
+            default:
+                break;
+        }
+        advance(ctx);
+    } while (length(open) > 0);
+}
+
+/* a body from its '{', parsed unless the node it belongs to is being skipped */
+static void parse_body(lfEventCtx *ctx) {
+    flush(ctx);
+    if (ctx->skip_from >= 0) {
+        skip_body(ctx);
+        return;
+    }
+    advance(ctx);
+    if (!block_fits(ctx)) {
+        return;
+    }
+    ctx->depth += 1;
+    while (ctx->current.type != TT_RBRACE) {
+        parse_statement(ctx);
+        if (ctx->errored) {
+            return;
+        }
+    }
+    ctx->depth -= 1;
+    advance(ctx);
+}
+
+static void parse_fn(lfEventCtx *ctx) {
+    int first = ctx->current_idx;
+    if (ctx->current.type != TT_KEYWORD || strcmp(ctx->current.value, "fn")) {
+        error_here(ctx, "expected 'fn'");
+        return;
+    }
+    advance(ctx);
+    if (ctx->current.type != TT_IDENTIFIER) {
+        error_here(ctx, "expected function name");
+        return;
+    }
+    lfPendingEvent node = node_at(ctx, NT_FUNC, first);
+    node.token = ctx->current_idx;
+    node.ntokens = 1;
+    enter_at(ctx, length(&ctx->pending), &node);
+    flush(ctx);
+    advance(ctx);
+    skip_generics(ctx);
+    if (ctx->errored) {
+        return;
+    }
+    lfToken lparen = ctx->current;
+    if (ctx->current.type != TT_LPAREN) {
+        error_here(ctx, "expected '('");
+        return;
+    }
+    advance(ctx);
+    if (ctx->current.type != TT_RPAREN && ctx->current.type != TT_COMMA) {
+        do {
+            if (ctx->current.type == TT_COMMA) {
+                advance(ctx);
+            }
+            parse_vardecl(ctx, true);
+            if (ctx->errored) {
+                if (!ctx->described) {
+                    error_here(ctx, "expected parameter");
+                }
+                return;
+            }
+        } while (ctx->current.type == TT_COMMA);
+    }
+    if (ctx->current.type != TT_RPAREN) {
+        error_here(ctx, "expected ')'");
+        error_at(ctx, lparen, "... to close");
+        return;
+    }
+    advance(ctx);
+    if (ctx->current.type == TT_ARROW) {
+        advance(ctx);
+        skip_type(ctx);
+        if (ctx->errored) {
+            return;
+        }
+    }
+    if (ctx->current.type != TT_LBRACE) {
+        error_here(ctx, "expected '{'");
+        return;
+    }
+    parse_body(ctx);
+    if (ctx->errored) {
+        return;
+    }
+    leave(ctx, &node);
+}
+
+static void parse_compound(lfEventCtx *ctx) {
+    if (ctx->current.type != TT_LBRACE) {
+        error_here(ctx, "expected '{'");
+        return;
+    }
+    if (!block_fits(ctx)) {
+        return;
+    }
+    lfPendingEvent node = enter(ctx, NT_COMPOUND, ctx->current_idx, 0);
+    parse_body(ctx);
+    if (ctx->errored) {
+        return;
+    }
+    leave(ctx, &node);
+}
+
+static void parse_class(lfEventCtx *ctx) {
+    int first = ctx->current_idx;
+    advance(ctx);
+    if (ctx->current.type != TT_IDENTIFIER) {
+        error_here(ctx, "expected class name");
+        return;
+    }
+    lfPendingEvent node = node_at(ctx, NT_CLASS, first);
+    node.token = ctx->current_idx;
+    node.ntokens = 1;
+    enter_at(ctx, length(&ctx->pending), &node);
+    advance(ctx);
+    lfToken lbrace = ctx->current;
+    if (ctx->current.type != TT_LBRACE) {
+        error_here(ctx, "expected '{'");
+        return;
+    }
+    flush(ctx);
+    if (ctx->skip_from >= 0) {
+        skip_body(ctx);
+    } else {
+        advance(ctx);
+        while (ctx->current.type != TT_RBRACE) {
+            bool member = false;
+            if (ctx->current.type == TT_KEYWORD) {
+                if (!strcmp(ctx->current.value, "var") || !strcmp(ctx->current.value, "const")) {
+                    parse_vardecl(ctx, false);
+                    member = true;
+                } else if (!strcmp(ctx->current.value, "fn")) {
+                    parse_fn(ctx);
+                    member = true;
+                }
+            }
+            /* parse.c also reports a member that failed to parse as missing */
+            if (ctx->errored || !member) {
+                error_here(ctx, "expected 'var', 'const', 'fn', or '}'");
+                error_at(ctx, lbrace, "... in scope");
+                return;
+            }
+        }
+        advance(ctx);
+    }
+    if (ctx->errored) {
+        return;
+    }
+    leave(ctx, &node);
+}
+
+static void parse_statement(lfEventCtx *ctx) {
+    flush(ctx);
+    if (ctx->current.type == TT_KEYWORD) {
+        if (!strcmp(ctx->current.value, "var") || !strcmp(ctx->current.value, "const")) {
+            parse_vardecl(ctx, false);
+            return;
+        } else if (!strcmp(ctx->current.value, "if")) {
+            lfPendingEvent node = enter(ctx, NT_IF, ctx->current_idx, 0);
+            flush(ctx);
+            advance(ctx);
+            parse_expr(ctx);
+            if (ctx->errored) {
+                return;
+            }
+            parse_compound(ctx);
+            if (ctx->errored) {
+                return;
+            }
+            if (ctx->current.type == TT_KEYWORD && !strcmp(ctx->current.value, "else")) {
+                advance(ctx);
+                parse_compound(ctx);
+                if (ctx->errored) {
+                    return;
+                }
+            }
+            leave(ctx, &node);
+            return;
+        } else if (!strcmp(ctx->current.value, "while")) {
+            lfPendingEvent node = enter(ctx, NT_WHILE, ctx->current_idx, 0);
+            flush(ctx);
+            advance(ctx);
+            parse_expr(ctx);
+            if (ctx->errored) {
+                return;
+            }
+            parse_compound(ctx);
+            if (ctx->errored) {
+                return;
+            }
+            leave(ctx, &node);
+            return;
+        } else if (!strcmp(ctx->current.value, "fn")) {
+            parse_fn(ctx);
+            return;
+        } else if (!strcmp(ctx->current.value, "return")) {
+            lfPendingEvent node = enter(ctx, NT_RETURN, ctx->current_idx, 0);
+            flush(ctx);
+            advance(ctx);
+            if (starts_expression(&ctx->current)) {
+                lfEventCtxState old = save(ctx);
+                parse_binary(ctx, 0);
+                if (ctx->errored) {
+                    restore(ctx, &old);
+                }
+            }
+            leave(ctx, &node);
+            return;
+        } else if (!strcmp(ctx->current.value, "yield")) {
+            lfPendingEvent node = enter(ctx, NT_YIELD, ctx->current_idx, 0);
+            advance(ctx);
+            leave(ctx, &node);
+            return;
+        } else if (!strcmp(ctx->current.value, "class")) {
+            parse_class(ctx);
+            return;
+        } else if (!strcmp(ctx->current.value, "include")) {
+            lfPendingEvent node = node_at(ctx, NT_IMPORT, ctx->current_idx);
+            advance(ctx);
+            if (ctx->current.type != TT_IDENTIFIER) {
+                error_here(ctx, "expected include path");
+                return;
+            }
+            node.token = ctx->current_idx;
+            advance(ctx);
+            while (ctx->current.type == TT_DOT) {
+                advance(ctx);
+                if (ctx->current.type != TT_IDENTIFIER) {
+                    error_here(ctx, "expected include path");
+                    return;
+                }
+                advance(ctx);
+            }
+            node.ntokens = ctx->current_idx - node.token;
+            enter_at(ctx, length(&ctx->pending), &node);
+            leave(ctx, &node);
+            return;
+        }
+    } else if (ctx->current.type == TT_LBRACKET) {
+        parse_compound(ctx);
+        return;
+    }
+
+    parse_binary(ctx, 0); /* avoid the expr error printer */
+    if (ctx->errored && !ctx->described) {
+        error_here(ctx, "expected statement or expression");
+    }
+}
+
+bool lf_parse_events(lfParser *parser, const char *source, const char *file, const lfParseHandler *handler) {
+    if (!lf_parser_tokenize(parser, source, file)) {
+        return false;
+    }
+
+    lfEventCtx ctx = (lfEventCtx) {
+        .handler = handler,
+        .diagnostics = &parser->diagnostics,
+        .tokens = parser->tokens,
+        .current_idx = 0,
+        .current = parser->tokens[0],
+        .last_end = 0,
+        .pending = array_new(&parser->allocator, lfPendingEvent),
+        .brackets = &parser->brackets,
+        .open = 0,
+        .skip_from = -1,
+        .skipped = 0,
+        .line = 1,
+        .line_idx = 0,
+        .depth = 0,
+        .nesting = 0,
+        .errored = false,
+        .described = false,
+        .file = file,
+        .source = source
+    };
+
+    /* the chunk starts with the source, blanks and all */
+    lfPendingEvent chunk = node_at(&ctx, NT_COMPOUND, 0);
+    chunk.idx_start = 0;
+    chunk.lineno = 1;
+    enter_at(&ctx, 0, &chunk);
+    while (ctx.current.type != TT_EOF) {
+        parse_statement(&ctx);
+        if (ctx.errored) {
+            break;
+        }
+    }
+    if (!ctx.errored) {
+        leave(&ctx, &chunk);
+        flush(&ctx);
+    }
+
+    array_delete(&ctx.pending);
+    return !ctx.errored;
+}
+
+bool lf_parse_events_body(lfParser *parser, int *token, int depth, int lineno, const char *source, const char *file) {
+    static const lfParseHandler none = { NULL, NULL, NULL };
+    lfToken lbrace = parser->tokens[*token];
+    lfEventCtx ctx = (lfEventCtx) {
+        .handler = &none,
+        .diagnostics = &parser->diagnostics,
+        .tokens = parser->tokens,
+        .current_idx = *token,
+        .current = lbrace,
+        .last_end = lbrace.idx_start,
+        .pending = array_new(&parser->allocator, lfPendingEvent),
+        .brackets = &parser->brackets,
+        .open = 0,
+        .skip_from = -1,
+        .skipped = 0,
+        .line = lineno,
+        .line_idx = lbrace.idx_start,
+        .depth = depth,
+        .nesting = 0,
+        .errored = false,
+        .described = false,
+        .file = file,
+        .source = source
+    };
+
+    parse_body(&ctx);
+    flush(&ctx);
+
+    array_delete(&ctx.pending);
+    *token = ctx.current_idx;
+    return !ctx.errored;
+}
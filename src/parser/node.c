@@ -1,158 +1,471 @@
+#include <string.h>
+
 #include "parser/node.h"
 
-void lf_type_deleter(lfType **pt) {
+void lf_type_deleter(const lfAllocator *allocator, lfType **pt) {
     lfType *t = *pt;
     if (t->type == VT_UNION || t->type == VT_INTERSECTION) {
         lfTypeOp *op = (lfTypeOp *)t;
-        lf_type_deleter(&op->lhs);
-        lf_type_deleter(&op->rhs);
-        free(t);
+        lf_type_deleter(allocator, &op->lhs);
+        lf_type_deleter(allocator, &op->rhs);
+        lf_free(allocator, t, sizeof(lfTypeOp));
     } else if (t->type == VT_ARRAY) {
         lfArrayType *arr = (lfArrayType *)t;
         array_delete(&arr->values);
-        free(t);
+        lf_free(allocator, t, sizeof(lfArrayType));
     } else if (t->type == VT_MAP) {
         lfMapType *map = (lfMapType *)t;
         array_delete(&map->keys);
         array_delete(&map->values);
-        free(t);
+        lf_free(allocator, t, sizeof(lfMapType));
     } else if (t->type == VT_FUNC) {
         lfFuncType *f = (lfFuncType *)t;
         array_delete(&f->params);
-        lf_type_deleter(&f->ret);
-        free(t);
+        lf_type_deleter(allocator, &f->ret);
+        lf_free(allocator, t, sizeof(lfFuncType));
     } else if (t->type == VT_TYPENAME) {
         lfTypeName *tn = (lfTypeName *)t;
-        lf_token_deleter(&tn->typename);
-        free(t);
+        lf_token_deleter(allocator, &tn->typename);
+        lf_free(allocator, t, sizeof(lfTypeName));
     } else if (t->type == VT_ANY) {
-        free(t);
+        lf_free(allocator, t, sizeof(lfType));
     }
 }
 
-void lf_node_deleter(lfNode **pnode) {
+void lf_node_deleter(const lfAllocator *allocator, lfNode **pnode) {
     lfNode *node = *pnode;
     switch (node->type) {
         case NT_IF: {
             lfIfNode *ifnode = (lfIfNode *)node;
-            lf_node_deleter(&ifnode->condition);
-            lf_node_deleter(&ifnode->body);
+            lf_node_deleter(allocator, &ifnode->condition);
+            lf_node_deleter(allocator, &ifnode->body);
             if (ifnode->else_body) {
-                lf_node_deleter(&ifnode->else_body);
+                lf_node_deleter(allocator, &ifnode->else_body);
             }
-            free(node);
+            lf_free(allocator, node, sizeof(lfIfNode));
         } break;
         case NT_WHILE: {
             lfWhileNode *whilenode = (lfWhileNode *)node;
-            lf_node_deleter(&whilenode->condition);
-            lf_node_deleter(&whilenode->body);
-            free(node);
+            lf_node_deleter(allocator, &whilenode->condition);
+            lf_node_deleter(allocator, &whilenode->body);
+            lf_free(allocator, node, sizeof(lfWhileNode));
         } break;
         case NT_UNARYOP: {
             lfUnaryOpNode *unop = (lfUnaryOpNode *)node;
-            lf_token_deleter(&unop->op);
-            lf_node_deleter(&unop->value);
-            free(node);
+            lf_token_deleter(allocator, &unop->op);
+            lf_node_deleter(allocator, &unop->value);
+            lf_free(allocator, node, sizeof(lfUnaryOpNode));
         } break;
         case NT_BINARYOP: {
             lfBinaryOpNode *binop = (lfBinaryOpNode *)node;
-            lf_token_deleter(&binop->op);
-            lf_node_deleter(&binop->lhs);
-            lf_node_deleter(&binop->rhs);
-            free(node);
+            lf_token_deleter(allocator, &binop->op);
+            lf_node_deleter(allocator, &binop->lhs);
+            lf_node_deleter(allocator, &binop->rhs);
+            lf_free(allocator, node, sizeof(lfBinaryOpNode));
         } break;
         case NT_VARDECL: {
             lfVarDeclNode *decl = (lfVarDeclNode *)node;
-            lf_token_deleter(&decl->name);
+            lf_token_deleter(allocator, &decl->name);
             if (decl->vartype) {
-                lf_type_deleter(&decl->vartype);
+                lf_type_deleter(allocator, &decl->vartype);
             }
             if (decl->initializer)
-                lf_node_deleter(&decl->initializer);
-            free(node);
+                lf_node_deleter(allocator, &decl->initializer);
+            lf_free(allocator, node, sizeof(lfVarDeclNode));
         } break;
         case NT_CALL: {
             lfCallNode *call = (lfCallNode *)node;
-            lf_node_deleter(&call->func);
+            lf_node_deleter(allocator, &call->func);
             array_delete(&call->args);
-            free(node);
+            lf_free(allocator, node, sizeof(lfCallNode));
         } break;
         case NT_SUBSCRIBE: {
             lfSubscriptionNode *sub = (lfSubscriptionNode *)node;
-            lf_node_deleter(&sub->object);
-            lf_node_deleter(&sub->index);
-            free(node);
+            lf_node_deleter(allocator, &sub->object);
+            lf_node_deleter(allocator, &sub->index);
+            lf_free(allocator, node, sizeof(lfSubscriptionNode));
         } break;
         case NT_ARRAY: {
             lfArrayNode *arr = (lfArrayNode *)node;
             array_delete(&arr->values);
-            free(node);
+            lf_free(allocator, node, sizeof(lfArrayNode));
         } break;
         case NT_MAP: {
             lfMapNode *arr = (lfMapNode *)node;
             array_delete(&arr->keys);
             array_delete(&arr->values);
-            free(node);
+            lf_free(allocator, node, sizeof(lfMapNode));
         } break;
         case NT_VARACCESS: {
             lfVarAccessNode *var_access = (lfVarAccessNode *)node;
-            lf_token_deleter(&var_access->var);
-            free(node);
+            lf_token_deleter(allocator, &var_access->var);
+            lf_free(allocator, node, sizeof(lfVarAccessNode));
         } break;
         case NT_ASSIGN: {
             lfAssignNode *assign = (lfAssignNode *)node;
-            lf_token_deleter(&assign->var);
-            lf_node_deleter(&assign->value);
-            free(node);
+            lf_token_deleter(allocator, &assign->var);
+            lf_node_deleter(allocator, &assign->value);
+            lf_free(allocator, node, sizeof(lfAssignNode));
         } break;
         case NT_OBJASSIGN: {
             lfObjectAssignNode *assign = (lfObjectAssignNode *)node;
-            lf_node_deleter(&assign->object);
-            lf_node_deleter(&assign->key);
-            lf_node_deleter(&assign->value);
-            free(node);
+            lf_node_deleter(allocator, &assign->object);
+            lf_node_deleter(allocator, &assign->key);
+            lf_node_deleter(allocator, &assign->value);
+            lf_free(allocator, node, sizeof(lfObjectAssignNode));
         } break;
         case NT_FUNC: {
             lfFunctionNode *f = (lfFunctionNode *)node;
-            lf_token_deleter(&f->name);
+            lf_token_deleter(allocator, &f->name);
             array_delete(&f->params);
             array_delete(&f->body);
             array_delete(&f->type_names);
             array_delete(&f->types);
             if (f->return_type) {
-                lf_type_deleter(&f->return_type);
+                lf_type_deleter(allocator, &f->return_type);
+            }
+            if (f->captures) {
+                array_delete(&f->captures);
+            }
+            if (f->specializations) {
+                for (int i = 0; i < length(&f->specializations); i++) {
+                    lfSpecialization *spec = &f->specializations[i];
+                    array_delete(&spec->bindings);
+                    if (spec->node) {
+                        lf_node_deleter(allocator, (lfNode **)&spec->node);
+                    }
+                }
+                array_delete(&f->specializations);
             }
-            free(node);
+            lf_free(allocator, node, sizeof(lfFunctionNode));
         } break;
         case NT_CLASS: {
             lfClassNode *cls = (lfClassNode *)node;
-            lf_token_deleter(&cls->name);
+            lf_token_deleter(allocator, &cls->name);
             array_delete(&cls->body);
-            free(node);
+            lf_free(allocator, node, sizeof(lfClassNode));
         } break;
         case NT_RETURN: {
             lfReturnNode *ret = (lfReturnNode *)node;
             if (ret->value) {
-                lf_node_deleter(&ret->value);
+                lf_node_deleter(allocator, &ret->value);
             }
-            free(node);
+            lf_free(allocator, node, sizeof(lfReturnNode));
+        } break;
+        case NT_YIELD:
+            lf_free(allocator, node, sizeof(lfYieldNode));
+            break;
+        case NT_AWAIT: {
+            lfAwaitNode *await = (lfAwaitNode *)node;
+            lf_node_deleter(allocator, &await->value);
+            lf_free(allocator, node, sizeof(lfAwaitNode));
         } break;
         case NT_COMPOUND: {
             lfCompoundNode *comp = (lfCompoundNode *)node;
             array_delete(&comp->statements);
-            free(node);
+            lf_free(allocator, node, sizeof(lfCompoundNode));
         } break;
         case NT_IMPORT: {
             lfImportNode *import = (lfImportNode *)node;
             array_delete(&import->path);
-            free(node);
+            lf_free(allocator, node, sizeof(lfImportNode));
         } break;
         case NT_INT:
         case NT_FLOAT:
         case NT_STRING: {
             lfLiteralNode *lit = (lfLiteralNode *)node;
-            lf_token_deleter(&lit->value);
-            free(node);
+            lf_token_deleter(allocator, &lit->value);
+            lf_free(allocator, node, sizeof(lfLiteralNode));
         } break;
     }
 }
+
+static lfToken clone_token(const lfAllocator *allocator, lfToken tok) {
+    if (tok.value != NULL) {
+        char *value = array_new(allocator, char);
+        array_reserve(&value, length(&tok.value));
+        memcpy(value, tok.value, length(&tok.value));
+        length(&value) = length(&tok.value);
+        tok.value = value;
+    }
+    return tok;
+}
+
+static lfArray(lfType *) clone_types(const lfAllocator *allocator, lfArray(lfType *) types) {
+    lfArray(lfType *) copy = array_new(allocator, lfType *, lf_type_deleter);
+    array_reserve(&copy, length(&types));
+    for (int i = 0; i < length(&types); i++) {
+        copy[i] = lf_type_clone(allocator, types[i]);
+    }
+    length(&copy) = length(&types);
+    return copy;
+}
+
+static lfArray(lfNode *) clone_nodes(const lfAllocator *allocator, lfArray(lfNode *) nodes) {
+    lfArray(lfNode *) copy = array_new(allocator, lfNode *, lf_node_deleter);
+    array_reserve(&copy, length(&nodes));
+    for (int i = 0; i < length(&nodes); i++) {
+        copy[i] = lf_node_clone(allocator, nodes[i]);
+    }
+    length(&copy) = length(&nodes);
+    return copy;
+}
+
+#define clone(TYPE, SRC) (TYPE *)memcpy(lf_malloc(allocator, sizeof(TYPE)), (SRC), sizeof(TYPE))
+
+lfType *lf_type_clone(const lfAllocator *allocator, const lfType *t) {
+    switch (t->type) {
+        case VT_TYPENAME: {
+            lfTypeName *tn = clone(lfTypeName, t);
+            tn->typename = clone_token(allocator, tn->typename);
+            return (lfType *)tn;
+        }
+        case VT_UNION:
+        case VT_INTERSECTION: {
+            lfTypeOp *op = clone(lfTypeOp, t);
+            op->lhs = lf_type_clone(allocator, op->lhs);
+            op->rhs = lf_type_clone(allocator, op->rhs);
+            return (lfType *)op;
+        }
+        case VT_FUNC: {
+            lfFuncType *f = clone(lfFuncType, t);
+            f->params = clone_types(allocator, f->params);
+            f->ret = lf_type_clone(allocator, f->ret);
+            return (lfType *)f;
+        }
+        case VT_ARRAY: {
+            lfArrayType *arr = clone(lfArrayType, t);
+            arr->values = clone_types(allocator, arr->values);
+            return (lfType *)arr;
+        }
+        case VT_MAP: {
+            lfMapType *map = clone(lfMapType, t);
+            map->keys = clone_types(allocator, map->keys);
+            map->values = clone_types(allocator, map->values);
+            return (lfType *)map;
+        }
+        case VT_ANY:
+            break;
+    }
+    return clone(lfType, t);
+}
+
+lfNode *lf_node_clone(const lfAllocator *allocator, const lfNode *node) {
+    switch (node->type) {
+        case NT_INT:
+        case NT_FLOAT:
+        case NT_STRING: {
+            lfLiteralNode *lit = clone(lfLiteralNode, node);
+            lit->value = clone_token(allocator, lit->value);
+            return (lfNode *)lit;
+        }
+        case NT_ARRAY: {
+            lfArrayNode *arr = clone(lfArrayNode, node);
+            arr->values = clone_nodes(allocator, arr->values);
+            return (lfNode *)arr;
+        }
+        case NT_MAP: {
+            lfMapNode *map = clone(lfMapNode, node);
+            map->keys = clone_nodes(allocator, map->keys);
+            map->values = clone_nodes(allocator, map->values);
+            return (lfNode *)map;
+        }
+        case NT_UNARYOP: {
+            lfUnaryOpNode *unop = clone(lfUnaryOpNode, node);
+            unop->op = clone_token(allocator, unop->op);
+            unop->value = lf_node_clone(allocator, unop->value);
+            return (lfNode *)unop;
+        }
+        case NT_BINARYOP: {
+            lfBinaryOpNode *binop = clone(lfBinaryOpNode, node);
+            binop->op = clone_token(allocator, binop->op);
+            binop->lhs = lf_node_clone(allocator, binop->lhs);
+            binop->rhs = lf_node_clone(allocator, binop->rhs);
+            return (lfNode *)binop;
+        }
+        case NT_VARACCESS: {
+            lfVarAccessNode *access = clone(lfVarAccessNode, node);
+            access->var = clone_token(allocator, access->var);
+            return (lfNode *)access;
+        }
+        case NT_VARDECL: {
+            lfVarDeclNode *decl = clone(lfVarDeclNode, node);
+            decl->name = clone_token(allocator, decl->name);
+            if (decl->vartype) {
+                decl->vartype = lf_type_clone(allocator, decl->vartype);
+            }
+            if (decl->initializer) {
+                decl->initializer = lf_node_clone(allocator, decl->initializer);
+            }
+            return (lfNode *)decl;
+        }
+        case NT_SUBSCRIBE: {
+            lfSubscriptionNode *sub = clone(lfSubscriptionNode, node);
+            sub->object = lf_node_clone(allocator, sub->object);
+            sub->index = lf_node_clone(allocator, sub->index);
+            return (lfNode *)sub;
+        }
+        case NT_ASSIGN: {
+            lfAssignNode *assign = clone(lfAssignNode, node);
+            assign->var = clone_token(allocator, assign->var);
+            assign->value = lf_node_clone(allocator, assign->value);
+            return (lfNode *)assign;
+        }
+        case NT_OBJASSIGN: {
+            lfObjectAssignNode *assign = clone(lfObjectAssignNode, node);
+            assign->object = lf_node_clone(allocator, assign->object);
+            assign->key = lf_node_clone(allocator, assign->key);
+            assign->value = lf_node_clone(allocator, assign->value);
+            return (lfNode *)assign;
+        }
+        case NT_CALL: {
+            lfCallNode *call = clone(lfCallNode, node);
+            call->func = lf_node_clone(allocator, call->func);
+            call->args = clone_nodes(allocator, call->args);
+            call->inline_target = NULL;
+            call->inlined = NULL;
+            return (lfNode *)call;
+        }
+        case NT_FUNC: {
+            lfFunctionNode *f = clone(lfFunctionNode, node);
+            f->name = clone_token(allocator, f->name);
+            f->params = (lfArray(lfVarDeclNode *))clone_nodes(allocator, (lfArray(lfNode *))f->params);
+            f->body = clone_nodes(allocator, f->body);
+            if (f->return_type) {
+                f->return_type = lf_type_clone(allocator, f->return_type);
+            }
+            lfArray(lfToken) type_names = array_new(allocator, lfToken, lf_token_deleter);
+            for (int i = 0; i < length(&f->type_names); i++) {
+                lfToken name = clone_token(allocator, f->type_names[i]);
+                array_push(&type_names, name);
+            }
+            f->type_names = type_names;
+            f->types = clone_types(allocator, f->types);
+            if (f->captures) {
+                lfArray(lfCapture) captures = array_new(allocator, lfCapture);
+                for (int i = 0; i < length(&f->captures); i++) {
+                    array_push(&captures, f->captures[i]);
+                }
+                f->captures = captures;
+            }
+            f->specializations = NULL;
+            f->hotness = 0;
+            f->native = NULL;
+            f->inlinable = 0;
+            return (lfNode *)f;
+        }
+        case NT_IF: {
+            lfIfNode *ifnode = clone(lfIfNode, node);
+            ifnode->condition = lf_node_clone(allocator, ifnode->condition);
+            ifnode->body = lf_node_clone(allocator, ifnode->body);
+            if (ifnode->else_body) {
+                ifnode->else_body = lf_node_clone(allocator, ifnode->else_body);
+            }
+            return (lfNode *)ifnode;
+        }
+        case NT_WHILE: {
+            lfWhileNode *whilenode = clone(lfWhileNode, node);
+            whilenode->condition = lf_node_clone(allocator, whilenode->condition);
+            whilenode->body = lf_node_clone(allocator, whilenode->body);
+            whilenode->hotness = 0;
+            whilenode->backedges = 0;
+            whilenode->native = NULL;
+            return (lfNode *)whilenode;
+        }
+        case NT_RETURN: {
+            lfReturnNode *ret = clone(lfReturnNode, node);
+            if (ret->value) {
+                ret->value = lf_node_clone(allocator, ret->value);
+            }
+            return (lfNode *)ret;
+        }
+        case NT_YIELD:
+            return (lfNode *)clone(lfYieldNode, node);
+        case NT_AWAIT: {
+            lfAwaitNode *await = clone(lfAwaitNode, node);
+            await->value = lf_node_clone(allocator, await->value);
+            return (lfNode *)await;
+        }
+        case NT_CLASS: {
+            lfClassNode *cls = clone(lfClassNode, node);
+            cls->name = clone_token(allocator, cls->name);
+            cls->body = clone_nodes(allocator, cls->body);
+            return (lfNode *)cls;
+        }
+        case NT_COMPOUND: {
+            lfCompoundNode *comp = clone(lfCompoundNode, node);
+            comp->statements = clone_nodes(allocator, comp->statements);
+            return (lfNode *)comp;
+        }
+        case NT_IMPORT: {
+            lfImportNode *import = clone(lfImportNode, node);
+            lfArray(lfToken) path = array_new(allocator, lfToken, lf_token_deleter);
+            for (int i = 0; i < length(&import->path); i++) {
+                lfToken part = clone_token(allocator, import->path[i]);
+                array_push(&path, part);
+            }
+            import->path = path;
+            return (lfNode *)import;
+        }
+    }
+    return NULL;
+}
+
+static int count_nodes(lfArray(lfNode *) nodes) {
+    int n = 0;
+    for (int i = 0; i < length(&nodes); i++) {
+        n += lf_node_count(nodes[i]);
+    }
+    return n;
+}
+
+/* the number of nodes in a tree, as a measure of code size */
+int lf_node_count(const lfNode *node) {
+    switch (node->type) {
+        case NT_ARRAY:
+            return 1 + count_nodes(((lfArrayNode *)node)->values);
+        case NT_MAP:
+            return 1 + count_nodes(((lfMapNode *)node)->keys) + count_nodes(((lfMapNode *)node)->values);
+        case NT_UNARYOP:
+            return 1 + lf_node_count(((lfUnaryOpNode *)node)->value);
+        case NT_BINARYOP:
+            return 1 + lf_node_count(((lfBinaryOpNode *)node)->lhs) + lf_node_count(((lfBinaryOpNode *)node)->rhs);
+        case NT_VARDECL: {
+            lfVarDeclNode *decl = (lfVarDeclNode *)node;
+            return 1 + (decl->initializer ? lf_node_count(decl->initializer) : 0);
+        }
+        case NT_SUBSCRIBE:
+            return 1 + lf_node_count(((lfSubscriptionNode *)node)->object) + lf_node_count(((lfSubscriptionNode *)node)->index);
+        case NT_ASSIGN:
+            return 1 + lf_node_count(((lfAssignNode *)node)->value);
+        case NT_OBJASSIGN: {
+            lfObjectAssignNode *assign = (lfObjectAssignNode *)node;
+            return 1 + lf_node_count(assign->object) + lf_node_count(assign->key) + lf_node_count(assign->value);
+        }
+        case NT_CALL:
+            return 1 + lf_node_count(((lfCallNode *)node)->func) + count_nodes(((lfCallNode *)node)->args);
+        case NT_FUNC: {
+            lfFunctionNode *f = (lfFunctionNode *)node;
+            return 1 + count_nodes((lfArray(lfNode *))f->params) + count_nodes(f->body);
+        }
+        case NT_IF: {
+            lfIfNode *ifnode = (lfIfNode *)node;
+            int n = 1 + lf_node_count(ifnode->condition) + lf_node_count(ifnode->body);
+            return n + (ifnode->else_body ? lf_node_count(ifnode->else_body) : 0);
+        }
+        case NT_WHILE:
+            return 1 + lf_node_count(((lfWhileNode *)node)->condition) + lf_node_count(((lfWhileNode *)node)->body);
+        case NT_RETURN: {
+            lfReturnNode *ret = (lfReturnNode *)node;
+            return 1 + (ret->value ? lf_node_count(ret->value) : 0);
+        }
+        case NT_AWAIT:
+            return 1 + lf_node_count(((lfAwaitNode *)node)->value);
+        case NT_CLASS:
+            return 1 + count_nodes(((lfClassNode *)node)->body);
+        case NT_COMPOUND:
+            return 1 + count_nodes(((lfCompoundNode *)node)->statements);
+        default:
+            return 1;
+    }
+}
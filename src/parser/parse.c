@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include "parser/events.h"
 #include "parser/node.h"
 #include "parser/parse.h"
 #include "parser/token.h"
@@ -13,14 +14,24 @@
 #include "parser/tokenize.h"
 
 /* TODO: add error checking everywhere this is called */
-#define alloc(TYPE) (TYPE *)malloc(sizeof(TYPE))
+/* nodes start zeroed so that resolution fields are unset */
+#define alloc(TYPE) (TYPE *)memset(lf_malloc(ctx->allocator, sizeof(TYPE)), 0, sizeof(TYPE))
 
 typedef struct lfParseCtx {
+    const lfAllocator *allocator;
+    const lfDiagnosticSink *diagnostics;
     int current_idx;
     lfToken current;
     const lfArray(lfToken) tokens;
     bool errored; /* whether the current context ran into a syntax error */
     bool described; /* whether an error has been printed */
+    bool lazy; /* preparse the bodies of functions that can capture nothing */
+    lfParser *parser; /* whose tokens and scratch preparsing checks bodies with */
+    int depth; /* function bodies and blocks around the current token */
+    int nesting; /* operands and types being parsed around the current token */
+    int height; /* of the expression or type parsed last */
+    int line; /* the line source[line_idx] is on */
+    int line_idx;
     /* strictly for error messages */
     const char *file;
     const char *source;
@@ -31,16 +42,22 @@ typedef struct lfParseCtxState {
     lfToken old;
 } lfParseCtxState;
 
+/* counted on from the last position asked about, which is never far behind */
 int get_lineno(lfParseCtx *ctx) {
-    int line = 1;
     int idx = ctx->current.idx_start;
-    while (idx > 0 && ctx->source[idx]) {
-        if (ctx->source[idx] == '\n') {
-            line += 1;
+    while (ctx->line_idx < idx) {
+        if (ctx->source[ctx->line_idx] == '\n') {
+            ctx->line += 1;
         }
-        idx -= 1;
+        ctx->line_idx += 1;
     }
-    return line;
+    while (ctx->line_idx > idx) {
+        ctx->line_idx -= 1;
+        if (ctx->source[ctx->line_idx] == '\n') {
+            ctx->line -= 1;
+        }
+    }
+    return ctx->line;
 }
 
 void advance(lfParseCtx *ctx) {
@@ -63,7 +80,7 @@ void restore(lfParseCtx *ctx, const lfParseCtxState *state) {
 }
 
 void parse_error_at(lfParseCtx *ctx, lfToken token, const char *message) {
-    lf_error_print(ctx->file, ctx->source, token.idx_start, token.idx_end, message);
+    lf_error_report(ctx->diagnostics, ctx->file, ctx->source, token.idx_start, token.idx_end, message);
     ctx->errored = true;
     ctx->described = true;
 }
@@ -72,18 +89,43 @@ void parse_error_here(lfParseCtx *ctx, const char *message) {
     parse_error_at(ctx, ctx->current, message);
 }
 
-lfToken copy(lfToken tok) {
-    if (tok.value != NULL) {
-        lfArray(char) buf = array_new(char);
-        array_reserve(&buf, length(&tok.value));
-        memcpy(buf, tok.value, length(&tok.value));
-        length(&buf) = length(&tok.value);
-        tok.value = buf;
+/*
+ * records the height of the node about to be built, false with a syntax
+ * error once it would sit deeper than any tree walk may recurse
+ */
+bool nest(lfParseCtx *ctx, int height) {
+    ctx->height = height;
+    if (ctx->depth + height > LF_MAX_NESTING) {
+        parse_error_here(ctx, "expression too deeply nested");
+        return false;
     }
-    return tok;
+    return true;
+}
+
+/* the same for the parser's own recursion, which parentheses add to without adding nodes */
+bool enter_nesting(lfParseCtx *ctx) {
+    if (ctx->depth + ctx->nesting >= LF_MAX_NESTING) {
+        parse_error_here(ctx, "expression too deeply nested");
+        return false;
+    }
+    ctx->nesting += 1;
+    return true;
 }
 
+/* and for the blocks and function bodies around the current token */
+bool enter_block(lfParseCtx *ctx) {
+    if (ctx->depth + ctx->nesting >= LF_MAX_NESTING) {
+        parse_error_here(ctx, "block too deeply nested");
+        return false;
+    }
+    ctx->depth += 1;
+    return true;
+}
+
+#define higher(A, B) ((A) > (B) ? (A) : (B))
+
 lfNode *parse_expr(lfParseCtx *ctx);
+lfNode *parse_subscriptive(lfParseCtx *ctx);
 lfType *parse_type(lfParseCtx *ctx);
 lfNode *parse_statement(lfParseCtx *ctx);
 
@@ -94,19 +136,21 @@ lfType *parse_typename(lfParseCtx *ctx) {
     }
     lfTypeName *typename = alloc(lfTypeName);
     typename->type = VT_TYPENAME;
-    typename->typename = copy(ctx->current);
+    typename->typename = ctx->current;
     advance(ctx);
+    ctx->height = 1;
     return (lfType *)typename;
 }
 
 lfType *parse_nontrivial_type(lfParseCtx *ctx) {
     if (ctx->current.type == TT_LBRACE) {
-        lfArray(lfType *) keys = array_new(lfType *, lf_type_deleter);
-        lfArray(lfType *) values = array_new(lfType *, lf_type_deleter);
+        lfArray(lfType *) keys = array_new(ctx->allocator, lfType *, lf_type_deleter);
+        lfArray(lfType *) values = array_new(ctx->allocator, lfType *, lf_type_deleter);
         lfToken lbrace = ctx->current;
         advance(ctx);
         bool is_map = false;
         bool is_array = false;
+        int height = 0;
         if (ctx->current.type != TT_RBRACE && ctx->current.type != TT_COMMA) {
             do {
                 if (ctx->current.type == TT_COMMA) {
@@ -118,6 +162,7 @@ lfType *parse_nontrivial_type(lfParseCtx *ctx) {
                     array_delete(&values);
                     return NULL;
                 }
+                height = higher(height, ctx->height);
                 if (ctx->current.type == TT_COLON) {
                     is_map = true;
                     array_push(&keys, t);
@@ -134,6 +179,7 @@ lfType *parse_nontrivial_type(lfParseCtx *ctx) {
                         array_delete(&values);
                         return NULL;
                     }
+                    height = higher(height, ctx->height);
                     array_push(&values, v);
                 } else {
                     is_array = true;
@@ -155,6 +201,11 @@ lfType *parse_nontrivial_type(lfParseCtx *ctx) {
             return NULL;
         }
         advance(ctx);
+        if (!nest(ctx, height + 1)) {
+            array_delete(&keys);
+            array_delete(&values);
+            return NULL;
+        }
         if (is_map) {
             lfMapType *t = alloc(lfMapType);
             t->type = VT_MAP;
@@ -173,14 +224,16 @@ lfType *parse_nontrivial_type(lfParseCtx *ctx) {
         advance(ctx);
         lfArray(lfType *) params = NULL;
         lfType *t = NULL;
+        int height = 0;
         if (ctx->current.type != TT_RPAREN) {
             t = parse_type(ctx);
             if (ctx->errored) {
                 return NULL;
             }
+            height = ctx->height;
         }
         if (ctx->current.type == TT_COMMA) {
-            params = array_new(lfType *, lf_type_deleter);
+            params = array_new(ctx->allocator, lfType *, lf_type_deleter);
             array_push(&params, t);
             do {
                 advance(ctx);
@@ -189,6 +242,7 @@ lfType *parse_nontrivial_type(lfParseCtx *ctx) {
                     array_delete(&params);
                     return NULL;
                 }
+                height = higher(height, ctx->height);
                 array_push(&params, t);
             } while (ctx->current.type == TT_COMMA);
         }
@@ -198,7 +252,7 @@ lfType *parse_nontrivial_type(lfParseCtx *ctx) {
             if (params != NULL) {
                 array_delete(&params);
             } else {
-                lf_type_deleter(&t);
+                lf_type_deleter(ctx->allocator, &t);
             }
             return NULL;
         }
@@ -206,13 +260,13 @@ lfType *parse_nontrivial_type(lfParseCtx *ctx) {
         if (ctx->current.type == TT_ARROW) {
             advance(ctx);
             if (params == NULL) { /* turn our single type into a parameter list with one type */
-                params = array_new(lfType *, lf_type_deleter);
+                params = array_new(ctx->allocator, lfType *, lf_type_deleter);
                 if (t) {
                     array_push(&params, t);
                 }
             }
             lfType *ret = parse_type(ctx);
-            if (ctx->errored) {
+            if (ctx->errored || !nest(ctx, higher(height, ctx->height) + 1)) {
                 array_delete(&params);
                 return NULL;
             }
@@ -228,7 +282,7 @@ lfType *parse_nontrivial_type(lfParseCtx *ctx) {
             if (params != NULL) {
                 array_delete(&params);
             } else if (t) {
-                lf_type_deleter(&t);
+                lf_type_deleter(ctx->allocator, &t);
             }
             return NULL;
         }
@@ -238,18 +292,29 @@ lfType *parse_nontrivial_type(lfParseCtx *ctx) {
 }
 
 lfType *parse_type(lfParseCtx *ctx) {
+    if (!enter_nesting(ctx)) {
+        return NULL;
+    }
     lfType *t = parse_nontrivial_type(ctx);
+    ctx->nesting -= 1;
     if (ctx->errored) {
         return NULL;
     }
+    int height = ctx->height;
     while (ctx->current.type == TT_BAND || ctx->current.type == TT_BOR) {
         lfTypeType op = ctx->current.type == TT_BAND ? VT_INTERSECTION : VT_UNION;
         advance(ctx);
         lfType *rhs = parse_nontrivial_type(ctx);
         if (ctx->errored) {
-            lf_type_deleter(&t);
+            lf_type_deleter(ctx->allocator, &t);
             return NULL;
         }
+        if (!nest(ctx, higher(height, ctx->height) + 1)) {
+            lf_type_deleter(ctx->allocator, &t);
+            lf_type_deleter(ctx->allocator, &rhs);
+            return NULL;
+        }
+        height = ctx->height;
         lfTypeOp *o = alloc(lfTypeOp);
         o->type = op;
         o->lhs = t;
@@ -263,9 +328,10 @@ lfNode *parse_literal(lfParseCtx *ctx) {
     if (ctx->current.type == TT_INT || ctx->current.type == TT_FLOAT || ctx->current.type == TT_STRING) {
         lfLiteralNode *literal = alloc(lfLiteralNode);
         literal->type = ctx->current.type == TT_INT ? NT_INT : ctx->current.type == TT_FLOAT ? NT_FLOAT : NT_STRING;
-        literal->value = copy(ctx->current);
+        literal->value = ctx->current;
         literal->lineno = get_lineno(ctx);
         advance(ctx);
+        ctx->height = 1;
         return (lfNode *)literal;
     } else if (ctx->current.type == TT_LPAREN) {
         lfToken lparen = ctx->current;
@@ -275,7 +341,7 @@ lfNode *parse_literal(lfParseCtx *ctx) {
         if (ctx->current.type != TT_RPAREN) {
             parse_error_here(ctx, "expected ')'");
             parse_error_at(ctx, lparen, "... to close");
-            lf_node_deleter(&expr);
+            lf_node_deleter(ctx->allocator, &expr);
             return NULL;
         }
         advance(ctx);
@@ -283,16 +349,44 @@ lfNode *parse_literal(lfParseCtx *ctx) {
     } else if (ctx->current.type == TT_SUB || ctx->current.type == TT_NOT) {
         lfToken op = ctx->current;
         advance(ctx);
+        if (!enter_nesting(ctx)) {
+            return NULL;
+        }
         lfNode *expr = parse_literal(ctx);
+        ctx->nesting -= 1;
         if (ctx->errored) {
             return NULL;
         }
+        if (!nest(ctx, ctx->height + 1)) {
+            lf_node_deleter(ctx->allocator, &expr);
+            return NULL;
+        }
         lfUnaryOpNode *unop = alloc(lfUnaryOpNode);
         unop->type = NT_UNARYOP;
         unop->op = op;
         unop->value = expr;
         unop->lineno = expr->lineno;
         return (lfNode *)unop;
+    } else if (ctx->current.type == TT_KEYWORD && !strcmp(ctx->current.value, "await")) {
+        int lineno = get_lineno(ctx);
+        advance(ctx);
+        if (!enter_nesting(ctx)) {
+            return NULL;
+        }
+        lfNode *expr = parse_subscriptive(ctx);
+        ctx->nesting -= 1;
+        if (ctx->errored) {
+            return NULL;
+        }
+        if (!nest(ctx, ctx->height + 1)) {
+            lf_node_deleter(ctx->allocator, &expr);
+            return NULL;
+        }
+        lfAwaitNode *await = alloc(lfAwaitNode);
+        await->type = NT_AWAIT;
+        await->value = expr;
+        await->lineno = lineno;
+        return (lfNode *)await;
     } else if (ctx->current.type == TT_IDENTIFIER) {
         lfToken var = ctx->current;
         int lineno = get_lineno(ctx);
@@ -303,17 +397,22 @@ lfNode *parse_literal(lfParseCtx *ctx) {
             if (ctx->errored) {
                 return NULL;
             }
+            if (!nest(ctx, ctx->height + 1)) {
+                lf_node_deleter(ctx->allocator, &value);
+                return NULL;
+            }
             lfAssignNode *assign = alloc(lfAssignNode);
             assign->type = NT_ASSIGN;
-            assign->var = copy(var);
+            assign->var = var;
             assign->value = value;
             assign->lineno = lineno;
             return (lfNode *)assign;
         } else {
             lfVarAccessNode *access = alloc(lfVarAccessNode);
             access->type = NT_VARACCESS;
-            access->var = copy(var);
+            access->var = var;
             access->lineno = lineno;
+            ctx->height = 1;
             return (lfNode *)access;
         }
     } else if (ctx->current.type == TT_LBRACE) {
@@ -321,8 +420,9 @@ lfNode *parse_literal(lfParseCtx *ctx) {
         int lineno = get_lineno(ctx);
         bool is_arr = false;
         bool is_map = false;
-        lfArray(lfNode *) keys = array_new(lfNode *, lf_node_deleter);
-        lfArray(lfNode *) values = array_new(lfNode *, lf_node_deleter);
+        lfArray(lfNode *) keys = array_new(ctx->allocator, lfNode *, lf_node_deleter);
+        lfArray(lfNode *) values = array_new(ctx->allocator, lfNode *, lf_node_deleter);
+        int height = 0;
         advance(ctx);
         if (ctx->current.type != TT_RBRACE && ctx->current.type != TT_COMMA) {
             do {
@@ -335,6 +435,7 @@ lfNode *parse_literal(lfParseCtx *ctx) {
                     array_delete(&values);
                     return NULL;
                 }
+                height = higher(height, ctx->height);
                 if (ctx->current.type == TT_COLON) {
                     is_map = true;
                     array_push(&keys, expr);
@@ -351,6 +452,7 @@ lfNode *parse_literal(lfParseCtx *ctx) {
                         array_delete(&values);
                         return NULL;
                     }
+                    height = higher(height, ctx->height);
                     array_push(&values, value);
                 } else {
                     is_arr = true;
@@ -372,6 +474,11 @@ lfNode *parse_literal(lfParseCtx *ctx) {
             return NULL;
         }
         advance(ctx);
+        if (!nest(ctx, height + 1)) {
+            array_delete(&keys);
+            array_delete(&values);
+            return NULL;
+        }
         if (is_map) {
             lfMapNode *map = alloc(lfMapNode);
             map->type = NT_MAP;
@@ -397,24 +504,32 @@ lfNode *parse_literal(lfParseCtx *ctx) {
 lfNode *parse_subscriptive(lfParseCtx *ctx) {
     lfNode *object = parse_literal(ctx);
     if (ctx->errored) return NULL;
+    int height = ctx->height;
     while (ctx->current.type == TT_LBRACKET || ctx->current.type == TT_DOT || ctx->current.type == TT_LPAREN) {
         if (ctx->current.type == TT_LBRACKET) {
             lfToken lbracket = ctx->current;
             advance(ctx);
             lfNode *index = parse_expr(ctx);
             if (ctx->errored) {
-                lf_node_deleter(&object);
+                lf_node_deleter(ctx->allocator, &object);
                 return NULL;
             }
+            int index_height = ctx->height;
             if (ctx->current.type != TT_RBRACKET) {
                 parse_error_here(ctx, "expected ']'");
                 parse_error_at(ctx, lbracket, "... to close");
-                lf_node_deleter(&index);
-                lf_node_deleter(&object);
+                lf_node_deleter(ctx->allocator, &index);
+                lf_node_deleter(ctx->allocator, &object);
                 return NULL;
             }
             advance(ctx);
             if (ctx->current.type != TT_ASSIGN) {
+                if (!nest(ctx, higher(height, index_height) + 1)) {
+                    lf_node_deleter(ctx->allocator, &index);
+                    lf_node_deleter(ctx->allocator, &object);
+                    return NULL;
+                }
+                height = ctx->height;
                 lfSubscriptionNode *sub = alloc(lfSubscriptionNode);
                 sub->type = NT_SUBSCRIBE;
                 sub->object = object;
@@ -425,7 +540,13 @@ lfNode *parse_subscriptive(lfParseCtx *ctx) {
                 advance(ctx);
                 lfNode *value = parse_expr(ctx);
                 if (ctx->errored) {
-                    lf_node_deleter(&object);
+                    lf_node_deleter(ctx->allocator, &object);
+                    return NULL;
+                }
+                if (!nest(ctx, higher(higher(height, index_height), ctx->height) + 1)) {
+                    lf_node_deleter(ctx->allocator, &value);
+                    lf_node_deleter(ctx->allocator, &index);
+                    lf_node_deleter(ctx->allocator, &object);
                     return NULL;
                 }
                 lfObjectAssignNode *assign = alloc(lfObjectAssignNode);
@@ -440,14 +561,20 @@ lfNode *parse_subscriptive(lfParseCtx *ctx) {
             advance(ctx);
             if (ctx->current.type != TT_IDENTIFIER) {
                 parse_error_here(ctx, "expected identifier");
-                lf_node_deleter(&object);
+                lf_node_deleter(ctx->allocator, &object);
                 return NULL;
             }
             lfLiteralNode *index = alloc(lfLiteralNode);
             index->type = NT_STRING;
-            index->value = copy(ctx->current);
+            index->value = ctx->current;
             advance(ctx);
             if (ctx->current.type != TT_ASSIGN) {
+                if (!nest(ctx, height + 1)) {
+                    lf_node_deleter(ctx->allocator, (lfNode **)&index);
+                    lf_node_deleter(ctx->allocator, &object);
+                    return NULL;
+                }
+                height = ctx->height;
                 lfSubscriptionNode *sub = alloc(lfSubscriptionNode);
                 sub->type = NT_SUBSCRIBE;
                 sub->object = object;
@@ -458,8 +585,14 @@ lfNode *parse_subscriptive(lfParseCtx *ctx) {
                 advance(ctx);
                 lfNode *value = parse_expr(ctx);
                 if (ctx->errored) {
-                    lf_node_deleter(&object);
-                    lf_node_deleter((lfNode **)&index);
+                    lf_node_deleter(ctx->allocator, &object);
+                    lf_node_deleter(ctx->allocator, (lfNode **)&index);
+                    return NULL;
+                }
+                if (!nest(ctx, higher(height, ctx->height) + 1)) {
+                    lf_node_deleter(ctx->allocator, &value);
+                    lf_node_deleter(ctx->allocator, &object);
+                    lf_node_deleter(ctx->allocator, (lfNode **)&index);
                     return NULL;
                 }
                 lfObjectAssignNode *assign = alloc(lfObjectAssignNode);
@@ -472,7 +605,8 @@ lfNode *parse_subscriptive(lfParseCtx *ctx) {
             }
         } else {
             lfToken lparen = ctx->current;
-            lfArray(lfNode *) args = array_new(lfNode *, lf_node_deleter);
+            lfArray(lfNode *) args = array_new(ctx->allocator, lfNode *, lf_node_deleter);
+            int args_height = 0;
             advance(ctx);
             if (ctx->current.type != TT_RPAREN && ctx->current.type != TT_COMMA) {
                 do {
@@ -481,21 +615,28 @@ lfNode *parse_subscriptive(lfParseCtx *ctx) {
                     }
                     lfNode *arg = parse_expr(ctx);
                     if (ctx->errored) {
-                        lf_node_deleter(&object);
+                        lf_node_deleter(ctx->allocator, &object);
                         array_delete(&args);
                         return NULL;
                     }
+                    args_height = higher(args_height, ctx->height);
                     array_push(&args, arg);
                 } while (ctx->current.type == TT_COMMA);
             }
             if (ctx->current.type != TT_RPAREN) {
                 parse_error_here(ctx, "expected ')'");
                 parse_error_at(ctx, lparen, "... to close");
-                lf_node_deleter(&object);
+                lf_node_deleter(ctx->allocator, &object);
                 array_delete(&args);
                 return NULL;
             }
             advance(ctx);
+            if (!nest(ctx, higher(height, args_height) + 1)) {
+                lf_node_deleter(ctx->allocator, &object);
+                array_delete(&args);
+                return NULL;
+            }
+            height = ctx->height;
             lfCallNode *call = alloc(lfCallNode);
             call->type = NT_CALL;
             call->func = object;
@@ -511,14 +652,21 @@ lfNode *parse_subscriptive(lfParseCtx *ctx) {
 lfNode *parse_bitwise(lfParseCtx *ctx) {
     lfNode *lhs = parse_subscriptive(ctx);
     if (ctx->errored) return NULL;
+    int height = ctx->height;
     while (ctx->current.type == TT_LSHIFT || ctx->current.type == TT_RSHIFT) {
         lfToken op = ctx->current;
         advance(ctx);
         lfNode *rhs = parse_subscriptive(ctx);
         if (ctx->errored) {
-            lf_node_deleter(&lhs);
+            lf_node_deleter(ctx->allocator, &lhs);
             return NULL;
         }
+        if (!nest(ctx, higher(height, ctx->height) + 1)) {
+            lf_node_deleter(ctx->allocator, &lhs);
+            lf_node_deleter(ctx->allocator, &rhs);
+            return NULL;
+        }
+        height = ctx->height;
         lfBinaryOpNode *binop = alloc(lfBinaryOpNode);
         binop->type = NT_BINARYOP;
         binop->lhs = lhs;
@@ -533,14 +681,21 @@ lfNode *parse_bitwise(lfParseCtx *ctx) {
 lfNode *parse_multiplicative(lfParseCtx *ctx) {
     lfNode *lhs = parse_bitwise(ctx);
     if (ctx->errored) return NULL;
+    int height = ctx->height;
     while (ctx->current.type == TT_MUL || ctx->current.type == TT_DIV || ctx->current.type == TT_POW) {
         lfToken op = ctx->current;
         advance(ctx);
         lfNode *rhs = parse_bitwise(ctx);
         if (ctx->errored) {
-            lf_node_deleter(&lhs);
+            lf_node_deleter(ctx->allocator, &lhs);
             return NULL;
         }
+        if (!nest(ctx, higher(height, ctx->height) + 1)) {
+            lf_node_deleter(ctx->allocator, &lhs);
+            lf_node_deleter(ctx->allocator, &rhs);
+            return NULL;
+        }
+        height = ctx->height;
         lfBinaryOpNode *binop = alloc(lfBinaryOpNode);
         binop->type = NT_BINARYOP;
         binop->lhs = lhs;
@@ -555,14 +710,21 @@ lfNode *parse_multiplicative(lfParseCtx *ctx) {
 lfNode *parse_additive(lfParseCtx *ctx) {
     lfNode *lhs = parse_multiplicative(ctx);
     if (ctx->errored) return NULL;
+    int height = ctx->height;
     while (ctx->current.type == TT_ADD || ctx->current.type == TT_SUB) {
         lfToken op = ctx->current;
         advance(ctx);
         lfNode *rhs = parse_multiplicative(ctx);
         if (ctx->errored) {
-            lf_node_deleter(&lhs);
+            lf_node_deleter(ctx->allocator, &lhs);
+            return NULL;
+        }
+        if (!nest(ctx, higher(height, ctx->height) + 1)) {
+            lf_node_deleter(ctx->allocator, &lhs);
+            lf_node_deleter(ctx->allocator, &rhs);
             return NULL;
         }
+        height = ctx->height;
         lfBinaryOpNode *binop = alloc(lfBinaryOpNode);
         binop->type = NT_BINARYOP;
         binop->lhs = lhs;
@@ -577,6 +739,7 @@ lfNode *parse_additive(lfParseCtx *ctx) {
 lfNode *parse_comparative(lfParseCtx *ctx) {
     lfNode *lhs = parse_additive(ctx);
     if (ctx->errored) return NULL;
+    int height = ctx->height;
     while (
         ctx->current.type == TT_EQ || ctx->current.type == TT_NE ||
         ctx->current.type == TT_LT || ctx->current.type == TT_GT ||
@@ -586,9 +749,15 @@ lfNode *parse_comparative(lfParseCtx *ctx) {
         advance(ctx);
         lfNode *rhs = parse_additive(ctx);
         if (ctx->errored) {
-            lf_node_deleter(&lhs);
+            lf_node_deleter(ctx->allocator, &lhs);
             return NULL;
         }
+        if (!nest(ctx, higher(height, ctx->height) + 1)) {
+            lf_node_deleter(ctx->allocator, &lhs);
+            lf_node_deleter(ctx->allocator, &rhs);
+            return NULL;
+        }
+        height = ctx->height;
         lfBinaryOpNode *binop = alloc(lfBinaryOpNode);
         binop->type = NT_BINARYOP;
         binop->lhs = lhs;
@@ -601,7 +770,11 @@ lfNode *parse_comparative(lfParseCtx *ctx) {
 }
 
 lfNode *parse_expr(lfParseCtx *ctx) {
+    if (!enter_nesting(ctx)) {
+        return NULL;
+    }
     lfNode *expr = parse_comparative(ctx);
+    ctx->nesting -= 1;
     if (ctx->errored && !ctx->described) {
         parse_error_here(ctx, "expected expression");
     }
@@ -642,7 +815,7 @@ lfNode *parse_vardecl(lfParseCtx *ctx, bool allow_ref) {
             initializer = parse_expr(ctx);
             if (ctx->errored) {
                 if (type) {
-                    lf_type_deleter(&type);
+                    lf_type_deleter(ctx->allocator, &type);
                 }
                 return NULL;
             }
@@ -650,7 +823,7 @@ lfNode *parse_vardecl(lfParseCtx *ctx, bool allow_ref) {
         lfVarDeclNode *decl = alloc(lfVarDeclNode);
         decl->type = NT_VARDECL;
         decl->is_const = is_const;
-        decl->name = copy(name);
+        decl->name = name;
         decl->initializer = initializer;
         decl->is_ref = is_ref;
         decl->vartype = type;
@@ -713,6 +886,45 @@ bool parse_generics(lfParseCtx *ctx, lfArray(lfToken) *type_names, lfArray(lfTyp
     return true;
 }
 
+/*
+ * skips a function body, from its '{' to the matching '}', checking its
+ * syntax with the grammar of events.c, which builds nothing. body_end is
+ * left at the end of the '}'
+ */
+bool preparse_body(lfParseCtx *ctx, int *body_start, int *body_end) {
+    *body_start = ctx->current.idx_start;
+    int token = ctx->current_idx;
+    if (!lf_parse_events_body(ctx->parser, &token, ctx->depth, get_lineno(ctx), ctx->source, ctx->file)) {
+        ctx->errored = true;
+        ctx->described = true;
+        return false;
+    }
+    *body_end = ctx->tokens[token - 1].idx_end;
+    ctx->current_idx = token;
+    ctx->current = ctx->tokens[token];
+    return true;
+}
+
+/* statements up to the '}' closing a function body, the '{' already consumed */
+lfArray(lfNode *) parse_body(lfParseCtx *ctx) {
+    if (!enter_block(ctx)) {
+        return NULL;
+    }
+    lfArray(lfNode *) body = array_new(ctx->allocator, lfNode *, lf_node_deleter);
+    while (ctx->current.type != TT_RBRACE) {
+        lfNode *statement = parse_statement(ctx);
+        if (ctx->errored) {
+            array_delete(&body);
+            ctx->depth -= 1;
+            return NULL;
+        }
+        array_push(&body, statement);
+    }
+    ctx->depth -= 1;
+    advance(ctx);
+    return body;
+}
+
 lfNode *parse_fn(lfParseCtx *ctx) {
     int lineno = get_lineno(ctx);
     if (ctx->current.type != TT_KEYWORD || strcmp(ctx->current.value, "fn")) {
@@ -726,8 +938,8 @@ lfNode *parse_fn(lfParseCtx *ctx) {
     }
     lfToken name = ctx->current;
     advance(ctx);
-    lfArray(lfToken) type_names = array_new(lfToken, lf_token_deleter);
-    lfArray(lfType *) types = array_new(lfType *, lf_type_deleter);
+    lfArray(lfToken) type_names = array_new(ctx->allocator, lfToken, lf_token_deleter);
+    lfArray(lfType *) types = array_new(ctx->allocator, lfType *, lf_type_deleter);
     if (!parse_generics(ctx, &type_names, &types)) {
         return NULL;
     }
@@ -739,7 +951,7 @@ lfNode *parse_fn(lfParseCtx *ctx) {
         return NULL;
     }
     advance(ctx);
-    lfArray(lfVarDeclNode *) params = array_new(lfVarDeclNode *, lf_node_deleter);
+    lfArray(lfVarDeclNode *) params = array_new(ctx->allocator, lfVarDeclNode *, lf_node_deleter);
     if (ctx->current.type != TT_RPAREN && ctx->current.type != TT_COMMA) {
         do {
             if (ctx->current.type == TT_COMMA) {
@@ -783,38 +995,52 @@ lfNode *parse_fn(lfParseCtx *ctx) {
         parse_error_here(ctx, "expected '{'");
         array_delete(&params);
         if (type) {
-            lf_type_deleter(&type);
+            lf_type_deleter(ctx->allocator, &type);
         }
         array_delete(&type_names);
         array_delete(&types);
         return NULL;
     }
-    advance(ctx);
-    lfArray(lfNode *) body = array_new(lfNode *, lf_node_deleter);
-    while (ctx->current.type != TT_RBRACE) {
-        lfNode *statement = parse_statement(ctx);
-        if (ctx->errored) {
-            array_delete(&params);
+    /*
+     * functions outside any block or other function can only capture
+     * globals, so their bodies can be resolved on their own later. generic
+     * ones are copied per instantiation while checking their callers, which
+     * needs the body there and then
+     */
+    bool lazy = ctx->lazy && ctx->depth == 0 && length(&type_names) == 0;
+    int body_start = 0;
+    int body_end = 0;
+    lfArray(lfNode *) body = NULL;
+    if (lazy) {
+        body = array_new(ctx->allocator, lfNode *, lf_node_deleter);
+        if (!preparse_body(ctx, &body_start, &body_end)) {
             array_delete(&body);
-            if (type) {
-                lf_type_deleter(&type);
-            }
-            array_delete(&type_names);
-            array_delete(&types);
-            return NULL;
         }
-        array_push(&body, statement);
+    } else {
+        advance(ctx);
+        body = parse_body(ctx);
+    }
+    if (ctx->errored) {
+        array_delete(&params);
+        if (type) {
+            lf_type_deleter(ctx->allocator, &type);
+        }
+        array_delete(&type_names);
+        array_delete(&types);
+        return NULL;
     }
-    advance(ctx);
     lfFunctionNode *f = alloc(lfFunctionNode);
     f->type = NT_FUNC;
-    f->name = copy(name);
+    f->name = name;
     f->body = body;
     f->params = params;
     f->return_type = type;
     f->type_names = type_names;
     f->types = types;
     f->lineno = lineno;
+    f->lazy = lazy;
+    f->body_start = body_start;
+    f->body_end = body_end;
     return (lfNode *)f;
 }
 
@@ -825,19 +1051,24 @@ lfNode *parse_compound(lfParseCtx *ctx) {
         return NULL;
     }
     lfToken lbrace = ctx->current;
+    if (!enter_block(ctx)) {
+        return NULL;
+    }
     advance(ctx);
     lfCompoundNode *compound = alloc(lfCompoundNode);
     compound->type = NT_COMPOUND;
     compound->lineno = lineno;
-    compound->statements = array_new(lfNode *, lf_node_deleter);
+    compound->statements = array_new(ctx->allocator, lfNode *, lf_node_deleter);
     while (ctx->current.type != TT_RBRACE) {
         lfNode *statement = parse_statement(ctx);
         if (ctx->errored) {
-            lf_node_deleter((lfNode **)&compound);
+            ctx->depth -= 1;
+            lf_node_deleter(ctx->allocator, (lfNode **)&compound);
             return NULL;
         }
         array_push(&compound->statements, statement);
     }
+    ctx->depth -= 1;
     advance(ctx);
 
     return (lfNode *)compound;
@@ -856,7 +1087,7 @@ lfNode *parse_statement(lfParseCtx *ctx) {
             }
             lfNode *body = parse_compound(ctx);
             if (ctx->errored) {
-                lf_node_deleter(&condition);
+                lf_node_deleter(ctx->allocator, &condition);
                 return NULL;
             }
             lfNode *else_body = NULL;
@@ -864,8 +1095,8 @@ lfNode *parse_statement(lfParseCtx *ctx) {
                 advance(ctx);
                 else_body = parse_compound(ctx);
                 if (ctx->errored) {
-                    lf_node_deleter(&condition);
-                    lf_node_deleter(&body);
+                    lf_node_deleter(ctx->allocator, &condition);
+                    lf_node_deleter(ctx->allocator, &body);
                     return NULL;
                 }
             }
@@ -884,7 +1115,7 @@ lfNode *parse_statement(lfParseCtx *ctx) {
             }
             lfNode *body = parse_compound(ctx);
             if (ctx->errored) {
-                lf_node_deleter(&condition);
+                lf_node_deleter(ctx->allocator, &condition);
                 return NULL;
             }
             lfWhileNode *whilenode = alloc(lfWhileNode);
@@ -907,6 +1138,12 @@ lfNode *parse_statement(lfParseCtx *ctx) {
             ret->value = expr;
             ret->lineno = lineno;
             return (lfNode *)ret;
+        } else if (!strcmp(ctx->current.value, "yield")) {
+            advance(ctx);
+            lfYieldNode *yield = alloc(lfYieldNode);
+            yield->type = NT_YIELD;
+            yield->lineno = lineno;
+            return (lfNode *)yield;
         } else if (!strcmp(ctx->current.value, "class")) {
             advance(ctx);
             if (ctx->current.type != TT_IDENTIFIER) {
@@ -918,11 +1155,10 @@ lfNode *parse_statement(lfParseCtx *ctx) {
             lfToken lbrace = ctx->current;
             if (ctx->current.type != TT_LBRACE) {
                 parse_error_here(ctx, "expected '{'");
-                lf_token_deleter(&name);
                 return NULL;
             }
             advance(ctx);
-            lfArray(lfNode *) body = array_new(lfNode *, lf_node_deleter);
+            lfArray(lfNode *) body = array_new(ctx->allocator, lfNode *, lf_node_deleter);
             while (ctx->current.type != TT_RBRACE) {
                 lfNode *statement = NULL;
                 if (ctx->current.type == TT_KEYWORD) {
@@ -938,7 +1174,6 @@ lfNode *parse_statement(lfParseCtx *ctx) {
                         parse_error_at(ctx, lbrace, "... in scope"); /* ... to close */
                     }
                     array_delete(&body);
-                    lf_token_deleter(&name);
                     return NULL;
                 }
                 array_push(&body, statement);
@@ -952,13 +1187,13 @@ lfNode *parse_statement(lfParseCtx *ctx) {
             return (lfNode *)cls;
         } else if (!strcmp(ctx->current.value, "include")) {
             advance(ctx);
-            lfArray(lfToken) path = array_new(lfToken, lf_token_deleter);
+            lfArray(lfToken) path = array_new(ctx->allocator, lfToken, lf_token_deleter);
             if (ctx->current.type != TT_IDENTIFIER) {
                 parse_error_here(ctx, "expected include path");
                 array_delete(&path);
                 return NULL;
             }
-            array_push(&path, copy(ctx->current));
+            array_push(&path, ctx->current);
             advance(ctx);
             while (ctx->current.type == TT_DOT) {
                 advance(ctx);
@@ -988,36 +1223,132 @@ lfNode *parse_statement(lfParseCtx *ctx) {
     return expr;
 }
 
-lfNode *lf_parse(const char *source, const char *file) {
-    lfArray(lfToken) tokens = lf_tokenize(source, file);
-    if (tokens == NULL) {
+#define PARSER_ARENA_CHUNK 16384
+
+lfParser *lf_parser_new(const lfAllocator *allocator, const lfDiagnosticSink *diagnostics) {
+    lfParser *parser = lf_malloc(allocator, sizeof(lfParser));
+    if (parser == NULL) {
+        return NULL;
+    }
+    parser->allocator = *allocator;
+    parser->diagnostics = *diagnostics;
+    lf_arena_init(&parser->arena, allocator, PARSER_ARENA_CHUNK);
+    parser->arena_allocator = lf_arena_allocator(&parser->arena);
+    /* token values live in the arena, so the buffer itself needs no deleter */
+    parser->tokens = array_new(&parser->allocator, lfToken);
+    parser->brackets = array_new(&parser->allocator, lfToken);
+    parser->lazy = false;
+    parser->threads = 1;
+    parser->lexer_allocators[0] = parser->arena_allocator;
+    for (int i = 1; i < LF_TOKENIZE_MAX_THREADS; i++) {
+        lf_arena_init(&parser->lexer_arenas[i - 1], allocator, PARSER_ARENA_CHUNK);
+        parser->lexer_allocators[i] = lf_arena_allocator(&parser->lexer_arenas[i - 1]);
+    }
+    return parser;
+}
+
+void lf_parser_reset(lfParser *parser) {
+    length(&parser->tokens) = 0;
+    lf_arena_reset(&parser->arena);
+    for (int i = 0; i < LF_TOKENIZE_MAX_THREADS - 1; i++) {
+        lf_arena_reset(&parser->lexer_arenas[i]);
+    }
+}
+
+void lf_parser_delete(lfParser *parser) {
+    lfAllocator allocator = parser->allocator;
+    array_delete(&parser->tokens);
+    array_delete(&parser->brackets);
+    lf_arena_free(&parser->arena);
+    for (int i = 0; i < LF_TOKENIZE_MAX_THREADS - 1; i++) {
+        lf_arena_free(&parser->lexer_arenas[i]);
+    }
+    lf_free(&allocator, parser, sizeof(lfParser));
+}
+
+bool lf_parser_tokenize(lfParser *parser, const char *source, const char *file) {
+    length(&parser->tokens) = 0;
+    if (parser->threads > 1 && strlen(source) >= LF_TOKENIZE_PARALLEL_MIN) {
+        return lf_tokenize_parallel(&parser->tokens, parser->lexer_allocators, parser->threads, &parser->diagnostics, source, file);
+    }
+    return lf_tokenize_into(&parser->tokens, &parser->arena_allocator, &parser->diagnostics, source, file);
+}
+
+lfNode *lf_parse(lfParser *parser, const char *source, const char *file) {
+    if (!lf_parser_tokenize(parser, source, file)) {
         return NULL;
     }
 
     lfParseCtx ctx = (lfParseCtx) {
-        .tokens = tokens,
+        .allocator = &parser->arena_allocator,
+        .diagnostics = &parser->diagnostics,
+        .tokens = parser->tokens,
         .current_idx = 0,
-        .current = tokens[0],
+        .current = parser->tokens[0],
         .file = file,
         .source = source,
         .errored = false,
-        .described = false
+        .described = false,
+        .lazy = parser->lazy,
+        .depth = 0,
+        .nesting = 0,
+        .parser = parser,
+        .line = 1,
+        .line_idx = 0
     };
 
-    lfCompoundNode *chunk = alloc(lfCompoundNode);
+    lfCompoundNode *chunk = memset(lf_malloc(ctx.allocator, sizeof(lfCompoundNode)), 0, sizeof(lfCompoundNode));
     chunk->type = NT_COMPOUND;
-    chunk->statements = array_new(lfNode *, lf_node_deleter);
+    chunk->lineno = 1;
+    chunk->statements = array_new(ctx.allocator, lfNode *, lf_node_deleter);
     while (ctx.current.type != TT_EOF) {
         lfNode *statement = parse_statement(&ctx);
         if (ctx.errored) {
-            lf_node_deleter((lfNode **)&chunk);
             chunk = NULL;
             break;
         }
         array_push(&chunk->statements, statement);
     }
 
-    array_delete(&tokens);
-
     return (lfNode *)chunk;
 }
+
+bool lf_parse_body(lfParser *parser, lfFunctionNode *f, const char *source, const char *file) {
+    length(&parser->tokens) = 0;
+    if (!lf_tokenize_range(&parser->tokens, &parser->arena_allocator, &parser->diagnostics, source, f->body_start, f->body_end, file)) {
+        return false;
+    }
+
+    lfParseCtx ctx = (lfParseCtx) {
+        .allocator = &parser->arena_allocator,
+        .diagnostics = &parser->diagnostics,
+        .tokens = parser->tokens,
+        .current_idx = 0,
+        .current = parser->tokens[0],
+        .file = file,
+        .source = source,
+        .errored = false,
+        .described = false,
+        .lazy = false, /* anything nested can capture from f */
+        .depth = 0,
+        .nesting = 0,
+        .parser = parser,
+        .line = 1,
+        .line_idx = 0
+    };
+
+    /* the preparse matched the braces, so the range starts with '{' and ends with its '}' */
+    advance(&ctx);
+    lfArray(lfNode *) body = parse_body(&ctx);
+    if (ctx.errored) {
+        return false;
+    }
+    if (ctx.current.type != TT_EOF) {
+        parse_error_here(&ctx, "expected end of function");
+        return false;
+    }
+    array_delete(&f->body);
+    f->body = body;
+    f->lazy = false;
+    return true;
+}
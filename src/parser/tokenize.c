@@ -2,6 +2,7 @@
  * This file is part of the leaf programming language
  */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
@@ -11,19 +12,49 @@
 #include "lib/array.h"
 #include "lib/error.h"
 
-const char *keywords[] = {
-    /* var decl */
-    "var", "const", "ref",
-    /* functions and classes */
-    "fn", "class", "struct",
-    /* control flow */
-    "if", "else", "while", "for", "continue", "break", "return",
-    /* imports */
-    "include",
-    NULL
-};
+#if LF_TOKENIZE_SUPPORTED
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
-void lf_token_deleter(lfToken *tok) {
+/*
+ * var const ref fn class struct if else while for continue break return
+ * yield await include, matched on length and first letter so an
+ * identifier is compared with one keyword at most
+ */
+static bool is_keyword(const char *word, int length) {
+#define KEYWORD(K) (length == (int)sizeof(K) - 1 && !memcmp(word, K, sizeof(K) - 1))
+    switch (word[0]) {
+        case 'a':
+            return KEYWORD("await");
+        case 'b':
+            return KEYWORD("break");
+        case 'c':
+            return length == 5 ? KEYWORD("const") || KEYWORD("class") : KEYWORD("continue");
+        case 'e':
+            return KEYWORD("else");
+        case 'f':
+            return KEYWORD("fn") || KEYWORD("for");
+        case 'i':
+            return KEYWORD("if") || KEYWORD("include");
+        case 'r':
+            return KEYWORD("ref") || KEYWORD("return");
+        case 's':
+            return KEYWORD("struct");
+        case 'v':
+            return KEYWORD("var");
+        case 'w':
+            return KEYWORD("while");
+        case 'y':
+            return KEYWORD("yield");
+        default:
+            return false;
+    }
+#undef KEYWORD
+}
+
+void lf_token_deleter(const lfAllocator *allocator, lfToken *tok) {
+    (void)allocator; /* the value buffer knows its own allocator */
     if (tok->value != NULL) {
         array_delete(&tok->value);
         tok->value = NULL;
@@ -72,11 +103,10 @@ static inline void token_singledoubledouble(const char *source, int *index, lfAr
     *index += 1;
 }
 
-lfArray(lfToken) lf_tokenize(const char *source, const char *file) {
-    lfArray(lfToken) tokens = array_new(lfToken, lf_token_deleter);
+bool lf_tokenize_range(lfArray(lfToken) *tokens, const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, const char *source, int start, int end, const char *file) {
 
-    int i = 0;
-    while (source[i]) {
+    int i = start;
+    while (i < end && source[i]) {
         switch (source[i]) {
             case '\n':
             case ' ':
@@ -84,13 +114,13 @@ lfArray(lfToken) lf_tokenize(const char *source, const char *file) {
                 i += 1;
                 break;
             case '+':
-                token_singledouble(source, &i, &tokens, TT_ADD, TT_ADDASSIGN, '=');
+                token_singledouble(source, &i, tokens, TT_ADD, TT_ADDASSIGN, '=');
                 break;
             case '-':
-                token_singledoubledouble(source, &i, &tokens, TT_SUB, TT_SUBASSIGN, TT_ARROW, '=', '>');
+                token_singledoubledouble(source, &i, tokens, TT_SUB, TT_SUBASSIGN, TT_ARROW, '=', '>');
                 break;
             case '*':
-                token_singledouble(source, &i, &tokens, TT_MUL, TT_MULASSIGN, '=');
+                token_singledouble(source, &i, tokens, TT_MUL, TT_MULASSIGN, '=');
                 break;
             case '/':
                 if (source[i + 1] == '/') {
@@ -114,71 +144,70 @@ lfArray(lfToken) lf_tokenize(const char *source, const char *file) {
                         i += 1;
                     }
                     if (!closed) {
-                        lf_error_print(file, source, start, start + 2, "unclosed '/*'");
-                        array_delete(&tokens);
-                        return NULL;
+                        lf_error_report(diagnostics, file, source, start, start + 2, "unclosed '/*'");
+                        return false;
                     }
                     break;
                 }
-                token_singledouble(source, &i, &tokens, TT_DIV, TT_DIVASSIGN, '=');
+                token_singledouble(source, &i, tokens, TT_DIV, TT_DIVASSIGN, '=');
                 break;
 
             case '&':
-                token_singledouble(source, &i, &tokens, TT_BAND, TT_AND, '&');
+                token_singledouble(source, &i, tokens, TT_BAND, TT_AND, '&');
                 break;
             case '|':
-                token_singledouble(source, &i, &tokens, TT_BOR, TT_OR, '|');
+                token_singledouble(source, &i, tokens, TT_BOR, TT_OR, '|');
                 break;
 
             case '=':
-                token_singledouble(source, &i, &tokens, TT_ASSIGN, TT_EQ, '=');
+                token_singledouble(source, &i, tokens, TT_ASSIGN, TT_EQ, '=');
                 break;
             case '!':
-                token_singledouble(source, &i, &tokens, TT_NOT, TT_NE, '=');
+                token_singledouble(source, &i, tokens, TT_NOT, TT_NE, '=');
                 break;
             case '<':
-                token_singledoubledouble(source, &i, &tokens, TT_LT, TT_LE, TT_LSHIFT, '=', '<');
+                token_singledoubledouble(source, &i, tokens, TT_LT, TT_LE, TT_LSHIFT, '=', '<');
                 break;
             case '>':
-                token_singledoubledouble(source, &i, &tokens, TT_GT, TT_GE, TT_RSHIFT, '=', '>');
+                token_singledoubledouble(source, &i, tokens, TT_GT, TT_GE, TT_RSHIFT, '=', '>');
                 break;
 
             case '(':
-                array_push(&tokens, token_single(TT_LPAREN, i));
+                array_push(tokens, token_single(TT_LPAREN, i));
                 i += 1;
                 break;
             case ')':
-                array_push(&tokens, token_single(TT_RPAREN, i));
+                array_push(tokens, token_single(TT_RPAREN, i));
                 i += 1;
                 break;
             case '{':
-                array_push(&tokens, token_single(TT_LBRACE, i));
+                array_push(tokens, token_single(TT_LBRACE, i));
                 i += 1;
                 break;
             case '}':
-                array_push(&tokens, token_single(TT_RBRACE, i));
+                array_push(tokens, token_single(TT_RBRACE, i));
                 i += 1;
                 break;
             case '[':
-                array_push(&tokens, token_single(TT_LBRACKET, i));
+                array_push(tokens, token_single(TT_LBRACKET, i));
                 i += 1;
                 break;
             case ']':
-                array_push(&tokens, token_single(TT_RBRACKET, i));
+                array_push(tokens, token_single(TT_RBRACKET, i));
                 i += 1;
                 break;
 
             case ':':
-                array_push(&tokens, token_single(TT_COLON, i));
+                array_push(tokens, token_single(TT_COLON, i));
                 i += 1;
                 break;
 
             case '.':
-                array_push(&tokens, token_single(TT_DOT, i));
+                array_push(tokens, token_single(TT_DOT, i));
                 i += 1;
                 break;
             case ',':
-                array_push(&tokens, token_single(TT_COMMA, i));
+                array_push(tokens, token_single(TT_COMMA, i));
                 i += 1;
                 break;
 
@@ -193,13 +222,12 @@ lfArray(lfToken) lf_tokenize(const char *source, const char *file) {
                         i += 1;
                     }
                     if (dots > 1) {
-                        lf_error_print(file, source, start, i, "malformed number");
-                        array_delete(&tokens);
-                        return NULL;
+                        lf_error_report(diagnostics, file, source, start, i, "malformed number");
+                        return false;
                     }
                     lfToken tok = (lfToken) {
                         .type = dots == 0 ? TT_INT : TT_FLOAT,
-                        .value = array_new(char),
+                        .value = array_new(allocator, char),
                         .idx_start = start,
                         .idx_end = i
                     };
@@ -207,7 +235,7 @@ lfArray(lfToken) lf_tokenize(const char *source, const char *file) {
                     length(&tok.value) = i - start + 1;
                     memcpy(tok.value, source + start, i - start);
                     tok.value[i - start] = 0;
-                    array_push(&tokens, tok);
+                    array_push(tokens, tok);
                 } else if (
                     (source[i] >= 'A' && source[i] <= 'Z') ||
                     (source[i] >= 'a' && source[i] <= 'z') ||
@@ -224,7 +252,7 @@ lfArray(lfToken) lf_tokenize(const char *source, const char *file) {
                     }
                     lfToken tok = (lfToken) {
                         .type = TT_IDENTIFIER,
-                        .value = array_new(char),
+                        .value = array_new(allocator, char),
                         .idx_start = start,
                         .idx_end = i
                     };
@@ -232,19 +260,15 @@ lfArray(lfToken) lf_tokenize(const char *source, const char *file) {
                     length(&tok.value) = i - start + 1;
                     memcpy(tok.value, source + start, i - start);
                     tok.value[length(&tok.value) - 1] = 0;
-                    int j = 0;
-                    while (keywords[j] != NULL) {
-                        if (!strcmp(tok.value, keywords[j])) {
-                            tok.type = TT_KEYWORD;
-                        }
-                        j += 1;
+                    if (is_keyword(tok.value, i - start)) {
+                        tok.type = TT_KEYWORD;
                     }
-                    array_push(&tokens, tok);
+                    array_push(tokens, tok);
                 } else if (source[i] == '"' || source[i] == '\'') {
                     int start = i;
                     char opener = source[i];
                     i += 1;
-                    lfArray(char) buffer = array_new(char);
+                    lfArray(char) buffer = array_new(allocator, char);
                     while (source[i] && source[i] != '\n' && source[i] != opener) {
                         if (source[i] == '\\') {
                             switch (source[i + 1]) {
@@ -280,10 +304,9 @@ lfArray(lfToken) lf_tokenize(const char *source, const char *file) {
                                     break;
                                 case 'x':
                                     if (!source[i + 2] || !source[i + 3]) {
-                                        lf_error_print(file, source, i, i + 1, "incomplete hexadecimal escape");
+                                        lf_error_report(diagnostics, file, source, i, i + 1, "incomplete hexadecimal escape");
                                         array_delete(&buffer);
-                                        array_delete(&tokens);
-                                        return NULL;
+                                        return false;
                                     }
                                     char tmp[3] = { source[i + 2], source[i + 3], 0 };
                                     char v = strtol(tmp, NULL, 16);
@@ -291,10 +314,9 @@ lfArray(lfToken) lf_tokenize(const char *source, const char *file) {
                                     i += 2;
                                     break;
                                 default:
-                                    lf_error_print(file, source, i, i + 1, "unknown escape sequence");
+                                    lf_error_report(diagnostics, file, source, i, i + 1, "unknown escape sequence");
                                     array_delete(&buffer);
-                                    array_delete(&tokens);
-                                    return NULL;
+                                    return false;
                             }
                             i += 2;
                         } else {
@@ -303,10 +325,9 @@ lfArray(lfToken) lf_tokenize(const char *source, const char *file) {
                         }
                     }
                     if (source[i] != opener) {
-                        lf_error_print(file, source, start, i, "unterminated string literal");
+                        lf_error_report(diagnostics, file, source, start, i, "unterminated string literal");
                         array_delete(&buffer);
-                        array_delete(&tokens);
-                        return NULL;
+                        return false;
                     }
                     i += 1;
                     lfToken tok = (lfToken) {
@@ -315,12 +336,194 @@ lfArray(lfToken) lf_tokenize(const char *source, const char *file) {
                         .idx_start = start,
                         .idx_end = i
                     };
-                    array_push(&tokens, tok);
+                    array_push(tokens, tok);
+                } else {
+                    lf_error_report(diagnostics, file, source, i, i + 1, "unexpected character");
+                    return false;
                 }
         }
     }
 
-    array_push(&tokens, token_single(TT_EOF, i - 1));
+    array_push(tokens, token_single(TT_EOF, i - 1));
+
+    return true;
+}
+
+bool lf_tokenize_into(lfArray(lfToken) *tokens, const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, const char *source, const char *file) {
+    return lf_tokenize_range(tokens, allocator, diagnostics, source, 0, INT_MAX, file);
+}
+
+/*
+ * the lexer keeps no state between tokens but its position, so lexing
+ * from any position the serial lexer passes through gives the tokens it
+ * would. chunks start after a newline, which only a block comment (or a
+ * string whose \x escape swallows the newline) can span: each chunk is
+ * lexed speculatively from its start and, if a block comment could end in
+ * it, from just after the first place one would, in case one opened in an
+ * earlier chunk. the chunks are then stitched in order, each taking
+ * whichever speculation starts where the one before it really stopped. a
+ * chunk where neither does, or whose speculation ran into an error, is
+ * lexed again from there on the calling thread, which also reports the
+ * error exactly as the serial lexer would
+ */
+typedef struct lfLexChunk {
+    const char *source;
+    const char *file;
+    const lfAllocator *allocator; /* the thread's, for token values */
+    const lfAllocator *parent; /* for the chunk's token arrays */
+    int start;
+    int end;
+    int resume; /* just after the first comment closer in the chunk, or -1 */
+    lfArray(lfToken) tokens[2]; /* lexed from start and from resume */
+    int stop[2]; /* where each left off, which can be past end */
+    bool ok[2];
+} lfLexChunk;
+
+static void discard_diagnostic(void *userdata, const lfDiagnostic *diagnostic) {
+    (void)userdata;
+    (void)diagnostic;
+}
+
+/* lexes [from, end) into tokens, without the end of file token; where it stopped, or -1 on an error */
+static int lex_chunk(lfArray(lfToken) *tokens, const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, const char *source, int from, int end, const char *file) {
+    if (!lf_tokenize_range(tokens, allocator, diagnostics, source, from, end, file)) {
+        return -1;
+    }
+    length(tokens) -= 1;
+    return (*tokens)[length(tokens)].idx_start + 1;
+}
+
+static void *lex_speculatively(void *arg) {
+    static const lfDiagnosticSink discard = { discard_diagnostic, NULL };
+    lfLexChunk *chunk = arg;
+    int from[2] = { chunk->start, chunk->resume };
+    for (int i = 0; i < 2; i++) {
+        chunk->tokens[i] = array_new(chunk->parent, lfToken);
+        chunk->ok[i] = false;
+        if (from[i] >= 0) {
+            /* about one token per four bytes, so the array seldom moves */
+            array_reserve(&chunk->tokens[i], (chunk->end - from[i]) / 4 + 16);
+            chunk->stop[i] = lex_chunk(&chunk->tokens[i], chunk->allocator, &discard, chunk->source, from[i], chunk->end, chunk->file);
+            chunk->ok[i] = chunk->stop[i] >= 0;
+        }
+    }
+    return NULL;
+}
+
+int lf_tokenize_threads(void) {
+#if LF_TOKENIZE_SUPPORTED
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+        return 1;
+    }
+    return cores < LF_TOKENIZE_MAX_THREADS ? (int)cores : LF_TOKENIZE_MAX_THREADS;
+#else
+    return 1;
+#endif
+}
+
+bool lf_tokenize_parallel(lfArray(lfToken) *tokens, const lfAllocator *allocators, int threads, const lfDiagnosticSink *diagnostics, const char *source, const char *file) {
+#if LF_TOKENIZE_SUPPORTED
+    int n = (int)strlen(source);
+    if (threads > LF_TOKENIZE_MAX_THREADS) {
+        threads = LF_TOKENIZE_MAX_THREADS;
+    }
+    if (threads < 2) {
+        return lf_tokenize_range(tokens, &allocators[0], diagnostics, source, 0, INT_MAX, file);
+    }
+
+    lfLexChunk chunks[LF_TOKENIZE_MAX_THREADS];
+    int nchunks = 0;
+    int start = 0;
+    for (int t = 0; t < threads && start < n; t++) {
+        int end = t == threads - 1 ? n : (int)((long long)n * (t + 1) / threads);
+        if (end <= start) {
+            end = start + 1;
+        }
+        while (end < n && source[end - 1] != '\n') {
+            end += 1;
+        }
+        const char *closer = NULL;
+        for (int i = start; i + 1 < end; i++) {
+            if (source[i] == '*' && source[i + 1] == '/') {
+                closer = source + i;
+                break;
+            }
+        }
+        chunks[nchunks] = (lfLexChunk) {
+            .source = source,
+            .file = file,
+            .allocator = &allocators[nchunks],
+            .parent = allocator(tokens),
+            .start = start,
+            .end = end,
+            .resume = closer != NULL && nchunks > 0 ? (int)(closer - source) + 2 : -1
+        };
+        nchunks += 1;
+        start = end;
+    }
+
+    /* the first chunk is lexed here, while the others are lexed on threads of their own */
+    pthread_t workers[LF_TOKENIZE_MAX_THREADS];
+    bool started[LF_TOKENIZE_MAX_THREADS] = { false };
+    for (int c = 1; c < nchunks; c++) {
+        started[c] = pthread_create(&workers[c], NULL, lex_speculatively, &chunks[c]) == 0;
+    }
+    for (int c = 0; c < nchunks; c++) {
+        if (c == 0 || !started[c]) {
+            lex_speculatively(&chunks[c]);
+        }
+    }
+    for (int c = 1; c < nchunks; c++) {
+        if (started[c]) {
+            pthread_join(workers[c], NULL);
+        }
+    }
+
+    int total = 1;
+    for (int c = 0; c < nchunks; c++) {
+        total += length(&chunks[c].tokens[0]);
+    }
+    array_reserve(tokens, length(tokens) + total);
+
+    bool ok = true;
+    int at = 0; /* where the serial lexer would be */
+    for (int c = 0; c < nchunks; c++) {
+        lfLexChunk *chunk = &chunks[c];
+        if (!ok || at >= chunk->end) {
+            continue;
+        }
+        int which = at == chunk->start ? 0 : at == chunk->resume ? 1 : -1;
+        if (which >= 0 && chunk->ok[which]) {
+            lfArray(lfToken) *lexed = &chunk->tokens[which];
+            array_reserve(tokens, length(tokens) + length(lexed));
+            memcpy(*tokens + length(tokens), *lexed, length(lexed) * sizeof(lfToken));
+            length(tokens) += length(lexed);
+            at = chunk->stop[which];
+        } else {
+            at = lex_chunk(tokens, chunk->allocator, diagnostics, source, at, chunk->end, file);
+            ok = at >= 0;
+        }
+    }
+    for (int c = 0; c < nchunks; c++) {
+        array_delete(&chunks[c].tokens[0]);
+        array_delete(&chunks[c].tokens[1]);
+    }
+    if (ok) {
+        array_push(tokens, token_single(TT_EOF, at - 1));
+    }
+    return ok;
+#else
+    (void)threads;
+    return lf_tokenize_range(tokens, &allocators[0], diagnostics, source, 0, INT_MAX, file);
+#endif
+}
 
+lfArray(lfToken) lf_tokenize(const lfAllocator *allocator, const lfDiagnosticSink *diagnostics, const char *source, const char *file) {
+    lfArray(lfToken) tokens = array_new(allocator, lfToken, lf_token_deleter);
+    if (!lf_tokenize_into(&tokens, allocator, diagnostics, source, file)) {
+        array_delete(&tokens);
+        return NULL;
+    }
     return tokens;
 }
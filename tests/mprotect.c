@@ -0,0 +1,24 @@
+/*
+ * This file is part of the leaf programming language
+ */
+
+/*
+ * linked into leafc with -Wl,--wrap=mprotect for tests of what the JIT
+ * does when mprotect fails: every third request for writable pages fails,
+ * and every second request for executable ones, which a retry gets past
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+int __real_mprotect(void *addr, size_t len, int prot);
+
+int __wrap_mprotect(void *addr, size_t len, int prot) {
+    static int writes = 0, execs = 0;
+    if ((prot & PROT_WRITE && ++writes % 3 == 0) || (prot & PROT_EXEC && ++execs % 2 == 0)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return __real_mprotect(addr, len, prot);
+}
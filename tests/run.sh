@@ -0,0 +1,40 @@
+#!/bin/sh
+# runs every test with a leafc binary and checks what it prints against
+# the test's .out file: stdout, then stderr, with colours stripped
+#
+#   tests/run.sh build/leafc
+#   tests/run.sh build/leafc tests/deep_chain.lf
+#
+# a test whose first line is "// leafc: <options>" runs with those options.
+# tests run from this directory, so diagnostics name the file alone
+
+if [ $# -lt 1 ]; then
+    echo "syntax: $0 <leafc> [tests...]" >&2
+    exit 1
+fi
+
+case $1 in
+    */*) leafc=$(cd "$(dirname "$1")" && pwd)/$(basename "$1") ;;
+    *) leafc=$1 ;;
+esac
+shift
+dir=$(dirname "$0")
+[ $# -gt 0 ] || set -- "$dir"/*.lf
+esc=$(printf '\033')
+status=0
+
+for test in "$@"; do
+    name=$(basename "$test" .lf)
+    options=$(sed -n '1s|^// leafc: ||p' "$test")
+    actual=$(cd "$dir" && $leafc $options "$name.lf" 2>&1; echo "exit $?")
+    actual=$(printf '%s\n' "$actual" | sed "s/$esc\[[0-9;]*m//g")
+    if [ "$actual" = "$(cat "$dir/$name.out")" ]; then
+        echo "ok      $name"
+    else
+        echo "FAILED  $name"
+        printf '%s\n' "$actual" | diff "$dir/$name.out" - | head -20
+        status=1
+    fi
+done
+
+exit $status